@@ -416,6 +416,7 @@ function init_input(conf)
             filter = string.split(conf.filter, ","),
             ["filter~"] = string.split(conf["filter~"], ","),
             no_reload = conf.no_reload,
+            loop = conf.loop,
         })
         instance.tail = instance.channel
     end
@@ -490,8 +491,14 @@ end
 
 udp_input_instance_list = {}
 
+local function udp_input_instance_id(conf)
+    return tostring(conf.localaddr) .. "@" .. conf.addr .. ":" .. conf.port
+           .. "/" .. tostring(conf.loop or 0)
+           .. "/" .. tostring(conf.engine or "socket")
+end
+
 init_input_module.udp = function(conf)
-    local instance_id = tostring(conf.localaddr) .. "@" .. conf.addr .. ":" .. conf.port
+    local instance_id = udp_input_instance_id(conf)
     local instance = udp_input_instance_list[instance_id]
 
     if not instance then
@@ -503,6 +510,9 @@ init_input_module.udp = function(conf)
             socket_size = conf.socket_size,
             renew = conf.renew,
             rtp = conf.rtp,
+            burst = conf.burst,
+            loop = conf.loop,
+            engine = conf.engine,
         })
     end
 
@@ -511,7 +521,7 @@ init_input_module.udp = function(conf)
 end
 
 kill_input_module.udp = function(module, conf)
-    local instance_id = tostring(conf.localaddr) .. "@" .. conf.addr .. ":" .. conf.port
+    local instance_id = udp_input_instance_id(conf)
     local instance = udp_input_instance_list[instance_id]
 
     instance.clients = instance.clients - 1
@@ -150,6 +150,10 @@ function channel_init_input(channel_data, input_id)
         input_data.config.set_pnr = channel_data.config.set_pnr
     end
 
+    if channel_data.config.loop and input_data.config.loop == nil then
+        input_data.config.loop = channel_data.config.loop
+    end
+
     input_data.input = init_input(input_data.config)
 
     if input_data.config.no_analyze ~= true then
@@ -204,6 +208,7 @@ init_output_option.biss = function(channel_data, output_id)
     output_data.biss = biss_encrypt({
         upstream = channel_data.tail:stream(),
         key = output_data.config.biss,
+        loop = channel_data.config.loop,
     })
     channel_data.tail = output_data.biss
 end
@@ -226,6 +231,7 @@ init_output_option.remux = function(channel_data, output_id)
     local remux_conf = {
         upstream = channel_data.tail:stream(),
         name = channel_data.config.name,
+        loop = channel_data.config.loop,
     }
 
     if output_conf.rate then remux_conf.rate = output_conf.rate end
@@ -293,6 +299,9 @@ init_output_module.udp = function(channel_data, output_id)
         rtp = (output_data.config.format == "rtp"),
         sync = output_data.config.sync,
         sync_opts = output_data.config.sync_opts,
+        batch = output_data.config.batch,
+        batch_time = output_data.config.batch_time,
+        loop = channel_data.config.loop,
     })
 end
 
@@ -324,6 +333,7 @@ init_output_module.file = function(channel_data, output_id)
         buffer_size = output_data.config.buffer_size,
         aio = output_data.config.aio,
         directio = output_data.config.directio,
+        loop = channel_data.config.loop,
     })
 end
 
@@ -729,7 +739,7 @@ function make_channel(channel_config)
     end
 
     channel_data.active_input_id = 0
-    channel_data.transmit = transmit()
+    channel_data.transmit = transmit({ loop = channel_config.loop })
     channel_data.tail = channel_data.transmit
 
     for xfrm_id in ipairs(channel_data.transform) do
@@ -104,6 +104,11 @@
 #define __func_pure __attribute__((__pure__))
 #define __func_const __attribute__((__const__))
 
+/* thread-local storage */
+#ifndef __thread_local
+#   define __thread_local __thread
+#endif /* !__thread_local */
+
 /* additional exit codes */
 #define EXIT_ABORT      2   /* asc_lib_abort() */
 #define EXIT_SIGHANDLER 101 /* signal handling error */
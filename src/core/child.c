@@ -21,6 +21,7 @@
 #include <core/child.h>
 #include <core/spawn.h>
 #include <core/timer.h>
+#include <mpegts/framer.h>
 
 #define MSG(_msg) "[child/%s] " _msg, child->name
 
@@ -40,6 +41,8 @@ typedef struct
 
     child_io_mode_t mode;
     child_io_callback_t on_flush;
+    mpegts_framer_t *framer;
+    asc_child_t *child;
 
     uint8_t data[IO_BUFFER_SIZE];
     size_t pos_read;
@@ -65,8 +68,9 @@ struct asc_child_t
 
 #define CHILD_IO_SETUP(__io) \
     do { \
-        child->__io.mode = cfg->__io.mode; \
+        child->__io.child = child; \
         child->__io.on_flush = cfg->__io.on_flush; \
+        io_set_mode(&child->__io, cfg->__io.mode); \
         child->__io.on_read = EVENT_##__io##_read; \
         child->__io.on_close = EVENT_##__io##_close; \
         child->__io.ev = asc_event_init(child->__io.fd, child); \
@@ -122,27 +126,26 @@ void recv_text(const asc_child_t *child, child_io_t *io)
 }
 
 static
-void recv_mpegts(const asc_child_t *child, child_io_t *io)
+void on_mpegts(void *arg, const uint8_t *ts, size_t count)
 {
-    /* 188-byte TS packets */
-    for (; io->pos_write >= io->pos_read + (TS_PACKET_SIZE * 2)
-         ; io->pos_read += TS_PACKET_SIZE)
-    {
-        /* look for sync byte */
-        for (size_t i = 0; i < TS_PACKET_SIZE; i++)
-        {
-            const uint8_t *const ts = &io->data[io->pos_read + i];
-            if (TS_IS_SYNC(ts))
-            {
-                io->pos_read += i;
-                if (io->on_flush != NULL)
-                    io->on_flush(child->arg, ts, 1);
-                    // FIXME: flush more than 1
+    const child_io_t *const io = (child_io_t *)arg;
 
-                break;
-            }
-        }
-    }
+    if (io->on_flush != NULL)
+        io->on_flush(io->child->arg, ts, count);
+}
+
+static
+void io_set_mode(child_io_t *io, child_io_mode_t mode)
+{
+    io->pos_read = io->pos_write = 0;
+    io->mode = mode;
+
+    if (mode != CHILD_IO_MPEGTS)
+        ASC_FREE(io->framer, mpegts_framer_destroy);
+    else if (io->framer == NULL)
+        io->framer = mpegts_framer_init(on_mpegts, io);
+    else
+        mpegts_framer_reset(io->framer);
 }
 
 static
@@ -166,7 +169,9 @@ ssize_t recv_buffer(asc_child_t *child, child_io_t *io)
     switch (io->mode)
     {
         case CHILD_IO_MPEGTS:
-            recv_mpegts(child, io);
+            /* framer keeps partial packets on its own */
+            mpegts_framer_push(io->framer, io->data, io->pos_write);
+            io->pos_write = 0;
             break;
 
         case CHILD_IO_TEXT:
@@ -396,6 +401,17 @@ void io_cleanup(child_io_t *io)
     }
 }
 
+static
+void child_free(asc_child_t *child)
+{
+    ASC_FREE(child->sin.framer, mpegts_framer_destroy);
+    ASC_FREE(child->sout.framer, mpegts_framer_destroy);
+    ASC_FREE(child->serr.framer, mpegts_framer_destroy);
+
+    asc_process_free(&child->proc);
+    free(child);
+}
+
 void asc_child_close(asc_child_t *child)
 {
     ASC_FREE(child->kill_timer, asc_timer_destroy);
@@ -482,8 +498,7 @@ void asc_child_close(asc_child_t *child)
     if (child->on_close != NULL)
         child->on_close(child->arg, status);
 
-    asc_process_free(&child->proc);
-    free(child);
+    child_free(child);
 }
 
 void asc_child_destroy(asc_child_t *child)
@@ -537,8 +552,7 @@ void asc_child_destroy(asc_child_t *child)
             asc_log_error(MSG("couldn't get status: %s"), asc_error_msg());
     }
 
-    asc_process_free(&child->proc);
-    free(child);
+    child_free(child);
 }
 
 /*
@@ -586,10 +600,7 @@ void asc_child_set_on_flush(asc_child_t *child, int child_fd
 void asc_child_set_mode(asc_child_t *child, int child_fd
                         , child_io_mode_t mode)
 {
-    child_io_t *const io = get_io_by_fd(child, child_fd);
-
-    io->pos_read = io->pos_write = 0;
-    io->mode = mode;
+    io_set_mode(get_io_by_fd(child, child_fd), mode);
 }
 
 void asc_child_toggle_input(asc_child_t *child, int child_fd
@@ -35,7 +35,7 @@ typedef void (*child_io_callback_t)(void *, const void *, size_t);
 typedef enum
 {
     CHILD_IO_NONE   = 0, /* discard all data */
-    CHILD_IO_MPEGTS = 1, /* TS with 188-byte packets */
+    CHILD_IO_MPEGTS = 1, /* TS, passed on as 188-byte packets */
     CHILD_IO_TEXT   = 2, /* line-buffered stream */
     CHILD_IO_RAW    = 3, /* no buffering at all */
 } child_io_mode_t;
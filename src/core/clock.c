@@ -48,6 +48,21 @@ uint64_t asc_utime(void)
 #endif
 }
 
+/* nanosecond counterpart of asc_utime() for timing short calls */
+uint64_t asc_ntime(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && !defined(_WIN32)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == EINVAL)
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+#else
+    return asc_utime() * 1000ULL;
+#endif
+}
+
 void asc_usleep(uint64_t usec)
 {
 #ifndef _WIN32
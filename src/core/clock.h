@@ -27,6 +27,7 @@
 #endif /* !_ASTRA_H_ */
 
 uint64_t asc_utime(void) __wur;
+uint64_t asc_ntime(void) __wur;
 void asc_usleep(uint64_t usec);
 
 #endif /* _ASC_CLOCK_H_ */
@@ -21,6 +21,7 @@
 #include <astra.h>
 #include <core/event.h>
 #include <core/list.h>
+#include <core/mutex.h>
 
 #ifndef EV_LIST_SIZE
 #   define EV_LIST_SIZE 1024
@@ -55,10 +56,25 @@
 #   endif
 #   define EPOLLCLOSE (EPOLLERR | EPOLLHUP | EPOLLRDHUP)
 #   define MSG(_msg) "[core/event epoll] " _msg
+#elif defined(WITH_IO_URING)
+#   define EV_TYPE_IO_URING
+#   include <linux/io_uring.h>
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#   include <poll.h>
+#   ifndef POLLRDHUP
+#       define POLLRDHUP 0
+#   endif
+#   define POLLCLOSE (POLLERR | POLLHUP | POLLRDHUP | POLLNVAL)
+#   define MSG(_msg) "[core/event io_uring] " _msg
 #else
 #   error "Event notification interface not set"
 #endif
 
+#ifdef EV_TYPE_IO_URING
+typedef struct ev_poll_t ev_poll_t;
+#endif
+
 struct asc_event_t
 {
     int fd;
@@ -66,8 +82,35 @@ struct asc_event_t
     event_callback_t on_write;
     event_callback_t on_error;
     void *arg;
+    bool is_edge;
+
+#ifdef EV_TYPE_IO_URING
+    /* poll request currently armed for this event */
+    ev_poll_t *poll;
+#endif
+
+#if defined(EV_TYPE_KQUEUE) || defined(EV_TYPE_EPOLL)
+    /* closed events stay allocated until the next wait */
+    bool is_closed;
+    asc_event_t *next_closed;
+#endif
 };
 
+typedef asc_event_observer_t event_observer_t;
+
+/* worker loops give up their lock while waiting, see core/loop.c */
+#define EV_UNLOCK() \
+    do { \
+        if (event_observer->lock != NULL) \
+            asc_mutex_unlock(event_observer->lock); \
+    } while (0)
+
+#define EV_LOCK() \
+    do { \
+        if (event_observer->lock != NULL) \
+            asc_mutex_lock(event_observer->lock); \
+    } while (0)
+
 #if defined(EV_TYPE_KQUEUE) || defined(EV_TYPE_EPOLL)
 
 /*
@@ -118,40 +161,60 @@ static inline int __event_init(void)
     return fd;
 }
 
-typedef struct
+struct asc_event_observer_t
 {
     asc_list_t *event_list;
-    bool is_changed;
+
+    /*
+     * Events returned by a wait may be closed by callbacks or by another
+     * thread before they are dispatched. They are only freed before the
+     * next wait, so that the rest of the list is still walked; skipping
+     * an edge-triggered event would lose its notification for good.
+     */
+    asc_event_t *closed;
 
     int fd;
     EV_OTYPE ed_list[EV_LIST_SIZE];
-} event_observer_t;
 
-static event_observer_t event_observer;
+    /* held by the owning thread except while waiting for events */
+    asc_mutex_t *lock;
+};
+
+static __thread_local event_observer_t *event_observer = NULL;
+
+static void event_flush_closed(void)
+{
+    while(event_observer->closed != NULL)
+    {
+        asc_event_t *const event = event_observer->closed;
+        event_observer->closed = event->next_closed;
+        free(event);
+    }
+}
 
 void asc_event_core_init(void)
 {
-    memset(&event_observer, 0, sizeof(event_observer));
-    event_observer.event_list = asc_list_init();
+    event_observer = ASC_ALLOC(1, event_observer_t);
+    event_observer->event_list = asc_list_init();
 
-    event_observer.fd = __event_init();
-    asc_assert(event_observer.fd != -1
+    event_observer->fd = __event_init();
+    asc_assert(event_observer->fd != -1
                , MSG("failed to init event observer [%s]")
                , strerror(errno));
 }
 
 void asc_event_core_destroy(void)
 {
-    if (!event_observer.event_list || !event_observer.fd)
+    if (event_observer == NULL)
         return;
 
-    close(event_observer.fd);
-    event_observer.fd = 0;
+    close(event_observer->fd);
+    event_observer->fd = 0;
 
     asc_event_t *prev_event = NULL;
-    asc_list_till_empty(event_observer.event_list)
+    asc_list_till_empty(event_observer->event_list)
     {
-        asc_event_t *event = (asc_event_t *)asc_list_data(event_observer.event_list);
+        asc_event_t *event = (asc_event_t *)asc_list_data(event_observer->event_list);
         asc_assert(event != prev_event
                    , MSG("loop on asc_event_core_destroy() event:%p")
                    , (void *)event);
@@ -162,39 +225,48 @@ void asc_event_core_destroy(void)
         prev_event = event;
     }
 
-    ASC_FREE(event_observer.event_list, asc_list_destroy);
+    event_flush_closed();
+
+    ASC_FREE(event_observer->event_list, asc_list_destroy);
+    ASC_FREE(event_observer, free);
 }
 
 void asc_event_core_loop(unsigned int timeout)
 {
-    if(asc_list_size(event_observer.event_list) == 0)
+    event_flush_closed();
+
+    if(asc_list_size(event_observer->event_list) == 0)
     {
+        EV_UNLOCK();
         asc_usleep(timeout * 1000ULL); /* dry run */
+        EV_LOCK();
         return;
     }
 
+    EV_UNLOCK();
+
 #if defined(EV_TYPE_KQUEUE)
     const struct timespec ts = {
         (timeout / 1000), /* tv_sec */
         (timeout % 1000) * 1000000UL, /* tv_nsec */
     };
-    const int ret = kevent(event_observer.fd, NULL, 0
-                           , event_observer.ed_list, EV_LIST_SIZE, &ts);
+    const int ret = kevent(event_observer->fd, NULL, 0
+                           , event_observer->ed_list, EV_LIST_SIZE, &ts);
 #else
-    const int ret = epoll_wait(event_observer.fd, event_observer.ed_list
+    const int ret = epoll_wait(event_observer->fd, event_observer->ed_list
                                , EV_LIST_SIZE, timeout);
 #endif
 
+    EV_LOCK();
     if(ret == -1)
     {
         asc_assert(errno == EINTR, MSG("event observer critical error [%s]"), strerror(errno));
         return;
     }
 
-    event_observer.is_changed = false;
     for(int i = 0; i < ret; ++i)
     {
-        EV_OTYPE *ed = &event_observer.ed_list[i];
+        EV_OTYPE *ed = &event_observer->ed_list[i];
 #if defined(EV_TYPE_KQUEUE)
         asc_event_t *event = (asc_event_t *)ed->udata;
         const bool is_rd = (ed->data > 0) && (ed->filter == EVFILT_READ);
@@ -209,21 +281,17 @@ void asc_event_core_loop(unsigned int timeout)
         if(event->on_read && is_rd)
         {
             event->on_read(event->arg);
-            if(event_observer.is_changed)
-                break;
+            if(event->is_closed)
+                continue;
         }
         if(event->on_error && is_er)
         {
             event->on_error(event->arg);
-            if(event_observer.is_changed)
-                break;
+            if(event->is_closed)
+                continue;
         }
         if(event->on_write && is_wr)
-        {
             event->on_write(event->arg);
-            if(event_observer.is_changed)
-                break;
-        }
     }
 }
 
@@ -237,28 +305,30 @@ static void asc_event_subscribe(asc_event_t *event)
     {
         if(event->on_read)
         {
-            EV_SET(&ed, event->fd, EVFILT_READ, EV_ADD | EV_EOF | EV_ERROR, 0, 0, event);
-            ret = kevent(event_observer.fd, &ed, 1, NULL, 0, NULL);
+            const int clear = (event->is_edge) ? EV_CLEAR : 0;
+            EV_SET(&ed, event->fd, EVFILT_READ, EV_ADD | EV_EOF | EV_ERROR | clear
+                   , 0, 0, event);
+            ret = kevent(event_observer->fd, &ed, 1, NULL, 0, NULL);
             if(ret == -1)
                 break;
         }
         else
         {
             EV_SET(&ed, event->fd, EVFILT_READ, EV_DELETE, 0, 0, event);
-            kevent(event_observer.fd, &ed, 1, NULL, 0, NULL);
+            kevent(event_observer->fd, &ed, 1, NULL, 0, NULL);
         }
 
         if(event->on_write)
         {
             EV_SET(&ed, event->fd, EVFILT_WRITE, EV_ADD | EV_EOF | EV_ERROR, 0, 0, event);
-            ret = kevent(event_observer.fd, &ed, 1, NULL, 0, NULL);
+            ret = kevent(event_observer->fd, &ed, 1, NULL, 0, NULL);
             if(ret == -1)
                 break;
         }
         else
         {
             EV_SET(&ed, event->fd, EVFILT_WRITE, EV_DELETE, 0, 0, event);
-            kevent(event_observer.fd, &ed, 1, NULL, 0, NULL);
+            kevent(event_observer->fd, &ed, 1, NULL, 0, NULL);
         }
 
         return;
@@ -270,9 +340,12 @@ static void asc_event_subscribe(asc_event_t *event)
     ed.events = EPOLLCLOSE;
     if(event->on_read)
         ed.events |= EPOLLIN;
+    /* EPOLLET covers both directions, writers expect level-triggering */
     if(event->on_write)
         ed.events |= EPOLLOUT;
-    ret = epoll_ctl(event_observer.fd, EPOLL_CTL_MOD, event->fd, &ed);
+    else if(event->is_edge)
+        ed.events |= EPOLLET;
+    ret = epoll_ctl(event_observer->fd, EPOLL_CTL_MOD, event->fd, &ed);
 #endif
 
     asc_assert(ret != -1, MSG("failed to set fd=%d [%s]")
@@ -291,15 +364,14 @@ asc_event_t *asc_event_init(int fd, void *arg)
     ed.data.ptr = event;
     ed.events = EPOLLCLOSE;
 
-    const int ret = epoll_ctl(event_observer.fd
+    const int ret = epoll_ctl(event_observer->fd
                               , EPOLL_CTL_ADD, event->fd, &ed);
 
     asc_assert(ret != -1, MSG("failed to attach fd=%d [%s]")
                , event->fd, strerror(errno));
 #endif
 
-    asc_list_insert_tail(event_observer.event_list, event);
-    event_observer.is_changed = true;
+    asc_list_insert_tail(event_observer->event_list, event);
 
     return event;
 }
@@ -315,25 +387,726 @@ void asc_event_close(asc_event_t *event)
     if(event->on_read)
     {
         EV_SET(&ed, event->fd, EVFILT_READ, EV_DELETE, 0, 0, event);
-        kevent(event_observer.fd, &ed, 1, NULL, 0, NULL);
+        kevent(event_observer->fd, &ed, 1, NULL, 0, NULL);
     }
     if(event->on_write)
     {
         EV_SET(&ed, event->fd, EVFILT_WRITE, EV_DELETE, 0, 0, event);
-        kevent(event_observer.fd, &ed, 1, NULL, 0, NULL);
+        kevent(event_observer->fd, &ed, 1, NULL, 0, NULL);
     }
 
 #else /* EV_TYPE_EPOLL */
 
-    epoll_ctl(event_observer.fd, EPOLL_CTL_DEL, event->fd, NULL);
+    epoll_ctl(event_observer->fd, EPOLL_CTL_DEL, event->fd, NULL);
 #endif
 
-    event_observer.is_changed = true;
-    asc_list_remove_item(event_observer.event_list, event);
+    asc_list_remove_item(event_observer->event_list, event);
+
+    /* callbacks are cleared in case it's still in the ready list */
+    event->on_read = NULL;
+    event->on_write = NULL;
+    event->on_error = NULL;
+    event->is_closed = true;
+
+    event->next_closed = event_observer->closed;
+    event_observer->closed = event;
+}
+
+#elif defined(EV_TYPE_IO_URING)
+
+/*
+ * ooooo  ooooooo          ooooo  oooo oooooooooo  ooooo oooo   oooo  ooooooo8
+ *  888 o888   888o         888    88   888    888  888   8888o  88 o888    88
+ *  888 888     888         888    88   888oooo88   888   88 888o88 888    oooo
+ *  888 888o   o888         888    88   888  88o    888   88   8888 888o    88
+ * o888o  88ooo88 ooooooooo  888oo88   o888o  88o8 o888o o88o    88  888ooo888
+ *
+ */
+
+/*
+ * Readiness mode: every event has an IORING_OP_POLL_ADD request in
+ * flight. Edge-triggered readers (see asc_event_set_edge()) get a
+ * multishot poll that stays armed across callbacks; the rest get a
+ * one-shot poll which is re-armed after its callbacks have run.
+ *
+ * Completion mode: asc_event_io_t handles queue the reads and writes
+ * themselves, see asc_event_io_init().
+ *
+ * New, re-armed and cancelled requests queue up in the SQ and go to
+ * the kernel with the next wait, so each loop iteration costs a single
+ * io_uring_enter() call.
+ */
+
+#define EV_RING_SIZE 256
+
+/* milliseconds to wait for the kernel to accept queued requests */
+#define EV_SUBMIT_TIMEOUT 1000
+
+/* user_data of completion requests is tagged, polls aren't */
+#define EV_IO_TAG 1
+
+struct ev_poll_t
+{
+    /* NULL once the event is closed or has been re-armed */
+    asc_event_t *event;
+    /* kernel is done with the request, its CQE is being processed */
+    bool is_done;
+    bool is_multishot;
+};
+
+struct asc_event_io_t
+{
+    int fd;
+    void *arg;
+    event_io_callback_t on_done;
+
+    /* request in flight, the kernel may use the buffer */
+    bool is_busy;
+    uint8_t opcode;
+};
+
+typedef struct
+{
+    uint64_t user_data;
+    int res;
+    unsigned int flags;
+} ev_cqe_t;
+
+struct asc_event_observer_t
+{
+    asc_list_t *event_list;
+    bool is_changed;
+
+    int fd;
+
+    /* submission queue */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_pending;
+
+    /* completion queue */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* completions taken off the CQ by asc_event_io_close() */
+    ev_cqe_t *deferred;
+    unsigned int deferred_count;
+    unsigned int deferred_size;
+
+    /* requests the kernel hasn't completed yet */
+    unsigned int request_count;
+
+    /* cleared if the kernel turns down multishot polls */
+    bool is_multishot;
+
+    asc_mutex_t *lock;
+};
+
+static __thread_local event_observer_t *event_observer = NULL;
+
+static int ring_enter(unsigned int to_submit, unsigned int min_complete
+                      , int timeout)
+{
+    struct __kernel_timespec ts = {
+        .tv_sec = (timeout / 1000),
+        .tv_nsec = (timeout % 1000) * 1000000L,
+    };
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uintptr_t)&ts;
+
+    unsigned int flags = IORING_ENTER_EXT_ARG;
+    if (min_complete > 0)
+        flags |= IORING_ENTER_GETEVENTS;
+
+    return syscall(__NR_io_uring_enter, event_observer->fd, to_submit
+                   , min_complete, flags, &arg, sizeof(arg));
+}
+
+/* hand queued requests over to the kernel without waiting */
+static void ring_submit(void)
+{
+    unsigned int stalled = 0;
+
+    while (event_observer->sq_pending > 0)
+    {
+        const int ret = ring_enter(event_observer->sq_pending, 0, 0);
+        if (ret > 0)
+        {
+            event_observer->sq_pending -= ret;
+            stalled = 0;
+            continue;
+        }
+
+        if (ret == -1 && errno == EINTR)
+            continue;
+
+        /* nothing taken: out of memory or the CQ is full. waiting for
+         * completions lets the kernel flush its backlog; don't spin. */
+        asc_assert(ret == 0 || errno == EAGAIN || errno == EBUSY
+                   , MSG("failed to submit requests [%s]")
+                   , strerror(errno));
+
+        asc_assert(++stalled < EV_SUBMIT_TIMEOUT
+                   , MSG("kernel hasn't accepted %u requests in %u ms")
+                   , event_observer->sq_pending, stalled);
+
+        ring_enter(0, 1, 1);
+    }
+}
+
+static struct io_uring_sqe *ring_get_sqe(void)
+{
+    unsigned int tail = *event_observer->sq_tail;
+    const unsigned int head =
+        __atomic_load_n(event_observer->sq_head, __ATOMIC_ACQUIRE);
+
+    if (tail - head >= event_observer->sq_entries)
+    {
+        ring_submit();
+        tail = *event_observer->sq_tail;
+    }
+
+    const unsigned int idx = tail & event_observer->sq_mask;
+    struct io_uring_sqe *const sqe = &event_observer->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    event_observer->sq_array[idx] = idx;
+
+    return sqe;
+}
+
+/* make the request filled in by ring_get_sqe() visible to the kernel */
+static void ring_push_sqe(void)
+{
+    __atomic_store_n(event_observer->sq_tail, *event_observer->sq_tail + 1
+                     , __ATOMIC_RELEASE);
+
+    event_observer->sq_pending++;
+}
+
+/* cancel request by its user_data; the CQE of the cancel is ignored */
+static void ring_cancel(uint64_t user_data)
+{
+    struct io_uring_sqe *const sqe = ring_get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = 0;
+    ring_push_sqe();
+}
+
+static void poll_arm(asc_event_t *event)
+{
+    ev_poll_t *const poll = ASC_ALLOC(1, ev_poll_t);
+    poll->event = event;
+    event->poll = poll;
+
+    /* multishot polls don't fire again until new data arrives */
+    poll->is_multishot = (event_observer->is_multishot && event->is_edge
+                          && event->on_read && !event->on_write);
+
+    struct io_uring_sqe *const sqe = ring_get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = event->fd;
+    sqe->poll32_events = POLLCLOSE;
+    if (event->on_read)
+        sqe->poll32_events |= POLLIN;
+    if (event->on_write)
+        sqe->poll32_events |= POLLOUT;
+    if (poll->is_multishot)
+        sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = (uintptr_t)poll;
+    ring_push_sqe();
+
+    event_observer->request_count++;
+}
+
+static void poll_disarm(asc_event_t *event)
+{
+    ev_poll_t *const poll = event->poll;
+    if (poll == NULL)
+        return;
+
+    event->poll = NULL;
+    poll->event = NULL;
+
+    /* completed request is freed by ring_complete() */
+    if (poll->is_done)
+        return;
+
+    /* cancelled request still produces a CQE, the poll is freed there */
+    struct io_uring_sqe *const sqe = ring_get_sqe();
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)poll;
+    sqe->user_data = 0;
+    ring_push_sqe();
+}
+
+static void poll_complete(ev_poll_t *poll, int res, unsigned int flags)
+{
+    /* multishot poll stays armed while the kernel sets F_MORE */
+    const bool is_more = (flags & IORING_CQE_F_MORE);
+    if (!is_more)
+    {
+        event_observer->request_count--;
+        poll->is_done = true;
+    }
+
+    asc_event_t *const event = poll->event;
+    if (event != NULL && res == -EINVAL && poll->is_multishot)
+    {
+        /* kernel is older than 5.13, stay with one-shot polls */
+        asc_log_debug(MSG("multishot polls are not supported"));
+        event_observer->is_multishot = false;
+
+        event->poll = NULL;
+        poll_arm(event);
+    }
+    else if (event != NULL)
+    {
+        const unsigned int revents = (res < 0) ? POLLERR : (unsigned)res;
+
+        if (event->on_read && (revents & POLLIN))
+            event->on_read(event->arg);
+
+        /* stop if the event was closed or re-armed by the callback */
+        if (poll->event == event
+            && event->on_error && (revents & POLLCLOSE))
+        {
+            event->on_error(event->arg);
+        }
+
+        if (poll->event == event
+            && event->on_write && (revents & POLLOUT))
+        {
+            event->on_write(event->arg);
+        }
+
+        if (poll->event == event && !is_more)
+        {
+            event->poll = NULL;
+
+            if (res >= 0)
+                poll_arm(event);
+            else
+                asc_log_error(MSG("poll failed on fd=%d [%s]")
+                              , event->fd, strerror(-res));
+        }
+    }
+
+    if (!is_more)
+        free(poll);
+}
+
+static void ring_complete(uint64_t user_data, int res, unsigned int flags)
+{
+    /* result of a POLL_REMOVE or ASYNC_CANCEL request */
+    if (user_data == 0)
+        return;
+
+    if (user_data & EV_IO_TAG)
+    {
+        asc_event_io_t *const io =
+            (asc_event_io_t *)(uintptr_t)(user_data & ~(uint64_t)EV_IO_TAG);
+
+        event_observer->request_count--;
+        io->is_busy = false;
+        io->on_done(io->arg, res);
+    }
+    else
+    {
+        poll_complete((ev_poll_t *)(uintptr_t)user_data, res, flags);
+    }
+}
+
+static void ring_process(void)
+{
+    /* completions taken early go first, callbacks may add more */
+    for (unsigned int i = 0; i < event_observer->deferred_count; i++)
+    {
+        const ev_cqe_t cqe = event_observer->deferred[i];
+        event_observer->deferred[i].user_data = 0;
+
+        ring_complete(cqe.user_data, cqe.res, cqe.flags);
+    }
+    event_observer->deferred_count = 0;
+
+    /* callbacks may reap the CQ too, re-read the head every time */
+    while (true)
+    {
+        const unsigned int head = *event_observer->cq_head;
+        if (head == __atomic_load_n(event_observer->cq_tail, __ATOMIC_ACQUIRE))
+            break;
+
+        const struct io_uring_cqe *const cqe =
+            &event_observer->cqes[head & event_observer->cq_mask];
+
+        const uint64_t user_data = cqe->user_data;
+        const int res = cqe->res;
+        const unsigned int flags = cqe->flags;
+
+        /* release the slot before callbacks get a chance to re-enter */
+        __atomic_store_n(event_observer->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        ring_complete(user_data, res, flags);
+    }
+}
+
+void asc_event_core_init(void)
+{
+    event_observer = ASC_ALLOC(1, event_observer_t);
+    event_observer->event_list = asc_list_init();
+    event_observer->is_multishot = true;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    event_observer->fd = syscall(__NR_io_uring_setup, EV_RING_SIZE, &params);
+    asc_assert(event_observer->fd != -1
+               , MSG("failed to init event observer [%s]")
+               , strerror(errno));
+
+    asc_assert(params.features & IORING_FEAT_EXT_ARG
+               , MSG("kernel doesn't support IORING_FEAT_EXT_ARG"));
+
+    if (fcntl(event_observer->fd, F_SETFD, FD_CLOEXEC) != 0)
+        asc_log_error(MSG("failed to set FD_CLOEXEC [%s]"), strerror(errno));
+
+    /* map rings */
+    event_observer->sq_ring_size = params.sq_off.array
+                                   + params.sq_entries * sizeof(unsigned int);
+    event_observer->cq_ring_size = params.cq_off.cqes
+                                   + params.cq_entries
+                                   * sizeof(struct io_uring_cqe);
+
+    event_observer->sq_ring = mmap(NULL, event_observer->sq_ring_size
+                                   , PROT_READ | PROT_WRITE
+                                   , MAP_SHARED | MAP_POPULATE
+                                   , event_observer->fd, IORING_OFF_SQ_RING);
+    asc_assert(event_observer->sq_ring != MAP_FAILED
+               , MSG("failed to map SQ ring [%s]"), strerror(errno));
+
+    event_observer->cq_ring = mmap(NULL, event_observer->cq_ring_size
+                                   , PROT_READ | PROT_WRITE
+                                   , MAP_SHARED | MAP_POPULATE
+                                   , event_observer->fd, IORING_OFF_CQ_RING);
+    asc_assert(event_observer->cq_ring != MAP_FAILED
+               , MSG("failed to map CQ ring [%s]"), strerror(errno));
+
+    event_observer->sqes = (struct io_uring_sqe *)mmap(NULL
+                                   , params.sq_entries
+                                   * sizeof(struct io_uring_sqe)
+                                   , PROT_READ | PROT_WRITE
+                                   , MAP_SHARED | MAP_POPULATE
+                                   , event_observer->fd, IORING_OFF_SQES);
+    asc_assert(event_observer->sqes != MAP_FAILED
+               , MSG("failed to map SQ entries [%s]"), strerror(errno));
+
+    uint8_t *const sq = (uint8_t *)event_observer->sq_ring;
+    event_observer->sq_head = (unsigned int *)&sq[params.sq_off.head];
+    event_observer->sq_tail = (unsigned int *)&sq[params.sq_off.tail];
+    event_observer->sq_mask = *(unsigned int *)&sq[params.sq_off.ring_mask];
+    event_observer->sq_entries = params.sq_entries;
+    event_observer->sq_array = (unsigned int *)&sq[params.sq_off.array];
+
+    uint8_t *const cq = (uint8_t *)event_observer->cq_ring;
+    event_observer->cq_head = (unsigned int *)&cq[params.cq_off.head];
+    event_observer->cq_tail = (unsigned int *)&cq[params.cq_off.tail];
+    event_observer->cq_mask = *(unsigned int *)&cq[params.cq_off.ring_mask];
+    event_observer->cqes = (struct io_uring_cqe *)&cq[params.cq_off.cqes];
+}
+
+void asc_event_core_destroy(void)
+{
+    if (event_observer == NULL)
+        return;
+
+    asc_event_t *prev_event = NULL;
+    asc_list_till_empty(event_observer->event_list)
+    {
+        asc_event_t *event = (asc_event_t *)asc_list_data(event_observer->event_list);
+        asc_assert(event != prev_event
+                   , MSG("loop on asc_event_core_destroy() event:%p")
+                   , (void *)event);
+
+        if (event->on_error)
+            event->on_error(event->arg);
+
+        prev_event = event;
+    }
+
+    /* collect cancelled requests so their poll structs can be freed */
+    for (unsigned int i = 0; i < 100 && event_observer->request_count > 0; i++)
+    {
+        const unsigned int to_submit = event_observer->sq_pending;
+        event_observer->sq_pending = 0;
+
+        ring_enter(to_submit, 1, 10);
+        ring_process();
+    }
+
+    if (event_observer->request_count > 0)
+    {
+        asc_log_error(MSG("%u requests didn't complete")
+                      , event_observer->request_count);
+    }
+
+    munmap(event_observer->sqes
+           , event_observer->sq_entries * sizeof(struct io_uring_sqe));
+    munmap(event_observer->cq_ring, event_observer->cq_ring_size);
+    munmap(event_observer->sq_ring, event_observer->sq_ring_size);
+    close(event_observer->fd);
+
+    free(event_observer->deferred);
+    ASC_FREE(event_observer->event_list, asc_list_destroy);
+    ASC_FREE(event_observer, free);
+}
+
+void asc_event_core_loop(unsigned int timeout)
+{
+    /* completion requests don't have an event of their own */
+    if(asc_list_size(event_observer->event_list) == 0
+       && event_observer->request_count == 0
+       && event_observer->sq_pending == 0)
+    {
+        EV_UNLOCK();
+        asc_usleep(timeout * 1000ULL); /* dry run */
+        EV_LOCK();
+        return;
+    }
+
+    /* requests queued after this point wait for the next iteration */
+    const unsigned int to_submit = event_observer->sq_pending;
+    event_observer->sq_pending = 0;
+
+    event_observer->is_changed = false;
+    EV_UNLOCK();
+    const int ret = ring_enter(to_submit, 1, timeout);
+    EV_LOCK();
+
+    if(ret == -1)
+    {
+        asc_assert(errno == EINTR || errno == ETIME || errno == EAGAIN
+                   || errno == EBUSY
+                   , MSG("event observer critical error [%s]")
+                   , strerror(errno));
+
+        /* nothing was submitted, retry with the next call */
+        event_observer->sq_pending += to_submit;
+    }
+    else if((unsigned)ret < to_submit)
+    {
+        /* kernel stopped early; keep the rest for the next call */
+        event_observer->sq_pending += to_submit - ret;
+    }
+
+    /*
+     * closed events detach from their polls, so completions are safe
+     * to process even if another thread changed the list meanwhile.
+     */
+    ring_process();
+}
+
+static void asc_event_subscribe(asc_event_t *event)
+{
+    poll_disarm(event);
+    poll_arm(event);
+}
+
+asc_event_t *asc_event_init(int fd, void *arg)
+{
+    asc_event_t *const event = ASC_ALLOC(1, asc_event_t);
+
+    event->fd = fd;
+    event->arg = arg;
+
+    poll_arm(event);
+
+    asc_list_insert_tail(event_observer->event_list, event);
+    event_observer->is_changed = true;
+
+    return event;
+}
+
+void asc_event_close(asc_event_t *event)
+{
+    if(!event)
+        return;
+
+    poll_disarm(event);
+
+    /* the fd may be closed right after this call */
+    ring_submit();
+
+    event_observer->is_changed = true;
+    asc_list_remove_item(event_observer->event_list, event);
 
     free(event);
 }
 
+/*
+ * completion I/O
+ */
+
+asc_event_io_t *asc_event_io_init(int fd, void *arg
+                                  , event_io_callback_t on_done)
+{
+    asc_event_io_t *const io = ASC_ALLOC(1, asc_event_io_t);
+
+    io->fd = fd;
+    io->arg = arg;
+    io->on_done = on_done;
+
+    return io;
+}
+
+static void io_queue(asc_event_io_t *io, uint8_t opcode, const void *buffer
+                     , size_t size, uint64_t offset)
+{
+    asc_assert(!io->is_busy, MSG("fd=%d already has a request in flight")
+               , io->fd);
+
+    struct io_uring_sqe *const sqe = ring_get_sqe();
+    sqe->opcode = opcode;
+    sqe->fd = io->fd;
+    sqe->addr = (uintptr_t)buffer;
+    sqe->len = size;
+    sqe->off = offset;
+    if (opcode == IORING_OP_SEND)
+        sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)io | EV_IO_TAG;
+    ring_push_sqe();
+
+    io->is_busy = true;
+    io->opcode = opcode;
+    event_observer->request_count++;
+}
+
+void asc_event_io_recv(asc_event_io_t *io, void *buffer, size_t size)
+{
+    io_queue(io, IORING_OP_RECV, buffer, size, 0);
+}
+
+void asc_event_io_send(asc_event_io_t *io, const void *buffer, size_t size)
+{
+    io_queue(io, IORING_OP_SEND, buffer, size, 0);
+}
+
+void asc_event_io_write(asc_event_io_t *io, const void *buffer, size_t size
+                        , uint64_t offset)
+{
+    io_queue(io, IORING_OP_WRITE, buffer, size, offset);
+}
+
+bool asc_event_io_is_busy(const asc_event_io_t *io)
+{
+    return io->is_busy;
+}
+
+static void io_defer(const struct io_uring_cqe *cqe)
+{
+    if (event_observer->deferred_count == event_observer->deferred_size)
+    {
+        const size_t size = event_observer->deferred_size + EV_RING_SIZE;
+        ev_cqe_t *const deferred =
+            (ev_cqe_t *)realloc(event_observer->deferred
+                                , size * sizeof(*deferred));
+        asc_assert(deferred != NULL, MSG("realloc() failed"));
+
+        event_observer->deferred = deferred;
+        event_observer->deferred_size = size;
+    }
+
+    ev_cqe_t *const item =
+        &event_observer->deferred[event_observer->deferred_count++];
+
+    item->user_data = cqe->user_data;
+    item->res = cqe->res;
+    item->flags = cqe->flags;
+}
+
+/*
+ * take CQEs off the ring until `io' is done; others are kept for
+ * ring_process(), their callbacks can't run from here.
+ */
+static void io_reap(asc_event_io_t *io)
+{
+    const uint64_t user_data = (uintptr_t)io | EV_IO_TAG;
+
+    /* might have been reaped already */
+    for (unsigned int i = 0; i < event_observer->deferred_count; i++)
+    {
+        if (event_observer->deferred[i].user_data == user_data)
+        {
+            event_observer->deferred[i].user_data = 0;
+            event_observer->request_count--;
+            io->is_busy = false;
+            return;
+        }
+    }
+
+    for (unsigned int waited = 0; io->is_busy; waited++)
+    {
+        asc_assert(waited < EV_SUBMIT_TIMEOUT
+                   , MSG("request on fd=%d didn't complete in %u ms")
+                   , io->fd, waited);
+
+        ring_submit();
+        ring_enter(0, 1, 1);
+
+        unsigned int head = *event_observer->cq_head;
+        while (head != __atomic_load_n(event_observer->cq_tail
+                                       , __ATOMIC_ACQUIRE))
+        {
+            const struct io_uring_cqe *const cqe =
+                &event_observer->cqes[head & event_observer->cq_mask];
+
+            if (cqe->user_data == user_data)
+            {
+                event_observer->request_count--;
+                io->is_busy = false;
+            }
+            else if (cqe->user_data != 0)
+            {
+                io_defer(cqe);
+            }
+
+            __atomic_store_n(event_observer->cq_head, ++head
+                             , __ATOMIC_RELEASE);
+        }
+    }
+}
+
+void asc_event_io_close(asc_event_io_t *io)
+{
+    if (io == NULL)
+        return;
+
+    if (io->is_busy)
+    {
+        /* data already handed over to a write is not thrown away */
+        if (io->opcode != IORING_OP_WRITE)
+            ring_cancel((uintptr_t)io | EV_IO_TAG);
+
+        io_reap(io);
+    }
+
+    free(io);
+}
+
 #elif defined(EV_TYPE_POLL)
 
 /*
@@ -345,49 +1118,62 @@ void asc_event_close(asc_event_t *event)
  *
  */
 
-typedef struct
+struct asc_event_observer_t
 {
     asc_event_t *event_list[EV_LIST_SIZE];
     bool is_changed;
     int fd_count;
 
     struct pollfd fd_list[EV_LIST_SIZE];
-} event_observer_t;
+
+    asc_mutex_t *lock;
+};
 
 #define ED_SIZE (int)(sizeof(struct pollfd))
 
-static event_observer_t event_observer;
+static __thread_local event_observer_t *event_observer = NULL;
 
 void asc_event_core_init(void)
 {
-    memset(&event_observer, 0, sizeof(event_observer));
+    event_observer = ASC_ALLOC(1, event_observer_t);
 }
 
 void asc_event_core_destroy(void)
 {
-    while(event_observer.fd_count > 0)
+    if (event_observer == NULL)
+        return;
+
+    while(event_observer->fd_count > 0)
     {
-        const int next_fd_count = event_observer.fd_count - 1;
+        const int next_fd_count = event_observer->fd_count - 1;
 
-        asc_event_t *event = event_observer.event_list[next_fd_count];
+        asc_event_t *event = event_observer->event_list[next_fd_count];
         if(event->on_error)
             event->on_error(event->arg);
 
-        asc_assert(event_observer.fd_count == next_fd_count
+        asc_assert(event_observer->fd_count == next_fd_count
                    , MSG("loop on asc_event_core_destroy() event:%p")
                    , (void *)event);
     }
+
+    ASC_FREE(event_observer, free);
 }
 
 void asc_event_core_loop(unsigned int timeout)
 {
-    if(event_observer.fd_count == 0)
+    if(event_observer->fd_count == 0)
     {
+        EV_UNLOCK();
         asc_usleep(timeout * 1000ULL); /* dry run */
+        EV_LOCK();
         return;
     }
 
-    int ret = poll(event_observer.fd_list, event_observer.fd_count, timeout);
+    event_observer->is_changed = false;
+    EV_UNLOCK();
+    int ret = poll(event_observer->fd_list, event_observer->fd_count, timeout);
+    EV_LOCK();
+
     if(ret == -1)
     {
 #ifndef _WIN32
@@ -399,31 +1185,33 @@ void asc_event_core_loop(unsigned int timeout)
         asc_lib_abort();
     }
 
-    event_observer.is_changed = false;
-    for(int i = 0; i < event_observer.fd_count && ret > 0; ++i)
+    if(event_observer->is_changed)
+        return;
+
+    for(int i = 0; i < event_observer->fd_count && ret > 0; ++i)
     {
-        const short revents = event_observer.fd_list[i].revents;
+        const short revents = event_observer->fd_list[i].revents;
         if(revents == 0)
             continue;
 
         --ret;
-        asc_event_t *const event = event_observer.event_list[i];
+        asc_event_t *const event = event_observer->event_list[i];
         if(event->on_read && (revents & POLLIN))
         {
             event->on_read(event->arg);
-            if(event_observer.is_changed)
+            if(event_observer->is_changed)
                 break;
         }
         if(event->on_error && (revents & (POLLERR | POLLHUP | POLLNVAL)))
         {
             event->on_error(event->arg);
-            if(event_observer.is_changed)
+            if(event_observer->is_changed)
                 break;
         }
         if(event->on_write && (revents & POLLOUT))
         {
             event->on_write(event->arg);
-            if(event_observer.is_changed)
+            if(event_observer->is_changed)
                 break;
         }
     }
@@ -432,35 +1220,35 @@ void asc_event_core_loop(unsigned int timeout)
 static void asc_event_subscribe(asc_event_t *event)
 {
     int i;
-    for(i = 0; i < event_observer.fd_count; ++i)
+    for(i = 0; i < event_observer->fd_count; ++i)
     {
-        if(event_observer.event_list[i]->fd == event->fd)
+        if(event_observer->event_list[i]->fd == event->fd)
             break;
     }
-    asc_assert(i < event_observer.fd_count
+    asc_assert(i < event_observer->fd_count
                , MSG("failed to set fd=%d"), event->fd);
 
-    event_observer.fd_list[i].events = 0;
+    event_observer->fd_list[i].events = 0;
     if(event->on_read)
-        event_observer.fd_list[i].events |= POLLIN;
+        event_observer->fd_list[i].events |= POLLIN;
     if(event->on_write)
-        event_observer.fd_list[i].events |= POLLOUT;
+        event_observer->fd_list[i].events |= POLLOUT;
 }
 
 asc_event_t *asc_event_init(int fd, void *arg)
 {
-    const int i = event_observer.fd_count;
-    memset(&event_observer.fd_list[i], 0, sizeof(struct pollfd));
-    event_observer.fd_list[i].fd = fd;
+    const int i = event_observer->fd_count;
+    memset(&event_observer->fd_list[i], 0, sizeof(struct pollfd));
+    event_observer->fd_list[i].fd = fd;
 
     asc_event_t *const event = ASC_ALLOC(1, asc_event_t);
 
-    event_observer.event_list[i] = event;
+    event_observer->event_list[i] = event;
     event->fd = fd;
     event->arg = arg;
 
-    event_observer.fd_count += 1;
-    event_observer.is_changed = true;
+    event_observer->fd_count += 1;
+    event_observer->is_changed = true;
 
     return event;
 }
@@ -471,25 +1259,25 @@ void asc_event_close(asc_event_t *event)
         return;
 
     int i;
-    for(i = 0; i < event_observer.fd_count; ++i)
+    for(i = 0; i < event_observer->fd_count; ++i)
     {
-        if(event_observer.event_list[i]->fd == event->fd)
+        if(event_observer->event_list[i]->fd == event->fd)
             break;
     }
-    asc_assert(i < event_observer.fd_count
+    asc_assert(i < event_observer->fd_count
                , MSG("failed to detach fd=%d"), event->fd);
 
-    for(; i < event_observer.fd_count; ++i)
+    for(; i < event_observer->fd_count; ++i)
     {
-        memcpy(&event_observer.fd_list[i], &event_observer.fd_list[i + 1]
+        memcpy(&event_observer->fd_list[i], &event_observer->fd_list[i + 1]
                , sizeof(struct pollfd));
-        event_observer.event_list[i] = event_observer.event_list[i + 1];
+        event_observer->event_list[i] = event_observer->event_list[i + 1];
     }
-    memset(&event_observer.fd_list[i], 0, sizeof(struct pollfd));
-    event_observer.event_list[i] = NULL;
+    memset(&event_observer->fd_list[i], 0, sizeof(struct pollfd));
+    event_observer->event_list[i] = NULL;
 
-    event_observer.fd_count -= 1;
-    event_observer.is_changed = true;
+    event_observer->fd_count -= 1;
+    event_observer->is_changed = true;
 
     free(event);
 }
@@ -505,7 +1293,7 @@ void asc_event_close(asc_event_t *event)
  *
  */
 
-typedef struct
+struct asc_event_observer_t
 {
     asc_list_t *event_list;
     bool is_changed;
@@ -514,26 +1302,28 @@ typedef struct
     fd_set rmaster;
     fd_set wmaster;
     fd_set emaster;
-} event_observer_t;
 
-static event_observer_t event_observer;
+    asc_mutex_t *lock;
+};
+
+static __thread_local event_observer_t *event_observer = NULL;
 
 void asc_event_core_init(void)
 {
-    memset(&event_observer, 0, sizeof(event_observer));
-    event_observer.event_list = asc_list_init();
+    event_observer = ASC_ALLOC(1, event_observer_t);
+    event_observer->event_list = asc_list_init();
 }
 
 void asc_event_core_destroy(void)
 {
-    if (!event_observer.event_list)
+    if (event_observer == NULL)
         return;
 
     asc_event_t *prev_event = NULL;
-    asc_list_till_empty(event_observer.event_list)
+    asc_list_till_empty(event_observer->event_list)
     {
         asc_event_t *const event =
-            (asc_event_t *)asc_list_data(event_observer.event_list);
+            (asc_event_t *)asc_list_data(event_observer->event_list);
 
         asc_assert(event != prev_event
                    , MSG("loop on asc_event_core_destroy() event:%p")
@@ -545,30 +1335,36 @@ void asc_event_core_destroy(void)
         prev_event = event;
     }
 
-    ASC_FREE(event_observer.event_list, asc_list_destroy);
+    ASC_FREE(event_observer->event_list, asc_list_destroy);
+    ASC_FREE(event_observer, free);
 }
 
 void asc_event_core_loop(unsigned int timeout)
 {
-    if(asc_list_size(event_observer.event_list) == 0)
+    if(asc_list_size(event_observer->event_list) == 0)
     {
+        EV_UNLOCK();
         asc_usleep(timeout * 1000ULL); /* dry run */
+        EV_LOCK();
         return;
     }
 
     fd_set rset;
     fd_set wset;
     fd_set eset;
-    memcpy(&rset, &event_observer.rmaster, sizeof(rset));
-    memcpy(&wset, &event_observer.wmaster, sizeof(wset));
-    memcpy(&eset, &event_observer.emaster, sizeof(eset));
+    memcpy(&rset, &event_observer->rmaster, sizeof(rset));
+    memcpy(&wset, &event_observer->wmaster, sizeof(wset));
+    memcpy(&eset, &event_observer->emaster, sizeof(eset));
 
     struct timeval tv = {
         (timeout / 1000), /* tv_sec */
         (timeout % 1000) * 1000UL, /* tv_usec */
     };
-    const int ret = select(event_observer.max_fd + 1
+    event_observer->is_changed = false;
+    EV_UNLOCK();
+    const int ret = select(event_observer->max_fd + 1
                            , &rset, &wset, &eset, &tv);
+    EV_LOCK();
 
     if(ret == -1)
     {
@@ -580,30 +1376,29 @@ void asc_event_core_loop(unsigned int timeout)
         asc_log_error(MSG("select() failed: %s"), asc_error_msg());
         asc_lib_abort();
     }
-    else if(ret > 0)
+    else if(ret > 0 && !event_observer->is_changed)
     {
-        event_observer.is_changed = false;
-        asc_list_for(event_observer.event_list)
+        asc_list_for(event_observer->event_list)
         {
             asc_event_t *const event =
-                (asc_event_t *)asc_list_data(event_observer.event_list);
+                (asc_event_t *)asc_list_data(event_observer->event_list);
 
             if(event->on_read && FD_ISSET(event->fd, &rset))
             {
                 event->on_read(event->arg);
-                if(event_observer.is_changed)
+                if(event_observer->is_changed)
                     break;
             }
             if(event->on_error && FD_ISSET(event->fd, &eset))
             {
                 event->on_error(event->arg);
-                if(event_observer.is_changed)
+                if(event_observer->is_changed)
                     break;
             }
             if(event->on_write && FD_ISSET(event->fd, &wset))
             {
                 event->on_write(event->arg);
-                if(event_observer.is_changed)
+                if(event_observer->is_changed)
                     break;
             }
         }
@@ -613,19 +1408,19 @@ void asc_event_core_loop(unsigned int timeout)
 static void asc_event_subscribe(asc_event_t *event)
 {
     if(event->on_read)
-        FD_SET((unsigned)event->fd, &event_observer.rmaster);
+        FD_SET((unsigned)event->fd, &event_observer->rmaster);
     else
-        FD_CLR((unsigned)event->fd, &event_observer.rmaster);
+        FD_CLR((unsigned)event->fd, &event_observer->rmaster);
 
     if(event->on_write)
-        FD_SET((unsigned)event->fd, &event_observer.wmaster);
+        FD_SET((unsigned)event->fd, &event_observer->wmaster);
     else
-        FD_CLR((unsigned)event->fd, &event_observer.wmaster);
+        FD_CLR((unsigned)event->fd, &event_observer->wmaster);
 
     if(event->on_error)
-        FD_SET((unsigned)event->fd, &event_observer.emaster);
+        FD_SET((unsigned)event->fd, &event_observer->emaster);
     else
-        FD_CLR((unsigned)event->fd, &event_observer.emaster);
+        FD_CLR((unsigned)event->fd, &event_observer->emaster);
 }
 
 asc_event_t *asc_event_init(int fd, void *arg)
@@ -635,11 +1430,11 @@ asc_event_t *asc_event_init(int fd, void *arg)
     event->fd = fd;
     event->arg = arg;
 
-    if(fd > event_observer.max_fd)
-        event_observer.max_fd = fd;
+    if(fd > event_observer->max_fd)
+        event_observer->max_fd = fd;
 
-    asc_list_insert_tail(event_observer.event_list, event);
-    event_observer.is_changed = true;
+    asc_list_insert_tail(event_observer->event_list, event);
+    event_observer->is_changed = true;
 
     return event;
 }
@@ -649,38 +1444,38 @@ void asc_event_close(asc_event_t *event)
     if (!event)
         return;
 
-    event_observer.is_changed = true;
+    event_observer->is_changed = true;
 
     event->on_read = NULL;
     event->on_write = NULL;
     event->on_error = NULL;
     asc_event_subscribe(event);
 
-    if (event->fd < event_observer.max_fd)
+    if (event->fd < event_observer->max_fd)
     {
-        asc_list_remove_item(event_observer.event_list, event);
+        asc_list_remove_item(event_observer->event_list, event);
         free(event);
         return;
     }
 
-    event_observer.max_fd = 0;
-    asc_list_first(event_observer.event_list);
-    while (!asc_list_eol(event_observer.event_list))
+    event_observer->max_fd = 0;
+    asc_list_first(event_observer->event_list);
+    while (!asc_list_eol(event_observer->event_list))
     {
         asc_event_t *const i_event =
-            (asc_event_t *)asc_list_data(event_observer.event_list);
+            (asc_event_t *)asc_list_data(event_observer->event_list);
 
         if (i_event == event)
         {
-            asc_list_remove_current(event_observer.event_list);
+            asc_list_remove_current(event_observer->event_list);
             free(event);
         }
         else
         {
-            if(i_event->fd > event_observer.max_fd)
-                event_observer.max_fd = i_event->fd;
+            if(i_event->fd > event_observer->max_fd)
+                event_observer->max_fd = i_event->fd;
 
-            asc_list_next(event_observer.event_list);
+            asc_list_next(event_observer->event_list);
         }
     }
 }
@@ -722,3 +1517,89 @@ void asc_event_set_on_error(asc_event_t *event, event_callback_t on_error)
     event->on_error = on_error;
     asc_event_subscribe(event);
 }
+
+void asc_event_set_edge(asc_event_t *event, bool is_edge)
+{
+    if(event->is_edge == is_edge)
+        return;
+
+    event->is_edge = is_edge;
+#if defined(EV_TYPE_KQUEUE) || defined(EV_TYPE_EPOLL) \
+    || defined(EV_TYPE_IO_URING)
+    asc_event_subscribe(event);
+#endif
+}
+
+/* readiness is re-checked on modification, an undrained fd fires again */
+void asc_event_rearm(asc_event_t *event)
+{
+#if defined(EV_TYPE_KQUEUE) || defined(EV_TYPE_EPOLL) \
+    || defined(EV_TYPE_IO_URING)
+    if(event->is_edge && event->on_read)
+        asc_event_subscribe(event);
+#else
+    __uarg(event);
+#endif
+}
+
+#ifndef EV_TYPE_IO_URING
+/* no completions here, callers stay with readiness callbacks */
+asc_event_io_t *asc_event_io_init(int fd, void *arg
+                                  , event_io_callback_t on_done)
+{
+    __uarg(fd);
+    __uarg(arg);
+    __uarg(on_done);
+
+    return NULL;
+}
+
+void asc_event_io_recv(asc_event_io_t *io, void *buffer, size_t size)
+{
+    __uarg(io);
+    __uarg(buffer);
+    __uarg(size);
+}
+
+void asc_event_io_send(asc_event_io_t *io, const void *buffer, size_t size)
+{
+    __uarg(io);
+    __uarg(buffer);
+    __uarg(size);
+}
+
+void asc_event_io_write(asc_event_io_t *io, const void *buffer, size_t size
+                        , uint64_t offset)
+{
+    __uarg(io);
+    __uarg(buffer);
+    __uarg(size);
+    __uarg(offset);
+}
+
+bool asc_event_io_is_busy(const asc_event_io_t *io)
+{
+    __uarg(io);
+    return false;
+}
+
+void asc_event_io_close(asc_event_io_t *io)
+{
+    __uarg(io);
+}
+#endif /* !EV_TYPE_IO_URING */
+
+/* make `observer' current for the calling thread, return previous one */
+asc_event_observer_t *asc_event_core_switch(asc_event_observer_t *observer)
+{
+    asc_event_observer_t *const prev = event_observer;
+    event_observer = observer;
+
+    return prev;
+}
+
+/* release `lock' while waiting for events; NULL to disable */
+void asc_event_core_set_lock(asc_mutex_t *lock)
+{
+    event_observer->lock = lock;
+}
@@ -25,18 +25,59 @@
 #   error "Please include <astra.h> first"
 #endif /* !_ASTRA_H_ */
 
+#include <core/mutex.h>
+
 typedef struct asc_event_t asc_event_t;
+typedef struct asc_event_observer_t asc_event_observer_t;
 typedef void (*event_callback_t)(void *);
 
 void asc_event_core_init(void);
 void asc_event_core_loop(unsigned int timeout);
 void asc_event_core_destroy(void);
 
+asc_event_observer_t *asc_event_core_switch(asc_event_observer_t *observer);
+void asc_event_core_set_lock(asc_mutex_t *lock);
+
 asc_event_t *asc_event_init(int fd, void *arg) __wur;
 void asc_event_set_on_read(asc_event_t *event, event_callback_t on_read);
 void asc_event_set_on_write(asc_event_t *event, event_callback_t on_write);
 void asc_event_set_on_error(asc_event_t *event, event_callback_t on_error);
 
+/*
+ * edge-triggered reads: on_read is called when new data arrives, so it
+ * has to read until EAGAIN. A callback that stops after ASC_EVENT_BUDGET
+ * reads to let other fds run calls asc_event_rearm() to be called again
+ * on the next loop iteration. Only applies while on_write is not set;
+ * backends without edge-triggered notification stay level-triggered.
+ */
+#define ASC_EVENT_BUDGET 16
+
+void asc_event_set_edge(asc_event_t *event, bool is_edge);
+void asc_event_rearm(asc_event_t *event);
+
 void asc_event_close(asc_event_t *event);
 
+/*
+ * completion I/O: the read or write itself is queued on the event ring
+ * and on_done gets its result, byte count or -errno, on a later loop
+ * iteration. One request at a time per handle; the buffer has to stay
+ * untouched until on_done. asc_event_io_close() cancels reads and
+ * sends, lets writes finish, and returns once the kernel is done with
+ * the buffer; on_done is not called then. It must come before closing
+ * the fd.
+ * asc_event_io_init() returns NULL on backends without completions,
+ * callers fall back to readiness callbacks then.
+ */
+typedef struct asc_event_io_t asc_event_io_t;
+typedef void (*event_io_callback_t)(void *, ssize_t);
+
+asc_event_io_t *asc_event_io_init(int fd, void *arg
+                                  , event_io_callback_t on_done) __wur;
+void asc_event_io_recv(asc_event_io_t *io, void *buffer, size_t size);
+void asc_event_io_send(asc_event_io_t *io, const void *buffer, size_t size);
+void asc_event_io_write(asc_event_io_t *io, const void *buffer, size_t size
+                        , uint64_t offset);
+bool asc_event_io_is_busy(const asc_event_io_t *io) __wur;
+void asc_event_io_close(asc_event_io_t *io);
+
 #endif /* _ASC_EVENT_H_ */
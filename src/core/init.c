@@ -20,6 +20,7 @@
 
 #include <astra.h>
 #include <core/init.h>
+#include <core/loop.h>
 #include <core/mainloop.h>
 #include <core/event.h>
 #include <core/thread.h>
@@ -68,6 +69,9 @@ void asc_lib_init(void)
     asc_event_core_init();
     asc_main_loop_init();
 
+    /* worker loops are started on demand */
+    asc_loop_core_init();
+
     /* Lua modules may need features init'd above */
     lua = lua_api_init();
 }
@@ -83,6 +87,9 @@ void asc_lib_destroy(void)
      */
     ASC_FREE(lua, lua_api_destroy);
 
+    /* stop worker loops before their threads are joined below */
+    asc_loop_core_destroy();
+
     /* join any stray threads */
     asc_thread_core_destroy();
 
@@ -0,0 +1,320 @@
+/*
+ * Astra Core (Worker loops)
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Worker loops run their own event observer, timer set and job queue
+ * on a dedicated thread. Loop number 0 is the main loop.
+ *
+ * Only the main thread may enter a worker loop. While it's inside,
+ * the worker is parked and every event, timer and job call made by
+ * the main thread goes to the worker's state. This is how Lua creates,
+ * controls and destroys module instances pinned to a worker loop.
+ * The worker thread gives up its lock only while waiting for events.
+ */
+
+#include <astra.h>
+#include <core/loop.h>
+#include <core/event.h>
+#include <core/mutex.h>
+#include <core/thread.h>
+#include <core/timer.h>
+
+#define MSG(_msg) "[core/loop %u] " _msg, loop->id
+
+struct asc_loop_t
+{
+    unsigned int id;
+
+    asc_event_observer_t *observer;
+    asc_timer_mgr_t *timer_mgr;
+    asc_main_loop_t *queue;
+
+    /* NULL for the main loop */
+    asc_thread_t *thread;
+    asc_mutex_t mutex;
+    asc_cond_t cond;
+
+    /* main thread is waiting for the lock */
+    unsigned int pending;
+    /* nested asc_loop_enter() calls */
+    unsigned int depth;
+
+    bool is_running;
+};
+
+typedef struct
+{
+    asc_loop_t *list[ASC_LOOP_MAX + 1];
+} asc_loop_mgr_t;
+
+static asc_loop_mgr_t *loop_mgr = NULL;
+
+/* loop whose state the calling thread is using */
+static __thread_local asc_loop_t *loop_current = NULL;
+
+/* loop run by the calling thread, NULL on the main thread */
+static __thread_local asc_loop_t *loop_self = NULL;
+
+static
+void loop_switch(asc_loop_t *loop)
+{
+    asc_event_core_switch(loop->observer);
+    asc_timer_core_switch(loop->timer_mgr);
+    asc_main_loop_switch(loop->queue);
+
+    loop_current = loop;
+}
+
+/*
+ * worker thread
+ */
+
+static
+void loop_thread(void *arg)
+{
+    asc_loop_t *const loop = (asc_loop_t *)arg;
+
+    /* let the thread exit job go to the creator's queue */
+    asc_main_loop_t *const parent = asc_main_loop_current();
+
+    loop_self = loop;
+    loop_switch(loop);
+
+    asc_log_debug(MSG("worker thread started"));
+
+    unsigned int ev_sleep = 0;
+
+    asc_mutex_lock(&loop->mutex);
+    while (true)
+    {
+        /* step aside if the main thread wants to get in */
+        while (__atomic_load_n(&loop->pending, __ATOMIC_ACQUIRE) > 0)
+            asc_cond_wait(&loop->cond, &loop->mutex);
+
+        if (!loop->is_running)
+            break;
+
+        asc_event_core_loop(ev_sleep);
+        asc_job_run();
+        ev_sleep = asc_timer_core_loop();
+    }
+    asc_mutex_unlock(&loop->mutex);
+
+    asc_log_debug(MSG("worker thread exiting"));
+
+    asc_main_loop_switch(parent);
+    loop_self = loop_current = NULL;
+}
+
+static
+asc_loop_t *loop_create(unsigned int id)
+{
+    asc_loop_t *const loop = ASC_ALLOC(1, asc_loop_t);
+
+    loop->id = id;
+    asc_mutex_init(&loop->mutex);
+    asc_cond_init(&loop->cond);
+
+    /* set up fresh core state, then hand it over to the new loop */
+    asc_event_observer_t *const observer = asc_event_core_switch(NULL);
+    asc_timer_mgr_t *const timer_mgr = asc_timer_core_switch(NULL);
+    asc_main_loop_t *const queue = asc_main_loop_switch(NULL);
+
+    asc_event_core_init();
+    asc_event_core_set_lock(&loop->mutex);
+    asc_timer_core_init();
+    asc_main_loop_init();
+    asc_wake_open();
+
+    loop->observer = asc_event_core_switch(observer);
+    loop->timer_mgr = asc_timer_core_switch(timer_mgr);
+    loop->queue = asc_main_loop_switch(queue);
+
+    /* worker's exit job should end up on the main loop */
+    asc_loop_t *const prev = asc_loop_enter(loop_mgr->list[0]);
+
+    loop->is_running = true;
+    loop->thread = asc_thread_init();
+    asc_thread_start(loop->thread, loop, loop_thread, NULL);
+
+    asc_loop_leave(loop_mgr->list[0], prev);
+
+    return loop;
+}
+
+static
+void loop_destroy(asc_loop_t *loop)
+{
+    if (loop->thread != NULL)
+    {
+        asc_loop_t *const prev = asc_loop_enter(loop);
+        loop->is_running = false;
+        asc_loop_leave(loop, prev);
+
+        ASC_FREE(loop->thread, asc_thread_join);
+
+        /* clean up whatever the loop's users have left behind */
+        loop_switch(loop);
+
+        asc_wake_close();
+        asc_event_core_destroy();
+        asc_main_loop_destroy();
+        asc_timer_core_destroy();
+
+        loop_switch(prev);
+    }
+
+    asc_cond_destroy(&loop->cond);
+    asc_mutex_destroy(&loop->mutex);
+
+    free(loop);
+}
+
+/*
+ * public API
+ */
+
+void asc_loop_core_init(void)
+{
+    loop_mgr = ASC_ALLOC(1, asc_loop_mgr_t);
+
+    /* describe main thread's state as loop 0 */
+    asc_loop_t *const loop = ASC_ALLOC(1, asc_loop_t);
+
+    loop->observer = asc_event_core_switch(NULL);
+    asc_event_core_switch(loop->observer);
+    loop->timer_mgr = asc_timer_core_switch(NULL);
+    asc_timer_core_switch(loop->timer_mgr);
+    loop->queue = asc_main_loop_current();
+
+    asc_mutex_init(&loop->mutex);
+    asc_cond_init(&loop->cond);
+
+    loop_mgr->list[0] = loop;
+    loop_current = loop;
+}
+
+void asc_loop_core_destroy(void)
+{
+    if (loop_mgr == NULL)
+        return;
+
+    for (unsigned int i = ASC_LOOP_MAX; i > 0; i--)
+    {
+        if (loop_mgr->list[i] != NULL)
+            ASC_FREE(loop_mgr->list[i], loop_destroy);
+    }
+
+    ASC_FREE(loop_mgr->list[0], loop_destroy);
+    ASC_FREE(loop_mgr, free);
+
+    loop_current = NULL;
+}
+
+/* return loop by number, starting a worker thread if needed */
+asc_loop_t *asc_loop_get(unsigned int id)
+{
+    if (id > ASC_LOOP_MAX)
+        return NULL;
+
+    asc_loop_t *loop = loop_mgr->list[id];
+    if (loop == NULL)
+    {
+        loop = loop_mgr->list[id] = loop_create(id);
+        asc_log_debug(MSG("started worker loop"));
+    }
+
+    return loop;
+}
+
+asc_loop_t *asc_loop_current(void)
+{
+    if (loop_current != NULL)
+        return loop_current;
+
+    return loop_mgr->list[0];
+}
+
+unsigned int asc_loop_id(const asc_loop_t *loop)
+{
+    return loop->id;
+}
+
+/* stop loop's thread and switch to its state; returns loop to go back to */
+asc_loop_t *asc_loop_enter(asc_loop_t *loop)
+{
+    asc_loop_t *const prev = asc_loop_current();
+    if (loop == prev)
+        return prev;
+
+    asc_assert(loop_self == NULL
+               , MSG("can't enter from a worker thread"));
+
+    if (loop->thread != NULL && loop->depth++ == 0)
+    {
+        __atomic_add_fetch(&loop->pending, 1, __ATOMIC_SEQ_CST);
+
+        /* interrupt event wait */
+        asc_main_loop_switch(loop->queue);
+        asc_wake();
+        asc_main_loop_switch(prev->queue);
+
+        asc_mutex_lock(&loop->mutex);
+        __atomic_sub_fetch(&loop->pending, 1, __ATOMIC_SEQ_CST);
+    }
+
+    loop_switch(loop);
+
+    return prev;
+}
+
+/* return to `prev' and let the loop's thread continue */
+void asc_loop_leave(asc_loop_t *loop, asc_loop_t *prev)
+{
+    if (loop == prev)
+        return;
+
+    loop_switch(prev);
+
+    if (loop->thread != NULL && --loop->depth == 0)
+    {
+        asc_mutex_unlock(&loop->mutex);
+        asc_cond_signal(&loop->cond);
+    }
+}
+
+/* add a job to another loop's queue; can be called from any thread */
+void asc_loop_job_queue(asc_loop_t *loop, void *owner
+                        , loop_callback_t proc, void *arg)
+{
+    asc_main_loop_t *const prev = asc_main_loop_switch(loop->queue);
+
+    asc_job_queue(owner, proc, arg);
+    asc_wake();
+
+    asc_main_loop_switch(prev);
+}
+
+void asc_loop_job_prune(asc_loop_t *loop, void *owner)
+{
+    asc_main_loop_t *const prev = asc_main_loop_switch(loop->queue);
+    asc_job_prune(owner);
+    asc_main_loop_switch(prev);
+}
@@ -0,0 +1,49 @@
+/*
+ * Astra Core (Worker loops)
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ASC_LOOP_H_
+#define _ASC_LOOP_H_ 1
+
+#ifndef _ASTRA_H_
+#   error "Please include <astra.h> first"
+#endif /* !_ASTRA_H_ */
+
+#include <core/mainloop.h>
+
+/* maximum number of worker loops */
+#define ASC_LOOP_MAX 64
+
+typedef struct asc_loop_t asc_loop_t;
+
+void asc_loop_core_init(void);
+void asc_loop_core_destroy(void);
+
+asc_loop_t *asc_loop_get(unsigned int id) __wur;
+asc_loop_t *asc_loop_current(void) __wur;
+unsigned int asc_loop_id(const asc_loop_t *loop) __func_pure;
+
+asc_loop_t *asc_loop_enter(asc_loop_t *loop) __wur;
+void asc_loop_leave(asc_loop_t *loop, asc_loop_t *prev);
+
+void asc_loop_job_queue(asc_loop_t *loop, void *owner
+                        , loop_callback_t proc, void *arg);
+void asc_loop_job_prune(asc_loop_t *loop, void *owner);
+
+#endif /* _ASC_LOOP_H_ */
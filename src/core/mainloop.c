@@ -22,7 +22,6 @@
 #include <astra.h>
 #include <core/mainloop.h>
 #include <core/event.h>
-#include <core/mutex.h>
 #include <core/timer.h>
 #include <core/socket.h>
 #include <core/spawn.h>
@@ -34,7 +33,7 @@
 /* garbage collector interval */
 #define LUA_GC_TIMEOUT (1 * 1000 * 1000)
 
-/* maximum number of jobs queued */
+/* queue depth above which new jobs are counted as overflow */
 #define JOB_QUEUE_SIZE 256
 
 enum
@@ -44,14 +43,18 @@ enum
     MAIN_LOOP_SHUTDOWN = 0x00000004,
 };
 
-typedef struct
+typedef struct loop_job_t loop_job_t;
+
+struct loop_job_t
 {
     loop_callback_t proc;
     void *arg;
     void *owner;
-} loop_job_t;
 
-typedef struct
+    loop_job_t *next;
+};
+
+struct asc_main_loop_t
 {
     uint32_t flags;
     unsigned int stop_cnt;
@@ -60,15 +63,28 @@ typedef struct
     asc_event_t *wake_ev;
     unsigned int wake_cnt;
 
-    loop_job_t jobs[JOB_QUEUE_SIZE];
-    unsigned int job_cnt;
-    asc_mutex_t job_mutex;
-} asc_main_loop_t;
+    /*
+     * Intrusive MPSC list: producers swap themselves into `job_head',
+     * the loop's own thread pops from `job_tail'. `job_stub' keeps
+     * the list non-empty so neither side ever needs a lock.
+     */
+    loop_job_t *job_head;
+    loop_job_t *job_tail;
+    loop_job_t job_stub;
+
+    unsigned int job_depth;
+    unsigned int job_peak;
+    uint64_t job_overflow;
+};
 
+/* process-wide loop, receives shutdown and reload requests */
 static asc_main_loop_t *main_loop = NULL;
 
+/* job queue and wake up pipe used by the calling thread */
+static __thread_local asc_main_loop_t *this_loop = NULL;
+
 /*
- * main thread wake up mechanism
+ * loop thread wake up mechanism
  */
 
 static void on_wake_read(void *arg);
@@ -80,33 +96,33 @@ static bool wake_open(void)
     if (asc_pipe_open(fds, NULL, PIPE_BOTH) != 0)
         return false;
 
-    main_loop->wake_fd[0] = fds[0];
-    main_loop->wake_fd[1] = fds[1];
+    this_loop->wake_fd[0] = fds[0];
+    this_loop->wake_fd[1] = fds[1];
 
-    main_loop->wake_ev = asc_event_init(fds[PIPE_RD], NULL);
-    asc_event_set_on_read(main_loop->wake_ev, on_wake_read);
+    this_loop->wake_ev = asc_event_init(fds[PIPE_RD], NULL);
+    asc_event_set_on_read(this_loop->wake_ev, on_wake_read);
 
     return true;
 }
 
 static void wake_close(void)
 {
-    ASC_FREE(main_loop->wake_ev, asc_event_close);
+    ASC_FREE(this_loop->wake_ev, asc_event_close);
 
     const int fds[2] = {
-        main_loop->wake_fd[0],
-        main_loop->wake_fd[1],
+        this_loop->wake_fd[0],
+        this_loop->wake_fd[1],
     };
 
     if (fds[0] != -1)
     {
-        main_loop->wake_fd[0] = -1;
+        this_loop->wake_fd[0] = -1;
         asc_pipe_close(fds[0]);
     }
 
     if (fds[1] != -1)
     {
-        main_loop->wake_fd[1] = -1;
+        this_loop->wake_fd[1] = -1;
         asc_pipe_close(fds[1]);
     }
 }
@@ -117,7 +133,7 @@ static void on_wake_read(void *arg)
     __uarg(arg);
 
     char buf[32];
-    const int ret = recv(main_loop->wake_fd[PIPE_RD], buf, sizeof(buf), 0);
+    const int ret = recv(this_loop->wake_fd[PIPE_RD], buf, sizeof(buf), 0);
     switch (ret)
     {
         case -1:
@@ -149,25 +165,25 @@ static void on_wake_read(void *arg)
 /* increase pipe refcount, opening it if necessary */
 void asc_wake_open(void)
 {
-    if (main_loop->wake_cnt == 0)
+    if (this_loop->wake_cnt == 0)
     {
-        asc_log_debug(MSG("opening main loop wake up pipe"));
+        asc_log_debug(MSG("opening wake up pipe"));
         if (!wake_open())
             asc_log_error(MSG("couldn't open pipe: %s"), asc_error_msg());
     }
 
-    ++main_loop->wake_cnt;
+    ++this_loop->wake_cnt;
 }
 
 /* decrease pipe refcount, closing it when it's no longer needed */
 void asc_wake_close(void)
 {
-    asc_assert(main_loop->wake_cnt > 0, MSG("wake up pipe already closed"));
-    --main_loop->wake_cnt;
+    asc_assert(this_loop->wake_cnt > 0, MSG("wake up pipe already closed"));
+    --this_loop->wake_cnt;
 
-    if (main_loop->wake_cnt == 0)
+    if (this_loop->wake_cnt == 0)
     {
-        asc_log_debug(MSG("closing main loop wake up pipe"));
+        asc_log_debug(MSG("closing wake up pipe"));
         wake_close();
     }
 }
@@ -175,7 +191,7 @@ void asc_wake_close(void)
 /* signal event polling function to return */
 void asc_wake(void)
 {
-    const int fd = main_loop->wake_fd[PIPE_WR];
+    const int fd = this_loop->wake_fd[PIPE_WR];
     static const char byte = '\0';
 
     if (fd != -1 && send(fd, &byte, 1, 0) == -1)
@@ -186,74 +202,159 @@ void asc_wake(void)
  * callback queue
  */
 
-/* add a procedure to main loop's job list */
-void asc_job_queue(void *owner, loop_callback_t proc, void *arg)
+static
+void job_push(asc_main_loop_t *loop, loop_job_t *job)
+{
+    job->next = NULL;
+
+    loop_job_t *const prev = __atomic_exchange_n(&loop->job_head, job
+                                                 , __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, job, __ATOMIC_RELEASE);
+}
+
+/* take oldest job off the list; NULL if empty or a push is in progress */
+static
+loop_job_t *job_pop(asc_main_loop_t *loop)
 {
-    bool overflow = false;
+    loop_job_t *tail = loop->job_tail;
+    loop_job_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
 
-    asc_mutex_lock(&main_loop->job_mutex);
-    if (main_loop->job_cnt < JOB_QUEUE_SIZE)
+    if (tail == &loop->job_stub)
     {
-        loop_job_t *const job = &main_loop->jobs[main_loop->job_cnt++];
+        if (next == NULL)
+            return NULL;
+
+        loop->job_tail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
 
-        job->proc = proc;
-        job->arg = arg;
-        job->owner = owner;
+    if (next != NULL)
+    {
+        loop->job_tail = next;
+        return tail;
     }
-    else
+
+    /* last item; put the stub behind it before taking it out */
+    if (tail != __atomic_load_n(&loop->job_head, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    job_push(loop, &loop->job_stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL)
     {
-        main_loop->job_cnt = 0;
-        overflow = true;
+        loop->job_tail = next;
+        return tail;
     }
-    asc_mutex_unlock(&main_loop->job_mutex);
 
-    if (overflow)
-        asc_log_error(MSG("job queue overflow, list flushed"));
+    return NULL;
 }
 
-/* remove jobs belonging to a specific module or object */
+/* add a procedure to main loop's job list; can be called from any thread */
+void asc_job_queue(void *owner, loop_callback_t proc, void *arg)
+{
+    asc_main_loop_t *const loop = this_loop;
+    loop_job_t *const job = ASC_ALLOC(1, loop_job_t);
+
+    job->proc = proc;
+    job->arg = arg;
+    job->owner = owner;
+
+    const unsigned int depth = __atomic_add_fetch(&loop->job_depth, 1
+                                                  , __ATOMIC_RELAXED);
+
+    unsigned int peak = __atomic_load_n(&loop->job_peak, __ATOMIC_RELAXED);
+    while (depth > peak
+           && !__atomic_compare_exchange_n(&loop->job_peak, &peak, depth
+                                           , true, __ATOMIC_RELAXED
+                                           , __ATOMIC_RELAXED))
+    {
+        ; /* `peak' is reloaded on failure */
+    }
+
+    if (depth > JOB_QUEUE_SIZE)
+        __atomic_add_fetch(&loop->job_overflow, 1, __ATOMIC_RELAXED);
+
+    job_push(loop, job);
+}
+
+/*
+ * remove jobs belonging to a specific module or object. must be called
+ * from the loop's own thread, or while the loop is entered.
+ */
 void asc_job_prune(void *owner)
 {
-    unsigned int i = 0;
+    asc_main_loop_t *const loop = this_loop;
+    loop_job_t *const last = __atomic_load_n(&loop->job_head
+                                             , __ATOMIC_ACQUIRE);
+
+    /* cancelled jobs stay on the list until popped */
+    loop_job_t *job = loop->job_tail;
+    while (true)
+    {
+        if (job->owner == owner && job != &loop->job_stub)
+            job->proc = NULL;
+
+        if (job == last)
+            break;
+
+        /* wait for a producer that has swapped in but not linked yet */
+        loop_job_t *next;
+        while ((next = __atomic_load_n(&job->next, __ATOMIC_ACQUIRE)) == NULL)
+            ;
+
+        job = next;
+    }
+}
+
+/*
+ * run queued callbacks in batches. jobs queued while a batch is running
+ * are left for the next pass unless there's no pipe to wake us up.
+ */
+void asc_job_run(void)
+{
+    asc_main_loop_t *const loop = this_loop;
 
-    asc_mutex_lock(&main_loop->job_mutex);
-    while (i < main_loop->job_cnt)
+    while (true)
     {
-        loop_job_t *const job = &main_loop->jobs[i];
+        unsigned int batch = __atomic_load_n(&loop->job_depth
+                                             , __ATOMIC_RELAXED);
 
-        if (job->owner == owner)
+        for (; batch > 0; batch--)
         {
-            main_loop->job_cnt--;
-            memmove(job, &job[1], (main_loop->job_cnt - i) * sizeof(*job));
+            loop_job_t *const job = job_pop(loop);
+            if (job == NULL)
+                break;
+
+            __atomic_sub_fetch(&loop->job_depth, 1, __ATOMIC_RELAXED);
+
+            const loop_callback_t proc = job->proc;
+            void *const arg = job->arg;
+            free(job);
+
+            if (proc != NULL)
+                proc(arg);
         }
-        else
+
+        if (__atomic_load_n(&loop->job_depth, __ATOMIC_RELAXED) == 0)
+            break;
+
+        if (loop->wake_fd[PIPE_WR] != -1)
         {
-            i++;
+            asc_wake();
+            break;
         }
     }
-    asc_mutex_unlock(&main_loop->job_mutex);
 }
 
-/* run all queued callbacks */
-static void run_jobs(void)
+/* get job queue counters for the calling thread's loop */
+void asc_job_stats(asc_job_stats_t *stats)
 {
-    loop_job_t *const first = &main_loop->jobs[0];
-    loop_job_t job;
+    asc_main_loop_t *const loop = this_loop;
 
-    asc_mutex_lock(&main_loop->job_mutex);
-    while (main_loop->job_cnt > 0)
-    {
-        /* pull first job in queue */
-        main_loop->job_cnt--;
-        job = *first;
-        memmove(first, &first[1], main_loop->job_cnt * sizeof(*first));
-
-        /* run it with mutex unlocked */
-        asc_mutex_unlock(&main_loop->job_mutex);
-        job.proc(job.arg);
-        asc_mutex_lock(&main_loop->job_mutex);
-    }
-    asc_mutex_unlock(&main_loop->job_mutex);
+    stats->depth = __atomic_load_n(&loop->job_depth, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&loop->job_peak, __ATOMIC_RELAXED);
+    stats->overflow = __atomic_load_n(&loop->job_overflow, __ATOMIC_RELAXED);
 }
 
 /*
@@ -262,18 +363,42 @@ static void run_jobs(void)
 
 void asc_main_loop_init(void)
 {
-    main_loop = ASC_ALLOC(1, asc_main_loop_t);
+    this_loop = ASC_ALLOC(1, asc_main_loop_t);
+
+    this_loop->wake_fd[0] = this_loop->wake_fd[1] = -1;
+    this_loop->job_head = this_loop->job_tail = &this_loop->job_stub;
 
-    main_loop->wake_fd[0] = main_loop->wake_fd[1] = -1;
-    asc_mutex_init(&main_loop->job_mutex);
+    /* first instance belongs to the main thread */
+    if (main_loop == NULL)
+        main_loop = this_loop;
 }
 
 void asc_main_loop_destroy(void)
 {
     wake_close();
-    asc_mutex_destroy(&main_loop->job_mutex);
 
-    ASC_FREE(main_loop, free);
+    loop_job_t *job;
+    while ((job = job_pop(this_loop)) != NULL)
+        free(job);
+
+    if (main_loop == this_loop)
+        main_loop = NULL;
+
+    ASC_FREE(this_loop, free);
+}
+
+asc_main_loop_t *asc_main_loop_current(void)
+{
+    return this_loop;
+}
+
+/* make `loop' current for the calling thread, return previous one */
+asc_main_loop_t *asc_main_loop_switch(asc_main_loop_t *loop)
+{
+    asc_main_loop_t *const prev = this_loop;
+    this_loop = loop;
+
+    return prev;
 }
 
 /* process events, return when a shutdown or reload is requested */
@@ -320,7 +445,7 @@ bool asc_main_loop_run(void)
             lua_gc(lua, LUA_GCCOLLECT, 0);
         }
 
-        run_jobs();
+        asc_job_run();
         ev_sleep = asc_timer_core_loop();
     }
 }
@@ -26,18 +26,33 @@
 #   error "Please include <astra.h> first"
 #endif /* !_ASTRA_H_ */
 
+typedef struct asc_main_loop_t asc_main_loop_t;
 typedef void (*loop_callback_t)(void *);
 
+typedef struct
+{
+    /* jobs waiting to run */
+    unsigned int depth;
+    /* highest depth seen */
+    unsigned int peak;
+    /* jobs queued above the soft limit of 256 */
+    uint64_t overflow;
+} asc_job_stats_t;
+
 void asc_wake_open(void);
 void asc_wake_close(void);
 void asc_wake(void);
 
 void asc_job_queue(void *owner, loop_callback_t proc, void *arg);
 void asc_job_prune(void *owner);
+void asc_job_run(void);
+void asc_job_stats(asc_job_stats_t *stats);
 
 void asc_main_loop_init(void);
 void asc_main_loop_destroy(void);
 bool asc_main_loop_run(void) __wur;
+asc_main_loop_t *asc_main_loop_current(void);
+asc_main_loop_t *asc_main_loop_switch(asc_main_loop_t *loop);
 
 void asc_main_loop_shutdown(void);
 void asc_main_loop_reload(void);
@@ -95,4 +95,130 @@ void asc_mutex_unlock(asc_mutex_t *mutex)
 
 bool asc_mutex_timedlock(asc_mutex_t *mutex, unsigned int ms) __wur;
 
+/*
+ * condition variables
+ */
+
+#ifndef _WIN32
+
+typedef pthread_cond_t asc_cond_t;
+
+static inline
+void asc_cond_init(asc_cond_t *cond)
+{
+    const int ret = pthread_cond_init(cond, NULL);
+    asc_assert(ret == 0, "[core/mutex] couldn't init condition: %s"
+               , strerror(ret));
+}
+
+static inline
+void asc_cond_destroy(asc_cond_t *cond)
+{
+    const int ret = pthread_cond_destroy(cond);
+    asc_assert(ret == 0, "[core/mutex] couldn't destroy condition: %s"
+               , strerror(ret));
+}
+
+static inline
+void asc_cond_wait(asc_cond_t *cond, asc_mutex_t *mutex)
+{
+    const int ret = pthread_cond_wait(cond, mutex);
+    asc_assert(ret == 0, "[core/mutex] couldn't wait on condition: %s"
+               , strerror(ret));
+}
+
+static inline
+void asc_cond_signal(asc_cond_t *cond)
+{
+    const int ret = pthread_cond_signal(cond);
+    asc_assert(ret == 0, "[core/mutex] couldn't signal condition: %s"
+               , strerror(ret));
+}
+
+static inline
+void asc_cond_broadcast(asc_cond_t *cond)
+{
+    const int ret = pthread_cond_broadcast(cond);
+    asc_assert(ret == 0, "[core/mutex] couldn't broadcast condition: %s"
+               , strerror(ret));
+}
+
+#elif (_WIN32_WINNT >= 0x0600)
+
+typedef CONDITION_VARIABLE asc_cond_t;
+
+static inline
+void asc_cond_init(asc_cond_t *cond)
+{
+    InitializeConditionVariable(cond);
+}
+
+static inline
+void asc_cond_destroy(asc_cond_t *cond)
+{
+    __uarg(cond);
+}
+
+static inline
+void asc_cond_wait(asc_cond_t *cond, asc_mutex_t *mutex)
+{
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+}
+
+static inline
+void asc_cond_signal(asc_cond_t *cond)
+{
+    WakeConditionVariable(cond);
+}
+
+static inline
+void asc_cond_broadcast(asc_cond_t *cond)
+{
+    WakeAllConditionVariable(cond);
+}
+
+#else /* _WIN32_WINNT < 0x0600 */
+
+/*
+ * NOTE: no condition variables before Vista; since callers must be
+ *       prepared for spurious wakeups anyway, just poll the mutex.
+ */
+typedef int asc_cond_t;
+
+static inline
+void asc_cond_init(asc_cond_t *cond)
+{
+    __uarg(cond);
+}
+
+static inline
+void asc_cond_destroy(asc_cond_t *cond)
+{
+    __uarg(cond);
+}
+
+static inline
+void asc_cond_wait(asc_cond_t *cond, asc_mutex_t *mutex)
+{
+    __uarg(cond);
+
+    LeaveCriticalSection(mutex);
+    Sleep(1);
+    EnterCriticalSection(mutex);
+}
+
+static inline
+void asc_cond_signal(asc_cond_t *cond)
+{
+    __uarg(cond);
+}
+
+static inline
+void asc_cond_broadcast(asc_cond_t *cond)
+{
+    __uarg(cond);
+}
+
+#endif /* _WIN32_WINNT < 0x0600 */
+
 #endif /* _ASC_MUTEX_H_ */
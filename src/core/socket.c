@@ -30,6 +30,7 @@
 #   include <arpa/inet.h>
 #   include <netinet/in.h>
 #   include <netinet/tcp.h>
+#   include <netinet/udp.h>
 #   ifdef HAVE_NETINET_SCTP_H
 #       include <netinet/sctp.h>
 #   endif
@@ -41,8 +42,26 @@
 #   define IGMP_HEADER_SIZE 8
 #endif
 
+#if defined(SO_TXTIME) && defined(HAVE_SENDMMSG) && defined(HAVE_CLOCK_GETTIME)
+    /* txtime is in the asc_utime() clock, i.e. CLOCK_MONOTONIC; the etf
+     * qdisc only takes CLOCK_TAI, so it's converted on the way out */
+#   include <linux/net_tstamp.h>
+#   define SOCKET_TXTIME 1
+#endif
+
+#ifdef UDP_SEGMENT
+    /* limits for UDP generic segmentation offload */
+#   define GSO_MAX_SIZE 65000
+#   define GSO_MAX_SEGS 64
+#endif
+
 #define MSG(_msg) "[core/socket %d] " _msg, sock->fd
 
+/* control message buffers must be aligned like the header */
+#define CMSG_BUFFER(_name, _size) \
+    char _name[CMSG_SPACE(_size)] \
+        __attribute__((__aligned__(__alignof__(struct cmsghdr))))
+
 struct asc_socket_t
 {
     int fd;
@@ -57,6 +76,10 @@ struct asc_socket_t
 
     struct ip_mreq mreq;
 
+    bool no_gso; /* UDP_SEGMENT was rejected by kernel */
+    bool txtime_tai; /* SO_TXTIME is set up with CLOCK_TAI */
+    bool is_edge; /* edge-triggered reads, see asc_event_set_edge() */
+
     /* Callbacks */
     void *arg;
     event_callback_t on_read;      /* data read */
@@ -251,7 +274,10 @@ static bool __asc_socket_check_event(asc_socket_t *sock)
     if(sock->event == NULL)
     {
         if(is_callback == true)
+        {
             sock->event = asc_event_init(sock->fd, sock);
+            asc_event_set_edge(sock->event, sock->is_edge);
+        }
     }
     else
     {
@@ -295,6 +321,22 @@ void asc_socket_set_on_ready(asc_socket_t *sock, event_callback_t on_ready)
     }
 }
 
+/* on_read drains the socket, see asc_event_set_edge() */
+void asc_socket_set_edge(asc_socket_t *sock, bool is_edge)
+{
+    sock->is_edge = is_edge;
+
+    if(sock->event != NULL)
+        asc_event_set_edge(sock->event, is_edge);
+}
+
+/* on_read stopped before EAGAIN, call it again on the next iteration */
+void asc_socket_rearm(asc_socket_t *sock)
+{
+    if(sock->event != NULL)
+        asc_event_rearm(sock->event);
+}
+
 void asc_socket_set_on_close(asc_socket_t *sock, event_callback_t on_close)
 {
     if(sock->on_close == on_close)
@@ -518,6 +560,60 @@ ssize_t asc_socket_recvfrom(asc_socket_t *sock, void *buffer, size_t size)
                     , (struct sockaddr *)&sock->sockaddr, &slen);
 }
 
+/*
+ * read up to `count' datagrams in one go. datagram n is stored at
+ * `buffer + n * size', its length at lens[n]. returns number of datagrams
+ * read, 0 if there's nothing to read, or -1 on error.
+ */
+ssize_t asc_socket_recv_burst(asc_socket_t *sock, void *buffer, size_t size
+                              , size_t *lens, unsigned int count)
+{
+    if(count > ASC_SOCKET_BURST_MAX)
+        count = ASC_SOCKET_BURST_MAX;
+
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msg[ASC_SOCKET_BURST_MAX];
+    struct iovec iov[ASC_SOCKET_BURST_MAX];
+
+    memset(msg, 0, count * sizeof(*msg));
+    for(unsigned int i = 0; i < count; ++i)
+    {
+        iov[i].iov_base = (uint8_t *)buffer + i * size;
+        iov[i].iov_len = size;
+        msg[i].msg_hdr.msg_iov = &iov[i];
+        msg[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    const int ret = recvmmsg(sock->fd, msg, count, 0, NULL);
+    if(ret == -1)
+        return (asc_socket_would_block() ? 0 : -1);
+
+    for(int i = 0; i < ret; ++i)
+        lens[i] = msg[i].msg_len;
+
+    return ret;
+#else /* HAVE_RECVMMSG */
+    unsigned int i = 0;
+
+    for(; i < count; ++i)
+    {
+        const ssize_t ret = recv(sock->fd, (char *)buffer + i * size, size, 0);
+        if(ret == -1)
+        {
+            /* report errors on the next call */
+            if(i > 0 || asc_socket_would_block())
+                break;
+
+            return -1;
+        }
+
+        lens[i] = ret;
+    }
+
+    return i;
+#endif /* !HAVE_RECVMMSG */
+}
+
 /*
  *  oooooooo8 ooooooooooo oooo   oooo ooooooooo
  * 888         888    88   8888o  88   888    88o
@@ -545,6 +641,217 @@ ssize_t asc_socket_sendto(asc_socket_t *sock, const void *buffer, size_t size)
                   , (struct sockaddr *)&sock->sockaddr, slen);
 }
 
+#ifdef UDP_SEGMENT
+static ssize_t sendto_gso(asc_socket_t *sock, const void *buffer, size_t size
+                          , size_t dsize)
+{
+    struct iovec iov;
+    iov.iov_base = (void *)buffer;
+    iov.iov_len = size;
+
+    CMSG_BUFFER(ctl, sizeof(uint16_t));
+    memset(ctl, 0, sizeof(ctl));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &sock->sockaddr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+
+    struct cmsghdr *const cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+    const uint16_t gso_size = dsize;
+    memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+
+    return sendmsg(sock->fd, &msg, 0);
+}
+#endif /* UDP_SEGMENT */
+
+#ifdef SOCKET_TXTIME
+/* nanoseconds to add to an asc_utime() based txtime for CLOCK_TAI */
+static uint64_t txtime_tai_offset(void)
+{
+    struct timespec mono, tai;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_TAI, &tai);
+
+    return ((tai.tv_sec - mono.tv_sec) * 1000000000ULL)
+           + (tai.tv_nsec - mono.tv_nsec);
+}
+#endif /* SOCKET_TXTIME */
+
+#ifdef HAVE_SENDMMSG
+/*
+ * send datagrams from `skip' onwards with sendmmsg(), ASC_SOCKET_BURST_MAX
+ * at a time. with `txtime', each one carries its SCM_TXTIME. returns the
+ * same as asc_socket_sendto_burst(), counting the `skip' bytes as sent.
+ */
+static ssize_t sendto_mmsg(asc_socket_t *sock, const uint8_t *data
+                           , size_t size, size_t dsize, size_t skip
+                           , const uint64_t *txtime)
+{
+    struct mmsghdr msg[ASC_SOCKET_BURST_MAX];
+    struct iovec iov[ASC_SOCKET_BURST_MAX];
+#ifdef SOCKET_TXTIME
+    CMSG_BUFFER(ctl[ASC_SOCKET_BURST_MAX], sizeof(uint64_t));
+
+    /* difference between the two clocks, taken once per call */
+    uint64_t offset = 0;
+    if(txtime != NULL && sock->txtime_tai)
+        offset = txtime_tai_offset();
+#else /* SOCKET_TXTIME */
+    __uarg(txtime);
+#endif /* !SOCKET_TXTIME */
+
+    while(skip < size)
+    {
+        unsigned int count = 0;
+        size_t pos = skip;
+
+        memset(msg, 0, sizeof(msg));
+        for(; count < ASC_SOCKET_BURST_MAX && pos < size; ++count)
+        {
+            const size_t len = (size - pos > dsize) ? dsize : (size - pos);
+            struct msghdr *const hdr = &msg[count].msg_hdr;
+
+            iov[count].iov_base = (void *)&data[pos];
+            iov[count].iov_len = len;
+            hdr->msg_name = &sock->sockaddr;
+            hdr->msg_namelen = sizeof(struct sockaddr_in);
+            hdr->msg_iov = &iov[count];
+            hdr->msg_iovlen = 1;
+
+#ifdef SOCKET_TXTIME
+            if(txtime != NULL)
+            {
+                memset(ctl[count], 0, sizeof(ctl[count]));
+                hdr->msg_control = ctl[count];
+                hdr->msg_controllen = sizeof(ctl[count]);
+
+                struct cmsghdr *const cm = CMSG_FIRSTHDR(hdr);
+                cm->cmsg_level = SOL_SOCKET;
+                cm->cmsg_type = SCM_TXTIME;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+
+                const uint64_t ns = (txtime[pos / dsize] * 1000ULL) + offset;
+                memcpy(CMSG_DATA(cm), &ns, sizeof(ns));
+            }
+#endif /* SOCKET_TXTIME */
+
+            pos += len;
+        }
+
+        const int ret = sendmmsg(sock->fd, msg, count, 0);
+        if(ret == -1)
+        {
+            if(asc_socket_would_block())
+                return skip;
+
+            return (skip > 0) ? (ssize_t)skip : -1;
+        }
+
+        for(int i = 0; i < ret; ++i)
+            skip += iov[i].iov_len;
+
+        if((unsigned int)ret < count)
+            break;
+    }
+
+    return skip;
+}
+#endif /* HAVE_SENDMMSG */
+
+/*
+ * send `size' bytes as a series of `dsize' byte datagrams; the last one
+ * may be shorter. uses GSO or sendmmsg() if available. returns number of
+ * bytes sent, which is less than `size' if the socket buffer is full,
+ * or -1 on error.
+ */
+ssize_t asc_socket_sendto_burst(asc_socket_t *sock, const void *buffer
+                                , size_t size, size_t dsize)
+{
+    const uint8_t *const data = (const uint8_t *)buffer;
+    size_t skip = 0;
+
+#ifdef UDP_SEGMENT
+    size_t gso_max = (GSO_MAX_SIZE / dsize);
+    if(gso_max > GSO_MAX_SEGS)
+        gso_max = GSO_MAX_SEGS;
+    gso_max *= dsize;
+
+    while(!sock->no_gso && size - skip > dsize)
+    {
+        size_t chunk = size - skip;
+        if(chunk > gso_max)
+            chunk = gso_max;
+
+        const ssize_t ret = sendto_gso(sock, &data[skip], chunk, dsize);
+        if(ret == -1)
+        {
+            if(asc_socket_would_block())
+                return skip;
+
+            if(errno != EIO && errno != EINVAL
+               && errno != ENOPROTOOPT && errno != EOPNOTSUPP)
+            {
+                return (skip > 0) ? (ssize_t)skip : -1;
+            }
+
+            asc_log_debug(MSG("UDP GSO is not supported, using fallback"));
+            sock->no_gso = true;
+            break;
+        }
+
+        skip += ret;
+    }
+#endif /* UDP_SEGMENT */
+
+#ifdef HAVE_SENDMMSG
+    return sendto_mmsg(sock, data, size, dsize, skip, NULL);
+#else /* HAVE_SENDMMSG */
+    while(skip < size)
+    {
+        const size_t len = (size - skip > dsize) ? dsize : (size - skip);
+
+        const ssize_t ret = asc_socket_sendto(sock, &data[skip], len);
+        if(ret == -1)
+        {
+            if(asc_socket_would_block())
+                return skip;
+
+            return (skip > 0) ? (ssize_t)skip : -1;
+        }
+
+        skip += len;
+    }
+
+    return skip;
+#endif /* !HAVE_SENDMMSG */
+}
+
+/*
+ * same as asc_socket_sendto_burst(), with each datagram held by the
+ * kernel until its transmit time in `txtime' (asc_utime() clock). the
+ * socket must have asc_socket_set_txtime() enabled.
+ */
+ssize_t asc_socket_sendto_txtime(asc_socket_t *sock, const void *buffer
+                                 , size_t size, size_t dsize
+                                 , const uint64_t *txtime)
+{
+#ifdef SOCKET_TXTIME
+    return sendto_mmsg(sock, (const uint8_t *)buffer, size, dsize, 0, txtime);
+#else /* SOCKET_TXTIME */
+    __uarg(txtime);
+    return asc_socket_sendto_burst(sock, buffer, size, dsize);
+#endif /* !SOCKET_TXTIME */
+}
+
 /*
  * ooooo oooo   oooo ooooooooooo  ooooooo
  *  888   8888o  88   888    88 o888   888o
@@ -751,6 +1058,32 @@ void asc_socket_set_buffer(asc_socket_t *sock, int rcvbuf, int sndbuf)
     }
 }
 
+/*
+ * let the kernel hold datagrams until their SCM_TXTIME. the fq qdisc
+ * works with CLOCK_MONOTONIC, etf needs `is_tai' for CLOCK_TAI.
+ */
+bool asc_socket_set_txtime(asc_socket_t *sock, bool is_tai)
+{
+#ifdef SOCKET_TXTIME
+    struct sock_txtime cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.clockid = is_tai ? CLOCK_TAI : CLOCK_MONOTONIC;
+
+    if(setsockopt(sock->fd, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) != 0)
+    {
+        asc_log_error(MSG("failed to enable SO_TXTIME: %s"), asc_error_msg());
+        return false;
+    }
+
+    sock->txtime_tai = is_tai;
+    return true;
+#else /* SOCKET_TXTIME */
+    __uarg(is_tai);
+    asc_log_error(MSG("SO_TXTIME is not supported on this system"));
+    return false;
+#endif /* !SOCKET_TXTIME */
+}
+
 /*
  * oooo     oooo       oooooooo8     o       oooooooo8 ooooooooooo
  *  8888o   888      o888     88    888     888        88  888  88
@@ -44,6 +44,8 @@ asc_socket_t *asc_socket_open_sctp4(void *arg) __wur;
 void asc_socket_set_on_read(asc_socket_t *sock, event_callback_t on_read);
 void asc_socket_set_on_close(asc_socket_t *sock, event_callback_t on_close);
 void asc_socket_set_on_ready(asc_socket_t *sock, event_callback_t on_ready);
+void asc_socket_set_edge(asc_socket_t *sock, bool is_edge);
+void asc_socket_rearm(asc_socket_t *sock);
 
 void asc_socket_shutdown_recv(asc_socket_t *sock);
 void asc_socket_shutdown_send(asc_socket_t *sock);
@@ -59,9 +61,16 @@ void asc_socket_connect(asc_socket_t *sock, const char *addr, int port
 
 ssize_t asc_socket_recv(asc_socket_t *sock, void *buffer, size_t size) __wur;
 ssize_t asc_socket_recvfrom(asc_socket_t *sock, void *buffer, size_t size) __wur;
+ssize_t asc_socket_recv_burst(asc_socket_t *sock, void *buffer, size_t size
+                              , size_t *lens, unsigned int count) __wur;
 
 ssize_t asc_socket_send(asc_socket_t *sock, const void *buffer, size_t size) __wur;
 ssize_t asc_socket_sendto(asc_socket_t *sock, const void *buffer, size_t size) __wur;
+ssize_t asc_socket_sendto_burst(asc_socket_t *sock, const void *buffer
+                                , size_t size, size_t dsize) __wur;
+ssize_t asc_socket_sendto_txtime(asc_socket_t *sock, const void *buffer
+                                 , size_t size, size_t dsize
+                                 , const uint64_t *txtime) __wur;
 
 int asc_socket_fd(asc_socket_t *sock) __func_pure __wur;
 const char *asc_socket_addr(asc_socket_t *sock) __wur;
@@ -75,6 +84,7 @@ void asc_socket_set_keep_alive(asc_socket_t *sock, int is_on);
 void asc_socket_set_broadcast(asc_socket_t *sock, int is_on);
 void asc_socket_set_timeout(asc_socket_t *sock, int rcvmsec, int sndmsec);
 void asc_socket_set_buffer(asc_socket_t *sock, int rcvbuf, int sndbuf);
+bool asc_socket_set_txtime(asc_socket_t *sock, bool is_tai);
 
 void asc_socket_set_multicast_if(asc_socket_t *sock, const char *addr);
 void asc_socket_set_multicast_ttl(asc_socket_t *sock, int ttl);
@@ -93,4 +103,7 @@ bool asc_socket_would_block(void)
 #endif
 }
 
+/* upper limit for asc_socket_recv_burst() and sendmmsg() batches */
+#define ASC_SOCKET_BURST_MAX 64
+
 #endif /* _ASC_SOCKET_H_ */
@@ -27,15 +27,31 @@
 
 #define MSG(_msg) "[core/thread %p] " _msg, (void *)thr
 
+/*
+ * Single producer, single consumer ring. Positions grow without bound
+ * and are masked on access; each side only ever stores its own index.
+ * The spill area past the end of the ring lets the producer reserve
+ * a contiguous region across the wrap point.
+ */
+#define BUFFER_CACHE_LINE 64
+#define BUFFER_SPILL_MAX (64 * 1024)
+
 struct asc_thread_buffer_t
 {
     uint8_t *buffer;
     size_t size;
-    size_t read;
-    size_t write;
-    size_t count;
+    size_t mask;
+    size_t spill;
 
-    asc_mutex_t mutex;
+    /* written by the producer */
+    char pad_head[BUFFER_CACHE_LINE];
+    size_t head;
+
+    /* written by the consumer */
+    char pad_tail[BUFFER_CACHE_LINE - sizeof(size_t)];
+    size_t tail;
+
+    char pad_end[BUFFER_CACHE_LINE - sizeof(size_t)];
 };
 
 struct asc_thread_t
@@ -44,6 +60,9 @@ struct asc_thread_t
     thread_callback_t on_close;
     void *arg;
 
+    /* loop that receives our jobs */
+    asc_main_loop_t *loop;
+
 #ifdef _WIN32
     HANDLE thread;
 #else
@@ -54,6 +73,7 @@ struct asc_thread_t
 typedef struct
 {
     asc_list_t *list;
+    asc_mutex_t mutex;
 } asc_thread_mgr_t;
 
 static asc_thread_mgr_t *thread_mgr = NULL;
@@ -65,15 +85,25 @@ void asc_thread_core_init(void)
 {
     thread_mgr = ASC_ALLOC(1, asc_thread_mgr_t);
     thread_mgr->list = asc_list_init();
+    asc_mutex_init(&thread_mgr->mutex);
 }
 
 void asc_thread_core_destroy(void)
 {
     asc_thread_t *thr, *prev = NULL;
 
-    asc_list_till_empty(thread_mgr->list)
+    while (true)
     {
-        thr = (asc_thread_t *)asc_list_data(thread_mgr->list);
+        asc_mutex_lock(&thread_mgr->mutex);
+        asc_list_first(thread_mgr->list);
+        thr = NULL;
+        if (!asc_list_eol(thread_mgr->list))
+            thr = (asc_thread_t *)asc_list_data(thread_mgr->list);
+        asc_mutex_unlock(&thread_mgr->mutex);
+
+        if (thr == NULL)
+            break;
+
         asc_assert(thr != prev, MSG("on_close didn't join thread"));
 
         if (thr->on_close != NULL)
@@ -85,13 +115,17 @@ void asc_thread_core_destroy(void)
     }
 
     ASC_FREE(thread_mgr->list, asc_list_destroy);
+    asc_mutex_destroy(&thread_mgr->mutex);
     ASC_FREE(thread_mgr, free);
 }
 
 asc_thread_t *asc_thread_init(void)
 {
     asc_thread_t *const thr = ASC_ALLOC(1, asc_thread_t);
+
+    asc_mutex_lock(&thread_mgr->mutex);
     asc_list_insert_tail(thread_mgr->list, thr);
+    asc_mutex_unlock(&thread_mgr->mutex);
 
     return thr;
 }
@@ -114,6 +148,9 @@ static void *thread_proc(void *arg)
 {
     asc_thread_t *const thr = (asc_thread_t *)arg;
 
+    /* post jobs to the loop that started us */
+    asc_main_loop_switch(thr->loop);
+
     thr->proc(thr->arg);
     asc_job_queue(thr, on_thread_exit, thr);
 
@@ -128,6 +165,7 @@ void asc_thread_start(asc_thread_t *thr, void *arg, thread_callback_t proc
     thr->arg = arg;
     thr->proc = proc;
     thr->on_close = on_close;
+    thr->loop = asc_main_loop_current();
 
 #ifdef _WIN32
     const intptr_t ret = _beginthreadex(NULL, 0, thread_proc, thr, 0, NULL);
@@ -161,8 +199,16 @@ void asc_thread_join(asc_thread_t *thr)
 #endif /* !_WIN32 */
     }
 
+    asc_mutex_lock(&thread_mgr->mutex);
     asc_list_remove_item(thread_mgr->list, thr);
-    asc_job_prune(thr);
+    asc_mutex_unlock(&thread_mgr->mutex);
+
+    if (thr->loop != NULL)
+    {
+        asc_main_loop_t *const prev = asc_main_loop_switch(thr->loop);
+        asc_job_prune(thr);
+        asc_main_loop_switch(prev);
+    }
 
     free(thr);
 }
@@ -174,9 +220,16 @@ asc_thread_buffer_t *asc_thread_buffer_init(size_t size)
 {
     asc_thread_buffer_t *const buffer = ASC_ALLOC(1, asc_thread_buffer_t);
 
-    buffer->size = size;
-    buffer->buffer = ASC_ALLOC(size, uint8_t);
-    asc_mutex_init(&buffer->mutex);
+    /* round up to a power of two */
+    buffer->size = 1;
+    while (buffer->size < size)
+        buffer->size <<= 1;
+
+    buffer->mask = buffer->size - 1;
+    buffer->spill = buffer->size;
+    if (buffer->spill > BUFFER_SPILL_MAX)
+        buffer->spill = BUFFER_SPILL_MAX;
+    buffer->buffer = ASC_ALLOC(buffer->size + buffer->spill, uint8_t);
 
     return buffer;
 }
@@ -184,85 +237,99 @@ asc_thread_buffer_t *asc_thread_buffer_init(size_t size)
 void asc_thread_buffer_destroy(asc_thread_buffer_t *buffer)
 {
     free(buffer->buffer);
-    asc_mutex_destroy(&buffer->mutex);
     free(buffer);
 }
 
+/* drop buffered data; consumer side */
 void asc_thread_buffer_flush(asc_thread_buffer_t *buffer)
 {
-    asc_mutex_lock(&buffer->mutex);
-    buffer->count = 0;
-    buffer->read = 0;
-    buffer->write = 0;
-    asc_mutex_unlock(&buffer->mutex);
+    const size_t head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&buffer->tail, head, __ATOMIC_RELEASE);
 }
 
 ssize_t asc_thread_buffer_read(asc_thread_buffer_t *buffer, void *data
                                , size_t size)
 {
-    asc_mutex_lock(&buffer->mutex);
-    if (size > buffer->count)
-        size = buffer->count;
+    const size_t tail = buffer->tail;
+    const size_t head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+
+    if (size > head - tail)
+        size = head - tail;
 
     if (!size)
-    {
-        asc_mutex_unlock(&buffer->mutex);
         return 0;
-    }
 
-    const size_t next_read = buffer->read + size;
-    if (next_read < buffer->size)
-    {
-        memcpy(data, &buffer->buffer[buffer->read], size);
-        buffer->read += size;
-    }
-    else if (next_read > buffer->size)
-    {
-        const size_t tail = buffer->size - buffer->read;
-        memcpy(data, &buffer->buffer[buffer->read], tail);
-        buffer->read = size - tail;
-        memcpy(&((uint8_t *)data)[tail], buffer->buffer, buffer->read);
-    }
-    else
-    {
-        memcpy(data, &buffer->buffer[buffer->read], size);
-        buffer->read = 0;
-    }
+    const size_t pos = tail & buffer->mask;
+    size_t first = buffer->size - pos;
+    if (first > size)
+        first = size;
 
-    buffer->count -= size;
-    asc_mutex_unlock(&buffer->mutex);
+    memcpy(data, &buffer->buffer[pos], first);
+    if (first < size)
+        memcpy(&((uint8_t *)data)[first], buffer->buffer, size - first);
+
+    __atomic_store_n(&buffer->tail, tail + size, __ATOMIC_RELEASE);
 
     return size;
 }
 
+/* get contiguous space for `size' bytes; NULL if the ring is full */
+void *asc_thread_buffer_reserve(asc_thread_buffer_t *buffer, size_t size)
+{
+    asc_assert(size <= buffer->spill
+               , "[core/thread] reserve size exceeds %zu bytes"
+               , buffer->spill);
+
+    const size_t head = buffer->head;
+    const size_t tail = __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE);
+
+    if (size > buffer->size - (head - tail))
+        return NULL;
+
+    return &buffer->buffer[head & buffer->mask];
+}
+
+/* publish `size' bytes written to the last reserved region */
+void asc_thread_buffer_commit(asc_thread_buffer_t *buffer, size_t size)
+{
+    if (!size)
+        return;
+
+    const size_t head = buffer->head;
+    const size_t pos = head & buffer->mask;
+
+    /* move the part that went into the spill area to the front */
+    if (pos + size > buffer->size)
+    {
+        const size_t over = pos + size - buffer->size;
+        memcpy(buffer->buffer, &buffer->buffer[buffer->size], over);
+    }
+
+    __atomic_store_n(&buffer->head, head + size, __ATOMIC_RELEASE);
+}
+
 ssize_t asc_thread_buffer_write(asc_thread_buffer_t *buffer, const void *data
                                 , size_t size)
 {
     if (!size)
         return 0;
 
-    asc_mutex_lock(&buffer->mutex);
-    if (buffer->count + size > buffer->size)
-    {
-        asc_mutex_unlock(&buffer->mutex);
+    const size_t head = buffer->head;
+    const size_t tail = __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE);
+
+    if (size > buffer->size - (head - tail))
         return -1; // buffer overflow
-    }
 
-    if (buffer->write + size >= buffer->size)
-    {
-        const size_t tail = buffer->size - buffer->write;
-        memcpy(&buffer->buffer[buffer->write], data, tail);
-        buffer->write = size - tail;
-        if(buffer->write > 0)
-            memcpy(buffer->buffer, &((uint8_t *)data)[tail], buffer->write);
-    }
-    else
-    {
-        memcpy(&buffer->buffer[buffer->write], data, size);
-        buffer->write += size;
-    }
-    buffer->count += size;
-    asc_mutex_unlock(&buffer->mutex);
+    const size_t pos = head & buffer->mask;
+    size_t first = buffer->size - pos;
+    if (first > size)
+        first = size;
+
+    memcpy(&buffer->buffer[pos], data, first);
+    if (first < size)
+        memcpy(buffer->buffer, &((const uint8_t *)data)[first], size - first);
+
+    __atomic_store_n(&buffer->head, head + size, __ATOMIC_RELEASE);
 
     return size;
 }
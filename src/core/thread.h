@@ -47,4 +47,8 @@ ssize_t asc_thread_buffer_read(asc_thread_buffer_t *buffer
 ssize_t asc_thread_buffer_write(asc_thread_buffer_t *buffer
                                 , const void *data, size_t size) __wur;
 
+void *asc_thread_buffer_reserve(asc_thread_buffer_t *buffer
+                                , size_t size) __wur;
+void asc_thread_buffer_commit(asc_thread_buffer_t *buffer, size_t size);
+
 #endif /* _ASC_THREAD_H_ */
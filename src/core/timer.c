@@ -20,11 +20,16 @@
 
 #include <astra.h>
 #include <core/timer.h>
-#include <core/list.h>
 
 #define TIMER_DELAY_MIN 1000 /* 1ms */
 #define TIMER_DELAY_MAX 100000 /* 100ms */
 
+#define TIMER_HEAP_SIZE 64
+
+/*
+ * timers are kept in a binary min-heap ordered by next shot time,
+ * with insertion order breaking ties.
+ */
 struct asc_timer_t
 {
     timer_callback_t callback;
@@ -32,65 +37,186 @@ struct asc_timer_t
 
     uint64_t interval;
     uint64_t next_shot;
+
+    uint64_t seq;
+    size_t idx;
 };
 
-static asc_list_t *timer_list = NULL;
+struct asc_timer_mgr_t
+{
+    asc_timer_t **heap;
+    size_t count;
+    size_t size;
 
-void asc_timer_core_init(void)
+    uint64_t seq;
+    asc_timer_t *current;
+};
+
+/* each event loop thread has its own set of timers */
+static __thread_local asc_timer_mgr_t *timer_mgr = NULL;
+
+static inline
+bool timer_less(const asc_timer_t *a, const asc_timer_t *b)
 {
-    timer_list = asc_list_init();
+    if (a->next_shot != b->next_shot)
+        return (a->next_shot < b->next_shot);
+
+    return (a->seq < b->seq);
 }
 
-void asc_timer_core_destroy(void)
+static inline
+void heap_set(size_t idx, asc_timer_t *timer)
 {
-    if (timer_list == NULL)
-        return;
+    timer_mgr->heap[idx] = timer;
+    timer->idx = idx;
+}
 
-    asc_list_clear(timer_list)
+static
+void heap_sift_up(size_t idx)
+{
+    asc_timer_t *const timer = timer_mgr->heap[idx];
+
+    while (idx > 0)
     {
-        free(asc_list_data(timer_list));
+        const size_t parent = (idx - 1) / 2;
+        if (!timer_less(timer, timer_mgr->heap[parent]))
+            break;
+
+        heap_set(idx, timer_mgr->heap[parent]);
+        idx = parent;
     }
 
-    ASC_FREE(timer_list, asc_list_destroy);
+    heap_set(idx, timer);
 }
 
-unsigned int asc_timer_core_loop(void)
+static
+void heap_sift_down(size_t idx)
 {
-    uint64_t nearest = UINT64_MAX;
-    uint64_t now = asc_utime();
+    asc_timer_t *const timer = timer_mgr->heap[idx];
+    const size_t count = timer_mgr->count;
 
-    asc_list_first(timer_list);
-    while (!asc_list_eol(timer_list))
+    while (true)
     {
-        asc_timer_t *const timer = (asc_timer_t *)asc_list_data(timer_list);
+        size_t child = idx * 2 + 1;
+        if (child >= count)
+            break;
 
-        if (timer->callback != NULL && now >= timer->next_shot)
+        if (child + 1 < count
+            && timer_less(timer_mgr->heap[child + 1], timer_mgr->heap[child]))
         {
-            timer->callback(timer->arg);
+            child++;
+        }
 
-            /* refresh timestamp */
-            now = asc_utime();
+        if (!timer_less(timer_mgr->heap[child], timer))
+            break;
 
-            if (timer->interval > 0)
-                timer->next_shot = now + timer->interval; /* periodic timer */
-            else
-                timer->callback = NULL; /* one shot timer, so remove it */
-        }
+        heap_set(idx, timer_mgr->heap[child]);
+        idx = child;
+    }
+
+    heap_set(idx, timer);
+}
+
+static
+void heap_insert(asc_timer_t *timer)
+{
+    if (timer_mgr->count >= timer_mgr->size)
+    {
+        const size_t size = timer_mgr->size * 2;
+        asc_timer_t **const heap =
+            (asc_timer_t **)realloc(timer_mgr->heap, size * sizeof(*heap));
+        asc_assert(heap != NULL, "[core/timer] realloc() failed");
+
+        timer_mgr->heap = heap;
+        timer_mgr->size = size;
+    }
+
+    timer->seq = timer_mgr->seq++;
+    heap_set(timer_mgr->count++, timer);
+    heap_sift_up(timer->idx);
+}
+
+static
+void heap_remove(asc_timer_t *timer)
+{
+    const size_t idx = timer->idx;
+    asc_timer_t *const last = timer_mgr->heap[--timer_mgr->count];
+
+    if (last == timer)
+        return;
+
+    heap_set(idx, last);
+    if (idx > 0 && timer_less(last, timer_mgr->heap[(idx - 1) / 2]))
+        heap_sift_up(idx);
+    else
+        heap_sift_down(idx);
+}
+
+void asc_timer_core_init(void)
+{
+    timer_mgr = ASC_ALLOC(1, asc_timer_mgr_t);
+
+    timer_mgr->size = TIMER_HEAP_SIZE;
+    timer_mgr->heap = ASC_ALLOC(timer_mgr->size, asc_timer_t *);
+}
+
+void asc_timer_core_destroy(void)
+{
+    if (timer_mgr == NULL)
+        return;
+
+    for (size_t i = 0; i < timer_mgr->count; i++)
+        free(timer_mgr->heap[i]);
+
+    free(timer_mgr->heap);
+    ASC_FREE(timer_mgr, free);
+}
+
+/* make `mgr' current for the calling thread, return previous one */
+asc_timer_mgr_t *asc_timer_core_switch(asc_timer_mgr_t *mgr)
+{
+    asc_timer_mgr_t *const prev = timer_mgr;
+    timer_mgr = mgr;
+
+    return prev;
+}
 
-        if (timer->callback == NULL)
+unsigned int asc_timer_core_loop(void)
+{
+    const uint64_t start = asc_utime();
+    uint64_t now = start;
+
+    while (timer_mgr->count > 0)
+    {
+        asc_timer_t *const timer = timer_mgr->heap[0];
+        if (timer->next_shot > start)
+            break;
+
+        heap_remove(timer);
+
+        timer_mgr->current = timer;
+        timer->callback(timer->arg);
+        timer_mgr->current = NULL;
+
+        if (timer->callback != NULL && timer->interval > 0)
         {
-            asc_list_remove_current(timer_list);
-            free(timer);
+            /* periodic timer; interval counts from the end of callback */
+            now = asc_utime();
+            timer->next_shot = now + timer->interval;
+            heap_insert(timer);
         }
         else
         {
-            if (timer->next_shot < nearest)
-                nearest = timer->next_shot;
-
-            asc_list_next(timer_list);
+            /* one shot timer or destroyed by its own callback */
+            free(timer);
         }
     }
 
+    if (timer_mgr->count == 0)
+        return (TIMER_DELAY_MAX / 1000);
+
+    const uint64_t nearest = timer_mgr->heap[0]->next_shot;
+
     uint64_t diff;
     if (nearest < now + TIMER_DELAY_MIN)
         diff = TIMER_DELAY_MIN;
@@ -113,7 +239,7 @@ asc_timer_t *asc_timer_init(unsigned int ms, timer_callback_t callback
 
     timer->next_shot = asc_utime() + timer->interval;
 
-    asc_list_insert_tail(timer_list, timer);
+    heap_insert(timer);
 
     return timer;
 }
@@ -132,6 +258,13 @@ void asc_timer_destroy(asc_timer_t *timer)
     if (timer == NULL)
         return;
 
-    /* setting callback to NULL causes timer removal by loop function */
-    timer->callback = NULL;
+    if (timer == timer_mgr->current)
+    {
+        /* called from its own callback; loop function will free it */
+        timer->callback = NULL;
+        return;
+    }
+
+    heap_remove(timer);
+    free(timer);
 }
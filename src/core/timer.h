@@ -26,12 +26,15 @@
 #endif /* !_ASTRA_H_ */
 
 typedef struct asc_timer_t asc_timer_t;
+typedef struct asc_timer_mgr_t asc_timer_mgr_t;
 typedef void (*timer_callback_t)(void *);
 
 void asc_timer_core_init(void);
 unsigned int asc_timer_core_loop(void);
 void asc_timer_core_destroy(void);
 
+asc_timer_mgr_t *asc_timer_core_switch(asc_timer_mgr_t *mgr);
+
 asc_timer_t *asc_timer_init(unsigned int ms, timer_callback_t callback
                             , void *arg) __wur;
 asc_timer_t *asc_timer_one_shot(unsigned int ms, timer_callback_t callback
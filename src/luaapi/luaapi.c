@@ -105,3 +105,45 @@ bool module_option_boolean(lua_State *L, const char *name, bool *boolean)
     lua_pop(L, 1);
     return result;
 }
+
+/* resolve `loop' option; returns the loop instance should be pinned to */
+asc_loop_t *module_option_loop(lua_State *L, bool allowed)
+{
+    int id = 0;
+
+    if (!module_option_integer(L, "loop", &id) || id == 0)
+        return asc_loop_current();
+
+    if (!allowed)
+        luaL_error(L, "option 'loop' is not supported by this module");
+
+    asc_loop_t *const loop = (id > 0) ? asc_loop_get(id) : NULL;
+    if (loop == NULL)
+    {
+        luaL_error(L, "option 'loop' must be between 0 and %d"
+                   , ASC_LOOP_MAX);
+    }
+
+    return loop;
+}
+
+/*
+ * call C closure on top of the stack with a copy of the caller's
+ * arguments while inside `loop'; Lua errors are re-raised only after
+ * leaving the loop.
+ */
+int module_loop_call(lua_State *L, asc_loop_t *loop)
+{
+    const int argc = lua_gettop(L) - 1;
+    for (int i = 1; i <= argc; i++)
+        lua_pushvalue(L, i);
+
+    asc_loop_t *const prev = asc_loop_enter(loop);
+    const int ret = lua_pcall(L, argc, LUA_MULTRET, 0);
+    asc_loop_leave(loop, prev);
+
+    if (ret != LUA_OK)
+        lua_error(L);
+
+    return lua_gettop(L) - argc;
+}
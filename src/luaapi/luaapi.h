@@ -34,6 +34,8 @@
 #   include <lua.hpp>
 #endif /* !__cplusplus */
 
+#include <core/loop.h>
+
 typedef struct module_data_t module_data_t;
 typedef int (*module_callback_t)(lua_State *L, module_data_t *);
 
@@ -48,13 +50,18 @@ bool module_option_string(lua_State *L, const char *name, const char **string
                           , size_t *length);
 bool module_option_boolean(lua_State *L, const char *name, bool *boolean);
 
+asc_loop_t *module_option_loop(lua_State *L, bool allowed);
+int module_loop_call(lua_State *L, asc_loop_t *loop);
+
 #define lua_foreach(_lua, _idx) \
     for(lua_pushnil(_lua); lua_next(_lua, _idx); lua_pop(_lua, 1))
 
 #define MODULE_OPTIONS_IDX 2
 
 #define MODULE_LUA_DATA() \
-    lua_State *__lua
+    lua_State *__lua; \
+    asc_loop_t *__loop; \
+    const char *__name
 
 #define MODULE_L(_mod) \
     ((_mod)->__lua)
@@ -65,14 +72,25 @@ bool module_option_boolean(lua_State *L, const char *name, bool *boolean);
 #define MODULE_LUA_METHODS() \
     static const module_method_t __module_methods[] =
 
+/*
+ * modules registered with MODULE_LUA_REGISTER_LOOP() accept `loop' option
+ * and can run on a worker loop. Such modules must not call into Lua
+ * except from module_init(), module_destroy() and Lua methods.
+ */
 #define MODULE_LUA_REGISTER(_name) \
+    __MODULE_LUA_REGISTER(_name, false)
+
+#define MODULE_LUA_REGISTER_LOOP(_name) \
+    __MODULE_LUA_REGISTER(_name, true)
+
+#define __MODULE_LUA_REGISTER(_name, _loop) \
     static const char __module_name[] = #_name; \
     static int __module_tostring(lua_State *L) \
     { \
         lua_pushstring(L, __module_name); \
         return 1; \
     } \
-    static int __module_thunk(lua_State *L) \
+    static int __module_method(lua_State *L) \
     { \
         module_data_t *const mod = \
             (module_data_t *)lua_touserdata(L, lua_upvalueindex(1)); \
@@ -80,11 +98,31 @@ bool module_option_boolean(lua_State *L, const char *name, bool *boolean);
             (module_method_t *)lua_touserdata(L, lua_upvalueindex(2)); \
         return m->method(L, mod); \
     } \
+    static int __module_thunk(lua_State *L) \
+    { \
+        module_data_t *const mod = \
+            (module_data_t *)lua_touserdata(L, lua_upvalueindex(1)); \
+        if(mod->__loop == asc_loop_current()) \
+            return __module_method(L); \
+        lua_pushvalue(L, lua_upvalueindex(1)); \
+        lua_pushvalue(L, lua_upvalueindex(2)); \
+        lua_pushcclosure(L, __module_method, 2); \
+        return module_loop_call(L, mod->__loop); \
+    } \
+    static int __module_init(lua_State *L) \
+    { \
+        module_data_t *const mod = \
+            (module_data_t *)lua_touserdata(L, lua_upvalueindex(1)); \
+        module_init(L, mod); \
+        return 0; \
+    } \
     static int __module_delete(lua_State *L) \
     { \
         module_data_t *const mod = \
             (module_data_t *)lua_touserdata(L, lua_upvalueindex(1)); \
+        asc_loop_t *const __prev = asc_loop_enter(mod->__loop); \
         module_destroy(mod); \
+        asc_loop_leave(mod->__loop, __prev); \
         free(mod); \
         return 0; \
     } \
@@ -96,6 +134,7 @@ bool module_option_boolean(lua_State *L, const char *name, bool *boolean);
             { "__gc", __module_delete }, \
             { "__tostring", __module_tostring }, \
         }; \
+        asc_loop_t *const __loop = module_option_loop(L, _loop); \
         module_data_t *const mod = ASC_ALLOC(1, module_data_t); \
         lua_newtable(L); \
         lua_newtable(L); \
@@ -122,7 +161,18 @@ bool module_option_boolean(lua_State *L, const char *name, bool *boolean);
             lua_setfield(L, 3, "__options"); \
         } \
         mod->__lua = L; \
-        module_init(L, mod); \
+        mod->__loop = __loop; \
+        mod->__name = __module_name; \
+        if(__loop == asc_loop_current()) \
+        { \
+            module_init(L, mod); \
+        } \
+        else \
+        { \
+            lua_pushlightuserdata(L, (void *)mod); \
+            lua_pushcclosure(L, __module_init, 1); \
+            module_loop_call(L, __loop); \
+        } \
         return 1; \
     } \
     MODULE_LUA_BINDING(_name) \
@@ -19,41 +19,1318 @@
  */
 
 #include <astra.h>
+#include <core/mutex.h>
+#include <core/thread.h>
 #include <luaapi/stream.h>
 
+#define MSG(_msg) "[luaapi/stream] " _msg
+
+/* maximum number of packets queued on a link */
+#define LINK_BUFFER_SIZE 4096
+
+/* queue entries picked up by downstream in one go */
+#define LINK_BATCH_SIZE 64
+
+/* spare blocks kept by a link's pool */
+#define LINK_POOL_CACHE 16
+
+/*
+ * dispatch sets
+ */
+
+static
+void set_insert(module_stream_set_t *set, module_stream_t *child)
+{
+    if (set->count >= set->size)
+    {
+        const unsigned int size = (set->size > 0) ? (set->size * 2) : 4;
+        module_stream_t **const items =
+            (module_stream_t **)realloc(set->items, size * sizeof(*items));
+        asc_assert(items != NULL, MSG("realloc() failed"));
+
+        set->items = items;
+        set->size = size;
+    }
+
+    set->items[set->count++] = child;
+}
+
+static
+void set_compact(module_stream_set_t *set)
+{
+    unsigned int j = 0;
+
+    for (unsigned int i = 0; i < set->count; i++)
+    {
+        if (set->items[i] != NULL)
+            set->items[j++] = set->items[i];
+    }
+
+    set->count = j;
+}
+
+static
+void set_remove(module_stream_t *stream, module_stream_set_t *set
+                , const module_stream_t *child)
+{
+    for (unsigned int i = 0; i < set->count; i++)
+    {
+        if (set->items[i] == child)
+        {
+            set->items[i] = NULL;
+            break;
+        }
+    }
+
+    /* don't shift items while they're being iterated over */
+    if (stream->sending > 0)
+        stream->dirty = true;
+    else
+        set_compact(set);
+}
+
+static
+void set_destroy(module_stream_set_t *set)
+{
+    ASC_FREE(set->items, free);
+    set->count = set->size = 0;
+}
+
+/* subscribers of `pid', NULL if there are none */
+static inline
+module_stream_set_t *pids_get(const module_stream_t *stream, uint16_t pid)
+{
+    if (stream->pids == NULL)
+        return NULL;
+
+    return (module_stream_set_t *)mpegts_pidmap_get(stream->pids, pid);
+}
+
+static
+void pids_free(module_stream_t *stream, uint16_t pid, module_stream_set_t *set)
+{
+    mpegts_pidmap_set(stream->pids, pid, NULL);
+    set_destroy(set);
+    free(set);
+}
+
+static
+void pids_insert(module_stream_t *stream, uint16_t pid
+                 , module_stream_t *child)
+{
+    if (stream->pids == NULL)
+        stream->pids = ASC_ALLOC(1, mpegts_pidmap_t);
+
+    module_stream_set_t *set = pids_get(stream, pid);
+    if (set == NULL)
+    {
+        set = ASC_ALLOC(1, module_stream_set_t);
+        mpegts_pidmap_set(stream->pids, pid, set);
+    }
+
+    set_insert(set, child);
+    stream->demux_gen++;
+}
+
+static
+void pids_remove(module_stream_t *stream, uint16_t pid
+                 , const module_stream_t *child)
+{
+    module_stream_set_t *const set = pids_get(stream, pid);
+    if (set == NULL)
+        return;
+
+    set_remove(stream, set, child);
+    stream->demux_gen++;
+
+    /* sets being iterated over are freed by stream_cleanup() */
+    if (set->count == 0)
+        pids_free(stream, pid, set);
+}
+
+static
+void stream_cleanup(module_stream_t *stream)
+{
+    stream->dirty = false;
+
+    set_compact(&stream->all);
+    set_compact(&stream->pending);
+
+    if (stream->pids != NULL)
+    {
+        for (unsigned int i = 0; i < MAX_PID; i++)
+        {
+            module_stream_set_t *const set = pids_get(stream, i);
+            if (set == NULL)
+                continue;
+
+            set_compact(set);
+            if (set->count == 0)
+                pids_free(stream, i, set);
+        }
+    }
+}
+
+/*
+ * list of all streams
+ */
+
+/* streams are created on every loop */
+static struct
+{
+    int lock;
+    unsigned int last_id;
+    size_t count;
+
+    module_stream_t *head;
+    module_stream_t *tail;
+} graph;
+
+static inline
+void graph_lock(void)
+{
+    while (__sync_lock_test_and_set(&graph.lock, 1))
+        ;
+}
+
+static inline
+void graph_unlock(void)
+{
+    __sync_lock_release(&graph.lock);
+}
+
+static
+void graph_insert(module_stream_t *stream)
+{
+    graph_lock();
+
+    stream->id = ++graph.last_id;
+    stream->graph_prev = graph.tail;
+    stream->graph_next = NULL;
+
+    if (graph.tail != NULL)
+        graph.tail->graph_next = stream;
+    else
+        graph.head = stream;
+
+    graph.tail = stream;
+    graph.count++;
+
+    graph_unlock();
+}
+
+static
+void graph_remove(module_stream_t *stream)
+{
+    graph_lock();
+
+    if (stream->graph_prev != NULL || graph.head == stream)
+        graph.count--;
+
+    if (stream->graph_prev != NULL)
+        stream->graph_prev->graph_next = stream->graph_next;
+    else if (graph.head == stream)
+        graph.head = stream->graph_next;
+
+    if (stream->graph_next != NULL)
+        stream->graph_next->graph_prev = stream->graph_prev;
+    else if (graph.tail == stream)
+        graph.tail = stream->graph_prev;
+
+    stream->graph_prev = stream->graph_next = NULL;
+
+    graph_unlock();
+}
+
+/*
+ * attach and detach
+ */
+
+static module_stream_t *link_create(module_stream_t *upstream
+                                    , module_stream_t *child);
+static void link_destroy(module_stream_link_t *link);
+static void psi_attach(module_stream_t *child, uint16_t pid);
+static void psi_detach(module_stream_t *child, uint16_t pid);
+
+static
+void stream_detach(module_stream_t *stream, module_stream_t *child)
+{
+    set_remove(stream, &stream->all, child);
+    set_remove(stream, &stream->pending, child);
+
+    if (stream->pids != NULL && child->pid_list != NULL)
+    {
+        for (unsigned int i = 0; i < MAX_PID; i++)
+        {
+            if (child->pid_list[i] > 0)
+                pids_remove(stream, i, child);
+        }
+    }
+
+    for (unsigned int i = 0; i < child->psi_sub_count; i++)
+        psi_detach(child, child->psi_subs[i].pid);
+
+    child->run_batch = 0;
+    child->run_count = 0;
+
+    asc_list_remove_item(stream->children, child);
+    child->parent = NULL;
+
+    if (child->link != NULL)
+    {
+        module_stream_link_t *const link = child->link;
+
+        child->link = NULL;
+        link_destroy(link);
+    }
+}
+
+void __module_stream_attach(module_stream_t *stream, module_stream_t *child)
+{
+    if (child->parent != NULL)
+        stream_detach(child->parent, child);
+
+    /* upstream runs on another thread; connect through a link */
+    if (stream->loop != child->loop)
+        stream = link_create(stream, child);
+
+    child->parent = stream;
+    asc_list_insert_tail(stream->children, child);
+
+    if (child->pid_list != NULL)
+    {
+        /* restore subscriptions made while attached elsewhere */
+        for (unsigned int i = 0; i < MAX_PID; i++)
+        {
+            if (child->pid_list[i] > 0)
+                __module_stream_subscribe(child, i);
+        }
+    }
+    else
+    {
+        set_insert(&stream->all, child);
+    }
+
+    for (unsigned int i = 0; i < child->psi_sub_count; i++)
+        psi_attach(child, child->psi_subs[i].pid);
+}
+
+/*
+ * demux subscriptions
+ */
+
+void __module_stream_demux_init(module_stream_t *stream)
+{
+    stream->pid_list = ASC_ALLOC(MAX_PID, uint8_t);
+
+    /* stop receiving every packet; wait for join_pid instead */
+    if (stream->parent != NULL)
+        set_remove(stream->parent, &stream->parent->all, stream);
+}
+
+void __module_stream_subscribe(module_stream_t *stream, uint16_t pid)
+{
+    pids_insert(stream->parent, pid, stream);
+}
+
+void __module_stream_unsubscribe(module_stream_t *stream, uint16_t pid)
+{
+    pids_remove(stream->parent, pid, stream);
+}
+
+/*
+ * shared PSI assemblers
+ *
+ * An assembler is a hidden demux child of the stream it reassembles
+ * sections for. It exists while at least one child of that stream
+ * has joined its PID through __module_stream_psi_join().
+ */
+
+struct module_stream_psi_t
+{
+    module_stream_t stream;
+    module_stream_psi_t *next;
+
+    mpegts_psi_t *psi;
+
+    /* children that joined the PID */
+    module_stream_set_t subs;
+    bool is_dead;
+};
+
+static
+void psi_free(module_stream_psi_t *cache)
+{
+    set_destroy(&cache->subs);
+    mpegts_psi_destroy(cache->psi);
+
+    free(cache);
+}
+
+static
+const module_stream_psi_sub_t *psi_find_sub(const module_stream_t *child
+                                            , uint16_t pid)
+{
+    for (unsigned int i = 0; i < child->psi_sub_count; i++)
+    {
+        if (child->psi_subs[i].pid == pid)
+            return &child->psi_subs[i];
+    }
+
+    return NULL;
+}
+
+static
+module_stream_psi_t *psi_find(const module_stream_t *stream, uint16_t pid)
+{
+    module_stream_psi_t *cache = stream->psi_cache;
+
+    while (cache != NULL && cache->psi->pid != pid)
+        cache = cache->next;
+
+    return cache;
+}
+
+/* check section once, then pass it on to every subscriber */
+static
+void on_psi_section(void *arg, mpegts_psi_t *psi)
+{
+    module_stream_psi_t *const cache = (module_stream_psi_t *)arg;
+
+    const uint32_t crc32 = PSI_GET_CRC32(psi);
+    psi->crc32 = PSI_CALC_CRC32(psi);
+
+    const bool is_valid = (crc32 == psi->crc32);
+    if (!is_valid)
+        asc_log_error(MSG("PID %hu: checksum error"), psi->pid);
+
+    const unsigned int count = cache->subs.count;
+    for (unsigned int i = 0; i < count && !cache->is_dead; i++)
+    {
+        module_stream_t *const child = cache->subs.items[i];
+        if (child == NULL)
+            continue;
+
+        const module_stream_psi_sub_t *const sub =
+            psi_find_sub(child, psi->pid);
+
+        if (sub == NULL || (!is_valid && !sub->is_raw))
+            continue;
+
+        /* subscription may be moved by a join from inside the callback */
+        const stream_psi_callback_t callback = sub->callback;
+        callback(child->self, psi);
+    }
+}
+
+static
+void on_psi_ts(module_data_t *arg, const uint8_t *ts)
+{
+    module_stream_psi_t *const cache = (module_stream_psi_t *)arg;
+    module_stream_t *const stream = &cache->stream;
+
+    stream->sending++;
+    mpegts_psi_mux(cache->psi, ts, on_psi_section, cache);
+
+    if (--stream->sending == 0)
+    {
+        /* last subscriber left during one of the callbacks */
+        if (cache->is_dead)
+        {
+            psi_free(cache);
+        }
+        else if (stream->dirty)
+        {
+            stream->dirty = false;
+            set_compact(&cache->subs);
+        }
+    }
+}
+
+/* stop reassembling; free now unless we're inside its callbacks */
+static
+void psi_close(module_stream_t *stream, module_stream_psi_t *cache)
+{
+    module_stream_psi_t **ptr = &stream->psi_cache;
+    while (*ptr != cache)
+        ptr = &(*ptr)->next;
+
+    *ptr = cache->next;
+
+    const uint16_t pid = cache->psi->pid;
+    __module_stream_unsubscribe(&cache->stream, pid);
+    set_remove(stream, &stream->pending, &cache->stream);
+
+    if (stream->leave_pid != NULL)
+        stream->leave_pid(stream->self, pid);
+
+    cache->is_dead = true;
+    if (cache->stream.sending == 0)
+        psi_free(cache);
+}
+
+static
+void psi_attach(module_stream_t *child, uint16_t pid)
+{
+    module_stream_t *const stream = child->parent;
+
+    module_stream_psi_t *cache = psi_find(stream, pid);
+    if (cache == NULL)
+    {
+        cache = ASC_ALLOC(1, module_stream_psi_t);
+        cache->psi = mpegts_psi_init(MPEGTS_PACKET_PSI, pid);
+
+        cache->stream.self = (module_data_t *)cache;
+        cache->stream.on_ts = on_psi_ts;
+        cache->stream.parent = stream;
+        cache->stream.loop = stream->loop;
+
+        cache->next = stream->psi_cache;
+        stream->psi_cache = cache;
+
+        __module_stream_subscribe(&cache->stream, pid);
+        if (stream->join_pid != NULL)
+            stream->join_pid(stream->self, pid);
+    }
+
+    set_insert(&cache->subs, child);
+}
+
+static
+void psi_detach(module_stream_t *child, uint16_t pid)
+{
+    module_stream_t *const stream = child->parent;
+
+    module_stream_psi_t *const cache = psi_find(stream, pid);
+    if (cache == NULL)
+        return;
+
+    set_remove(&cache->stream, &cache->subs, child);
+
+    for (unsigned int i = 0; i < cache->subs.count; i++)
+    {
+        if (cache->subs.items[i] != NULL)
+            return;
+    }
+
+    psi_close(stream, cache);
+}
+
+static
+void psi_join(module_stream_t *stream, uint16_t pid
+              , stream_psi_callback_t callback, bool is_raw)
+{
+    for (unsigned int i = 0; i < stream->psi_sub_count; i++)
+    {
+        if (stream->psi_subs[i].pid == pid)
+        {
+            stream->psi_subs[i].callback = callback;
+            stream->psi_subs[i].is_raw = is_raw;
+            return;
+        }
+    }
+
+    const size_t size = (stream->psi_sub_count + 1) * sizeof(*stream->psi_subs);
+    module_stream_psi_sub_t *const subs =
+        (module_stream_psi_sub_t *)realloc(stream->psi_subs, size);
+    asc_assert(subs != NULL, MSG("realloc() failed"));
+
+    subs[stream->psi_sub_count].pid = pid;
+    subs[stream->psi_sub_count].is_raw = is_raw;
+    subs[stream->psi_sub_count].callback = callback;
+    stream->psi_subs = subs;
+    stream->psi_sub_count++;
+
+    if (stream->parent != NULL)
+        psi_attach(stream, pid);
+}
+
+void __module_stream_psi_join(module_stream_t *stream, uint16_t pid
+                              , stream_psi_callback_t callback)
+{
+    psi_join(stream, pid, callback, false);
+}
+
+void __module_stream_psi_join_raw(module_stream_t *stream, uint16_t pid
+                                  , stream_psi_callback_t callback)
+{
+    psi_join(stream, pid, callback, true);
+}
+
+void __module_stream_psi_leave(module_stream_t *stream, uint16_t pid)
+{
+    for (unsigned int i = 0; i < stream->psi_sub_count; i++)
+    {
+        if (stream->psi_subs[i].pid != pid)
+            continue;
+
+        if (stream->parent != NULL)
+            psi_detach(stream, pid);
+
+        stream->psi_sub_count--;
+        memmove(&stream->psi_subs[i], &stream->psi_subs[i + 1]
+                , (stream->psi_sub_count - i) * sizeof(*stream->psi_subs));
+
+        return;
+    }
+}
+
+/*
+ * counters
+ */
+
+/* time one callback in this many */
+#define STAT_SAMPLE 64
+
+static bool stat_enabled = false;
+
+/* time spent in timed callbacks nested in the current one */
+static __thread_local uint64_t stat_nested = 0;
+static __thread_local unsigned int stat_depth = 0;
+
+typedef struct
+{
+    uint64_t start;
+    uint64_t nested;
+    bool is_timed;
+    bool is_sampled;
+} stat_frame_t;
+
+void module_stream_stat_enable(bool enable)
+{
+    __atomic_store_n(&stat_enabled, enable, __ATOMIC_RELAXED);
+}
+
+static inline
+bool stat_begin(module_stream_t *child, size_t count, stat_frame_t *frame)
+{
+    if (!__atomic_load_n(&stat_enabled, __ATOMIC_RELAXED))
+        return false;
+
+    child->stat.packets_in += count;
+
+    /* callbacks nested in a timed one are timed too, to subtract them */
+    frame->is_sampled = (++child->stat.calls % STAT_SAMPLE == 0);
+    frame->is_timed = (frame->is_sampled || stat_depth > 0);
+
+    if (frame->is_timed)
+    {
+        frame->nested = stat_nested;
+        stat_nested = 0;
+        stat_depth++;
+
+        frame->start = asc_ntime();
+    }
+
+    return true;
+}
+
+static inline
+void stat_end(module_stream_t *child, const stat_frame_t *frame)
+{
+    if (!frame->is_timed)
+        return;
+
+    const uint64_t elapsed = asc_ntime() - frame->start;
+
+    if (frame->is_sampled && elapsed > stat_nested)
+        child->stat.cpu_ns += (elapsed - stat_nested) * STAT_SAMPLE;
+
+    stat_nested = frame->nested + elapsed;
+    stat_depth--;
+}
+
+static inline
+void stat_send(module_stream_t *stream, size_t count)
+{
+    if (__atomic_load_n(&stat_enabled, __ATOMIC_RELAXED))
+        stream->stat.packets_out += count;
+}
+
+/*
+ * packet dispatch
+ */
+
+static inline
+void stream_deliver(module_stream_t *child, const uint8_t *ts, size_t count)
+{
+    stat_frame_t frame = { 0, 0, false, false };
+    const bool is_stat = stat_begin(child, count, &frame);
+
+    if (child->on_ts_batch != NULL)
+    {
+        child->on_ts_batch(child->self, ts, count);
+    }
+    else if (child->on_ts != NULL)
+    {
+        /* fall back to per-packet delivery */
+        for (size_t i = 0; i < count; i++)
+            child->on_ts(child->self, &ts[i * TS_PACKET_SIZE]);
+    }
+
+    if (is_stat)
+        stat_end(child, &frame);
+}
+
+static inline
+void stream_deliver_one(module_stream_t *child, const uint8_t *ts)
+{
+    stat_frame_t frame = { 0, 0, false, false };
+    const bool is_stat = stat_begin(child, 1, &frame);
+
+    if (child->on_ts != NULL)
+        child->on_ts(child->self, ts);
+    else if (child->on_ts_batch != NULL)
+        child->on_ts_batch(child->self, ts, 1);
+
+    if (is_stat)
+        stat_end(child, &frame);
+}
+
+static inline
+void stream_deliver_block(module_stream_t *child, mpegts_block_t *block)
+{
+    stat_frame_t frame = { 0, 0, false, false };
+    const bool is_stat = stat_begin(child, block->count, &frame);
+
+    child->on_ts_block(child->self, block);
+
+    if (is_stat)
+        stat_end(child, &frame);
+}
+
+void __module_stream_send(void *arg, const uint8_t *ts)
+{
+    module_stream_t *const stream = (module_stream_t *)arg;
+
+    stat_send(stream, 1);
+    stream->sending++;
+
+    /*
+     * NOTE: items added during dispatch are not visited until the next
+     *       packet; removed items are set to NULL and compacted later.
+     */
+    const unsigned int count = stream->all.count;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        module_stream_t *const child = stream->all.items[i];
+
+        if (child != NULL)
+            stream_deliver_one(child, ts);
+    }
+
+    const module_stream_set_t *const set = pids_get(stream, TS_GET_PID(ts));
+    if (set != NULL)
+    {
+        const unsigned int subs = set->count;
+        for (unsigned int i = 0; i < subs; i++)
+        {
+            module_stream_t *const child = set->items[i];
+
+            if (child != NULL)
+                stream_deliver_one(child, ts);
+        }
+    }
+
+    if (--stream->sending == 0 && stream->dirty)
+        stream_cleanup(stream);
+}
+
+/*
+ * Batches are split into per-child runs of consecutive packets. A child
+ * may join or leave PIDs while it handles a run; the rest of the batch
+ * is then routed again from the end of that run, so what it joined is
+ * not missed and what it left is not delivered. run_done keeps children
+ * from getting a packet twice.
+ */
+
+/* hand over the part of a queued run before `end'; returns where the
+ * delivered part ends. `child' may be gone once this returns. */
+static
+size_t run_deliver(module_stream_t *child, const uint8_t *ts, size_t end)
+{
+    const size_t first = child->run_first;
+    if (end > first + child->run_count)
+        end = first + child->run_count;
+
+    child->run_count = 0;
+    child->run_done = end;
+
+    stream_deliver(child, &ts[first * TS_PACKET_SIZE], end - first);
+
+    return end;
+}
+
+/* deliver runs queued before `pos' and drop the rest; returns where
+ * routing has to resume, which moves back if subscriptions change */
+static
+size_t demux_restart(module_stream_t *stream, const uint8_t *ts, size_t pos)
+{
+    unsigned int gen = stream->demux_gen;
+
+    for (unsigned int i = 0; i < stream->pending.count; i++)
+    {
+        module_stream_t *const child = stream->pending.items[i];
+
+        if (child == NULL || child->run_count == 0)
+            continue;
+
+        if (child->run_first >= pos)
+        {
+            child->run_count = 0;
+            continue;
+        }
+
+        const size_t end = run_deliver(child, ts, pos);
+        if (stream->demux_gen != gen)
+        {
+            gen = stream->demux_gen;
+            pos = end;
+        }
+    }
+
+    return pos;
+}
+
+/* queue packets from `pos' onwards; returns `count' once all are queued */
+static
+size_t demux_scan(module_stream_t *stream, const uint8_t *ts
+                  , size_t pos, size_t count)
+{
+    const unsigned int gen = stream->demux_gen;
+
+    for (size_t i = pos; i < count; i++)
+    {
+        const uint8_t *const pkt = &ts[i * TS_PACKET_SIZE];
+        const module_stream_set_t *const set = pids_get(stream, TS_GET_PID(pkt));
+
+        if (set == NULL)
+            continue;
+
+        const unsigned int subs = set->count;
+        for (unsigned int j = 0; j < subs; j++)
+        {
+            module_stream_t *const child = set->items[j];
+
+            if (child == NULL)
+                continue;
+            else if (child->run_batch != stream->batch_id)
+            {
+                child->run_batch = stream->batch_id;
+                child->run_count = 0;
+                child->run_done = 0;
+                set_insert(&stream->pending, child);
+            }
+            else if (i < child->run_done)
+            {
+                /* delivered before routing was restarted */
+                continue;
+            }
+            else if (child->run_count > 0
+                     && child->run_first + child->run_count != i)
+            {
+                /* not contiguous; flush whatever is queued */
+                const size_t end = run_deliver(child, ts, i);
+                if (stream->demux_gen != gen)
+                    return demux_restart(stream, ts, end);
+            }
+
+            if (child->run_count++ == 0)
+                child->run_first = i;
+        }
+    }
+
+    return count;
+}
+
+/* deliver queued runs; returns `count' unless routing has to resume */
 static
-void stream_detach(module_stream_t *stream, module_stream_t *child)
+size_t demux_flush(module_stream_t *stream, const uint8_t *ts
+                   , size_t count, mpegts_block_t *block)
 {
-    asc_list_remove_item(stream->children, child);
-    child->parent = NULL;
+    unsigned int gen = stream->demux_gen;
+
+    for (unsigned int i = 0; i < stream->pending.count; i++)
+    {
+        module_stream_t *const child = stream->pending.items[i];
+
+        if (child == NULL || child->run_count == 0)
+            continue;
+
+        size_t end = count;
+
+        /* every packet in the block is wanted; pass it on whole */
+        if (block != NULL && child->on_ts_block != NULL
+            && child->run_first == 0 && child->run_count == count)
+        {
+            child->run_count = 0;
+            child->run_done = count;
+            stream_deliver_block(child, block);
+        }
+        else
+        {
+            end = run_deliver(child, ts, count);
+        }
+
+        if (stream->demux_gen != gen)
+        {
+            if (end < count)
+                return demux_restart(stream, ts, end);
+
+            gen = stream->demux_gen;
+        }
+    }
+
+    return count;
 }
 
-void __module_stream_attach(module_stream_t *stream, module_stream_t *child)
+static
+void send_demux_batch(module_stream_t *stream, const uint8_t *ts
+                      , size_t count, mpegts_block_t *block)
 {
-    if (child->parent != NULL)
-        stream_detach(child->parent, child);
+    stream->pending.count = 0;
 
-    child->parent = stream;
-    asc_list_insert_tail(stream->children, child);
+    /* zero is left for children that are not queued anywhere */
+    if (++stream->batch_id == 0)
+        stream->batch_id = 1;
+
+    size_t pos = 0;
+    while (pos < count)
+    {
+        pos = demux_scan(stream, ts, pos, count);
+        if (pos == count)
+            pos = demux_flush(stream, ts, count, block);
+    }
+
+    stream->pending.count = 0;
 }
 
-void __module_stream_send(void *arg, const uint8_t *ts)
+static
+void stream_send(module_stream_t *stream, const uint8_t *ts, size_t count
+                 , mpegts_block_t *block)
 {
-    module_stream_t *const stream = (module_stream_t *)arg;
+    if (count == 0)
+        return;
 
-    asc_list_for(stream->children)
+    stat_send(stream, count);
+    stream->sending++;
+
+    const unsigned int all = stream->all.count;
+    for (unsigned int i = 0; i < all; i++)
     {
-        module_stream_t *const i =
-            (module_stream_t *)asc_list_data(stream->children);
+        module_stream_t *const child = stream->all.items[i];
+
+        if (child == NULL)
+            continue;
+        else if (block != NULL && child->on_ts_block != NULL)
+            stream_deliver_block(child, block);
+        else
+            stream_deliver(child, ts, count);
+    }
+
+    if (stream->pids != NULL)
+        send_demux_batch(stream, ts, count, block);
+
+    if (--stream->sending == 0 && stream->dirty)
+        stream_cleanup(stream);
+}
+
+void __module_stream_send_batch(void *arg, const uint8_t *ts, size_t count)
+{
+    stream_send((module_stream_t *)arg, ts, count, NULL);
+}
+
+void __module_stream_send_block(void *arg, mpegts_block_t *block)
+{
+    stream_send((module_stream_t *)arg, block->data, block->count, block);
+}
+
+/*
+ * cross-loop links
+ *
+ * When upstream and downstream modules run on different loops, the
+ * downstream module is attached to a link instead. Link's `in' stream
+ * is attached to the upstream module on its loop and pushes packets
+ * into a thread buffer; a job on downstream's loop drains it into
+ * link's `out' stream. PID joins travel the other way.
+ *
+ * Links are created and destroyed by the main thread.
+ *
+ * Packets cross the link as block references: blocks sent by upstream
+ * are retained as is, plain packets are first packed into blocks from
+ * the link's own pool. Downstream reads them in place.
+ */
+
+typedef struct
+{
+    mpegts_block_t *block;
+    uint32_t offset;
+    uint32_t count;
+} link_item_t;
+
+static const char link_type[] = "link";
+
+struct module_stream_link_t
+{
+    module_stream_t in;
+    module_stream_t out;
+
+    asc_thread_buffer_t *queue;
+    unsigned int queued;
+    uint64_t dropped;
+
+    /* upstream side: block being filled with packets */
+    mpegts_block_pool_t *pool;
+    mpegts_block_t *fill;
+
+    volatile int is_queued;
+    bool is_busy;
+    bool is_dead;
+
+    /* PIDs requested by downstream */
+    asc_mutex_t mutex;
+    uint8_t want[MAX_PID];
+    volatile int is_syncing;
+};
+
+/* tear down downstream side of the link and free it */
+static
+void link_free(module_stream_link_t *link)
+{
+    module_stream_t *const out = &link->out;
+
+    asc_loop_t *const prev = asc_loop_enter(out->loop);
+    asc_job_prune(link);
+    asc_wake_close();
+    __module_stream_destroy(out);
+    asc_loop_leave(out->loop, prev);
+
+    if (link->dropped > 0)
+    {
+        asc_log_error(MSG("link to loop %u dropped %" PRIu64 " packets")
+                      , asc_loop_id(out->loop), link->dropped);
+    }
+
+    /* upstream is detached by now, nothing else touches the queue */
+    link_item_t item;
+    while (asc_thread_buffer_read(link->queue, &item, sizeof(item)) > 0)
+        mpegts_block_release(item.block);
+
+    ASC_FREE(link->queue, asc_thread_buffer_destroy);
+    ASC_FREE(link->pool, mpegts_block_pool_destroy);
+    asc_mutex_destroy(&link->mutex);
+
+    free(link);
+}
+
+/* downstream loop: pass queued packets on */
+static
+void on_link_data(void *arg)
+{
+    module_stream_link_t *const link = (module_stream_link_t *)arg;
+    link_item_t items[LINK_BATCH_SIZE];
+
+    __sync_lock_release(&link->is_queued);
+
+    link->is_busy = true;
+    while (!link->is_dead)
+    {
+        const ssize_t ret =
+            asc_thread_buffer_read(link->queue, items, sizeof(items));
+
+        if (ret <= 0)
+            break;
+
+        const size_t count = ret / sizeof(*items);
+        for (size_t i = 0; i < count; i++)
+        {
+            link_item_t *const item = &items[i];
+
+            if (!link->is_dead)
+            {
+                __module_stream_send_batch(&link->out
+                                           , MPEGTS_BLOCK_TS(item->block
+                                                             , item->offset)
+                                           , item->count);
+            }
+
+            __atomic_sub_fetch(&link->queued, item->count, __ATOMIC_RELAXED);
+            mpegts_block_release(item->block);
+        }
+    }
+    link->is_busy = false;
+
+    /* downstream was removed by one of the callbacks above */
+    if (link->is_dead)
+        link_free(link);
+}
+
+static
+void link_overflow(module_stream_link_t *link, size_t count)
+{
+    if (link->dropped == 0)
+    {
+        asc_log_error(MSG("link to loop %u overflowed, dropping packets")
+                      , asc_loop_id(link->out.loop));
+    }
+
+    link->dropped += count;
+    link->in.stat.dropped += count;
+}
+
+/* upstream loop: hand a reference to `count' packets over to downstream */
+static
+void link_push(module_stream_link_t *link, mpegts_block_t *block
+               , size_t offset, size_t count)
+{
+    const link_item_t item = {
+        .block = block,
+        .offset = offset,
+        .count = count,
+    };
+
+    mpegts_block_retain(block);
+    __atomic_add_fetch(&link->queued, count, __ATOMIC_RELAXED);
+
+    if (asc_thread_buffer_write(link->queue, &item, sizeof(item)) < 0)
+    {
+        __atomic_sub_fetch(&link->queued, count, __ATOMIC_RELAXED);
+        mpegts_block_release(block);
+
+        link_overflow(link, count);
+    }
+}
+
+static
+void link_schedule(module_stream_link_t *link)
+{
+    if (!__sync_lock_test_and_set(&link->is_queued, 1))
+        asc_loop_job_queue(link->out.loop, link, on_link_data, link);
+}
+
+static
+bool link_has_room(module_stream_link_t *link, size_t count)
+{
+    const unsigned int queued =
+        __atomic_load_n(&link->queued, __ATOMIC_RELAXED);
+
+    if (queued + count > LINK_BUFFER_SIZE)
+    {
+        link_overflow(link, count);
+        return false;
+    }
+
+    return true;
+}
+
+/* upstream loop: pack packets into blocks for downstream */
+static
+void on_link_ts(module_data_t *arg, const uint8_t *ts, size_t count)
+{
+    module_stream_link_t *const link = (module_stream_link_t *)arg;
+
+    if (!link_has_room(link, count))
+        return;
+
+    while (count > 0)
+    {
+        if (link->fill == NULL || MPEGTS_BLOCK_SPACE(link->fill) == 0)
+        {
+            if (link->fill != NULL)
+                mpegts_block_release(link->fill);
+
+            link->fill = mpegts_block_alloc(link->pool);
+        }
+
+        /* downstream only reads ranges it was given; keep appending */
+        const size_t offset = link->fill->count;
+        const size_t added = mpegts_block_append(link->fill, ts, count);
+
+        link_push(link, link->fill, offset, added);
+
+        ts += added * TS_PACKET_SIZE;
+        count -= added;
+    }
+
+    link_schedule(link);
+}
+
+/* upstream loop: pass a reference to upstream's block */
+static
+void on_link_block(module_data_t *arg, mpegts_block_t *block)
+{
+    module_stream_link_t *const link = (module_stream_link_t *)arg;
+
+    if (block->count == 0 || !link_has_room(link, block->count))
+        return;
+
+    link_push(link, block, 0, block->count);
+    link_schedule(link);
+}
+
+/* upstream loop: apply downstream's PID subscriptions */
+static
+void link_sync(module_stream_link_t *link)
+{
+    module_stream_t *const in = &link->in;
+    module_stream_t *const parent = in->parent;
+    uint8_t want[MAX_PID];
+
+    asc_mutex_lock(&link->mutex);
+    memcpy(want, link->want, sizeof(want));
+    asc_mutex_unlock(&link->mutex);
+
+    if (in->pid_list == NULL)
+        __module_stream_demux_init(in);
+
+    for (unsigned int i = 0; i < MAX_PID; i++)
+    {
+        if (want[i] == in->pid_list[i])
+            continue;
+
+        in->pid_list[i] = want[i];
+        if (parent == NULL)
+            continue;
+
+        if (want[i])
+        {
+            __module_stream_subscribe(in, i);
+            if (parent->join_pid != NULL)
+                parent->join_pid(parent->self, i);
+        }
+        else
+        {
+            __module_stream_unsubscribe(in, i);
+            if (parent->leave_pid != NULL)
+                parent->leave_pid(parent->self, i);
+        }
+    }
+}
+
+static
+void on_link_sync(void *arg)
+{
+    module_stream_link_t *const link = (module_stream_link_t *)arg;
+
+    __sync_lock_release(&link->is_syncing);
+    link_sync(link);
+}
+
+/* downstream loop: record PID request, let upstream loop act on it */
+static
+void link_request(module_stream_link_t *link, uint16_t pid, bool join)
+{
+    asc_mutex_lock(&link->mutex);
+    link->want[pid] = join;
+    asc_mutex_unlock(&link->mutex);
+
+    if (!__sync_lock_test_and_set(&link->is_syncing, 1))
+        asc_loop_job_queue(link->in.loop, link, on_link_sync, link);
+}
+
+static
+void on_link_join(void *arg, uint16_t pid)
+{
+    link_request((module_stream_link_t *)arg, pid, true);
+}
+
+static
+void on_link_leave(void *arg, uint16_t pid)
+{
+    link_request((module_stream_link_t *)arg, pid, false);
+}
+
+static
+module_stream_t *link_create(module_stream_t *upstream
+                             , module_stream_t *child)
+{
+    module_stream_link_t *const link = ASC_ALLOC(1, module_stream_link_t);
+    asc_loop_t *prev;
+
+    /* enough references for one packet each */
+    link->queue =
+        asc_thread_buffer_init(LINK_BUFFER_SIZE * sizeof(link_item_t));
+    link->pool = mpegts_block_pool_init(MPEGTS_BLOCK_PACKETS
+                                        , LINK_POOL_CACHE);
+    asc_mutex_init(&link->mutex);
+
+    if (child->pid_list != NULL)
+    {
+        for (unsigned int i = 0; i < MAX_PID; i++)
+            link->want[i] = (child->pid_list[i] > 0);
+    }
+
+    /* downstream side */
+    module_stream_t *const out = &link->out;
+
+    prev = asc_loop_enter(child->loop);
+    out->self = (module_data_t *)link;
+    out->type = link_type;
+    out->join_pid = on_link_join;
+    out->leave_pid = on_link_leave;
+    __module_stream_init(out);
+    asc_wake_open();
+    asc_loop_leave(child->loop, prev);
+
+    /* upstream side */
+    module_stream_t *const in = &link->in;
+
+    prev = asc_loop_enter(upstream->loop);
+    in->self = (module_data_t *)link;
+    in->type = link_type;
+    in->on_ts_batch = on_link_ts;
+    in->on_ts_block = on_link_block;
+    __module_stream_init(in);
+    if (child->pid_list != NULL)
+        __module_stream_demux_init(in);
+
+    __module_stream_attach(upstream, in);
+    if (child->pid_list != NULL)
+        link_sync(link);
+    asc_loop_leave(upstream->loop, prev);
+
+    asc_log_debug(MSG("linked loop %u to loop %u")
+                  , asc_loop_id(in->loop), asc_loop_id(out->loop));
+
+    child->link = link;
+    return out;
+}
 
-        if (i->on_ts != NULL)
-            i->on_ts(i->self, ts);
+static
+void link_destroy(module_stream_link_t *link)
+{
+    module_stream_t *const in = &link->in;
+
+    /* detach from upstream, dropping its PID subscriptions */
+    asc_loop_t *const prev = asc_loop_enter(in->loop);
+    if (in->pid_list != NULL)
+    {
+        memset(link->want, 0, sizeof(link->want));
+        link_sync(link);
+        ASC_FREE(in->pid_list, free);
     }
+    __module_stream_destroy(in);
+    asc_job_prune(link);
+    ASC_FREE(link->fill, mpegts_block_release);
+    asc_loop_leave(in->loop, prev);
+
+    /* let on_link_data() finish if we got here from its callbacks */
+    if (link->is_busy)
+        link->is_dead = true;
+    else
+        link_free(link);
 }
 
+/*
+ * init and cleanup
+ */
+
 void __module_stream_init(module_stream_t *stream)
 {
     stream->children = asc_list_init();
+    stream->loop = asc_loop_current();
+
+    graph_insert(stream);
 }
 
 void __module_stream_destroy(module_stream_t *stream)
@@ -67,7 +1344,193 @@ void __module_stream_destroy(module_stream_t *stream)
             (module_stream_t *)asc_list_data(stream->children);
 
         i->parent = NULL;
+        i->run_batch = 0;
+        i->run_count = 0;
     }
 
     ASC_FREE(stream->children, asc_list_destroy);
+    graph_remove(stream);
+
+    /* no need to leave PIDs on a stream that's going away */
+    while (stream->psi_cache != NULL)
+    {
+        module_stream_psi_t *const cache = stream->psi_cache;
+        stream->psi_cache = cache->next;
+
+        cache->is_dead = true;
+        if (cache->stream.sending == 0)
+            psi_free(cache);
+    }
+
+    ASC_FREE(stream->psi_subs, free);
+    stream->psi_sub_count = 0;
+
+    set_destroy(&stream->all);
+    set_destroy(&stream->pending);
+
+    if (stream->pids != NULL)
+    {
+        for (unsigned int i = 0; i < MAX_PID; i++)
+        {
+            module_stream_set_t *const set = pids_get(stream, i);
+            if (set != NULL)
+                pids_free(stream, i, set);
+        }
+
+        ASC_FREE(stream->pids, free);
+    }
+}
+
+/*
+ * Lua interface to counters
+ */
+
+#define STAT_FIELD(_name, _value) \
+    do { \
+        const lua_Number __value = (_value); \
+        lua_pushnumber(L, __value); \
+        lua_setfield(L, -2, _name); \
+    } while (0)
+
+/* copy counters that may be updated from another loop meanwhile */
+static
+void stat_load(const module_stream_stat_t *st, module_stream_stat_t *out)
+{
+    out->packets_in = __atomic_load_n(&st->packets_in, __ATOMIC_RELAXED);
+    out->packets_out = __atomic_load_n(&st->packets_out, __ATOMIC_RELAXED);
+    out->dropped = __atomic_load_n(&st->dropped, __ATOMIC_RELAXED);
+    out->calls = __atomic_load_n(&st->calls, __ATOMIC_RELAXED);
+    out->cpu_ns = __atomic_load_n(&st->cpu_ns, __ATOMIC_RELAXED);
+}
+
+static
+void stat_push(lua_State *L, const module_stream_stat_t *st)
+{
+    lua_newtable(L);
+
+    STAT_FIELD("packets_in", st->packets_in);
+    STAT_FIELD("packets_out", st->packets_out);
+    STAT_FIELD("bytes_in", st->packets_in * TS_PACKET_SIZE);
+    STAT_FIELD("bytes_out", st->packets_out * TS_PACKET_SIZE);
+    STAT_FIELD("dropped", st->dropped);
+    STAT_FIELD("calls", st->calls);
+    STAT_FIELD("cpu_ns", st->cpu_ns);
+}
+
+/* push a table with stream's counters */
+void module_stream_stat_push(lua_State *L, const module_stream_t *stream)
+{
+    module_stream_stat_t st;
+    stat_load(&stream->stat, &st);
+    stat_push(L, &st);
+}
+
+static
+unsigned int graph_parent(const module_stream_t *stream)
+{
+    if (stream->parent != NULL)
+        return stream->parent->id;
+
+    /* downstream side of a link comes from its upstream side */
+    if (stream->type == link_type)
+    {
+        const module_stream_link_t *const link =
+            (const module_stream_link_t *)stream->self;
+
+        if (stream == &link->out)
+            return link->in.id;
+    }
+
+    return 0;
+}
+
+/* stream as seen by module_stream_graph() */
+typedef struct
+{
+    module_stream_stat_t stat;
+
+    unsigned int id;
+    unsigned int parent;
+    unsigned int loop;
+
+    const char *type;
+    char name[sizeof(((module_stream_t *)NULL)->name)];
+} graph_entry_t;
+
+/*
+ * Copy every stream out while holding the lock, so that no Lua
+ * allocations happen under it. Returns the number of entries.
+ */
+static
+size_t graph_snapshot(graph_entry_t **out)
+{
+    graph_entry_t *list = NULL;
+    size_t size = 0;
+
+    graph_lock();
+
+    /* don't allocate under the lock either; retry if the list grew */
+    while (size < graph.count)
+    {
+        size = graph.count;
+        graph_unlock();
+
+        free(list);
+        list = ASC_ALLOC(size, graph_entry_t);
+
+        graph_lock();
+    }
+
+    size_t count = 0;
+    for (const module_stream_t *stream = graph.head
+         ; stream != NULL
+         ; stream = stream->graph_next)
+    {
+        graph_entry_t *const entry = &list[count++];
+
+        stat_load(&stream->stat, &entry->stat);
+        entry->id = stream->id;
+        entry->parent = graph_parent(stream);
+        entry->loop = asc_loop_id(stream->loop);
+        entry->type = stream->type;
+        memcpy(entry->name, stream->name, sizeof(entry->name));
+    }
+
+    graph_unlock();
+
+    *out = list;
+    return count;
+}
+
+/* push an array of every stream with its counters and topology */
+void module_stream_graph(lua_State *L)
+{
+    graph_entry_t *list;
+    const size_t count = graph_snapshot(&list);
+
+    lua_newtable(L);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const graph_entry_t *const entry = &list[i];
+
+        stat_push(L, &entry->stat);
+
+        STAT_FIELD("id", entry->id);
+        STAT_FIELD("parent", entry->parent);
+        STAT_FIELD("loop", entry->loop);
+
+        lua_pushstring(L, (entry->type != NULL) ? entry->type : "stream");
+        lua_setfield(L, -2, "type");
+
+        if (entry->name[0] != '\0')
+        {
+            lua_pushstring(L, entry->name);
+            lua_setfield(L, -2, "name");
+        }
+
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    free(list);
 }
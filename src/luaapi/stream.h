@@ -27,23 +27,103 @@
 
 #include <core/list.h>
 #include <luaapi/luaapi.h>
+#include <mpegts/block.h>
+#include <mpegts/pidmap.h>
+#include <mpegts/psi.h>
 
 typedef struct module_stream_t module_stream_t;
+typedef struct module_stream_link_t module_stream_link_t;
+typedef struct module_stream_psi_t module_stream_psi_t;
 
 typedef void (*stream_callback_t)(module_data_t *, const uint8_t *);
+typedef void (*stream_batch_callback_t)(module_data_t *, const uint8_t *
+                                        , size_t);
+typedef void (*stream_block_callback_t)(module_data_t *, mpegts_block_t *);
+typedef void (*stream_psi_callback_t)(module_data_t *, const mpegts_psi_t *);
 typedef void (*demux_callback_t)(void *, uint16_t);
 
+typedef struct
+{
+    module_stream_t **items;
+    unsigned int count;
+    unsigned int size;
+} module_stream_set_t;
+
+typedef struct
+{
+    uint16_t pid;
+    bool is_raw;
+    stream_psi_callback_t callback;
+} module_stream_psi_sub_t;
+
+typedef struct
+{
+    /* packets received from parent and sent to children */
+    uint64_t packets_in;
+    uint64_t packets_out;
+    /* packets lost inside the module, e.g. on a full socket */
+    uint64_t dropped;
+
+    /* callbacks invoked, estimated time spent in them minus children */
+    uint64_t calls;
+    uint64_t cpu_ns;
+} module_stream_stat_t;
+
 struct module_stream_t
 {
     module_data_t *self;
     module_stream_t *parent;
 
     stream_callback_t on_ts;
+    stream_batch_callback_t on_ts_batch;
+    stream_block_callback_t on_ts_block;
     asc_list_t *children;
 
     demux_callback_t join_pid;
     demux_callback_t leave_pid;
     uint8_t *pid_list;
+
+    /*
+     * dispatch tables: children without a pid_list get every packet,
+     * demux children only get PIDs they have joined.
+     */
+    module_stream_set_t all;
+    mpegts_pidmap_t *pids; /* module_stream_set_t per joined PID */
+    module_stream_set_t pending;
+    unsigned int sending;
+    bool dirty;
+
+    /* bumped whenever demux children join or leave a PID */
+    unsigned int demux_gen;
+    unsigned int batch_id;
+
+    /* packets queued by parent while splitting a batch; indices are
+     * only valid while run_batch matches parent's batch_id */
+    unsigned int run_batch;
+    size_t run_first;
+    size_t run_count;
+    size_t run_done;
+
+    /* loop this stream runs on; parent may be a link to another loop */
+    asc_loop_t *loop;
+    module_stream_link_t *link;
+
+    /* section assemblers shared by children, one per PID */
+    module_stream_psi_t *psi_cache;
+
+    /* tables this stream receives from its parent's assemblers */
+    module_stream_psi_sub_t *psi_subs;
+    unsigned int psi_sub_count;
+
+    /* counters, updated while module_stream_stat_enable() is on */
+    module_stream_stat_t stat;
+
+    /* node in the list of all streams, see module_stream_graph() */
+    unsigned int id;
+    const char *type;
+    char name[32];
+    module_stream_t *graph_prev;
+    module_stream_t *graph_next;
 };
 
 /*
@@ -54,12 +134,24 @@ void __module_stream_init(module_stream_t *stream);
 void __module_stream_destroy(module_stream_t *stream);
 void __module_stream_attach(module_stream_t *stream, module_stream_t *child);
 
+void __module_stream_demux_init(module_stream_t *stream);
+void __module_stream_subscribe(module_stream_t *stream, uint16_t pid);
+void __module_stream_unsubscribe(module_stream_t *stream, uint16_t pid);
+
 #define module_stream_init(_mod, _on_ts) \
     do { \
         _mod->__stream.self = _mod; \
         _mod->__stream.on_ts = _on_ts; \
-        __module_stream_init(&_mod->__stream); \
+        _mod->__stream.type = _mod->__name; \
         lua_State *const _lua = _mod->__lua; \
+        lua_getfield(_lua, MODULE_OPTIONS_IDX, "name"); \
+        if(lua_type(_lua, -1) == LUA_TSTRING) \
+        { \
+            snprintf(_mod->__stream.name, sizeof(_mod->__stream.name) \
+                     , "%s", lua_tostring(_lua, -1)); \
+        } \
+        lua_pop(_lua, 1); \
+        __module_stream_init(&_mod->__stream); \
         lua_getfield(_lua, MODULE_OPTIONS_IDX, "upstream"); \
         if(lua_type(_lua, -1) == LUA_TLIGHTUSERDATA) \
         { \
@@ -70,6 +162,20 @@ void __module_stream_attach(module_stream_t *stream, module_stream_t *child);
         lua_pop(_lua, 1); \
     } while (0)
 
+#define module_stream_set_batch(_mod, _on_ts_batch) \
+    do { \
+        _mod->__stream.on_ts_batch = _on_ts_batch; \
+    } while (0)
+
+/*
+ * receive whole blocks; the callback may retain the block instead of
+ * copying packets it needs to keep
+ */
+#define module_stream_set_block(_mod, _on_ts_block) \
+    do { \
+        _mod->__stream.on_ts_block = _on_ts_block; \
+    } while (0)
+
 #define module_stream_destroy(_mod) \
     do { \
         if(_mod->__stream.self != NULL) \
@@ -95,10 +201,27 @@ void __module_stream_attach(module_stream_t *stream, module_stream_t *child);
  */
 
 void __module_stream_send(void *arg, const uint8_t *ts);
+void __module_stream_send_batch(void *arg, const uint8_t *ts, size_t count);
+void __module_stream_send_block(void *arg, mpegts_block_t *block);
 
 #define module_stream_send(_mod, _ts) \
     __module_stream_send(&_mod->__stream, _ts)
 
+/*
+ * send `count' contiguous packets at once; children without
+ * on_ts_batch get them one by one through their on_ts callback
+ */
+#define module_stream_send_batch(_mod, _ts, _count) \
+    __module_stream_send_batch(&_mod->__stream, _ts, _count)
+
+/*
+ * send packets stored in a block; children with on_ts_block get the
+ * block itself, the rest get its packets as a batch. the caller keeps
+ * its reference.
+ */
+#define module_stream_send_block(_mod, _block) \
+    __module_stream_send_block(&_mod->__stream, _block)
+
 /*
  * join/leave PID on upstream module instance
  */
@@ -106,10 +229,7 @@ void __module_stream_send(void *arg, const uint8_t *ts);
 #define module_stream_demux_set(_mod, _join_pid, _leave_pid) \
     do { \
         if(_mod->__stream.pid_list == NULL) \
-        { \
-            uint8_t *const _lst = ASC_ALLOC(MAX_PID, uint8_t); \
-            _mod->__stream.pid_list = _lst; \
-        } \
+            __module_stream_demux_init(&_mod->__stream); \
         _mod->__stream.join_pid = _join_pid; \
         _mod->__stream.leave_pid = _leave_pid; \
     } while (0)
@@ -125,11 +245,14 @@ void __module_stream_send(void *arg, const uint8_t *ts);
                    , __FILE__, __LINE__); \
         ++_mod->__stream.pid_list[___pid]; \
         if(_mod->__stream.pid_list[___pid] == 1 \
-           && _mod->__stream.parent != NULL \
-           && _mod->__stream.parent->join_pid != NULL) \
+           && _mod->__stream.parent != NULL) \
         { \
-            _mod->__stream.parent->join_pid(_mod->__stream.parent->self \
-                                            , ___pid); \
+            __module_stream_subscribe(&_mod->__stream, ___pid); \
+            if(_mod->__stream.parent->join_pid != NULL) \
+            { \
+                _mod->__stream.parent->join_pid( \
+                    _mod->__stream.parent->self, ___pid); \
+            } \
         } \
     } while (0)
 
@@ -143,11 +266,14 @@ void __module_stream_send(void *arg, const uint8_t *ts);
         { \
             --_mod->__stream.pid_list[___pid]; \
             if(_mod->__stream.pid_list[___pid] == 0 \
-               && _mod->__stream.parent != NULL \
-               && _mod->__stream.parent->leave_pid != NULL) \
+               && _mod->__stream.parent != NULL) \
             { \
-                _mod->__stream.parent->leave_pid(_mod->__stream.parent->self \
-                                                 , ___pid); \
+                __module_stream_unsubscribe(&_mod->__stream, ___pid); \
+                if(_mod->__stream.parent->leave_pid != NULL) \
+                { \
+                    _mod->__stream.parent->leave_pid( \
+                        _mod->__stream.parent->self, ___pid); \
+                } \
             } \
         } \
         else \
@@ -157,6 +283,49 @@ void __module_stream_send(void *arg, const uint8_t *ts);
         } \
     } while (0)
 
+/*
+ * receive PSI sections through the upstream's shared assembler
+ * instead of joining the PID. sections are reassembled and checked
+ * once per upstream no matter how many children want them; the
+ * callback gets each section with a valid CRC, psi->crc32 set to it.
+ * the section is read-only and only valid during the callback.
+ *
+ * with module_stream_psi_join_raw() the callback also gets sections
+ * that failed the check, for modules that report errors. psi->crc32
+ * is then the calculated CRC, which differs from PSI_GET_CRC32(psi).
+ */
+
+void __module_stream_psi_join(module_stream_t *stream, uint16_t pid
+                              , stream_psi_callback_t callback);
+void __module_stream_psi_join_raw(module_stream_t *stream, uint16_t pid
+                                  , stream_psi_callback_t callback);
+void __module_stream_psi_leave(module_stream_t *stream, uint16_t pid);
+
+#define module_stream_psi_join(_mod, _pid, _callback) \
+    __module_stream_psi_join(&_mod->__stream, _pid, _callback)
+
+#define module_stream_psi_join_raw(_mod, _pid, _callback) \
+    __module_stream_psi_join_raw(&_mod->__stream, _pid, _callback)
+
+#define module_stream_psi_leave(_mod, _pid) \
+    __module_stream_psi_leave(&_mod->__stream, _pid)
+
+/*
+ * per-stream counters. packet counts are exact, callback time is
+ * sampled on one call in every 64 and scaled up. module_stream_graph()
+ * pushes a list of every stream in the process with its counters and
+ * the id of its parent; streams crossing loops show up as `link'.
+ */
+
+void module_stream_stat_enable(bool enable);
+void module_stream_stat_push(lua_State *L, const module_stream_t *stream);
+void module_stream_graph(lua_State *L);
+
+#define module_stream_stat_drop(_mod, _count) \
+    do { \
+        _mod->__stream.stat.dropped += (_count); \
+    } while (0)
+
 /*
  * basic Lua methods required for every streaming module
  */
@@ -169,9 +338,15 @@ void __module_stream_send(void *arg, const uint8_t *ts);
     { \
         lua_pushlightuserdata(L, &mod->__stream); \
         return 1; \
+    } \
+    static int method_stream_stat(lua_State *L, module_data_t *mod) \
+    { \
+        module_stream_stat_push(L, &mod->__stream); \
+        return 1; \
     }
 
 #define MODULE_STREAM_METHODS_REF() \
-    { "stream", method_stream }
+    { "stream", method_stream }, \
+    { "stat", method_stream_stat }
 
 #endif /* _LUA_STREAM_H_ */
@@ -0,0 +1,239 @@
+/*
+ * Astra Module: MPEG-TS (Packet blocks)
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <astra.h>
+#include <core/mutex.h>
+#include <mpegts/block.h>
+
+#define MSG(_msg) "[mpegts/block] " _msg
+
+/* keep packet data on its own cache line */
+#define BLOCK_HEADER_SIZE \
+    ((sizeof(mpegts_block_t) + 63) & ~((size_t)63))
+
+struct mpegts_block_pool_t
+{
+    size_t packets;
+    size_t cache;
+
+    asc_mutex_t mutex;
+    mpegts_block_t *free;
+    size_t free_count;
+
+    unsigned int used;
+    bool is_dead;
+
+    uint64_t allocs;
+    uint64_t misses;
+    uint64_t copied;
+};
+
+/* process-wide totals */
+static uint64_t total_allocs = 0;
+static uint64_t total_misses = 0;
+static uint64_t total_copied = 0;
+
+static
+void pool_free(mpegts_block_pool_t *pool)
+{
+    while (pool->free != NULL)
+    {
+        mpegts_block_t *const block = pool->free;
+        pool->free = (mpegts_block_t *)block->next;
+
+        free(block);
+    }
+
+    pool->free_count = 0;
+}
+
+/* create pool of `packets'-sized blocks, keeping up to `cache' spares */
+mpegts_block_pool_t *mpegts_block_pool_init(size_t packets, size_t cache)
+{
+    asc_assert(packets > 0, MSG("block size can't be zero"));
+
+    mpegts_block_pool_t *const pool = ASC_ALLOC(1, mpegts_block_pool_t);
+
+    pool->packets = packets;
+    pool->cache = cache;
+    asc_mutex_init(&pool->mutex);
+
+    return pool;
+}
+
+/* blocks still in use keep the pool alive until they're released */
+void mpegts_block_pool_destroy(mpegts_block_pool_t *pool)
+{
+    asc_mutex_lock(&pool->mutex);
+    pool->is_dead = true;
+    pool_free(pool);
+
+    const bool is_idle = (pool->used == 0);
+    asc_mutex_unlock(&pool->mutex);
+
+    if (is_idle)
+    {
+        asc_mutex_destroy(&pool->mutex);
+        free(pool);
+    }
+}
+
+/* get pool counters, or totals for all pools if `pool' is NULL */
+void mpegts_block_pool_stats(mpegts_block_pool_t *pool
+                             , mpegts_block_stats_t *stats)
+{
+    if (pool == NULL)
+    {
+        stats->allocs = __atomic_load_n(&total_allocs, __ATOMIC_RELAXED);
+        stats->misses = __atomic_load_n(&total_misses, __ATOMIC_RELAXED);
+        stats->copied = __atomic_load_n(&total_copied, __ATOMIC_RELAXED);
+        stats->used = 0;
+
+        return;
+    }
+
+    asc_mutex_lock(&pool->mutex);
+    stats->allocs = pool->allocs;
+    stats->misses = pool->misses;
+    stats->used = pool->used;
+    asc_mutex_unlock(&pool->mutex);
+
+    stats->copied = __atomic_load_n(&pool->copied, __ATOMIC_RELAXED);
+}
+
+/* get an empty block holding one reference */
+mpegts_block_t *mpegts_block_alloc(mpegts_block_pool_t *pool)
+{
+    asc_mutex_lock(&pool->mutex);
+    asc_assert(!pool->is_dead, MSG("allocating from a destroyed pool"));
+
+    mpegts_block_t *block = pool->free;
+    if (block != NULL)
+    {
+        pool->free = (mpegts_block_t *)block->next;
+        pool->free_count--;
+    }
+    else
+    {
+        pool->misses++;
+    }
+
+    pool->allocs++;
+    pool->used++;
+    asc_mutex_unlock(&pool->mutex);
+
+    __atomic_add_fetch(&total_allocs, 1, __ATOMIC_RELAXED);
+
+    if (block == NULL)
+    {
+        __atomic_add_fetch(&total_misses, 1, __ATOMIC_RELAXED);
+
+        const size_t size = pool->packets * TS_PACKET_SIZE;
+        uint8_t *const ptr = ASC_ALLOC(BLOCK_HEADER_SIZE + size, uint8_t);
+
+        block = (mpegts_block_t *)ptr;
+        block->data = &ptr[BLOCK_HEADER_SIZE];
+        block->size = pool->packets;
+        block->pool = pool;
+    }
+
+    block->count = 0;
+    block->next = NULL;
+    block->refcnt = 1;
+
+    return block;
+}
+
+void mpegts_block_retain(mpegts_block_t *block)
+{
+    __atomic_add_fetch(&block->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/* drop a reference; last one returns the block to its pool */
+void mpegts_block_release(mpegts_block_t *block)
+{
+    if (__atomic_sub_fetch(&block->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    mpegts_block_pool_t *const pool = block->pool;
+    bool is_idle = false;
+
+    asc_mutex_lock(&pool->mutex);
+    pool->used--;
+
+    if (!pool->is_dead && pool->free_count < pool->cache)
+    {
+        block->next = pool->free;
+        pool->free = block;
+        pool->free_count++;
+        block = NULL;
+    }
+    else if (pool->is_dead && pool->used == 0)
+    {
+        is_idle = true;
+    }
+    asc_mutex_unlock(&pool->mutex);
+
+    free(block);
+
+    if (is_idle)
+    {
+        asc_mutex_destroy(&pool->mutex);
+        free(pool);
+    }
+}
+
+/* copy packets to the end of the block, return number of packets stored */
+size_t mpegts_block_append(mpegts_block_t *block, const uint8_t *ts
+                           , size_t count)
+{
+    const size_t space = MPEGTS_BLOCK_SPACE(block);
+    if (count > space)
+        count = space;
+
+    memcpy(MPEGTS_BLOCK_TS(block, block->count), ts, count * TS_PACKET_SIZE);
+    block->count += count;
+
+    __atomic_add_fetch(&block->pool->copied, count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&total_copied, count, __ATOMIC_RELAXED);
+
+    return count;
+}
+
+/*
+ * copy-on-write: return `block' itself if the caller holds the only
+ * reference, otherwise a private copy allocated from `pool'. Either
+ * way the caller's reference to `block' is consumed.
+ */
+mpegts_block_t *mpegts_block_writable(mpegts_block_t *block
+                                      , mpegts_block_pool_t *pool)
+{
+    if (__atomic_load_n(&block->refcnt, __ATOMIC_ACQUIRE) == 1)
+        return block;
+
+    mpegts_block_t *const copy = mpegts_block_alloc(pool);
+    asc_assert(copy->size >= block->count
+               , MSG("pool blocks are too small for a copy"));
+
+    mpegts_block_append(copy, block->data, block->count);
+    mpegts_block_release(block);
+
+    return copy;
+}
@@ -0,0 +1,86 @@
+/*
+ * Astra Module: MPEG-TS (Packet blocks)
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TS_BLOCK_
+#define _TS_BLOCK_ 1
+
+#ifndef _ASTRA_H_
+#   error "Please include <astra.h> first"
+#endif /* !_ASTRA_H_ */
+
+/*
+ * Reference-counted runs of TS packets. Blocks come from a pool and
+ * go back to it when the last reference is dropped, possibly on
+ * another thread. A module holding a block for later retains it
+ * instead of copying its packets.
+ */
+
+/* default block size, in packets */
+#define MPEGTS_BLOCK_PACKETS 64
+
+typedef struct mpegts_block_pool_t mpegts_block_pool_t;
+
+typedef struct
+{
+    /* packets, `size' slots of TS_PACKET_SIZE bytes */
+    uint8_t *data;
+    size_t size;
+    size_t count;
+
+    /* private */
+    mpegts_block_pool_t *pool;
+    unsigned int refcnt;
+    void *next;
+} mpegts_block_t;
+
+typedef struct
+{
+    /* blocks handed out, including reused ones */
+    uint64_t allocs;
+    /* blocks that had to be malloc()'d */
+    uint64_t misses;
+    /* packets copied into blocks */
+    uint64_t copied;
+    /* blocks currently referenced */
+    unsigned int used;
+} mpegts_block_stats_t;
+
+mpegts_block_pool_t *mpegts_block_pool_init(size_t packets
+                                            , size_t cache) __wur;
+void mpegts_block_pool_destroy(mpegts_block_pool_t *pool);
+void mpegts_block_pool_stats(mpegts_block_pool_t *pool
+                             , mpegts_block_stats_t *stats);
+
+mpegts_block_t *mpegts_block_alloc(mpegts_block_pool_t *pool) __wur;
+void mpegts_block_retain(mpegts_block_t *block);
+void mpegts_block_release(mpegts_block_t *block);
+
+size_t mpegts_block_append(mpegts_block_t *block, const uint8_t *ts
+                           , size_t count);
+mpegts_block_t *mpegts_block_writable(mpegts_block_t *block
+                                      , mpegts_block_pool_t *pool) __wur;
+
+#define MPEGTS_BLOCK_TS(_block, _idx) \
+    (&(_block)->data[(_idx) * TS_PACKET_SIZE])
+
+#define MPEGTS_BLOCK_SPACE(_block) \
+    ((_block)->size - (_block)->count)
+
+#endif /* _TS_BLOCK_ */
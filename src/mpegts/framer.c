@@ -0,0 +1,369 @@
+/*
+ * Astra Module: MPEG-TS (Packet framer)
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <astra.h>
+#include <mpegts/framer.h>
+
+#if defined(__AVX2__)
+#   include <immintrin.h>
+#elif defined(__SSE2__)
+#   include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#   include <arm_neon.h>
+#   define FRAMER_NEON 1
+#endif
+
+#define MSG(_msg) "[mpegts/framer] " _msg
+
+#define SYNC_BYTE 0x47
+
+/* bytes held while looking for sync */
+#define CARRY_SIZE (16 * RS_PACKET_SIZE)
+
+/* trimmed packets passed on per callback */
+#define STAGE_PACKETS 64
+
+/* candidate packet sizes, first match wins a tie */
+static const size_t packet_sizes[] =
+{
+    TS_PACKET_SIZE,
+    RS_PACKET_SIZE,
+    M2TS_PACKET_SIZE,
+};
+
+struct mpegts_framer_t
+{
+    framer_callback_t on_ts;
+    void *arg;
+
+    size_t packet_size;
+
+    uint8_t carry[CARRY_SIZE];
+    size_t carry_len;
+
+    uint8_t stage[STAGE_PACKETS * TS_PACKET_SIZE];
+
+    uint64_t packets;
+    uint64_t dropped;
+    uint64_t resyncs;
+};
+
+mpegts_framer_t *mpegts_framer_init(framer_callback_t on_ts, void *arg)
+{
+    mpegts_framer_t *const fr = ASC_ALLOC(1, mpegts_framer_t);
+
+    fr->on_ts = on_ts;
+    fr->arg = arg;
+
+    return fr;
+}
+
+void mpegts_framer_destroy(mpegts_framer_t *fr)
+{
+    free(fr);
+}
+
+void mpegts_framer_reset(mpegts_framer_t *fr)
+{
+    fr->packet_size = 0;
+    fr->carry_len = 0;
+}
+
+void mpegts_framer_query(const mpegts_framer_t *fr, mpegts_framer_stat_t *out)
+{
+    out->packet_size = fr->packet_size;
+    out->packets = fr->packets;
+    out->dropped = fr->dropped;
+    out->resyncs = fr->resyncs;
+}
+
+bool mpegts_framer_aligned(const mpegts_framer_t *fr)
+{
+    return (fr->packet_size == TS_PACKET_SIZE);
+}
+
+/* move partial packet to `dst', returns its size */
+size_t mpegts_framer_take(mpegts_framer_t *fr, uint8_t *dst)
+{
+    const size_t len = fr->carry_len;
+
+    memcpy(dst, fr->carry, len);
+    fr->carry_len = 0;
+
+    return len;
+}
+
+/*
+ * sync byte search
+ */
+
+size_t mpegts_framer_scan(const uint8_t *data, size_t size, size_t stride
+                          , unsigned int count)
+{
+    const size_t span = (count - 1) * stride;
+    if (count == 0 || size <= span)
+        return size;
+
+    /* candidate offsets, last byte checked stays inside the buffer */
+    const size_t limit = size - span;
+    size_t pos = 0;
+
+#if defined(__AVX2__)
+    const __m256i sync = _mm256_set1_epi8(SYNC_BYTE);
+
+    for (; pos + 32 <= limit; pos += 32)
+    {
+        const uint8_t *const ptr = &data[pos];
+        __m256i mask = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *)ptr), sync);
+
+        for (unsigned int i = 1; i < count; i++)
+        {
+            const __m256i next = _mm256_loadu_si256(
+                (const __m256i *)&ptr[i * stride]);
+            mask = _mm256_and_si256(mask, _mm256_cmpeq_epi8(next, sync));
+        }
+
+        const uint32_t bits = _mm256_movemask_epi8(mask);
+        if (bits != 0)
+            return pos + __builtin_ctz(bits);
+    }
+#elif defined(__SSE2__)
+    const __m128i sync = _mm_set1_epi8(SYNC_BYTE);
+
+    for (; pos + 16 <= limit; pos += 16)
+    {
+        const uint8_t *const ptr = &data[pos];
+        __m128i mask = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)ptr), sync);
+
+        for (unsigned int i = 1; i < count; i++)
+        {
+            const __m128i next = _mm_loadu_si128(
+                (const __m128i *)&ptr[i * stride]);
+            mask = _mm_and_si128(mask, _mm_cmpeq_epi8(next, sync));
+        }
+
+        const uint32_t bits = _mm_movemask_epi8(mask);
+        if (bits != 0)
+            return pos + __builtin_ctz(bits);
+    }
+#elif defined(FRAMER_NEON)
+    const uint8x16_t sync = vdupq_n_u8(SYNC_BYTE);
+
+    for (; pos + 16 <= limit; pos += 16)
+    {
+        const uint8_t *const ptr = &data[pos];
+        uint8x16_t mask = vceqq_u8(vld1q_u8(ptr), sync);
+
+        for (unsigned int i = 1; i < count; i++)
+            mask = vandq_u8(mask, vceqq_u8(vld1q_u8(&ptr[i * stride]), sync));
+
+        /* no movemask on NEON; find the lane in the scalar tail */
+        const uint64x2_t wide = vreinterpretq_u64_u8(mask);
+        if ((vgetq_lane_u64(wide, 0) | vgetq_lane_u64(wide, 1)) != 0)
+            break;
+    }
+#endif
+
+    for (; pos < limit; pos++)
+    {
+        unsigned int i = 0;
+        while (i < count && data[pos + i * stride] == SYNC_BYTE)
+            i++;
+
+        if (i == count)
+            return pos;
+    }
+
+    return size;
+}
+
+/*
+ * packet output
+ */
+
+static
+void emit_run(mpegts_framer_t *fr, const uint8_t *data, size_t count)
+{
+    fr->packets += count;
+
+    if (fr->packet_size == TS_PACKET_SIZE)
+    {
+        fr->on_ts(fr->arg, data, count);
+        return;
+    }
+
+    /* drop M2TS timestamps and RS parity, leaving plain TS */
+    while (count > 0)
+    {
+        const size_t batch = (count < STAGE_PACKETS) ? count : STAGE_PACKETS;
+
+        for (size_t i = 0; i < batch; i++)
+        {
+            memcpy(&fr->stage[i * TS_PACKET_SIZE], data, TS_PACKET_SIZE);
+            data += fr->packet_size;
+        }
+
+        fr->on_ts(fr->arg, fr->stage, batch);
+        count -= batch;
+    }
+}
+
+/* earliest offset validated for any packet size */
+static
+size_t find_chain(const uint8_t *data, size_t size, size_t *psize)
+{
+    size_t best = size;
+
+    for (size_t i = 0; i < ASC_ARRAY_SIZE(packet_sizes); i++)
+    {
+        const size_t off = mpegts_framer_scan(data, size, packet_sizes[i]
+                                              , MPEGTS_FRAMER_CHECK);
+        if (off < best)
+        {
+            best = off;
+            *psize = packet_sizes[i];
+        }
+    }
+
+    return best;
+}
+
+/* pass on every complete packet, returns number of bytes consumed */
+static
+size_t process(mpegts_framer_t *fr, const uint8_t *data, size_t size)
+{
+    size_t pos = 0;
+
+    size_t chain = 0;
+    size_t chain_size = 0;
+    bool scanned = false;
+
+    while (pos < size)
+    {
+        if (fr->packet_size == 0)
+        {
+            if (!scanned)
+            {
+                chain = pos + find_chain(&data[pos], size - pos, &chain_size);
+                scanned = true;
+            }
+
+            /*
+             * Sync bytes that don't start a validated run still get
+             * a packet passed on, same as before there was a framer.
+             * Such packets are cut short when they overlap a run.
+             */
+            const uint8_t *const sync = (uint8_t *)memchr(&data[pos]
+                                                          , SYNC_BYTE
+                                                          , chain - pos);
+            if (sync != NULL)
+            {
+                const size_t skip = sync - &data[pos];
+                fr->dropped += skip;
+                pos += skip;
+
+                if (pos + TS_PACKET_SIZE <= chain)
+                {
+                    fr->packets++;
+                    fr->on_ts(fr->arg, &data[pos], 1);
+                    pos += TS_PACKET_SIZE;
+
+                    continue;
+                }
+                else if (chain == size)
+                {
+                    /* partial packet left */
+                    break;
+                }
+            }
+
+            fr->dropped += chain - pos;
+            pos = chain;
+
+            if (chain == size)
+                break;
+
+            fr->packet_size = chain_size;
+        }
+
+        const size_t psize = fr->packet_size;
+        const uint8_t *const run = &data[pos];
+        size_t count = 0;
+
+        while (pos + psize <= size && data[pos] == SYNC_BYTE)
+        {
+            pos += psize;
+            count++;
+        }
+
+        if (count > 0)
+            emit_run(fr, run, count);
+
+        if (pos < size && data[pos] != SYNC_BYTE)
+        {
+            /* alignment lost, look for it again */
+            fr->packet_size = 0;
+            fr->resyncs++;
+            scanned = false;
+        }
+        else
+        {
+            /* partial packet left */
+            break;
+        }
+    }
+
+    return pos;
+}
+
+void mpegts_framer_push(mpegts_framer_t *fr, const uint8_t *data, size_t size)
+{
+    /* finish off whatever was left from the last call */
+    while (fr->carry_len > 0 && size > 0)
+    {
+        size_t want = CARRY_SIZE - fr->carry_len;
+        if (fr->packet_size != 0)
+            want = fr->packet_size - fr->carry_len;
+
+        const size_t len = (want < size) ? want : size;
+        memcpy(&fr->carry[fr->carry_len], data, len);
+        fr->carry_len += len;
+        data += len;
+        size -= len;
+
+        const size_t used = process(fr, fr->carry, fr->carry_len);
+        fr->carry_len -= used;
+        if (fr->carry_len > 0 && used > 0)
+            memmove(fr->carry, &fr->carry[used], fr->carry_len);
+    }
+
+    if (size == 0)
+        return;
+
+    const size_t used = process(fr, data, size);
+    data += used;
+    size -= used;
+
+    asc_assert(size < CARRY_SIZE, MSG("carry buffer overflow"));
+    memcpy(fr->carry, data, size);
+    fr->carry_len = size;
+}
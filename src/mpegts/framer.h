@@ -0,0 +1,74 @@
+/*
+ * Astra Module: MPEG-TS (Packet framer)
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TS_FRAMER_
+#define _TS_FRAMER_ 1
+
+#ifndef _ASTRA_H_
+#   error "Please include <astra.h> first"
+#endif /* !_ASTRA_H_ */
+
+/*
+ * Splits a byte stream into TS packets. Alignment is locked once sync
+ * bytes are found at the same offset in MPEGTS_FRAMER_CHECK packets
+ * in a row, trying 188, 192 (M2TS) and 204-byte (RS) packet sizes.
+ * Aligned packets are passed on in runs; 188-byte runs point straight
+ * into the pushed data, other sizes are trimmed to 188 bytes first.
+ * While there's no lock, each sync byte gets a single packet through.
+ */
+
+/* packets checked before locking on */
+#define MPEGTS_FRAMER_CHECK 4
+
+typedef struct mpegts_framer_t mpegts_framer_t;
+typedef void (*framer_callback_t)(void *, const uint8_t *, size_t);
+
+typedef struct
+{
+    /* locked packet size, 0 while searching */
+    size_t packet_size;
+
+    /* packets passed on */
+    uint64_t packets;
+    /* bytes skipped looking for sync */
+    uint64_t dropped;
+    /* alignment lost after being locked */
+    uint64_t resyncs;
+} mpegts_framer_stat_t;
+
+mpegts_framer_t *mpegts_framer_init(framer_callback_t on_ts, void *arg) __wur;
+void mpegts_framer_destroy(mpegts_framer_t *fr);
+
+void mpegts_framer_push(mpegts_framer_t *fr, const uint8_t *data, size_t size);
+void mpegts_framer_reset(mpegts_framer_t *fr);
+void mpegts_framer_query(const mpegts_framer_t *fr, mpegts_framer_stat_t *out);
+
+/*
+ * With a 188-byte lock, incoming data can skip the framer as long as
+ * it starts with the partial packet held back, moved out by _take().
+ */
+bool mpegts_framer_aligned(const mpegts_framer_t *fr) __func_pure;
+size_t mpegts_framer_take(mpegts_framer_t *fr, uint8_t *dst);
+
+/* offset of the first byte starting `count' sync bytes `stride' apart */
+size_t mpegts_framer_scan(const uint8_t *data, size_t size, size_t stride
+                          , unsigned int count) __func_pure __wur;
+
+#endif /* _TS_FRAMER_ */
@@ -0,0 +1,66 @@
+/*
+ * Astra Module: MPEG-TS (Sparse PID map)
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <astra.h>
+#include <mpegts/pidmap.h>
+
+#define MSG(_msg) "[mpegts/pidmap] " _msg
+
+/* store `ptr' for `pid'; NULL removes the entry */
+void mpegts_pidmap_set(mpegts_pidmap_t *map, uint16_t pid, void *ptr)
+{
+    asc_assert(pid < MAX_PID, MSG("PID out of range: %hu"), pid);
+
+    const unsigned int idx = pid / MPEGTS_PIDMAP_PAGE;
+    const unsigned int slot = pid % MPEGTS_PIDMAP_PAGE;
+    void **page = map->page[idx];
+
+    if (page == NULL)
+    {
+        if (ptr == NULL)
+            return;
+
+        page = ASC_ALLOC(MPEGTS_PIDMAP_PAGE, void *);
+        map->page[idx] = page;
+    }
+
+    if (page[slot] == NULL && ptr != NULL)
+        map->used[idx]++;
+    else if (page[slot] != NULL && ptr == NULL)
+        map->used[idx]--;
+
+    page[slot] = ptr;
+
+    if (map->used[idx] == 0)
+    {
+        free(page);
+        map->page[idx] = NULL;
+    }
+}
+
+/* drop all entries; stored pointers are not freed */
+void mpegts_pidmap_clear(mpegts_pidmap_t *map)
+{
+    for (unsigned int i = 0; i < MPEGTS_PIDMAP_PAGES; i++)
+    {
+        ASC_FREE(map->page[i], free);
+        map->used[i] = 0;
+    }
+}
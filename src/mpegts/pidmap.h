@@ -0,0 +1,59 @@
+/*
+ * Astra Module: MPEG-TS (Sparse PID map)
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TS_PIDMAP_
+#define _TS_PIDMAP_ 1
+
+#ifndef _ASTRA_H_
+#   error "Please include <astra.h> first"
+#endif /* !_ASTRA_H_ */
+
+/*
+ * Pointer per PID, for modules that only track a handful of PIDs.
+ * Pages of MPEGTS_PIDMAP_PAGE slots are allocated on first use and
+ * freed once empty, so a map costs a few hundred bytes instead of
+ * MAX_PID pointers.
+ */
+
+#define MPEGTS_PIDMAP_PAGE 256
+#define MPEGTS_PIDMAP_PAGES (MAX_PID / MPEGTS_PIDMAP_PAGE)
+
+typedef struct
+{
+    void **page[MPEGTS_PIDMAP_PAGES];
+    uint16_t used[MPEGTS_PIDMAP_PAGES];
+} mpegts_pidmap_t;
+
+void mpegts_pidmap_set(mpegts_pidmap_t *map, uint16_t pid, void *ptr);
+void mpegts_pidmap_clear(mpegts_pidmap_t *map);
+
+static inline
+void *mpegts_pidmap_get(const mpegts_pidmap_t *map, uint16_t pid)
+{
+    void **const page = map->page[(pid / MPEGTS_PIDMAP_PAGE)
+                                  % MPEGTS_PIDMAP_PAGES];
+
+    if (page == NULL)
+        return NULL;
+
+    return page[pid % MPEGTS_PIDMAP_PAGE];
+}
+
+#endif /* _TS_PIDMAP_ */
@@ -21,6 +21,159 @@
 #include <astra.h>
 #include <mpegts/psi.h>
 
+#define MSG(_msg) "[mpegts/psi] " _msg
+
+/*
+ * section buffers
+ *
+ * Most sections are well under 1KiB, so buffers come in a few size
+ * classes and grow as needed. Released buffers are kept per class for
+ * reuse, up to PSI_POOL_MAX of each.
+ */
+
+#define PSI_CLASS_COUNT 3
+#define PSI_POOL_MAX 64
+
+static const size_t psi_class_size[PSI_CLASS_COUNT] = {
+    256, 1024, PSI_MAX_SIZE + 1,
+};
+
+typedef struct psi_chunk_t
+{
+    struct psi_chunk_t *next;
+} psi_chunk_t;
+
+static struct
+{
+    /* instances may live on different threads */
+    int lock;
+
+    psi_chunk_t *free[PSI_CLASS_COUNT];
+    size_t free_count[PSI_CLASS_COUNT];
+    size_t used[PSI_CLASS_COUNT];
+
+    size_t objects;
+} psi_pool;
+
+static inline
+void pool_lock(void)
+{
+    while (__sync_lock_test_and_set(&psi_pool.lock, 1))
+        ;
+}
+
+static inline
+void pool_unlock(void)
+{
+    __sync_lock_release(&psi_pool.lock);
+}
+
+static
+unsigned int pool_class(size_t size)
+{
+    unsigned int i = 0;
+    while (psi_class_size[i] < size)
+        i++;
+
+    return i;
+}
+
+static
+uint8_t *pool_get(unsigned int cls)
+{
+    pool_lock();
+    psi_chunk_t *const chunk = psi_pool.free[cls];
+    if (chunk != NULL)
+    {
+        psi_pool.free[cls] = chunk->next;
+        psi_pool.free_count[cls]--;
+    }
+    psi_pool.used[cls]++;
+    pool_unlock();
+
+    if (chunk != NULL)
+        return (uint8_t *)chunk;
+
+    return ASC_ALLOC(psi_class_size[cls], uint8_t);
+}
+
+static
+void pool_put(unsigned int cls, uint8_t *buffer)
+{
+    psi_chunk_t *const chunk = (psi_chunk_t *)buffer;
+
+    pool_lock();
+    psi_pool.used[cls]--;
+    if (psi_pool.free_count[cls] < PSI_POOL_MAX)
+    {
+        chunk->next = psi_pool.free[cls];
+        psi_pool.free[cls] = chunk;
+        psi_pool.free_count[cls]++;
+        buffer = NULL;
+    }
+    pool_unlock();
+
+    free(buffer);
+}
+
+/* make room for at least `size' bytes, keeping what's in the buffer */
+void mpegts_psi_reserve(mpegts_psi_t *psi, size_t size)
+{
+    if (size <= psi->buffer_alloc)
+        return;
+
+    asc_assert(size <= PSI_MAX_SIZE + 1, MSG("section is too large: %zu")
+               , size);
+
+    const unsigned int cls = pool_class(size);
+    const size_t alloc = psi_class_size[cls];
+    uint8_t *const buffer = pool_get(cls);
+
+    const size_t keep = psi->buffer_alloc;
+    if (keep > 0)
+    {
+        memcpy(buffer, psi->buffer, keep);
+        pool_put(pool_class(keep), psi->buffer);
+    }
+    memset(&buffer[keep], 0, alloc - keep);
+
+    psi->buffer = buffer;
+    psi->buffer_alloc = alloc;
+}
+
+/* copy section contents; `dst' keeps its PID and continuity counter */
+void mpegts_psi_copy(mpegts_psi_t *dst, const mpegts_psi_t *src)
+{
+    if (src->buffer_size > 0)
+    {
+        mpegts_psi_reserve(dst, src->buffer_size);
+        memcpy(dst->buffer, src->buffer, src->buffer_size);
+    }
+
+    dst->buffer_size = src->buffer_size;
+    dst->buffer_skip = 0;
+    dst->crc32 = src->crc32;
+}
+
+void mpegts_psi_stats(mpegts_psi_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    pool_lock();
+    stats->objects = psi_pool.objects;
+    for (unsigned int i = 0; i < PSI_CLASS_COUNT; i++)
+    {
+        stats->buffers += psi_pool.used[i];
+        stats->bytes += psi_pool.used[i] * psi_class_size[i];
+        stats->cached += psi_pool.free_count[i] * psi_class_size[i];
+    }
+    pool_unlock();
+}
+
+/*
+ * init and cleanup
+ */
+
 mpegts_psi_t *mpegts_psi_init(mpegts_packet_type_t type, uint16_t pid)
 {
     mpegts_psi_t *const psi = ASC_ALLOC(1, mpegts_psi_t);
@@ -28,14 +181,25 @@ mpegts_psi_t *mpegts_psi_init(mpegts_packet_type_t type, uint16_t pid)
     psi->type = type;
     psi->pid = pid;
 
+    __atomic_add_fetch(&psi_pool.objects, 1, __ATOMIC_RELAXED);
+
     return psi;
 }
 
 void mpegts_psi_destroy(mpegts_psi_t *psi)
 {
+    if (psi->buffer != NULL)
+        pool_put(pool_class(psi->buffer_alloc), psi->buffer);
+
+    __atomic_sub_fetch(&psi_pool.objects, 1, __ATOMIC_RELAXED);
+
     free(psi);
 }
 
+/*
+ * mux and demux
+ */
+
 void mpegts_psi_mux(mpegts_psi_t *psi, const uint8_t *ts, psi_callback_t callback, void *arg)
 {
     const uint8_t *payload = TS_GET_PAYLOAD(ts);
@@ -63,6 +227,13 @@ void mpegts_psi_mux(mpegts_psi_t *psi, const uint8_t *ts, psi_callback_t callbac
                     psi->buffer_skip = 0;
                     return;
                 }
+                if(psi->buffer_size != 0
+                   && psi->buffer_size != psi->buffer_skip + ptr_field)
+                { // checking PSI length before touching the buffer
+                    psi->buffer_skip = 0;
+                    return;
+                }
+                mpegts_psi_reserve(psi, psi->buffer_skip + ptr_field);
                 memcpy(&psi->buffer[psi->buffer_skip], payload, ptr_field);
                 if(psi->buffer_size == 0)
                 { // incomplete PSI header
@@ -91,6 +262,7 @@ void mpegts_psi_mux(mpegts_psi_t *psi, const uint8_t *ts, psi_callback_t callbac
             const uint8_t remain = (ts + TS_PACKET_SIZE) - payload;
             if(remain < 3)
             {
+                mpegts_psi_reserve(psi, PSI_HEADER_SIZE);
                 memcpy(psi->buffer, payload, remain);
                 psi->buffer_skip = remain;
                 break;
@@ -104,6 +276,7 @@ void mpegts_psi_mux(mpegts_psi_t *psi, const uint8_t *ts, psi_callback_t callbac
             if(cpy_len > TS_BODY_SIZE)
                 break;
 
+            mpegts_psi_reserve(psi, psi_buffer_size);
             psi->buffer_size = psi_buffer_size;
             if(psi_buffer_size > cpy_len)
             {
@@ -143,6 +316,7 @@ void mpegts_psi_mux(mpegts_psi_t *psi, const uint8_t *ts, psi_callback_t callbac
                 psi->buffer_skip = 0;
                 return;
             }
+            mpegts_psi_reserve(psi, psi_buffer_size);
             psi->buffer_size = psi_buffer_size;
         }
         const size_t remain = psi->buffer_size - psi->buffer_skip;
@@ -167,7 +341,7 @@ void mpegts_psi_demux(mpegts_psi_t *psi, ts_callback_t callback, void *arg)
     if(!buffer_size)
         return;
 
-    uint8_t *ts = psi->ts;
+    uint8_t ts[TS_PACKET_SIZE];
 
     ts[0] = 0x47;
     ts[1] = 0x40 /* PUSI */ | psi->pid >> 8;
@@ -45,20 +45,38 @@ typedef struct
 
     uint32_t crc32;
 
-    // demux
-    uint8_t ts[TS_PACKET_SIZE];
-
     // mux
     uint16_t buffer_size;
     uint16_t buffer_skip;
-    uint8_t buffer[PSI_MAX_SIZE];
+
+    /*
+     * NULL until the first section arrives; sections built by hand
+     * need mpegts_psi_reserve() before writing to the buffer.
+     */
+    uint8_t *buffer;
+    uint16_t buffer_alloc;
 } mpegts_psi_t;
 
+typedef struct
+{
+    /* mpegts_psi_t instances */
+    size_t objects;
+    /* section buffers held by them and bytes allocated for these */
+    size_t buffers;
+    size_t bytes;
+    /* bytes kept for reuse */
+    size_t cached;
+} mpegts_psi_stats_t;
+
 typedef void (*psi_callback_t)(void *, mpegts_psi_t *);
 
 mpegts_psi_t *mpegts_psi_init(mpegts_packet_type_t type, uint16_t pid) __wur;
 void mpegts_psi_destroy(mpegts_psi_t *psi);
 
+void mpegts_psi_reserve(mpegts_psi_t *psi, size_t size);
+void mpegts_psi_copy(mpegts_psi_t *dst, const mpegts_psi_t *src);
+void mpegts_psi_stats(mpegts_psi_stats_t *stats);
+
 void mpegts_psi_mux(mpegts_psi_t *psi, const uint8_t *ts, psi_callback_t callback, void *arg);
 void mpegts_psi_demux(mpegts_psi_t *psi, ts_callback_t callback, void *arg);
 
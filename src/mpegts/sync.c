@@ -19,9 +19,22 @@
  */
 
 #include <astra.h>
+#include <core/loop.h>
+#include <core/timer.h>
 #include <mpegts/sync.h>
 #include <mpegts/pcr.h>
 
+#ifndef _WIN32
+#   include <sys/mman.h>
+#   define SYNC_MMAP 1
+#   ifndef MAP_ANONYMOUS
+#       define MAP_ANONYMOUS MAP_ANON
+#   endif
+#   ifndef MAP_NORESERVE
+#       define MAP_NORESERVE 0
+#   endif
+#endif /* !_WIN32 */
+
 #define MSG(_msg) "[%s] " _msg, sx->name
 
 /* default fill level thresholds (see sync.h) */
@@ -43,12 +56,23 @@
 /* timeout for new block arrival */
 #define MAX_IDLE_TIME (200 * 1000) /* 200ms */
 
+/* longest pacer sleep for a buffer that's sending */
+#define PACER_MAX_WAIT (5 * 1000) /* 5ms */
+
+#define PACER_HEAP_SIZE 16
+
+/* initial PCR index size, entries */
+#define INDEX_SIZE 256
+
 typedef uint8_t ts_packet_t[TS_PACKET_SIZE];
 
+typedef struct sync_pacer_t sync_pacer_t;
+
 struct mpegts_sync_t
 {
     char name[128];
     ts_packet_t *buf;
+    size_t capacity;
 
     unsigned int low_blocks;
     unsigned int enough_blocks;
@@ -63,6 +87,25 @@ struct mpegts_sync_t
         size_t send; /* TX tail */
     } pos;
 
+    /* packets received so far, numbers every packet */
+    uint64_t rcv_seq;
+    size_t reserved;
+
+    /* numbers of PCR packets still in the buffer */
+    struct
+    {
+        uint64_t *seq;
+        size_t mask;
+        uint64_t head; /* oldest entry */
+        uint64_t next; /* next one for seek_pcr() */
+        uint64_t tail; /* end of index */
+    } idx;
+
+    /* resize statistics */
+    unsigned int grows;
+    unsigned int shrinks;
+    uint64_t moved;
+
     uint64_t last_run;
     uint64_t last_error;
     unsigned int pcr_pid;
@@ -78,6 +121,20 @@ struct mpegts_sync_t
     void *arg;
     sync_callback_t on_ready;
     ts_callback_t on_write;
+
+    /* pacer queue entry */
+    sync_pacer_t *pacer;
+    size_t pacer_idx;
+    uint64_t deadline;
+
+    /* how late the pacer got to us, usecs */
+    double jitter_avg;
+    uint64_t jitter_max;
+
+    /* early release for kernel pacing, usecs */
+    unsigned int lead;
+    bool lead_added;
+    uint64_t txtime;
 #ifdef SYNC_DEBUG
     uint64_t last_report;
 #endif /* SYNC_DEBUG */
@@ -89,6 +146,44 @@ struct mpegts_sync_t
  * create and destroy
  */
 
+/*
+ * Where possible, the buffer is an anonymous mapping sized for the
+ * largest allowed buffer. Pages are only backed by memory once written
+ * to, so the ring can change size in place and give memory back with
+ * madvise() when it shrinks.
+ */
+static
+void buffer_alloc(mpegts_sync_t *sx, size_t packets)
+{
+#ifdef SYNC_MMAP
+    if (packets < sx->max_size)
+        packets = sx->max_size;
+
+    void *const buf = mmap(NULL, packets * TS_PACKET_SIZE
+                           , PROT_READ | PROT_WRITE
+                           , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+                           , -1, 0);
+    asc_assert(buf != MAP_FAILED, MSG("mmap() failed: %s"), asc_error_msg());
+
+    sx->buf = (ts_packet_t *)buf;
+#else
+    sx->buf = ASC_ALLOC(packets, ts_packet_t);
+#endif /* SYNC_MMAP */
+
+    sx->capacity = packets;
+}
+
+static
+void buffer_free(ts_packet_t *buf, size_t capacity)
+{
+#ifdef SYNC_MMAP
+    munmap(buf, capacity * TS_PACKET_SIZE);
+#else
+    __uarg(capacity);
+    free(buf);
+#endif /* SYNC_MMAP */
+}
+
 mpegts_sync_t *mpegts_sync_init(void)
 {
     mpegts_sync_t *const sx = ASC_ALLOC(1, mpegts_sync_t);
@@ -104,17 +199,33 @@ mpegts_sync_t *mpegts_sync_init(void)
     sx->pcr_last = XTS_NONE;
     sx->pcr_cur = XTS_NONE;
 
-    sx->buf = ASC_ALLOC(sx->size, ts_packet_t);
+    buffer_alloc(sx, sx->size);
+
+    sx->idx.seq = ASC_ALLOC(INDEX_SIZE, uint64_t);
+    sx->idx.mask = INDEX_SIZE - 1;
 
     return sx;
 }
 
-void mpegts_sync_destroy(mpegts_sync_t *sx)
+static
+bool pacer_remove(mpegts_sync_t *sx);
+
+static
+void sync_free(mpegts_sync_t *sx)
 {
-    free(sx->buf);
+    free(sx->idx.seq);
+    buffer_free(sx->buf, sx->capacity);
     free(sx);
 }
 
+void mpegts_sync_destroy(mpegts_sync_t *sx)
+{
+    if (sx->pacer != NULL && !pacer_remove(sx))
+        return;
+
+    sync_free(sx);
+}
+
 /*
  * setters and getters
  */
@@ -144,6 +255,19 @@ void mpegts_sync_set_arg(mpegts_sync_t *sx, void *arg)
     sx->arg = arg;
 }
 
+/* write packets up to `usecs' ahead of their transmit time */
+void mpegts_sync_set_lead(mpegts_sync_t *sx, unsigned int usecs)
+{
+    sx->lead = usecs;
+    sx->lead_added = false;
+}
+
+/* transmit time of the packet being passed to on_write */
+uint64_t mpegts_sync_txtime(const mpegts_sync_t *sx)
+{
+    return sx->txtime;
+}
+
 bool mpegts_sync_parse_opts(mpegts_sync_t *sx, const char *opts)
 {
     unsigned int numopts[3] = { 0, 0, 0 };
@@ -248,6 +372,13 @@ void mpegts_sync_query(const mpegts_sync_t *sx, mpegts_sync_stat_t *out)
     out->low_blocks = sx->low_blocks;
     out->max_size = sx->max_size;
 
+    out->jitter_avg = sx->jitter_avg;
+    out->jitter_max = sx->jitter_max;
+
+    out->grows = sx->grows;
+    out->shrinks = sx->shrinks;
+    out->moved = sx->moved;
+
     /* suggested packet count to push */
     if (out->filled == 0 || sx->num_blocks < sx->low_blocks)
     {
@@ -268,25 +399,98 @@ void mpegts_sync_query(const mpegts_sync_t *sx, mpegts_sync_stat_t *out)
  * worker functions
  */
 
+/* packet number to buffer slot and back */
+static inline
+size_t seq_slot(const mpegts_sync_t *sx, uint64_t seq)
+{
+    const size_t back = sx->rcv_seq - seq;
+
+    if (sx->pos.rcv >= back)
+        return sx->pos.rcv - back;
+    else
+        return sx->pos.rcv + sx->size - back;
+}
+
+static inline
+uint64_t slot_seq(const mpegts_sync_t *sx, size_t slot)
+{
+    if (sx->pos.rcv >= slot)
+        return sx->rcv_seq - (sx->pos.rcv - slot);
+    else
+        return sx->rcv_seq - (sx->pos.rcv + sx->size - slot);
+}
+
+/* forget PCR packets that were already sent */
+static
+void index_trim(mpegts_sync_t *sx)
+{
+    const uint64_t send = slot_seq(sx, sx->pos.send);
+
+    while (sx->idx.head < sx->idx.tail
+           && sx->idx.seq[sx->idx.head & sx->idx.mask] < send)
+    {
+        sx->idx.head++;
+    }
+
+    if (sx->idx.next < sx->idx.head)
+        sx->idx.next = sx->idx.head;
+}
+
+static
+void index_add(mpegts_sync_t *sx, uint64_t seq)
+{
+    const size_t size = sx->idx.mask + 1;
+
+    if (sx->idx.tail - sx->idx.head >= size)
+    {
+        /* full; double the size, keeping entries in order */
+        uint64_t *const entries = ASC_ALLOC(size * 2, uint64_t);
+        const size_t mask = (size * 2) - 1;
+
+        for (uint64_t i = sx->idx.head; i < sx->idx.tail; i++)
+            entries[i & mask] = sx->idx.seq[i & sx->idx.mask];
+
+        free(sx->idx.seq);
+        sx->idx.seq = entries;
+        sx->idx.mask = mask;
+    }
+
+    sx->idx.seq[sx->idx.tail++ & sx->idx.mask] = seq;
+}
+
+/* index PCR packets about to be added at the RX tail */
+static
+void index_packets(mpegts_sync_t *sx, const ts_packet_t *ts, size_t count)
+{
+    index_trim(sx);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!TS_IS_PCR(ts[i]))
+            continue;
+
+        index_add(sx, sx->rcv_seq + i);
+
+        /* update block count */
+        if (TS_GET_PID(ts[i]) == sx->pcr_pid)
+            sx->num_blocks++;
+    }
+}
+
 static __func_pure
 unsigned int block_count(const mpegts_sync_t *sx)
 {
     unsigned int count = 1;
 
     /* count blocks after PCR lookahead */
-    size_t pos = sx->pos.pcr;
-    while (pos != sx->pos.rcv)
+    for (uint64_t i = sx->idx.next; i < sx->idx.tail; i++)
     {
-        const uint8_t *const ts = sx->buf[pos];
-        if (TS_IS_PCR(ts) && TS_GET_PID(ts) == sx->pcr_pid)
+        const size_t slot = seq_slot(sx, sx->idx.seq[i & sx->idx.mask]);
+        if (TS_GET_PID(sx->buf[slot]) == sx->pcr_pid)
         {
             if (++count >= sx->enough_blocks)
                 break;
         }
-
-        if (++pos >= sx->size)
-            /* buffer wrap around */
-            pos = 0;
     }
 
     return count;
@@ -295,22 +499,29 @@ unsigned int block_count(const mpegts_sync_t *sx)
 static
 bool seek_pcr(mpegts_sync_t *sx)
 {
-    while (sx->pos.pcr != sx->pos.rcv)
+    uint64_t seq = slot_seq(sx, sx->pos.pcr);
+
+    /* jump from one indexed PCR packet to the next */
+    while (sx->idx.next < sx->idx.tail)
     {
-        const size_t lookahead = sx->pos.pcr;
+        const uint64_t at = sx->idx.seq[sx->idx.next++ & sx->idx.mask];
+        if (at < seq)
+            continue;
+
+        const size_t lookahead = seq_slot(sx, at);
         const uint8_t *const ts = sx->buf[lookahead];
         const unsigned int pid = TS_GET_PID(ts);
 
+        sx->offset += (at - seq) * TS_PACKET_SIZE;
         const size_t bytes = sx->offset;
         sx->offset += TS_PACKET_SIZE;
 
-        if (++sx->pos.pcr >= sx->size)
+        seq = at + 1;
+        sx->pos.pcr = lookahead + 1;
+        if (sx->pos.pcr >= sx->size)
             /* buffer wrap around */
             sx->pos.pcr = 0;
 
-        if (!TS_IS_PCR(ts))
-            continue;
-
         if (!sx->pcr_pid && pid != NULL_TS_PID)
         {
             /* latch onto first PCR pid we see */
@@ -376,6 +587,10 @@ bool seek_pcr(mpegts_sync_t *sx)
             return true;
     }
 
+    /* no more PCR packets, lookahead catches up with RX tail */
+    sx->offset += (sx->rcv_seq - seq) * TS_PACKET_SIZE;
+    sx->pos.pcr = sx->pos.rcv;
+
     return false;
 }
 
@@ -427,6 +642,72 @@ size_t buffer_slots(const mpegts_sync_t *sx, bool filled)
     return cnt;
 }
 
+#ifdef SYNC_MMAP
+/* extend the ring inside the mapping, moving its smaller wrapped part */
+static
+void buffer_grow(mpegts_sync_t *sx, size_t new_size)
+{
+    const size_t old_size = sx->size;
+
+    if (sx->pos.rcv < sx->pos.send)
+    {
+        const size_t head = sx->pos.rcv;
+        const size_t tail = old_size - sx->pos.send;
+
+        if (head <= tail && old_size + head < new_size)
+        {
+            /* packets from the start go after the old end */
+            memcpy(sx->buf[old_size], sx->buf[0], head * TS_PACKET_SIZE);
+
+            if (sx->pos.pcr < sx->pos.send)
+                sx->pos.pcr += old_size;
+
+            sx->pos.rcv += old_size;
+            sx->moved += head;
+        }
+        else
+        {
+            /* packets before the old end go to the new one */
+            const size_t shift = new_size - old_size;
+            memmove(sx->buf[sx->pos.send + shift], sx->buf[sx->pos.send]
+                    , tail * TS_PACKET_SIZE);
+
+            if (sx->pos.pcr >= sx->pos.send)
+                sx->pos.pcr += shift;
+
+            sx->pos.send += shift;
+            sx->moved += tail;
+        }
+    }
+
+    sx->size = new_size;
+    sx->grows++;
+}
+
+/* drop the end of the ring once nothing is stored there */
+static
+bool buffer_shrink(mpegts_sync_t *sx, size_t new_size)
+{
+    if (sx->pos.rcv < sx->pos.send || sx->pos.rcv >= new_size)
+        return false;
+
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t from = new_size * TS_PACKET_SIZE;
+    const size_t to = sx->size * TS_PACKET_SIZE;
+
+    const size_t start = ((from + page - 1) / page) * page;
+    const size_t end = (to / page) * page;
+
+    if (end > start)
+        madvise((uint8_t *)sx->buf + start, end - start, MADV_DONTNEED);
+
+    sx->size = new_size;
+    sx->shrinks++;
+
+    return true;
+}
+#endif /* SYNC_MMAP */
+
 static
 bool buffer_resize(mpegts_sync_t *sx, size_t new_size)
 {
@@ -459,6 +740,10 @@ bool buffer_resize(mpegts_sync_t *sx, size_t new_size)
     }
 
     /* adjust pointers */
+    if (sx->pos.send >= sx->size)
+        /* buffer wrap around */
+        sx->pos.send = 0;
+
     ssize_t filled = sx->pos.rcv - sx->pos.send;
     if (filled < 0)
         filled += sx->size;
@@ -471,6 +756,18 @@ bool buffer_resize(mpegts_sync_t *sx, size_t new_size)
         return false;
     }
 
+#ifdef SYNC_MMAP
+    if (new_size <= sx->capacity)
+    {
+        if (new_size > sx->size)
+            buffer_grow(sx, new_size);
+        else if (!buffer_shrink(sx, new_size))
+            return false;
+
+        return true;
+    }
+#endif /* SYNC_MMAP */
+
     ssize_t lookahead = sx->pos.pcr - sx->pos.send;
     if (lookahead < 0)
         lookahead += sx->size;
@@ -479,18 +776,20 @@ bool buffer_resize(mpegts_sync_t *sx, size_t new_size)
     sx->pos.pcr = lookahead;
 
     /* move contents to new buffer */
-    ts_packet_t *const buf = ASC_ALLOC(new_size, ts_packet_t);
+    ts_packet_t *const old_buf = sx->buf;
+    const size_t old_capacity = sx->capacity;
+    buffer_alloc(sx, new_size);
 
     size_t pos = sx->pos.send;
     size_t left = filled;
-    ts_packet_t *ts = buf;
+    ts_packet_t *ts = sx->buf;
     while (left > 0)
     {
         size_t chunk = sx->size - pos;
         if (left < chunk)
             chunk = left; /* last piece */
 
-        memcpy(ts, &sx->buf[pos], sizeof(*ts) * chunk);
+        memcpy(ts, &old_buf[pos], sizeof(*ts) * chunk);
 
         pos += chunk;
         if (pos >= sx->size)
@@ -508,21 +807,24 @@ bool buffer_resize(mpegts_sync_t *sx, size_t new_size)
                   , new_size, new_size * TS_PACKET_SIZE);
 #endif /* SYNC_DEBUG */
 
-    free(sx->buf);
+    buffer_free(old_buf, old_capacity);
+
+    if (new_size > sx->size)
+        sx->grows++;
+    else
+        sx->shrinks++;
 
+    sx->moved += filled;
     sx->pos.send = 0;
     sx->size = new_size;
-    sx->buf = buf;
 
     return true;
 }
 
-void mpegts_sync_loop(void *arg)
+static
+void sync_run(mpegts_sync_t *sx, uint64_t time_now)
 {
-    mpegts_sync_t *const sx = (mpegts_sync_t *)arg;
-
     /* timekeeping */
-    const uint64_t time_now = asc_utime();
     const unsigned int elapsed = usecs_elapsed(sx, time_now);
 
     if (!elapsed)
@@ -588,10 +890,10 @@ void mpegts_sync_loop(void *arg)
         {
             const unsigned int percent = (filled * 100) / sx->size;
 
-            asc_log_debug(MSG("BR: %.2f, fill: %5zu/%5zu (%2u%%), R: %5zu, P: %5zu, S: %5zu, B: %u")
+            asc_log_debug(MSG("BR: %.2f, fill: %5zu/%5zu (%2u%%), R: %5zu, P: %5zu, S: %5zu, B: %u, J: %.0f/%" PRIu64)
                           , sx->bitrate, filled, sx->size, percent
                           , sx->pos.rcv, sx->pos.pcr, sx->pos.send
-                          , sx->num_blocks);
+                          , sx->num_blocks, sx->jitter_avg, sx->jitter_max);
 
             sx->last_report = time_now;
         }
@@ -636,6 +938,14 @@ void mpegts_sync_loop(void *arg)
 
     /* output */
     sx->pending += (sx->bitrate / (1000000.0 / elapsed));
+    if (sx->lead > 0 && !sx->lead_added)
+    {
+        /* run ahead of the schedule by `lead' */
+        sx->pending += (sx->bitrate * sx->lead) / 1000000.0;
+        sx->lead_added = true;
+    }
+
+    const uint64_t horizon = time_now + sx->lead;
     while (sx->pending > TS_PACKET_SIZE)
     {
         if (sx->pos.send >= sx->size)
@@ -646,6 +956,18 @@ void mpegts_sync_loop(void *arg)
             /* block end */
             break;
 
+        /* bytes still pending are due after this packet */
+        const double ahead = sx->pending - TS_PACKET_SIZE;
+        const double due = horizon - ((ahead * 1000000.0) / sx->bitrate);
+
+        uint64_t txtime = time_now;
+        if (due > time_now)
+            txtime = due;
+        if (txtime < sx->txtime)
+            txtime = sx->txtime;
+
+        sx->txtime = txtime;
+
         const uint8_t *ts = sx->buf[sx->pos.send++];
         if (sx->on_write)
             sx->on_write(sx->arg, ts);
@@ -654,32 +976,305 @@ void mpegts_sync_loop(void *arg)
     }
 }
 
-bool mpegts_sync_push(mpegts_sync_t *sx, const void *buf, size_t count)
+void mpegts_sync_loop(void *arg)
 {
-    while (buffer_slots(sx, false) < count)
+    mpegts_sync_t *const sx = (mpegts_sync_t *)arg;
+
+    sync_run(sx, asc_utime());
+}
+
+/*
+ * shared pacer
+ *
+ * Each loop has one pacer for all the buffers started on it. Buffers
+ * are kept in a min-heap ordered by the time their next packet is due,
+ * and a single one-shot timer is armed for the earliest of them.
+ */
+
+struct sync_pacer_t
+{
+    mpegts_sync_t **heap;
+    size_t count;
+    size_t size;
+
+    asc_timer_t *timer;
+    uint64_t timer_due;
+
+    /* inside pacer_tick() */
+    bool is_busy;
+    /* buffer being run, reset if one of its callbacks destroys it */
+    mpegts_sync_t *current;
+
+    sync_pacer_t **slot;
+};
+
+static sync_pacer_t *pacer_list[ASC_LOOP_MAX + 1] = { NULL };
+
+static inline
+void pacer_set(sync_pacer_t *pacer, size_t idx, mpegts_sync_t *sx)
+{
+    pacer->heap[idx] = sx;
+    sx->pacer_idx = idx;
+}
+
+static
+void pacer_sift_up(sync_pacer_t *pacer, size_t idx)
+{
+    mpegts_sync_t *const sx = pacer->heap[idx];
+
+    while (idx > 0)
     {
-        if (!buffer_resize(sx, 0))
+        const size_t parent = (idx - 1) / 2;
+        if (pacer->heap[parent]->deadline <= sx->deadline)
+            break;
+
+        pacer_set(pacer, idx, pacer->heap[parent]);
+        idx = parent;
+    }
+
+    pacer_set(pacer, idx, sx);
+}
+
+static
+void pacer_sift_down(sync_pacer_t *pacer, size_t idx)
+{
+    mpegts_sync_t *const sx = pacer->heap[idx];
+
+    while (true)
+    {
+        size_t child = idx * 2 + 1;
+        if (child >= pacer->count)
+            break;
+
+        if (child + 1 < pacer->count
+            && pacer->heap[child + 1]->deadline < pacer->heap[child]->deadline)
         {
-            if (!sx->num_blocks)
-            {
-                /* buffer is at maximum size, yet we couldn't find PCR */
-                asc_log_error(MSG("PCR absent or invalid; dropping %zu packet%s")
-                              , count, (count > 1) ? "s" : "");
-            }
+            child++;
+        }
 
-            return false;
+        if (pacer->heap[child]->deadline >= sx->deadline)
+            break;
+
+        pacer_set(pacer, idx, pacer->heap[child]);
+        idx = child;
+    }
+
+    pacer_set(pacer, idx, sx);
+}
+
+static
+void pacer_insert(sync_pacer_t *pacer, mpegts_sync_t *sx)
+{
+    if (pacer->count >= pacer->size)
+    {
+        pacer->size *= 2;
+        pacer->heap = (mpegts_sync_t **)realloc(pacer->heap
+                                                , pacer->size
+                                                  * sizeof(*pacer->heap));
+        asc_assert(pacer->heap != NULL, "[mpegts/sync] realloc() failed");
+    }
+
+    pacer_set(pacer, pacer->count++, sx);
+    pacer_sift_up(pacer, sx->pacer_idx);
+}
+
+static
+void pacer_delete(sync_pacer_t *pacer, mpegts_sync_t *sx)
+{
+    const size_t idx = sx->pacer_idx;
+    mpegts_sync_t *const last = pacer->heap[--pacer->count];
+
+    if (last == sx)
+        return;
+
+    pacer_set(pacer, idx, last);
+    if (idx > 0 && last->deadline < pacer->heap[(idx - 1) / 2]->deadline)
+        pacer_sift_up(pacer, idx);
+    else
+        pacer_sift_down(pacer, idx);
+}
+
+static
+void pacer_free(sync_pacer_t *pacer)
+{
+    ASC_FREE(pacer->timer, asc_timer_destroy);
+    *pacer->slot = NULL;
+
+    free(pacer->heap);
+    free(pacer);
+}
+
+static
+void pacer_tick(void *arg);
+
+static
+void pacer_arm(sync_pacer_t *pacer, uint64_t now)
+{
+    const uint64_t due = pacer->heap[0]->deadline;
+    if (pacer->timer != NULL)
+    {
+        if (pacer->timer_due <= due)
+            return;
+
+        asc_timer_destroy(pacer->timer);
+    }
+
+    /* event loop sleeps at least 1ms anyway, so round down */
+    const unsigned int ms = (due > now) ? (due - now) / 1000 : 0;
+
+    pacer->timer = asc_timer_one_shot(ms, pacer_tick, pacer);
+    pacer->timer_due = now + ms * 1000ULL;
+}
+
+/* time until the next packet is due */
+static __func_pure
+unsigned int sync_wait(const mpegts_sync_t *sx)
+{
+    if (!sx->buffered || sx->last_error || sx->bitrate <= 0)
+        return SYNC_INTERVAL_MSEC * 1000;
+
+    const double need = TS_PACKET_SIZE - sx->pending;
+    if (need <= 0)
+        return 1;
+
+    const double usecs = (need * 1000000.0) / sx->bitrate;
+    if (usecs >= PACER_MAX_WAIT)
+        return PACER_MAX_WAIT;
+
+    return usecs + 1;
+}
+
+static
+void pacer_tick(void *arg)
+{
+    sync_pacer_t *const pacer = (sync_pacer_t *)arg;
+
+    /* one-shot timer is freed after it returns */
+    pacer->timer = NULL;
+    pacer->is_busy = true;
+
+    const uint64_t now = asc_utime();
+
+    while (pacer->count > 0)
+    {
+        mpegts_sync_t *const sx = pacer->heap[0];
+        if (sx->deadline > now)
+            break;
+
+        pacer_delete(pacer, sx);
+
+        const uint64_t late = now - sx->deadline;
+        sx->jitter_avg += (late - sx->jitter_avg) / 16.0;
+        if (late > sx->jitter_max)
+            sx->jitter_max = late;
+
+        pacer->current = sx;
+        sync_run(sx, now);
+
+        if (pacer->current != sx)
+        {
+            /* destroyed from its own callback */
+            sync_free(sx);
+            continue;
         }
+
+        pacer->current = NULL;
+        sx->deadline = now + sync_wait(sx);
+        pacer_insert(pacer, sx);
     }
 
-    const ts_packet_t *ts = (const ts_packet_t *)buf;
+    pacer->is_busy = false;
 
-    /* update block count */
-    for (size_t i = 0; i < count; i++)
+    if (pacer->count > 0)
+        pacer_arm(pacer, now);
+    else
+        pacer_free(pacer);
+}
+
+/* returns false if pacer_tick() is running `sx' and will free it */
+static
+bool pacer_remove(mpegts_sync_t *sx)
+{
+    sync_pacer_t *const pacer = sx->pacer;
+
+    if (pacer->current == sx)
     {
-        if (TS_IS_PCR(ts[i]) && TS_GET_PID(ts[i]) == sx->pcr_pid)
-            sx->num_blocks++;
+        /* not in the heap; let sync_run() finish without callbacks */
+        pacer->current = NULL;
+        sx->on_ready = NULL;
+        sx->on_write = NULL;
+
+        return false;
+    }
+
+    pacer_delete(pacer, sx);
+    sx->pacer = NULL;
+
+    if (pacer->count == 0 && !pacer->is_busy)
+        pacer_free(pacer);
+
+    return true;
+}
+
+/* hand the buffer over to the calling loop's pacer */
+void mpegts_sync_start(mpegts_sync_t *sx)
+{
+    asc_assert(sx->pacer == NULL, MSG("sync is already running"));
+
+    asc_loop_t *const loop = asc_loop_current();
+    const unsigned int id = (loop != NULL) ? asc_loop_id(loop) : 0;
+
+    sync_pacer_t *pacer = pacer_list[id];
+    if (pacer == NULL)
+    {
+        pacer = ASC_ALLOC(1, sync_pacer_t);
+        pacer->size = PACER_HEAP_SIZE;
+        pacer->heap = ASC_ALLOC(pacer->size, mpegts_sync_t *);
+        pacer->slot = &pacer_list[id];
+
+        pacer_list[id] = pacer;
+    }
+
+    const uint64_t now = asc_utime();
+    sx->deadline = now + SYNC_INTERVAL_MSEC * 1000;
+    sx->pacer = pacer;
+
+    pacer_insert(pacer, sx);
+    if (!pacer->is_busy)
+        pacer_arm(pacer, now);
+}
+
+/* make room for `count' more packets */
+static
+bool buffer_reserve(mpegts_sync_t *sx, size_t count)
+{
+    while (buffer_slots(sx, false) < count)
+    {
+        if (!buffer_resize(sx, 0))
+            return false;
+    }
+
+    return true;
+}
+
+bool mpegts_sync_push(mpegts_sync_t *sx, const void *buf, size_t count)
+{
+    if (!buffer_reserve(sx, count))
+    {
+        if (!sx->num_blocks)
+        {
+            /* buffer is at maximum size, yet we couldn't find PCR */
+            asc_log_error(MSG("PCR absent or invalid; dropping %zu packet%s")
+                          , count, (count > 1) ? "s" : "");
+        }
+
+        return false;
     }
 
+    const ts_packet_t *ts = (const ts_packet_t *)buf;
+    index_packets(sx, ts, count);
+
+    sx->rcv_seq += count;
     while (count > 0)
     {
         size_t chunk = sx->size - sx->pos.rcv;
@@ -700,6 +1295,52 @@ bool mpegts_sync_push(mpegts_sync_t *sx, const void *buf, size_t count)
     return true;
 }
 
+uint8_t *mpegts_sync_reserve(mpegts_sync_t *sx, size_t *count)
+{
+    if (!buffer_reserve(sx, *count))
+    {
+        /* settle for what's left */
+        const size_t left = buffer_slots(sx, false);
+        if (left < *count)
+        {
+            if (!sx->num_blocks)
+            {
+                /* buffer is at maximum size, yet we couldn't find PCR */
+                const size_t drop = *count - left;
+                asc_log_error(MSG("PCR absent or invalid; dropping %zu packet%s")
+                              , drop, (drop > 1) ? "s" : "");
+            }
+
+            *count = left;
+        }
+    }
+
+    /* contiguous part only */
+    const size_t chunk = sx->size - sx->pos.rcv;
+    if (*count > chunk)
+        *count = chunk;
+
+    sx->reserved = *count;
+    if (*count == 0)
+        return NULL;
+
+    return sx->buf[sx->pos.rcv];
+}
+
+void mpegts_sync_commit(mpegts_sync_t *sx, size_t count)
+{
+    asc_assert(count <= sx->reserved, MSG("commit exceeds reserved space"));
+    sx->reserved = 0;
+
+    index_packets(sx, (const ts_packet_t *)&sx->buf[sx->pos.rcv], count);
+
+    sx->rcv_seq += count;
+    sx->pos.rcv += count;
+    if (sx->pos.rcv >= sx->size)
+        /* buffer wrap around */
+        sx->pos.rcv = 0;
+}
+
 void mpegts_sync_reset(mpegts_sync_t *sx, enum mpegts_sync_reset type)
 {
     switch (type) {
@@ -719,8 +1360,12 @@ void mpegts_sync_reset(mpegts_sync_t *sx, enum mpegts_sync_reset type)
             sx->pcr_pid = sx->offset = 0;
             sx->pcr_last = sx->pcr_cur = XTS_NONE;
             sx->bitrate = sx->pending = 0.0;
+            sx->lead_added = false;
 
             /* start searching from first packet in queue */
             sx->pos.pcr = sx->pos.send;
+
+            index_trim(sx);
+            sx->idx.next = sx->idx.head;
     }
 }
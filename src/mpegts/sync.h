@@ -25,7 +25,7 @@
 #   error "Please include <astra.h> first"
 #endif /* !_ASTRA_H_ */
 
-/* default timer interval */
+/* polling interval while buffering */
 #define SYNC_INTERVAL_MSEC 1 /* 1ms */
 
 typedef struct mpegts_sync_t mpegts_sync_t;
@@ -51,6 +51,15 @@ typedef struct
     size_t want;
     double bitrate;
     unsigned int num_blocks;
+
+    /* pacer lateness, usecs: moving average and worst case */
+    double jitter_avg;
+    uint64_t jitter_max;
+
+    /* buffer resizes and packets copied by them */
+    unsigned int grows;
+    unsigned int shrinks;
+    uint64_t moved;
 } mpegts_sync_stat_t;
 
 mpegts_sync_t *mpegts_sync_init(void) __wur;
@@ -63,6 +72,14 @@ void mpegts_sync_set_on_ready(mpegts_sync_t *sx, sync_callback_t on_ready);
 void mpegts_sync_set_on_write(mpegts_sync_t *sx, ts_callback_t on_write);
 void mpegts_sync_set_arg(mpegts_sync_t *sx, void *arg);
 
+/*
+ * With a non-zero lead, packets are written up to that many usecs
+ * before they're due. mpegts_sync_txtime() returns the time (in
+ * asc_utime() units) the packet being written should leave at.
+ */
+void mpegts_sync_set_lead(mpegts_sync_t *sx, unsigned int usecs);
+uint64_t mpegts_sync_txtime(const mpegts_sync_t *sx) __func_pure;
+
 /*
  * Option string format:
  *    [normal = 20],[low = 10],[max size in MiB = 32]
@@ -83,8 +100,25 @@ bool mpegts_sync_set_blocks(mpegts_sync_t *sx, unsigned int enough
 
 void mpegts_sync_query(const mpegts_sync_t *sx, mpegts_sync_stat_t *out);
 
+/*
+ * Buffers are normally paced by a scheduler shared by every buffer on
+ * the calling loop. Alternatively, call mpegts_sync_loop() from a
+ * timer of your own.
+ */
+void mpegts_sync_start(mpegts_sync_t *sx);
 void mpegts_sync_loop(void *arg);
+
 bool mpegts_sync_push(mpegts_sync_t *sx, const void *buf, size_t count) __wur;
+
+/*
+ * Zero-copy alternative to mpegts_sync_push(). Reserve returns room for
+ * up to `*count' packets at the end of the buffer, lowering `*count' if
+ * there's less space before it wraps around, or NULL if it's full.
+ * Commit then adds the first `count' packets written there. Don't call
+ * anything else on the buffer in between.
+ */
+uint8_t *mpegts_sync_reserve(mpegts_sync_t *sx, size_t *count) __wur;
+void mpegts_sync_commit(mpegts_sync_t *sx, size_t count);
 void mpegts_sync_reset(mpegts_sync_t *sx, enum mpegts_sync_reset type);
 
 #endif /* _TS_SYNC_ */
@@ -31,6 +31,7 @@
 #define TS_BODY_SIZE (TS_PACKET_SIZE - TS_HEADER_SIZE)
 
 #define M2TS_PACKET_SIZE 192
+#define RS_PACKET_SIZE 204
 
 #define MAX_PID 8192
 #define NULL_TS_PID (MAX_PID - 1)
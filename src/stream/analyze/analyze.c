@@ -39,6 +39,7 @@
 #include <core/timer.h>
 #include <luaapi/stream.h>
 #include <mpegts/descriptors.h>
+#include <mpegts/pidmap.h>
 #include <mpegts/pes.h>
 #include <mpegts/psi.h>
 
@@ -80,12 +81,11 @@ struct module_data_t
     uint16_t tsid;
 
     asc_timer_t *check_stat;
-    analyze_item_t *stream[MAX_PID];
+    mpegts_pidmap_t stream;
 
-    mpegts_psi_t *pat;
-    mpegts_psi_t *cat;
-    mpegts_psi_t *pmt;
-    mpegts_psi_t *sdt;
+    // tables come from the upstream's shared assemblers
+    uint32_t pat_crc;
+    uint32_t cat_crc;
 
     int pmt_ready;
     int pmt_count;
@@ -101,6 +101,23 @@ struct module_data_t
     int rate[10];
 };
 
+static inline analyze_item_t *get_item(module_data_t *mod, uint16_t pid)
+{
+    return (analyze_item_t *)mpegts_pidmap_get(&mod->stream, pid);
+}
+
+static analyze_item_t *add_item(module_data_t *mod, uint16_t pid)
+{
+    analyze_item_t *item = get_item(mod, pid);
+    if(!item)
+    {
+        item = ASC_ALLOC(1, analyze_item_t);
+        mpegts_pidmap_set(&mod->stream, pid, item);
+    }
+
+    return item;
+}
+
 #define MSG(_msg) "[analyze %s] " _msg, mod->name
 
 static const char __pid[] = "pid";
@@ -132,9 +149,10 @@ static void callback(lua_State *L, module_data_t *mod)
  *
  */
 
-static void on_pat(void *arg, mpegts_psi_t *psi)
+static void on_pmt(module_data_t *mod, const mpegts_psi_t *psi);
+
+static void on_pat(module_data_t *mod, const mpegts_psi_t *psi)
 {
-    module_data_t *const mod = (module_data_t *)arg;
     lua_State *const L = MODULE_L(mod);
 
     if(psi->buffer[0] != 0x00)
@@ -142,7 +160,7 @@ static void on_pat(void *arg, mpegts_psi_t *psi)
 
     // check changes
     const uint32_t crc32 = PSI_GET_CRC32(psi);
-    if(crc32 == psi->crc32)
+    if(crc32 == mod->pat_crc)
         return;
 
     lua_newtable(L);
@@ -151,7 +169,7 @@ static void on_pat(void *arg, mpegts_psi_t *psi)
     lua_setfield(L, -2, __pid);
 
     // check crc
-    if(crc32 != PSI_CALC_CRC32(psi))
+    if(crc32 != psi->crc32)
     {
         lua_pushstring(L, "PAT checksum error");
         lua_setfield(L, -2, __err);
@@ -159,15 +177,23 @@ static void on_pat(void *arg, mpegts_psi_t *psi)
         return;
     }
 
-    psi->crc32 = crc32;
+    mod->pat_crc = crc32;
     mod->tsid = PAT_GET_TSID(psi);
 
     lua_pushstring(L, "pat");
     lua_setfield(L, -2, __psi);
 
-    lua_pushnumber(L, psi->crc32);
+    lua_pushnumber(L, crc32);
     lua_setfield(L, -2, __crc32);
 
+    // PMT PIDs may have changed
+    for(int i = 0; i < MAX_PID; ++i)
+    {
+        const analyze_item_t *const item = get_item(mod, i);
+        if(item && item->type == MPEGTS_PACKET_PMT)
+            module_stream_psi_leave(mod, i);
+    }
+
     lua_pushinteger(L, mod->tsid);
     lua_setfield(L, -2, __tsid);
 
@@ -193,19 +219,19 @@ static void on_pat(void *arg, mpegts_psi_t *psi)
         lua_setfield(L, -2, __pid);
         lua_settable(L, -3); // append to the "programs" table
 
-        if(!mod->stream[pid])
-            mod->stream[pid] = ASC_ALLOC(1, analyze_item_t);
+        analyze_item_t *const item = add_item(mod, pid);
 
         if(pnr != 0)
         {
-            mod->stream[pid]->type = MPEGTS_PACKET_PMT;
+            item->type = MPEGTS_PACKET_PMT;
             if(mod->join_pid)
                 module_stream_demux_join_pid(mod, pid);
+            module_stream_psi_join_raw(mod, pid, on_pmt);
             ++ mod->pmt_count;
         }
         else
         {
-            mod->stream[pid]->type = MPEGTS_PACKET_NIT;
+            item->type = MPEGTS_PACKET_NIT;
             if(mod->join_pid)
                 module_stream_demux_join_pid(mod, pid);
         }
@@ -228,9 +254,8 @@ static void on_pat(void *arg, mpegts_psi_t *psi)
  *
  */
 
-static void on_cat(void *arg, mpegts_psi_t *psi)
+static void on_cat(module_data_t *mod, const mpegts_psi_t *psi)
 {
-    module_data_t *const mod = (module_data_t *)arg;
     lua_State *const L = MODULE_L(mod);
 
     if(psi->buffer[0] != 0x01)
@@ -238,7 +263,7 @@ static void on_cat(void *arg, mpegts_psi_t *psi)
 
     // check changes
     const uint32_t crc32 = PSI_GET_CRC32(psi);
-    if(crc32 == psi->crc32)
+    if(crc32 == mod->cat_crc)
         return;
 
     lua_newtable(L);
@@ -247,19 +272,19 @@ static void on_cat(void *arg, mpegts_psi_t *psi)
     lua_setfield(L, -2, __pid);
 
     // check crc
-    if(crc32 != PSI_CALC_CRC32(psi))
+    if(crc32 != psi->crc32)
     {
         lua_pushstring(L, "CAT checksum error");
         lua_setfield(L, -2, __err);
         callback(L, mod);
         return;
     }
-    psi->crc32 = crc32;
+    mod->cat_crc = crc32;
 
     lua_pushstring(L, "cat");
     lua_setfield(L, -2, __psi);
 
-    lua_pushnumber(L, psi->crc32);
+    lua_pushnumber(L, crc32);
     lua_setfield(L, -2, __crc32);
 
     int descriptors_count = 1;
@@ -287,9 +312,8 @@ static void on_cat(void *arg, mpegts_psi_t *psi)
  *
  */
 
-static void on_pmt(void *arg, mpegts_psi_t *psi)
+static void on_pmt(module_data_t *mod, const mpegts_psi_t *psi)
 {
-    module_data_t *const mod = (module_data_t *)arg;
     lua_State *const L = MODULE_L(mod);
 
     if(psi->buffer[0] != 0x02)
@@ -298,7 +322,7 @@ static void on_pmt(void *arg, mpegts_psi_t *psi)
     const uint32_t crc32 = PSI_GET_CRC32(psi);
 
     // check crc
-    if(crc32 != PSI_CALC_CRC32(psi))
+    if(crc32 != psi->crc32)
     {
         lua_newtable(L);
 
@@ -384,11 +408,10 @@ static void on_pmt(void *arg, mpegts_psi_t *psi)
         lua_pushinteger(L, streams_count++);
         lua_newtable(L);
 
-        if(!mod->stream[pid])
-            mod->stream[pid] = ASC_ALLOC(1, analyze_item_t);
+        analyze_item_t *const item = add_item(mod, pid);
 
         const stream_type_t *const st = mpegts_stream_type(type);
-        mod->stream[pid]->type = st->pkt_type;
+        item->type = st->pkt_type;
 
         lua_pushinteger(L, pid);
         lua_setfield(L, -2, __pid);
@@ -401,12 +424,12 @@ static void on_pmt(void *arg, mpegts_psi_t *psi)
             mpegts_desc_to_lua(L, desc_pointer);
             lua_settable(L, -3); // append to the "streams[X].descriptors" table
 
-            if(type == 0x06 && mod->stream[pid]->type == MPEGTS_PACKET_DATA)
-                mod->stream[pid]->type = mpegts_priv_type(desc_pointer[0]);
+            if(type == 0x06 && item->type == MPEGTS_PACKET_DATA)
+                item->type = mpegts_priv_type(desc_pointer[0]);
         }
         lua_setfield(L, -2, __descriptors);
 
-        lua_pushstring(L, mpegts_type_name(mod->stream[pid]->type));
+        lua_pushstring(L, mpegts_type_name(item->type));
         lua_setfield(L, -2, "type_name");
 
         lua_pushinteger(L, type);
@@ -417,7 +440,7 @@ static void on_pmt(void *arg, mpegts_psi_t *psi)
 
         lua_settable(L, -3); // append to the "streams" table
 
-        if(mod->stream[pid]->type == MPEGTS_PACKET_VIDEO)
+        if(item->type == MPEGTS_PACKET_VIDEO)
             mod->video_check = true;
     }
     lua_setfield(L, -2, "streams");
@@ -434,9 +457,8 @@ static void on_pmt(void *arg, mpegts_psi_t *psi)
  *
  */
 
-static void on_sdt(void *arg, mpegts_psi_t *psi)
+static void on_sdt(module_data_t *mod, const mpegts_psi_t *psi)
 {
-    module_data_t *const mod = (module_data_t *)arg;
     lua_State *const L = MODULE_L(mod);
 
     if(psi->buffer[0] != 0x42)
@@ -448,7 +470,7 @@ static void on_sdt(void *arg, mpegts_psi_t *psi)
     const uint32_t crc32 = PSI_GET_CRC32(psi);
 
     // check crc
-    if(crc32 != PSI_CALC_CRC32(psi))
+    if(crc32 != psi->crc32)
     {
         lua_newtable(L);
 
@@ -597,37 +619,15 @@ static void on_ts(module_data_t *mod, const uint8_t *ts)
     const uint16_t pid = TS_GET_PID(ts);
     analyze_item_t *item = NULL;
     if(ts[0] == 0x47 && pid < MAX_PID)
-        item = mod->stream[pid];
+        item = get_item(mod, pid);
     if(!item)
-        item = mod->stream[NULL_TS_PID];
+        item = get_item(mod, NULL_TS_PID);
 
     ++item->packets;
 
     if(item->type == MPEGTS_PACKET_NULL)
         return;
 
-    if(item->type & (MPEGTS_PACKET_PSI | MPEGTS_PACKET_SI))
-    {
-        switch(item->type)
-        {
-            case MPEGTS_PACKET_PAT:
-                mpegts_psi_mux(mod->pat, ts, on_pat, mod);
-                break;
-            case MPEGTS_PACKET_CAT:
-                mpegts_psi_mux(mod->cat, ts, on_cat, mod);
-                break;
-            case MPEGTS_PACKET_PMT:
-                mod->pmt->pid = pid;
-                mpegts_psi_mux(mod->pmt, ts, on_pmt, mod);
-                break;
-            case MPEGTS_PACKET_SDT:
-                mpegts_psi_mux(mod->sdt, ts, on_sdt, mod);
-                break;
-            default:
-                break;
-        }
-    }
-
     // Analyze
 
     // skip packets without payload
@@ -686,7 +686,7 @@ static void on_check_stat(void *arg)
     lua_newtable(L);
     for(int i = 0; i < MAX_PID; ++i)
     {
-        analyze_item_t *item = mod->stream[i];
+        analyze_item_t *item = get_item(mod, i);
 
         if(!item)
             continue;
@@ -800,25 +800,18 @@ static void module_init(lua_State *L, module_data_t *mod)
     }
 
     // PAT
-    mod->stream[0x00] = ASC_ALLOC(1, analyze_item_t);
-    mod->stream[0x00]->type = MPEGTS_PACKET_PAT;
-    mod->pat = mpegts_psi_init(MPEGTS_PACKET_PAT, 0x00);
+    add_item(mod, 0x00)->type = MPEGTS_PACKET_PAT;
+    module_stream_psi_join_raw(mod, 0x00, on_pat);
     // CAT
-    mod->stream[0x01] = ASC_ALLOC(1, analyze_item_t);
-    mod->stream[0x01]->type = MPEGTS_PACKET_CAT;
-    mod->cat = mpegts_psi_init(MPEGTS_PACKET_CAT, 0x01);
+    add_item(mod, 0x01)->type = MPEGTS_PACKET_CAT;
+    module_stream_psi_join_raw(mod, 0x01, on_cat);
     // SDT
-    mod->stream[0x11] = ASC_ALLOC(1, analyze_item_t);
-    mod->stream[0x11]->type = MPEGTS_PACKET_SDT;
-    mod->sdt = mpegts_psi_init(MPEGTS_PACKET_SDT, 0x11);
+    add_item(mod, 0x11)->type = MPEGTS_PACKET_SDT;
+    module_stream_psi_join_raw(mod, 0x11, on_sdt);
     // EIT
-    mod->stream[0x12] = ASC_ALLOC(1, analyze_item_t);
-    mod->stream[0x12]->type = MPEGTS_PACKET_EIT;
-    // PMT
-    mod->pmt = mpegts_psi_init(MPEGTS_PACKET_PMT, MAX_PID);
+    add_item(mod, 0x12)->type = MPEGTS_PACKET_EIT;
     // NULL
-    mod->stream[NULL_TS_PID] = ASC_ALLOC(1, analyze_item_t);
-    mod->stream[NULL_TS_PID]->type = MPEGTS_PACKET_NULL;
+    add_item(mod, NULL_TS_PID)->type = MPEGTS_PACKET_NULL;
 
     mod->check_stat = asc_timer_init(1000, on_check_stat, mod);
 }
@@ -835,14 +828,11 @@ static void module_destroy(module_data_t *mod)
 
     for(int i = 0; i < MAX_PID; ++i)
     {
-        if(mod->stream[i])
-            free(mod->stream[i]);
+        analyze_item_t *const item = get_item(mod, i);
+        if(item)
+            free(item);
     }
-
-    mpegts_psi_destroy(mod->pat);
-    mpegts_psi_destroy(mod->cat);
-    mpegts_psi_destroy(mod->sdt);
-    mpegts_psi_destroy(mod->pmt);
+    mpegts_pidmap_clear(&mod->stream);
 
     asc_timer_destroy(mod->check_stat);
 
@@ -200,4 +200,4 @@ MODULE_LUA_METHODS()
 {
     MODULE_STREAM_METHODS_REF(),
 };
-MODULE_LUA_REGISTER(biss_encrypt)
+MODULE_LUA_REGISTER_LOOP(biss_encrypt)
@@ -35,6 +35,7 @@
  *                    type: video, audio, rus, eng... and other languages code
  *                     pid: number identifier in range 32-8190
  *      filter      - list, drop PID
+ *      loop        - number, worker loop to run on (default: 0, main loop)
  */
 
 #include <astra.h>
@@ -42,6 +43,9 @@
 #include <luaapi/stream.h>
 #include <mpegts/psi.h>
 
+/* spare blocks kept for packets with rewritten PIDs */
+#define CHANNEL_POOL_CACHE 8
+
 typedef struct
 {
     char type[6];
@@ -72,12 +76,14 @@ struct module_data_t
     /* */
     asc_list_t *map;
     uint16_t pid_map[MAX_PID];
-    uint8_t custom_ts[TS_PACKET_SIZE];
+    mpegts_block_pool_t *pool;
+
+    /* PAT, CAT, PMT and SDT come from upstream's shared assemblers */
+    uint16_t pmt_pid;
+    uint32_t pat_crc;
+    uint32_t cat_crc;
+    uint32_t pmt_crc;
 
-    mpegts_psi_t *pat;
-    mpegts_psi_t *cat;
-    mpegts_psi_t *pmt;
-    mpegts_psi_t *sdt;
     mpegts_psi_t *eit;
 
     mpegts_packet_type_t stream[MAX_PID];
@@ -111,23 +117,26 @@ static void stream_reload(module_data_t *mod)
             module_stream_demux_leave_pid(mod, __i);
     }
 
-    mod->pat->crc32 = 0;
-    mod->pmt->crc32 = 0;
+    /* PAT, CAT and SDT stay joined; PMT PID is taken from the next PAT */
+    module_stream_psi_leave(mod, mod->pmt_pid);
+    mod->pmt_pid = MAX_PID;
+
+    mod->pat_crc = 0;
+    mod->pmt_crc = 0;
 
     mod->stream[0x00] = MPEGTS_PACKET_PAT;
-    module_stream_demux_join_pid(mod, 0x00);
 
     if(mod->config.cas)
     {
-        mod->cat->crc32 = 0;
+        mod->cat_crc = 0;
         mod->stream[0x01] = MPEGTS_PACKET_CAT;
-        module_stream_demux_join_pid(mod, 0x01);
     }
 
     if(mod->config.no_sdt == false)
     {
         mod->stream[0x11] = MPEGTS_PACKET_SDT;
-        module_stream_demux_join_pid(mod, 0x11);
+        if(mod->config.pass_sdt)
+            module_stream_demux_join_pid(mod, 0x11);
         if(mod->sdt_checksum_list)
         {
             free(mod->sdt_checksum_list);
@@ -180,36 +189,31 @@ static void on_si_timer(void *arg)
  *
  */
 
-static void on_pat(void *arg, mpegts_psi_t *psi)
+static void on_pmt(module_data_t *mod, const mpegts_psi_t *psi);
+
+static void on_pat(module_data_t *mod, const mpegts_psi_t *psi)
 {
-    module_data_t *mod = (module_data_t *)arg;
+    if(mod->stream[psi->pid] != MPEGTS_PACKET_PAT)
+        return;
 
     if(psi->buffer[0] != 0x00)
         return;
 
     // check changes
-    const uint32_t crc32 = PSI_GET_CRC32(psi);
-    if(crc32 == psi->crc32)
+    if(psi->crc32 == mod->pat_crc)
     {
         mpegts_psi_demux(mod->custom_pat, __module_stream_send, &mod->__stream);
         return;
     }
 
-    // check crc
-    if(crc32 != PSI_CALC_CRC32(psi))
-    {
-        asc_log_error(MSG("PAT checksum error"));
-        return;
-    }
-
     // reload stream
-    if(psi->crc32 != 0)
+    if(mod->pat_crc != 0)
     {
         asc_log_warning(MSG("PAT changed. Reload stream info"));
         stream_reload(mod);
     }
 
-    psi->crc32 = crc32;
+    mod->pat_crc = psi->crc32;
 
     mod->tsid = PAT_GET_TSID(psi);
 
@@ -228,9 +232,9 @@ static void on_pat(void *arg, mpegts_psi_t *psi)
         {
             const uint16_t pid = PAT_ITEM_GET_PID(psi, pointer);
             mod->stream[pid] = MPEGTS_PACKET_PMT;
-            module_stream_demux_join_pid(mod, pid);
-            mod->pmt->pid = pid;
-            mod->pmt->crc32 = 0;
+            module_stream_psi_join(mod, pid, on_pmt);
+            mod->pmt_pid = pid;
+            mod->pmt_crc = 0;
             break;
         }
     }
@@ -242,11 +246,12 @@ static void on_pat(void *arg, mpegts_psi_t *psi)
         return;
     }
 
+    mpegts_psi_reserve(mod->custom_pat, 8 + 4 + CRC32_SIZE);
     const uint8_t pat_version = PAT_GET_VERSION(mod->custom_pat) + 1;
     PAT_INIT(mod->custom_pat, mod->tsid, pat_version);
     memcpy(PAT_ITEMS_FIRST(mod->custom_pat), pointer, 4);
 
-    mod->custom_pmt->pid = mod->pmt->pid;
+    mod->custom_pmt->pid = mod->pmt_pid;
 
     if(mod->config.set_pnr)
     {
@@ -262,11 +267,11 @@ static void on_pat(void *arg, mpegts_psi_t *psi)
             if(map_item->is_set)
                 continue;
 
-            if(   (map_item->origin_pid && map_item->origin_pid == mod->pmt->pid)
+            if(   (map_item->origin_pid && map_item->origin_pid == mod->pmt_pid)
                || (!strcmp(map_item->type, "pmt")) )
             {
                 map_item->is_set = true;
-                mod->pid_map[mod->pmt->pid] = map_item->custom_pid;
+                mod->pid_map[mod->pmt_pid] = map_item->custom_pid;
 
                 uint8_t *custom_pointer = PAT_ITEMS_FIRST(mod->custom_pat);
                 PAT_ITEM_SET_PID(mod->custom_pat, custom_pointer, map_item->custom_pid);
@@ -299,37 +304,30 @@ static void on_pat(void *arg, mpegts_psi_t *psi)
  *
  */
 
-static void on_cat(void *arg, mpegts_psi_t *psi)
+static void on_cat(module_data_t *mod, const mpegts_psi_t *psi)
 {
-    module_data_t *mod = (module_data_t *)arg;
+    if(mod->stream[psi->pid] != MPEGTS_PACKET_CAT)
+        return;
 
     if(psi->buffer[0] != 0x01)
         return;
 
     // check changes
-    const uint32_t crc32 = PSI_GET_CRC32(psi);
-    if(crc32 == psi->crc32)
+    if(psi->crc32 == mod->cat_crc)
     {
         mpegts_psi_demux(mod->custom_cat, __module_stream_send, &mod->__stream);
         return;
     }
 
-    // check crc
-    if(crc32 != PSI_CALC_CRC32(psi))
-    {
-        asc_log_error(MSG("CAT checksum error"));
-        return;
-    }
-
     // reload stream
-    if(psi->crc32 != 0)
+    if(mod->cat_crc != 0)
     {
         asc_log_warning(MSG("CAT changed. Reload stream info"));
         stream_reload(mod);
         return;
     }
 
-    psi->crc32 = crc32;
+    mod->cat_crc = psi->crc32;
 
     const uint8_t *desc_pointer;
 
@@ -348,8 +346,7 @@ static void on_cat(void *arg, mpegts_psi_t *psi)
         }
     }
 
-    memcpy(mod->custom_cat->buffer, psi->buffer, psi->buffer_size);
-    mod->custom_cat->buffer_size = psi->buffer_size;
+    mpegts_psi_copy(mod->custom_cat, psi);
     mod->custom_cat->cc = 0;
 
     mpegts_psi_demux(mod->custom_cat, __module_stream_send, &mod->__stream);
@@ -387,9 +384,10 @@ static uint16_t map_custom_pid(module_data_t *mod, uint16_t pid, const char *typ
     return 0;
 }
 
-static void on_pmt(void *arg, mpegts_psi_t *psi)
+static void on_pmt(module_data_t *mod, const mpegts_psi_t *psi)
 {
-    module_data_t *mod = (module_data_t *)arg;
+    if(mod->stream[psi->pid] != MPEGTS_PACKET_PMT)
+        return;
 
     if(psi->buffer[0] != 0x02)
         return;
@@ -400,31 +398,24 @@ static void on_pmt(void *arg, mpegts_psi_t *psi)
         return;
 
     // check changes
-    const uint32_t crc32 = PSI_GET_CRC32(psi);
-    if(crc32 == psi->crc32)
+    if(psi->crc32 == mod->pmt_crc)
     {
         mpegts_psi_demux(mod->custom_pmt, __module_stream_send, &mod->__stream);
         return;
     }
 
-    // check crc
-    if(crc32 != PSI_CALC_CRC32(psi))
-    {
-        asc_log_error(MSG("PMT checksum error"));
-        return;
-    }
-
     // reload stream
-    if(psi->crc32 != 0)
+    if(mod->pmt_crc != 0)
     {
         asc_log_warning(MSG("PMT changed. Reload stream info"));
         stream_reload(mod);
         return;
     }
 
-    psi->crc32 = crc32;
+    mod->pmt_crc = psi->crc32;
 
     uint16_t skip = 12;
+    mpegts_psi_reserve(mod->custom_pmt, psi->buffer_size);
     memcpy(mod->custom_pmt->buffer, psi->buffer, 10);
 
     const uint16_t pcr_pid = PMT_GET_PCR(psi);
@@ -606,9 +597,10 @@ static void on_pmt(void *arg, mpegts_psi_t *psi)
  *
  */
 
-static void on_sdt(void *arg, mpegts_psi_t *psi)
+static void on_sdt(module_data_t *mod, const mpegts_psi_t *psi)
 {
-    module_data_t *mod = (module_data_t *)arg;
+    if(mod->stream[psi->pid] != MPEGTS_PACKET_SDT)
+        return;
 
     if(psi->buffer[0] != 0x42)
         return;
@@ -616,14 +608,7 @@ static void on_sdt(void *arg, mpegts_psi_t *psi)
     if(mod->tsid != SDT_GET_TSID(psi))
         return;
 
-    const uint32_t crc32 = PSI_GET_CRC32(psi);
-
-    // check crc
-    if(crc32 != PSI_CALC_CRC32(psi))
-    {
-        asc_log_error(MSG("SDT checksum error"));
-        return;
-    }
+    const uint32_t crc32 = psi->crc32;
 
     // check changes
     if(!mod->sdt_checksum_list)
@@ -667,11 +652,13 @@ static void on_sdt(void *arg, mpegts_psi_t *psi)
 
     mod->sdt_original_section_id = section_id;
 
+    const uint16_t item_length = __SDT_ITEM_DESC_SIZE(pointer) + 5;
+    mpegts_psi_reserve(mod->custom_sdt, 11 + item_length + CRC32_SIZE);
+
     memcpy(mod->custom_sdt->buffer, psi->buffer, 11); // copy SDT header
     SDT_SET_SECTION_NUMBER(mod->custom_sdt, 0);
     SDT_SET_LAST_SECTION_NUMBER(mod->custom_sdt, 0);
 
-    const uint16_t item_length = __SDT_ITEM_DESC_SIZE(pointer) + 5;
     memcpy(&mod->custom_sdt->buffer[11], pointer, item_length);
     const uint16_t section_length = item_length + 8 + CRC32_SIZE;
     mod->custom_sdt->buffer_size = 3 + section_length;
@@ -737,60 +724,166 @@ static void on_eit(void *arg, mpegts_psi_t *psi)
  *
  */
 
-static void on_ts(module_data_t *mod, const uint8_t *ts)
+/*
+ * where a packet goes: 0 to pass it on as it is, a PID to pass it on
+ * with that PID, or MAX_PID if it's dropped or handled by on_ts_other()
+ */
+static inline uint16_t forward_pid(const module_data_t *mod, const uint8_t *ts)
 {
     const uint16_t pid = TS_GET_PID(ts);
-    if(!module_stream_demux_check_pid(mod, pid))
-        return;
-
-    if(pid == NULL_TS_PID)
-        return;
+    if(!module_stream_demux_check_pid(mod, pid) || pid == NULL_TS_PID)
+        return MAX_PID;
 
     switch(mod->stream[pid])
     {
-        case MPEGTS_PACKET_PES:
-            break;
         case MPEGTS_PACKET_PAT:
-            mpegts_psi_mux(mod->pat, ts, on_pat, mod);
-            return;
         case MPEGTS_PACKET_CAT:
-            mpegts_psi_mux(mod->cat, ts, on_cat, mod);
-            return;
         case MPEGTS_PACKET_PMT:
-            mpegts_psi_mux(mod->pmt, ts, on_pmt, mod);
-            return;
+            /* sections arrive through module_stream_psi_join() */
+        case MPEGTS_PACKET_UNKNOWN:
+            return MAX_PID;
         case MPEGTS_PACKET_SDT:
-            if(mod->config.pass_sdt)
-                break;
-            mpegts_psi_mux(mod->sdt, ts, on_sdt, mod);
-            return;
+            if(!mod->config.pass_sdt)
+                return MAX_PID;
+            break;
         case MPEGTS_PACKET_EIT:
-            if(mod->config.pass_eit)
-                break;
-            mpegts_psi_mux(mod->eit, ts, on_eit, mod);
-            return;
-        case MPEGTS_PACKET_UNKNOWN:
-            return;
+            if(!mod->config.pass_eit)
+                return MAX_PID;
+            break;
         default:
             break;
     }
 
-    if(mod->pid_map[pid] == MAX_PID)
-        return;
+    const uint16_t custom_pid = mod->pid_map[pid];
+    if(custom_pid == MAX_PID || mod->map != NULL)
+        return custom_pid;
 
-    if(mod->map)
+    return 0;
+}
+
+/* packets that are not forwarded; only EIT is of interest here */
+static void on_ts_other(module_data_t *mod, const uint8_t *ts)
+{
+    const uint16_t pid = TS_GET_PID(ts);
+
+    if(module_stream_demux_check_pid(mod, pid)
+       && mod->stream[pid] == MPEGTS_PACKET_EIT && !mod->config.pass_eit)
+    {
+        mpegts_psi_mux(mod->eit, ts, on_eit, mod);
+    }
+}
+
+static void rewrite_pids(module_data_t *mod, mpegts_block_t *block)
+{
+    for(size_t i = 0; i < block->count; ++i)
+    {
+        uint8_t *const ts = MPEGTS_BLOCK_TS(block, i);
+
+        const uint16_t custom_pid = forward_pid(mod, ts);
+        if(custom_pid != 0)
+            TS_SET_PID(ts, custom_pid);
+    }
+}
+
+/* copy packets once, into blocks children can keep, and remap them */
+static void send_rewritten(module_data_t *mod, const uint8_t *ts, size_t count)
+{
+    while(count > 0)
     {
-        const uint16_t custom_pid = mod->pid_map[pid];
-        if(custom_pid)
+        mpegts_block_t *const block = mpegts_block_alloc(mod->pool);
+        const size_t stored = mpegts_block_append(block, ts, count);
+
+        rewrite_pids(mod, block);
+        module_stream_send_block(mod, block);
+        mpegts_block_release(block);
+
+        ts += stored * TS_PACKET_SIZE;
+        count -= stored;
+    }
+}
+
+static void on_ts_batch(module_data_t *mod, const uint8_t *ts, size_t count)
+{
+    const uint8_t *run = ts;
+    size_t run_count = 0;
+    bool is_remap = false;
+
+    /* forward runs by reference unless they have PIDs to rewrite */
+    for(size_t i = 0; i <= count; ++i)
+    {
+        const uint8_t *const pkt = &ts[i * TS_PACKET_SIZE];
+        const uint16_t custom_pid =
+            (i < count) ? forward_pid(mod, pkt) : MAX_PID;
+
+        if(custom_pid != MAX_PID)
+        {
+            if(run_count == 0)
+                run = pkt;
+
+            ++run_count;
+            is_remap |= (custom_pid != 0);
+            continue;
+        }
+
+        if(run_count > 0)
         {
-            memcpy(mod->custom_ts, ts, TS_PACKET_SIZE);
-            TS_SET_PID(mod->custom_ts, custom_pid);
-            module_stream_send(mod, mod->custom_ts);
+            if(is_remap)
+                send_rewritten(mod, run, run_count);
+            else
+                module_stream_send_batch(mod, run, run_count);
+
+            run_count = 0;
+            is_remap = false;
+        }
+
+        if(i < count)
+            on_ts_other(mod, pkt);
+    }
+}
+
+static void on_ts(module_data_t *mod, const uint8_t *ts)
+{
+    on_ts_batch(mod, ts, 1);
+}
+
+static void on_ts_block(module_data_t *mod, mpegts_block_t *block)
+{
+    bool is_remap = false;
+
+    for(size_t i = 0; i < block->count; ++i)
+    {
+        const uint8_t *const ts = MPEGTS_BLOCK_TS(block, i);
+        const uint16_t custom_pid = forward_pid(mod, ts);
+        if(custom_pid == MAX_PID)
+        {
+            /* some packets stay behind */
+            on_ts_batch(mod, block->data, block->count);
             return;
         }
+
+        is_remap |= (custom_pid != 0);
+    }
+
+    /* nothing to drop or rewrite: children share upstream's block */
+    if(!is_remap)
+    {
+        module_stream_send_block(mod, block);
+        return;
+    }
+
+    if(block->count > MPEGTS_BLOCK_PACKETS)
+    {
+        send_rewritten(mod, block->data, block->count);
+        return;
     }
 
-    module_stream_send(mod, ts);
+    /* rewritten in place unless someone else holds the block too */
+    mpegts_block_retain(block);
+    mpegts_block_t *const out = mpegts_block_writable(block, mod->pool);
+
+    rewrite_pids(mod, out);
+    module_stream_send_block(mod, out);
+    mpegts_block_release(out);
 }
 
 /*
@@ -805,6 +898,8 @@ static void on_ts(module_data_t *mod, const uint8_t *ts)
 static void module_init(lua_State *L, module_data_t *mod)
 {
     module_stream_init(mod, on_ts);
+    module_stream_set_batch(mod, on_ts_batch);
+    module_stream_set_block(mod, on_ts_block);
     module_stream_demux_set(mod, NULL, NULL);
 
     module_option_string(L, "name", &mod->config.name, NULL);
@@ -816,29 +911,29 @@ static void module_init(lua_State *L, module_data_t *mod)
 
         module_option_boolean(L, "cas", &mod->config.cas);
 
-        mod->pat = mpegts_psi_init(MPEGTS_PACKET_PAT, 0);
-        mod->pmt = mpegts_psi_init(MPEGTS_PACKET_PMT, MAX_PID);
+        mod->pmt_pid = MAX_PID;
         mod->custom_pat = mpegts_psi_init(MPEGTS_PACKET_PAT, 0);
         mod->custom_pmt = mpegts_psi_init(MPEGTS_PACKET_PMT, MAX_PID);
         mod->stream[0] = MPEGTS_PACKET_PAT;
-        module_stream_demux_join_pid(mod, 0);
+        module_stream_psi_join(mod, 0, on_pat);
         if(mod->config.cas)
         {
-            mod->cat = mpegts_psi_init(MPEGTS_PACKET_CAT, 1);
             mod->custom_cat = mpegts_psi_init(MPEGTS_PACKET_CAT, 1);
             mod->stream[1] = MPEGTS_PACKET_CAT;
-            module_stream_demux_join_pid(mod, 1);
+            module_stream_psi_join(mod, 1, on_cat);
         }
 
         module_option_boolean(L, "no_sdt", &mod->config.no_sdt);
         if(mod->config.no_sdt == false)
         {
-            mod->sdt = mpegts_psi_init(MPEGTS_PACKET_SDT, 0x11);
             mod->custom_sdt = mpegts_psi_init(MPEGTS_PACKET_SDT, 0x11);
             mod->stream[0x11] = MPEGTS_PACKET_SDT;
-            module_stream_demux_join_pid(mod, 0x11);
 
             module_option_boolean(L, "pass_sdt", &mod->config.pass_sdt);
+            if(mod->config.pass_sdt)
+                module_stream_demux_join_pid(mod, 0x11);
+            else
+                module_stream_psi_join(mod, 0x11, on_sdt);
         }
 
         module_option_boolean(L, "no_eit", &mod->config.no_eit);
@@ -927,25 +1022,31 @@ static void module_init(lua_State *L, module_data_t *mod)
         }
     }
     lua_pop(L, 1); // filter~
+
+    if(mod->map)
+    {
+        mod->pool = mpegts_block_pool_init(MPEGTS_BLOCK_PACKETS
+                                           , CHANNEL_POOL_CACHE);
+    }
 }
 
 static void module_destroy(module_data_t *mod)
 {
     module_stream_destroy(mod);
 
-    mpegts_psi_destroy(mod->pat);
-    if(mod->cat)
-    {
-        mpegts_psi_destroy(mod->cat);
+    ASC_FREE(mod->pool, mpegts_block_pool_destroy);
+
+    if(mod->custom_cat)
         mpegts_psi_destroy(mod->custom_cat);
+
+    if(mod->custom_pat)
+    {
+        mpegts_psi_destroy(mod->custom_pat);
+        mpegts_psi_destroy(mod->custom_pmt);
     }
-    mpegts_psi_destroy(mod->pmt);
-    mpegts_psi_destroy(mod->custom_pat);
-    mpegts_psi_destroy(mod->custom_pmt);
 
-    if(mod->sdt)
+    if(mod->custom_sdt)
     {
-        mpegts_psi_destroy(mod->sdt);
         mpegts_psi_destroy(mod->custom_sdt);
 
         free(mod->sdt_checksum_list);
@@ -973,4 +1074,4 @@ MODULE_LUA_METHODS()
 {
     MODULE_STREAM_METHODS_REF(),
 };
-MODULE_LUA_REGISTER(channel)
+MODULE_LUA_REGISTER_LOOP(channel)
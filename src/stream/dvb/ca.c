@@ -1602,7 +1602,7 @@ static void on_pmt(void *arg, mpegts_psi_t *psi)
         ca_pmt->pnr = pnr;
         ca_pmt->buffer_size = 0;
         ca_pmt->psi = mpegts_psi_init(MPEGTS_PACKET_PMT, psi->pid);
-        memcpy(ca_pmt->psi, psi, sizeof(mpegts_psi_t));
+        mpegts_psi_copy(ca_pmt->psi, psi);
 
         asc_list_for(ca->ca_pmt_list_new)
         {
@@ -1780,6 +1780,11 @@ void ca_open(dvb_ca_t *ca)
     ca->ca_pmt_list_new = asc_list_init();
     ca->ca_pmt_list_del = asc_list_init();
 
+    /*
+     * dvb_input feeds CA straight from the DVR buffer before it becomes a
+     * stream, so there is no upstream with shared PSI assemblers to join.
+     * PAT and PMT are reassembled here for both dvb_input and ddci.
+     */
     ca->pat = mpegts_psi_init(MPEGTS_PACKET_PAT, 0x00);
     ca->pmt = mpegts_psi_init(MPEGTS_PACKET_PMT, MAX_PID);
 
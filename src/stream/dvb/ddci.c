@@ -105,36 +105,36 @@ static void on_thread_read(void *arg)
 static void thread_loop(void *arg)
 {
     module_data_t *mod = (module_data_t *)arg;
-    uint8_t ts[TS_PACKET_SIZE];
+    uint8_t drop[TS_PACKET_SIZE];
     uint64_t system_time, system_time_buffer = 0;
 
     mod->dec_sec_fd = open(mod->dev_name, O_RDONLY);
 
     while(1)
     {
-        const ssize_t len = read(mod->dec_sec_fd, ts, sizeof(ts));
+        // read straight into the ring; on overflow the packet is discarded
+        uint8_t *ts = (uint8_t *)asc_thread_buffer_reserve(mod->sec_thread_output
+                                                           , TS_PACKET_SIZE);
+        if(ts == NULL)
+            ts = drop;
+
+        const ssize_t len = read(mod->dec_sec_fd, ts, TS_PACKET_SIZE);
         if(len == -1)
             break;
 
-        if(len == sizeof(ts) && ts[0] == 0x47)
+        if(len == TS_PACKET_SIZE && ts[0] == 0x47 && ts != drop)
         {
-            const ssize_t r = asc_thread_buffer_write(mod->sec_thread_output, ts, sizeof(ts));
-            if(r != TS_PACKET_SIZE)
-            {
-                // overflow
-            }
-            else
+            asc_thread_buffer_commit(mod->sec_thread_output, TS_PACKET_SIZE);
+
+            /*
+             * TODO: add proper buffering with sync byte alignment checks
+             */
+            system_time = asc_utime();
+            if (system_time > system_time_buffer + 5000)
             {
-                /*
-                 * TODO: add proper buffering with sync byte alignment checks
-                 */
-                system_time = asc_utime();
-                if (system_time > system_time_buffer + 5000)
-                {
-                    system_time_buffer = system_time;
-                    asc_job_queue(mod->sec_thread_output, on_thread_read, mod);
-                    asc_wake();
-                }
+                system_time_buffer = system_time;
+                asc_job_queue(mod->sec_thread_output, on_thread_read, mod);
+                asc_wake();
             }
         }
     }
@@ -167,30 +167,52 @@ static void dvr_on_error(void *arg)
     dvr_open(mod);
 }
 
-static void dvr_on_read(void *arg)
+/* return false once the dvr is drained or reopened */
+static bool dvr_read(module_data_t *mod)
 {
-    module_data_t *mod = (module_data_t *)arg;
-
     const ssize_t len = read(mod->dvr_fd, mod->dvr_buffer, sizeof(mod->dvr_buffer));
     if(len <= 0)
     {
+        if(len == -1 && errno == EAGAIN)
+            return false;
+
         dvr_on_error(mod);
-        return;
+        return false;
     }
     mod->dvr_read += len;
 
-    for(int i = 0; i < len; i += TS_PACKET_SIZE)
+    const size_t count = len / TS_PACKET_SIZE;
+    if(mod->ca->ca_fd > 0)
     {
-        const uint8_t *ts = &mod->dvr_buffer[i];
+        for(size_t i = 0; i < count; ++i)
+            ca_on_ts(mod->ca, &mod->dvr_buffer[i * TS_PACKET_SIZE]);
+    }
 
-        if(mod->ca->ca_fd > 0)
-            ca_on_ts(mod->ca, ts);
+    module_stream_send_batch(mod, mod->dvr_buffer, count);
 
-        module_stream_send(mod, ts);
+    for(size_t i = 0; i < count; ++i)
+    {
+        const uint8_t *ts = &mod->dvr_buffer[i * TS_PACKET_SIZE];
 
         if(TS_IS_SYNC(ts) && TS_GET_PID(ts) == 0)
             mpegts_psi_mux(mod->pat, ts, on_pat, mod);
     }
+
+    /* short read, the ring buffer is empty */
+    return ((size_t)len == sizeof(mod->dvr_buffer));
+}
+
+static void dvr_on_read(void *arg)
+{
+    module_data_t *mod = (module_data_t *)arg;
+
+    for(unsigned int i = 0; i < ASC_EVENT_BUDGET; ++i)
+    {
+        if(!dvr_read(mod))
+            return;
+    }
+
+    asc_event_rearm(mod->dvr_event);
 }
 
 static void dvr_open(module_data_t *mod)
@@ -219,6 +241,7 @@ static void dvr_open(module_data_t *mod)
     }
 
     mod->dvr_event = asc_event_init(mod->dvr_fd, mod);
+    asc_event_set_edge(mod->dvr_event, true);
     asc_event_set_on_read(mod->dvr_event, dvr_on_read);
     asc_event_set_on_error(mod->dvr_event, dvr_on_error);
 }
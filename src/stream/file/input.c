@@ -39,6 +39,8 @@
 #define MSG(_msg) "[file_input %s] " _msg, mod->filename
 
 #define INPUT_BUFFER_SIZE 2
+#define THREAD_READ_BATCH 64
+#define THREAD_WRITE_BATCH 64
 
 struct module_data_t
 {
@@ -201,6 +203,9 @@ static void thread_loop(void *arg)
              , block_time, block_time_total = 0;
     size_t block_size = 0;
 
+    // bytes copied into the ring but not yet visible to the reader
+    size_t pending = 0;
+
     bool reset = true;
 
     if(!open_file(mod))
@@ -270,22 +275,34 @@ static void thread_loop(void *arg)
         const size_t block_end = mod->buffer_skip + block_size;
         while(mod->fd > 0 && mod->buffer_skip < block_end)
         {
-            // send
+            // send: copy straight into the ring, on overflow the packet
+            // is discarded
             mod->buffer_skip += mod->m2ts_header;
-            if(TS_PACKET_SIZE != asc_thread_buffer_write(  mod->thread_output
-                                                         , &mod->buffer[mod->buffer_skip]
-                                                         , TS_PACKET_SIZE))
+            uint8_t *const out = (uint8_t *)asc_thread_buffer_reserve(  mod->thread_output
+                                                                      , pending + TS_PACKET_SIZE);
+            if(out != NULL)
             {
-                ;
+                memcpy(&out[pending], &mod->buffer[mod->buffer_skip], TS_PACKET_SIZE);
+                pending += TS_PACKET_SIZE;
             }
             mod->buffer_skip += TS_PACKET_SIZE;
 
+            // publish in batches, and always before going to sleep
+            if(out == NULL || pending >= THREAD_WRITE_BATCH * TS_PACKET_SIZE)
+            {
+                asc_thread_buffer_commit(mod->thread_output, pending);
+                pending = 0;
+            }
+
             system_time = asc_utime();
             block_time_total += ts_sync;
 
             if(  (system_time < system_time_check) /* <-0s */
                ||(system_time > system_time_check + 1000000)) /* >+1s */
             {
+                asc_thread_buffer_commit(mod->thread_output, pending);
+                pending = 0;
+
                 asc_log_warning(MSG("system time changed"));
                 mod->buffer_skip = block_end;
                 reset = true;
@@ -298,6 +315,9 @@ static void thread_loop(void *arg)
              */
             if (system_time > system_time_buffer + 5000)
             {
+                asc_thread_buffer_commit(mod->thread_output, pending);
+                pending = 0;
+
                 system_time_buffer = system_time;
                 asc_job_queue(mod->thread_output, on_thread_read, mod);
                 asc_wake();
@@ -306,9 +326,17 @@ static void thread_loop(void *arg)
             system_time_check = system_time;
 
             if(block_time_total > system_time + 100)
+            {
+                asc_thread_buffer_commit(mod->thread_output, pending);
+                pending = 0;
+
                 asc_usleep(block_time_total - system_time);
+            }
         }
 
+        asc_thread_buffer_commit(mod->thread_output, pending);
+        pending = 0;
+
         if(reset)
             continue;
 
@@ -360,15 +388,15 @@ static void on_thread_read(void *arg)
 {
     module_data_t *mod = (module_data_t *)arg;
 
-    uint8_t ts[TS_PACKET_SIZE];
+    uint8_t ts[THREAD_READ_BATCH * TS_PACKET_SIZE];
     while (true)
     {
         const ssize_t r = asc_thread_buffer_read(mod->thread_output, ts
-                                                 , TS_PACKET_SIZE);
-        if (r != TS_PACKET_SIZE)
+                                                 , sizeof(ts));
+        if (r < TS_PACKET_SIZE)
             return;
 
-        module_stream_send(mod, ts);
+        module_stream_send_batch(mod, ts, r / TS_PACKET_SIZE);
     }
 }
 
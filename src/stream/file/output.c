@@ -28,6 +28,9 @@
  *      buffer_size - number, output buffer size. in kilobytes [default : 32]
  *      aio         - boolean, use aio [default : false]
  *      directio    - boolean, try to avoid all caching operations [default : false]
+ *      completion  - boolean, queue writes on the io_uring event ring instead
+ *                    of aio, falls back to write() [default : false]
+ *      loop        - number, worker loop to run on [default : 0, main loop]
  *
  * Module Methods:
  *      status      - return table with items:
@@ -35,6 +38,7 @@
  */
 
 #include <astra.h>
+#include <core/event.h>
 #include <luaapi/stream.h>
 
 #ifdef HAVE_AIO
@@ -69,11 +73,16 @@ struct module_data_t
 #ifdef HAVE_LIBAIO
         bool aio_kernel;
 #endif
+
+        bool completion;
     } config;
 
     int fd;
     bool error;
 
+    asc_event_io_t *io;
+    uint8_t *buffer_io;
+
 #ifdef HAVE_AIO
     struct aiocb aiocb;
     void *buffer_aio;
@@ -96,11 +105,46 @@ struct module_data_t
 
 static void module_destroy(module_data_t *mod);
 
+static void on_write(void *arg, ssize_t size)
+{
+    module_data_t *const mod = (module_data_t *)arg;
+
+    if(size < 0)
+    {
+        asc_log_error(MSG("write error: %s"), strerror(-size));
+        mod->error = true;
+        module_destroy(mod);
+    }
+}
+
 static void on_ts(module_data_t *mod, const uint8_t *ts)
 {
     if(mod->buffer_skip + mod->packet_size > mod->buffer_size || !ts)
     {
         ssize_t size;
+        if(mod->io)
+        {
+            if(asc_event_io_is_busy(mod->io))
+            {
+                if(!mod->error)
+                {
+                    asc_log_error(MSG("write in progress. "
+                                      "Try to increase buffer size"));
+                    mod->error = true;
+                }
+                return;
+            }
+
+#ifdef O_DIRECT
+            size = mod->config.directio ? align(mod->buffer_skip) : mod->buffer_skip;
+#else
+            size = mod->buffer_skip;
+#endif
+
+            memcpy(mod->buffer_io, mod->buffer, size);
+            asc_event_io_write(mod->io, mod->buffer_io, size, mod->file_size);
+        }
+        else
 #ifdef HAVE_AIO
         if(mod->config.aio)
         {
@@ -254,6 +298,12 @@ static void module_init(lua_State *L, module_data_t *mod)
     module_option_boolean(L, "aio", &mod->config.aio);
 #endif
 
+    module_option_boolean(L, "completion", &mod->config.completion);
+#ifdef HAVE_AIO
+    if(mod->config.completion)
+        mod->config.aio = false;
+#endif
+
 #ifdef HAVE_LIBAIO
     mod->config.aio_kernel = mod->config.aio && mod->config.directio;
 #endif
@@ -304,6 +354,31 @@ static void module_init(lua_State *L, module_data_t *mod)
     fstat(mod->fd, &st);
     mod->file_size = st.st_size;
 
+    if(mod->config.completion)
+    {
+        mod->io = asc_event_io_init(mod->fd, mod, on_write);
+        if(!mod->io)
+        {
+            asc_log_warning(MSG("completion writes are not available, "
+                                "using write()"));
+        }
+        else
+#if defined(HAVE_POSIX_MEMALIGN) && defined(O_DIRECT)
+        if(mod->config.directio)
+        {
+            if(posix_memalign((void **)&mod->buffer_io, ALIGN, mod->buffer_size))
+            {
+                asc_log_error(MSG("cannot malloc aligned memory"));
+                asc_lib_abort();
+            }
+        }
+        else
+#endif
+        {
+            mod->buffer_io = ASC_ALLOC(mod->buffer_size, uint8_t);
+        }
+    }
+
 #ifdef HAVE_AIO
     if(mod->config.aio)
     {
@@ -344,6 +419,9 @@ static void module_destroy(module_data_t *mod)
 {
     module_stream_destroy(mod);
 
+    /* lets the last queued write finish, the rest goes through write() */
+    ASC_FREE(mod->io, asc_event_io_close);
+
 #ifdef HAVE_AIO
     if(mod->config.aio)
     {
@@ -374,6 +452,7 @@ static void module_destroy(module_data_t *mod)
     }
 
     ASC_FREE(mod->buffer, free);
+    ASC_FREE(mod->buffer_io, free);
 
 #ifdef HAVE_AIO
     ASC_FREE(mod->buffer_aio, free);
@@ -384,4 +463,4 @@ MODULE_LUA_METHODS()
 {
     { "status", method_status },
 };
-MODULE_LUA_REGISTER(file_output)
+MODULE_LUA_REGISTER_LOOP(file_output)
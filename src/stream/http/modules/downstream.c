@@ -20,6 +20,7 @@
 
 #include <astra.h>
 #include <luaapi/stream.h>
+#include <mpegts/framer.h>
 
 #include "../http.h"
 
@@ -36,8 +37,7 @@ struct http_response_t
 
     module_data_t *mod;
 
-    uint8_t buffer[TS_PACKET_SIZE];
-    size_t buffer_skip;
+    mpegts_framer_t *framer;
 };
 
 /*
@@ -45,56 +45,42 @@ struct http_response_t
  * client->response->mod - http_upstream module
  */
 
-static void on_downstream_read(void *arg)
+static void on_downstream_ts(void *arg, const uint8_t *ts, size_t count)
 {
-    http_client_t *const client = (http_client_t *)arg;
+    http_response_t *const response = (http_response_t *)arg;
+    module_stream_send_batch(response, ts, count);
+}
 
+/* return false once the socket is drained or the client is closed */
+static bool downstream_recv(http_client_t *client)
+{
     const ssize_t size = asc_socket_recv(client->sock, client->buffer, HTTP_BUFFER_SIZE);
     if(size <= 0)
     {
         if (asc_socket_would_block())
-            return;
+            return false;
 
         http_client_close(client);
-        return;
+        return false;
     }
 
-    ssize_t skip = 0;
+    mpegts_framer_push(client->response->framer
+                       , (const uint8_t *)client->buffer, size);
 
-    if(client->response->buffer_skip > 0)
-    {
-        skip = TS_PACKET_SIZE - client->response->buffer_skip;
-        uint8_t *dst = &client->response->buffer[client->response->buffer_skip];
-        if(size < skip)
-        {
-            memcpy(dst, client->buffer, size);
-            client->response->buffer_skip += size;
-        }
-        else
-        {
-            memcpy(dst, client->buffer, skip);
-            module_stream_send(client->response, client->response->buffer);
-            client->response->buffer_skip = 0;
-        }
-    }
+    return (size == HTTP_BUFFER_SIZE);
+}
 
-    while(skip < size)
-    {
-        const uint8_t *ts = (const uint8_t *)&client->buffer[skip];
+static void on_downstream_read(void *arg)
+{
+    http_client_t *const client = (http_client_t *)arg;
 
-        const size_t remain = size - skip;
-        if(remain < TS_PACKET_SIZE)
-        {
-            memcpy(client->response->buffer, ts, remain);
-            client->response->buffer_skip = remain;
-            break;
-        }
-        else
-        {
-            module_stream_send(client->response, ts);
-            skip += TS_PACKET_SIZE;
-        }
+    for(unsigned int i = 0; i < ASC_EVENT_BUDGET; ++i)
+    {
+        if(!downstream_recv(client))
+            return;
     }
+
+    asc_socket_rearm(client->sock);
 }
 
 static void on_downstream_send(void *arg)
@@ -112,6 +98,8 @@ static void on_downstream_send(void *arg)
     client->on_ready = NULL;
     client->on_send = NULL;
 
+    asc_socket_set_edge(client->sock, true);
+
     const int idx_response = 3;
 
     lua_getfield(L, idx_response, "code");
@@ -153,6 +141,7 @@ static int module_call(lua_State *L, module_data_t *mod)
             lua_call(L, 3, 0);
 
             module_stream_destroy(client->response);
+            mpegts_framer_destroy(client->response->framer);
 
             free(client->response);
             client->response = NULL;
@@ -162,12 +151,15 @@ static int module_call(lua_State *L, module_data_t *mod)
 
     client->response = ASC_ALLOC(1, http_response_t);
     client->response->mod = mod;
+    client->response->framer = mpegts_framer_init(on_downstream_ts
+                                                  , client->response);
 
     client->on_send = on_downstream_send;
 
     // like module_stream_init()
     client->response->__stream.self = (module_data_t *)client;
     client->response->__stream.on_ts = NULL;
+    client->response->__stream.type = "http_downstream";
     __module_stream_init(&client->response->__stream);
 
     lua_rawgeti(L, LUA_REGISTRYINDEX, client->idx_request);
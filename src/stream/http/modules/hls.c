@@ -0,0 +1,678 @@
+/*
+ * Astra Module: HTTP Module: HLS Output
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Module Name:
+ *      hls_output
+ *
+ * Module Options:
+ *      upstream    - object, stream instance returned by module_instance:stream()
+ *      name        - string, instance name for logging
+ *      pnr         - number, program to segment (default: first in PAT)
+ *      duration    - number, target segment duration in seconds (default: 6)
+ *      window      - number, segments listed in the playlist (default: 5)
+ *
+ * Usage:
+ *      the instance is an http_server route handler. Mount it on a
+ *      wildcard route such as "/ch1/<asterisk>" to serve the playlist
+ *      as "/ch1/<anything>.m3u8" and segments as "/ch1/<seq>.ts".
+ *
+ * Segments are cut on random access points of the video PID, once
+ * `duration' has passed since the last cut. They are kept in memory
+ * and sent to every client from the same buffer.
+ */
+
+#include <astra.h>
+#include <ctype.h>
+#include <luaapi/stream.h>
+#include <mpegts/pes.h>
+#include <mpegts/psi.h>
+
+#include "../http.h"
+
+#define MSG(_msg) "[hls_output %s] " _msg, mod->__stream.name
+
+#define HLS_DEFAULT_DURATION 6
+#define HLS_DEFAULT_WINDOW 5
+
+/* first allocation for a segment; later ones start at the last size */
+#define HLS_SEGMENT_SIZE (1024 * 1024)
+
+/* give up on a segment that never sees a cut point */
+#define HLS_SEGMENT_MAX (64 * 1024 * 1024)
+
+#define PTS_MASK 0x1FFFFFFFFULL
+
+/*
+ * immutable once published; clients hold a reference while sending,
+ * so a buffer outlives its removal from the window.
+ */
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+
+    unsigned int refcnt;
+
+    uint64_t seq;
+    uint64_t duration; /* 90kHz */
+} hls_buffer_t;
+
+struct module_data_t
+{
+    MODULE_STREAM_DATA();
+
+    int pnr;
+    uint64_t duration;
+    unsigned int window;
+
+    /* PSI, re-emitted at the start of every segment */
+    mpegts_psi_t *pat;
+    mpegts_psi_t *pmt;
+    uint32_t pat_crc;
+    uint32_t pmt_crc;
+    uint8_t pat_version;
+    uint16_t pmt_pid;
+
+    uint16_t key_pid;
+    bool key_video;
+
+    /* segment being built */
+    hls_buffer_t *current;
+    uint64_t start_pts;
+
+    /* published segments, the last `window' are listed */
+    hls_buffer_t **store;
+    unsigned int store_size;
+    unsigned int store_count;
+    uint64_t sequence;
+
+    hls_buffer_t *playlist;
+};
+
+struct http_response_t
+{
+    hls_buffer_t *buffer;
+    size_t skip;
+};
+
+/*
+ * buffers
+ */
+
+static
+hls_buffer_t *buffer_alloc(size_t capacity)
+{
+    hls_buffer_t *const buffer = ASC_ALLOC(1, hls_buffer_t);
+
+    buffer->data = ASC_ALLOC(capacity, uint8_t);
+    buffer->capacity = capacity;
+    buffer->refcnt = 1;
+
+    return buffer;
+}
+
+static
+void buffer_release(hls_buffer_t *buffer)
+{
+    if (--buffer->refcnt > 0)
+        return;
+
+    free(buffer->data);
+    free(buffer);
+}
+
+static
+void segment_append(void *arg, const uint8_t *ts)
+{
+    module_data_t *const mod = (module_data_t *)arg;
+    hls_buffer_t *const seg = mod->current;
+
+    if (seg->size + TS_PACKET_SIZE > seg->capacity)
+    {
+        seg->capacity *= 2;
+        seg->data = (uint8_t *)realloc(seg->data, seg->capacity);
+        asc_assert(seg->data != NULL, MSG("realloc() failed"));
+    }
+
+    memcpy(&seg->data[seg->size], ts, TS_PACKET_SIZE);
+    seg->size += TS_PACKET_SIZE;
+}
+
+/* append formatted text, growing the buffer to fit */
+static __fmt_printf(2, 3)
+void playlist_printf(hls_buffer_t *playlist, const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    const int len = vsnprintf(NULL, 0, format, ap);
+    va_end(ap);
+
+    asc_assert(len >= 0, "[hls_output] vsnprintf() failed");
+
+    /* keep room for the terminating null */
+    const size_t need = playlist->size + len + 1;
+    if (need > playlist->capacity)
+    {
+        while (playlist->capacity < need)
+            playlist->capacity *= 2;
+
+        playlist->data = (uint8_t *)realloc(playlist->data
+                                            , playlist->capacity);
+        asc_assert(playlist->data != NULL, "[hls_output] realloc() failed");
+    }
+
+    va_start(ap, format);
+    vsnprintf((char *)&playlist->data[playlist->size]
+              , playlist->capacity - playlist->size, format, ap);
+    va_end(ap);
+
+    playlist->size += len;
+}
+
+static
+void playlist_update(module_data_t *mod)
+{
+    const unsigned int count = (mod->store_count < mod->window)
+                             ? mod->store_count : mod->window;
+    const uint64_t first = mod->sequence - count;
+
+    uint64_t max_duration = 0;
+    for (uint64_t seq = first; seq < mod->sequence; seq++)
+    {
+        const hls_buffer_t *const seg = mod->store[seq % mod->store_size];
+        if (seg->duration > max_duration)
+            max_duration = seg->duration;
+    }
+
+    /* EXTINF rounded to the nearest second must not exceed this */
+    unsigned int target = (max_duration + 45000) / 90000;
+    if (target == 0)
+        target = 1;
+
+    /* a guess; playlist_printf() grows it as needed */
+    hls_buffer_t *const playlist = buffer_alloc(128 + count * 64);
+
+    playlist_printf(playlist, "#EXTM3U\n"
+                              "#EXT-X-VERSION:3\n"
+                              "#EXT-X-TARGETDURATION:%u\n"
+                              "#EXT-X-MEDIA-SEQUENCE:%" PRIu64 "\n"
+                    , target, first);
+
+    for (uint64_t seq = first; seq < mod->sequence; seq++)
+    {
+        const hls_buffer_t *const seg = mod->store[seq % mod->store_size];
+
+        playlist_printf(playlist, "#EXTINF:%.3f,\n%" PRIu64 ".ts\n"
+                        , seg->duration / 90000.0, seq);
+    }
+
+    if (mod->playlist != NULL)
+        buffer_release(mod->playlist);
+
+    mod->playlist = playlist;
+}
+
+static
+void segment_publish(module_data_t *mod, uint64_t duration)
+{
+    hls_buffer_t *const seg = mod->current;
+    mod->current = NULL;
+
+    seg->seq = mod->sequence++;
+    seg->duration = duration;
+
+    hls_buffer_t **const slot = &mod->store[seg->seq % mod->store_size];
+    if (*slot != NULL)
+        buffer_release(*slot);
+    else
+        mod->store_count++;
+
+    *slot = seg;
+
+    playlist_update(mod);
+}
+
+static
+void segment_start(module_data_t *mod, uint64_t pts)
+{
+    size_t capacity = HLS_SEGMENT_SIZE;
+    if (mod->sequence > 0)
+    {
+        const hls_buffer_t *const last =
+            mod->store[(mod->sequence - 1) % mod->store_size];
+
+        /* leave room for a bitrate spike to avoid a realloc() */
+        if (last->size > capacity)
+            capacity = last->size + last->size / 4;
+    }
+
+    mod->current = buffer_alloc(capacity);
+    mod->start_pts = pts;
+
+    mpegts_psi_demux(mod->pat, segment_append, mod);
+    mpegts_psi_demux(mod->pmt, segment_append, mod);
+}
+
+static
+void segment_drop(module_data_t *mod)
+{
+    if (mod->current != NULL)
+    {
+        buffer_release(mod->current);
+        mod->current = NULL;
+    }
+}
+
+/*
+ * PSI
+ */
+
+static void on_pmt(module_data_t *mod, const mpegts_psi_t *psi);
+
+static
+void on_pat(module_data_t *mod, const mpegts_psi_t *psi)
+{
+    if (psi->buffer[0] != 0x00)
+        return;
+
+    if (psi->crc32 != mod->pat_crc)
+    {
+        const uint8_t *pointer;
+        uint16_t pnr = 0, pid = 0;
+
+        PAT_ITEMS_FOREACH(psi, pointer)
+        {
+            pnr = PAT_ITEM_GET_PNR(psi, pointer);
+            if (pnr != 0 && (mod->pnr == 0 || pnr == mod->pnr))
+            {
+                pid = PAT_ITEM_GET_PID(psi, pointer);
+                break;
+            }
+        }
+
+        if (pid == 0)
+        {
+            asc_log_error(MSG("PAT: program %d is not found"), mod->pnr);
+            return;
+        }
+
+        if (mod->pat_crc != 0)
+            asc_log_warning(MSG("PAT changed"));
+
+        mod->pat_crc = psi->crc32;
+
+        /* single program PAT */
+        mod->pat_version = (mod->pat_version + 1) & 0x0F;
+        mpegts_psi_reserve(mod->pat, 8 + 4 + CRC32_SIZE);
+        PAT_INIT(mod->pat, PAT_GET_TSID(psi), mod->pat_version);
+        PAT_ITEMS_APPEND(mod->pat, pnr, pid);
+        PSI_SET_CRC32(mod->pat);
+
+        if (pid != mod->pmt_pid)
+        {
+            if (mod->pmt_pid != 0)
+                module_stream_psi_leave(mod, mod->pmt_pid);
+
+            mod->pmt_pid = pid;
+            mod->pmt_crc = 0;
+            mod->pmt->pid = pid;
+            mod->pmt->buffer_size = 0;
+            mod->key_pid = 0;
+            segment_drop(mod);
+
+            module_stream_psi_join(mod, pid, on_pmt);
+        }
+    }
+
+    if (mod->current != NULL)
+        mpegts_psi_demux(mod->pat, segment_append, mod);
+}
+
+static
+void on_pmt(module_data_t *mod, const mpegts_psi_t *psi)
+{
+    if (psi->pid != mod->pmt_pid || psi->buffer[0] != 0x02)
+        return;
+
+    if (psi->crc32 != mod->pmt_crc)
+    {
+        const uint8_t *pointer;
+        uint16_t key_pid = 0;
+        bool key_video = false;
+
+        /* cut on video, or on any elementary stream for radio */
+        PMT_ITEMS_FOREACH(psi, pointer)
+        {
+            const uint8_t type = PMT_ITEM_GET_TYPE(psi, pointer);
+            const mpegts_packet_type_t pkt_type =
+                mpegts_stream_type(type)->pkt_type;
+
+            if (pkt_type == MPEGTS_PACKET_VIDEO)
+            {
+                key_pid = PMT_ITEM_GET_PID(psi, pointer);
+                key_video = true;
+                break;
+            }
+
+            if (key_pid == 0 && pkt_type == MPEGTS_PACKET_AUDIO)
+                key_pid = PMT_ITEM_GET_PID(psi, pointer);
+        }
+
+        if (key_pid == 0)
+        {
+            asc_log_error(MSG("PMT: no audio or video streams"));
+            return;
+        }
+
+        if (mod->pmt_crc != 0)
+            asc_log_warning(MSG("PMT changed"));
+
+        mod->pmt_crc = psi->crc32;
+        mpegts_psi_copy(mod->pmt, psi);
+
+        if (key_pid != mod->key_pid)
+        {
+            mod->key_pid = key_pid;
+            mod->key_video = key_video;
+            segment_drop(mod);
+        }
+    }
+
+    if (mod->current != NULL)
+        mpegts_psi_demux(mod->pmt, segment_append, mod);
+}
+
+/*
+ * segmenter
+ */
+
+/* PTS of the PES starting in this packet, or false if there's none */
+static
+bool packet_pts(const uint8_t *ts, uint64_t *pts)
+{
+    const uint8_t *const payload = TS_GET_PAYLOAD(ts);
+    if (payload == NULL || payload + PES_HEADER_SIZE + 5 > ts + TS_PACKET_SIZE)
+        return false;
+
+    if (PES_BUFFER_GET_HEADER(payload) != 0x000001 || !(payload[7] & 0x80))
+        return false;
+
+    *pts = PES_GET_PTS(payload);
+    return true;
+}
+
+static
+void on_key_packet(module_data_t *mod, const uint8_t *ts)
+{
+    uint64_t pts;
+    if (!packet_pts(ts, &pts))
+        return;
+
+    /* same as the key flag of mpegts_pes_t */
+    const bool is_key = !mod->key_video || TS_IS_RAI(ts);
+
+    if (mod->current == NULL)
+    {
+        if (is_key)
+            segment_start(mod, pts);
+
+        return;
+    }
+
+    const uint64_t elapsed = (pts - mod->start_pts) & PTS_MASK;
+
+    /* fall back to a cut without a key frame if they're too rare */
+    if (is_key ? (elapsed < mod->duration) : (elapsed < mod->duration * 2))
+        return;
+
+    /* timestamp jump, don't advertise it as the segment length */
+    uint64_t duration = elapsed;
+    if (duration > mod->duration * 3)
+        duration = mod->duration;
+
+    segment_publish(mod, duration);
+    segment_start(mod, pts);
+}
+
+static
+void on_ts(module_data_t *mod, const uint8_t *ts)
+{
+    const uint16_t pid = TS_GET_PID(ts);
+
+    /* PSI comes from our own copies */
+    if (pid == 0 || pid == mod->pmt_pid || pid == NULL_TS_PID)
+        return;
+
+    if (mod->key_pid == 0)
+        return;
+
+    if (pid == mod->key_pid && TS_IS_PAYLOAD_START(ts))
+        on_key_packet(mod, ts);
+
+    if (mod->current == NULL)
+        return;
+
+    if (mod->current->size >= HLS_SEGMENT_MAX)
+    {
+        asc_log_error(MSG("no cut point in %d bytes, dropping segment")
+                      , HLS_SEGMENT_MAX);
+        segment_drop(mod);
+        return;
+    }
+
+    segment_append(mod, ts);
+}
+
+/*
+ * HTTP
+ */
+
+static
+void on_ready_send_buffer(void *arg)
+{
+    http_client_t *const client = (http_client_t *)arg;
+    http_response_t *const response = client->response;
+    const hls_buffer_t *const buffer = response->buffer;
+
+    const ssize_t send_size = asc_socket_send(client->sock
+                                              , &buffer->data[response->skip]
+                                              , buffer->size - response->skip);
+    if (send_size == -1)
+    {
+        http_client_error(client, "failed to send response: %s"
+                          , asc_error_msg());
+        http_client_close(client);
+        return;
+    }
+
+    response->skip += send_size;
+
+    if (response->skip >= buffer->size)
+        http_client_close(client);
+}
+
+static
+hls_buffer_t *route_lookup(module_data_t *mod, const char *path
+                           , const char **content_type)
+{
+    const char *name = strrchr(path, '/');
+    name = (name != NULL) ? name + 1 : path;
+
+    const char *const ext = strrchr(name, '.');
+    if (ext == NULL)
+        return NULL;
+
+    if (!strcmp(ext, ".m3u8"))
+    {
+        *content_type = "application/vnd.apple.mpegurl";
+        return mod->playlist;
+    }
+
+    if (strcmp(ext, ".ts") != 0 || ext == name)
+        return NULL;
+
+    char *end = NULL;
+    const uint64_t seq = strtoull(name, &end, 10);
+    if (end != ext || !isdigit((unsigned char)name[0]))
+        return NULL;
+
+    /* anything within the store, including segments just left out of
+     * the playlist for clients still working through an older copy */
+    if (seq >= mod->sequence || mod->sequence - seq > mod->store_count)
+        return NULL;
+
+    *content_type = "video/MP2T";
+    return mod->store[seq % mod->store_size];
+}
+
+/* Stack: 1 - instance, 2 - server, 3 - client, 4 - request */
+static
+int module_call(lua_State *L, module_data_t *mod)
+{
+    http_client_t *const client = (http_client_t *)lua_touserdata(L, 3);
+
+    if (lua_isnil(L, 4))
+    {
+        if (client->response != NULL)
+        {
+            buffer_release(client->response->buffer);
+            ASC_FREE(client->response, free);
+        }
+
+        return 0;
+    }
+
+    lua_getfield(L, 4, "path");
+    const char *const path = lua_tostring(L, -1);
+    lua_pop(L, 1);
+
+    const char *content_type = NULL;
+    hls_buffer_t *const buffer =
+        (path != NULL) ? route_lookup(mod, path, &content_type) : NULL;
+
+    if (buffer == NULL)
+    {
+        http_client_abort(client, 404, NULL);
+        return 0;
+    }
+
+    buffer->refcnt++;
+
+    client->response = ASC_ALLOC(1, http_response_t);
+    client->response->buffer = buffer;
+
+    client->on_send = NULL;
+    client->on_read = NULL;
+    client->on_ready = on_ready_send_buffer;
+
+    http_response_code(client, 200, NULL);
+    http_response_header(client, "Cache-Control: %s"
+                         , (buffer == mod->playlist) ? "no-cache" : "max-age=60");
+    http_response_header(client, "Content-Type: %s", content_type);
+    http_response_header(client, "Content-Length: %zu", buffer->size);
+    http_response_header(client, "Connection: close");
+    http_response_send(client);
+
+    return 0;
+}
+
+static
+int __module_call(lua_State *L)
+{
+    module_data_t *const mod =
+        (module_data_t *)lua_touserdata(L, lua_upvalueindex(1));
+
+    return module_call(L, mod);
+}
+
+/*
+ * module
+ */
+
+static
+void module_init(lua_State *L, module_data_t *mod)
+{
+    module_stream_init(mod, on_ts);
+
+    module_option_integer(L, "pnr", &mod->pnr);
+
+    int duration = HLS_DEFAULT_DURATION;
+    module_option_integer(L, "duration", &duration);
+    if (duration <= 0)
+        luaL_error(L, MSG("duration must be above zero"));
+
+    mod->duration = duration * 90000ULL;
+
+    int window = HLS_DEFAULT_WINDOW;
+    module_option_integer(L, "window", &window);
+    if (window <= 0)
+        luaL_error(L, MSG("window must be above zero"));
+
+    mod->window = window;
+
+    /* keep segments around for as long as a playlist lists them */
+    mod->store_size = window * 2;
+    mod->store = ASC_ALLOC(mod->store_size, hls_buffer_t *);
+
+    mod->pat = mpegts_psi_init(MPEGTS_PACKET_PAT, 0);
+    mod->pmt = mpegts_psi_init(MPEGTS_PACKET_PMT, 0);
+
+    module_stream_psi_join(mod, 0, on_pat);
+
+    /* Set callback for http route */
+    lua_getmetatable(L, 3);
+    lua_pushlightuserdata(L, (void *)mod);
+    lua_pushcclosure(L, __module_call, 1);
+    lua_setfield(L, -2, "__call");
+    lua_pop(L, 1);
+}
+
+static
+void module_destroy(module_data_t *mod)
+{
+    module_stream_destroy(mod);
+
+    segment_drop(mod);
+
+    if (mod->store != NULL)
+    {
+        for (unsigned int i = 0; i < mod->store_size; i++)
+        {
+            if (mod->store[i] != NULL)
+                buffer_release(mod->store[i]);
+        }
+
+        ASC_FREE(mod->store, free);
+    }
+
+    ASC_FREE(mod->playlist, buffer_release);
+    ASC_FREE(mod->pat, mpegts_psi_destroy);
+    ASC_FREE(mod->pmt, mpegts_psi_destroy);
+}
+
+MODULE_STREAM_METHODS()
+MODULE_LUA_METHODS()
+{
+    MODULE_STREAM_METHODS_REF(),
+};
+MODULE_LUA_REGISTER(hls_output)
@@ -31,54 +31,136 @@ struct module_data_t
     MODULE_LUA_DATA();
 
     int idx_callback;
+    bool completion;
 };
 
-struct http_response_t
+/*
+ * clients watching the same upstream share a single ring buffer. every
+ * client keeps a read position and sends straight from the shared memory.
+ * positions are absolute byte counters, so a client is known to be lapped
+ * when the writer is more than a ring ahead of it.
+ */
+typedef struct
 {
-    MODULE_STREAM_DATA();
+    module_stream_t __stream;
 
-    module_data_t *mod;
+    /* stream the ring was requested for; the parent differs from it when
+     * the upstream runs on another loop and is reached through a link */
+    const module_stream_t *upstream;
 
     uint8_t *buffer;
-    size_t buffer_count;
-    size_t buffer_read;
-    size_t buffer_write;
+    size_t size;
+    uint64_t total;
+
+    asc_list_t *clients;
+} http_ring_t;
+
+struct http_response_t
+{
+    module_data_t *mod;
+
+    http_ring_t *ring;
+    uint64_t pos;
 
     size_t buffer_size;
     size_t buffer_fill;
 
+    /* completion mode: sends are queued on the event ring */
+    asc_event_io_t *io;
+
     bool is_socket_busy;
 };
 
+/* rings of the loop running on this thread */
+static __thread_local asc_list_t *ring_list = NULL;
+
 /*
  * client->mod - http_server module
  * client->response->mod - http_upstream module
  */
 
-static void on_upstream_ready(void *arg)
+/* next contiguous piece of the ring to send, 0 when the client is done */
+static size_t upstream_chunk(http_client_t *client, const uint8_t **data)
+{
+    http_response_t *const response = client->response;
+    const http_ring_t *const ring = response->ring;
+
+    if(ring->total - response->pos > ring->size)
+    {
+        // overflow, skip to the most recent data
+        http_client_warning(client, "client is too slow, dropped %" PRIu64 " bytes"
+                            , ring->total - response->pos);
+        response->pos = ring->total;
+    }
+
+    const size_t count = ring->total - response->pos;
+    const size_t buffer_read = response->pos % ring->size;
+
+    size_t block_size = ring->size - buffer_read;
+    if(block_size > count)
+        block_size = count;
+
+    *data = &ring->buffer[buffer_read];
+    return block_size;
+}
+
+/*
+ * completion mode keeps one send in flight per client. A client lapped
+ * while its send is queued gets the newer, still packet-aligned data
+ * from that part of the ring; the next chunk then skips ahead as usual.
+ */
+static void upstream_queue(http_client_t *client)
 {
-    http_client_t *const client = (http_client_t *)arg;
     http_response_t *const response = client->response;
 
-    if(response->buffer_count > 0)
+    const uint8_t *data;
+    const size_t block_size = upstream_chunk(client, &data);
+
+    if(block_size > 0)
+        asc_event_io_send(response->io, data, block_size);
+    else
+        response->is_socket_busy = false;
+}
+
+static void on_upstream_sent(void *arg, ssize_t send_size)
+{
+    http_client_t *const client = (http_client_t *)arg;
+
+    if(send_size < 0)
     {
-        size_t block_size = (response->buffer_write > response->buffer_read)
-                          ? (response->buffer_write - response->buffer_read)
-                          : (response->buffer_size - response->buffer_read);
+        http_client_error(client, "failed to send ts: %s", strerror(-send_size));
+        http_client_close(client);
+        return;
+    }
+
+    client->response->pos += send_size;
+    upstream_queue(client);
+}
 
-        if(block_size > response->buffer_count)
-            block_size = response->buffer_count;
+/* response headers are out, completion sends may start */
+static void on_upstream_started(void *arg)
+{
+    http_client_t *const client = (http_client_t *)arg;
+
+    asc_socket_set_on_ready(client->sock, NULL);
+    client->response->is_socket_busy = false;
+}
+
+static void on_upstream_ready(void *arg)
+{
+    http_client_t *const client = (http_client_t *)arg;
+    http_response_t *const response = client->response;
+    const http_ring_t *const ring = response->ring;
 
-        const ssize_t send_size = asc_socket_send(  client->sock
-                                                  , &response->buffer[response->buffer_read]
-                                                  , block_size);
+    const uint8_t *data;
+    const size_t block_size = upstream_chunk(client, &data);
+    if(block_size > 0)
+    {
+        const ssize_t send_size = asc_socket_send(client->sock, data, block_size);
 
         if(send_size > 0)
         {
-            response->buffer_count -= send_size;
-            response->buffer_read += send_size;
-            if(response->buffer_read >= response->buffer_size)
-                response->buffer_read = 0;
+            response->pos += send_size;
         }
         else if(send_size == -1)
         {
@@ -89,58 +171,115 @@ static void on_upstream_ready(void *arg)
         }
     }
 
-    if(response->buffer_count == 0)
+    if(response->pos == ring->total)
     {
         asc_socket_set_on_ready(client->sock, NULL);
         response->is_socket_busy = false;
     }
 }
 
-static void on_ts(void *arg, const uint8_t *ts)
+static void on_ts_batch(void *arg, const uint8_t *ts, size_t count)
 {
-    http_client_t *const client = (http_client_t *)arg;
-    http_response_t *const response = client->response;
+    http_ring_t *const ring = (http_ring_t *)arg;
 
-    if(response->buffer_count + TS_PACKET_SIZE >= response->buffer_size)
+    size_t size = count * TS_PACKET_SIZE;
+    if(size > ring->size)
     {
-        // overflow
-        response->buffer_count = 0;
-        response->buffer_read = 0;
-        response->buffer_write = 0;
-        if(response->is_socket_busy)
-        {
-            asc_socket_set_on_ready(client->sock, NULL);
-            response->is_socket_busy = false;
-        }
-        return;
+        // keep only the tail of a huge batch
+        ring->total += size - ring->size;
+        ts += size - ring->size;
+        size = ring->size;
     }
 
-    const size_t buffer_write = response->buffer_write + TS_PACKET_SIZE;
-    if(buffer_write < response->buffer_size)
+    const size_t buffer_write = ring->total % ring->size;
+    const size_t ts_head = ring->size - buffer_write;
+    if(size <= ts_head)
     {
-        memcpy(&response->buffer[response->buffer_write], ts, TS_PACKET_SIZE);
-        response->buffer_write = buffer_write;
+        memcpy(&ring->buffer[buffer_write], ts, size);
     }
-    else if(buffer_write > response->buffer_size)
+    else
     {
-        const size_t ts_head = response->buffer_size - response->buffer_write;
-        memcpy(&response->buffer[response->buffer_write], ts, ts_head);
-        response->buffer_write = TS_PACKET_SIZE - ts_head;
-        memcpy(response->buffer, &ts[ts_head], response->buffer_write);
+        memcpy(&ring->buffer[buffer_write], ts, ts_head);
+        memcpy(ring->buffer, &ts[ts_head], size - ts_head);
     }
-    else
+    ring->total += size;
+
+    asc_list_for(ring->clients)
     {
-        memcpy(&response->buffer[response->buffer_write], ts, TS_PACKET_SIZE);
-        response->buffer_write = 0;
+        http_client_t *const client =
+            (http_client_t *)asc_list_data(ring->clients);
+        http_response_t *const response = client->response;
+
+        if(   response->is_socket_busy == false
+           && ring->total - response->pos >= response->buffer_fill)
+        {
+            response->is_socket_busy = true;
+
+            if(response->io != NULL)
+                upstream_queue(client);
+            else
+                asc_socket_set_on_ready(client->sock, on_upstream_ready);
+        }
     }
-    response->buffer_count += TS_PACKET_SIZE;
+}
+
+static void on_ts(void *arg, const uint8_t *ts)
+{
+    on_ts_batch(arg, ts, 1);
+}
+
+static http_ring_t *ring_acquire(module_stream_t *upstream, size_t size)
+{
+    // keep packets whole in the ring
+    size -= size % TS_PACKET_SIZE;
 
-    if(   response->is_socket_busy == false
-       && response->buffer_count >= response->buffer_fill)
+    if(ring_list == NULL)
+        ring_list = asc_list_init();
+
+    asc_list_for(ring_list)
     {
-        asc_socket_set_on_ready(client->sock, on_upstream_ready);
-        response->is_socket_busy = true;
+        http_ring_t *const ring = (http_ring_t *)asc_list_data(ring_list);
+
+        /* a ring cut off from its upstream isn't fed anymore */
+        if(ring->upstream == upstream && ring->__stream.parent != NULL
+           && ring->size == size)
+            return ring;
     }
+
+    http_ring_t *const ring = ASC_ALLOC(1, http_ring_t);
+    ring->upstream = upstream;
+    ring->size = size;
+    ring->buffer = ASC_ALLOC(size, uint8_t);
+    ring->clients = asc_list_init();
+
+    // like module_stream_init()
+    ring->__stream.self = (module_data_t *)ring;
+    ring->__stream.on_ts = (stream_callback_t)on_ts;
+    ring->__stream.on_ts_batch = (stream_batch_callback_t)on_ts_batch;
+    ring->__stream.type = "http_upstream";
+    __module_stream_init(&ring->__stream);
+    __module_stream_attach(upstream, &ring->__stream);
+
+    asc_list_insert_tail(ring_list, ring);
+
+    return ring;
+}
+
+static void ring_release(http_ring_t *ring, http_client_t *client)
+{
+    asc_list_remove_item(ring->clients, client);
+    if(asc_list_size(ring->clients) > 0)
+        return;
+
+    __module_stream_destroy(&ring->__stream);
+    asc_list_destroy(ring->clients);
+    free(ring->buffer);
+
+    asc_list_remove_item(ring_list, ring);
+    free(ring);
+
+    if(asc_list_size(ring_list) == 0)
+        ASC_FREE(ring_list, asc_list_destroy);
 }
 
 static void on_upstream_read(void *arg)
@@ -205,17 +344,30 @@ static void on_upstream_send(void *arg)
         return;
     }
 
-    client->response->buffer = ASC_ALLOC(client->response->buffer_size, uint8_t);
+    http_ring_t *const ring =
+        ring_acquire(upstream, client->response->buffer_size);
 
-    // like module_stream_init()
-    client->response->__stream.self = (module_data_t *)client;
-    client->response->__stream.on_ts = (stream_callback_t)on_ts;
-    __module_stream_init(&client->response->__stream);
-    __module_stream_attach(upstream, &client->response->__stream);
+    client->response->ring = ring;
+    client->response->pos = ring->total;
+    asc_list_insert_tail(ring->clients, client);
 
     client->on_read = on_upstream_read;
     client->on_ready = NULL;
 
+    /* falls back to on_ready when the event backend has no completions */
+    if(client->response->mod->completion)
+    {
+        client->response->io = asc_event_io_init(asc_socket_fd(client->sock)
+                                                 , client, on_upstream_sent);
+    }
+
+    if(client->response->io != NULL)
+    {
+        // hold the ring back until the headers are sent
+        client->response->is_socket_busy = true;
+        client->on_ready = on_upstream_started;
+    }
+
     const char *content_type = lua_isstring(L, 4)
                              ? lua_tostring(L, 4)
                              : "application/octet-stream";
@@ -242,9 +394,12 @@ static int module_call(lua_State *L, module_data_t *mod)
             lua_pushvalue(L, 4);
             lua_call(L, 3, 0);
 
-            module_stream_destroy(client->response);
+            /* waits for the kernel to let go of the ring memory */
+            ASC_FREE(client->response->io, asc_event_io_close);
+
+            if(client->response->ring)
+                ring_release(client->response->ring, client);
 
-            free(client->response->buffer);
             free(client->response);
             client->response = NULL;
         }
@@ -279,6 +434,9 @@ static void module_init(lua_State *L, module_data_t *mod)
     asc_assert(lua_isfunction(L, -1), "[http_upstream] option 'callback' is required");
     mod->idx_callback = luaL_ref(L, LUA_REGISTRYINDEX);
 
+    // send from completions on the event ring instead of on_ready
+    module_option_boolean(L, "completion", &mod->completion);
+
     // Deprecated
     bool is_deprecated = false;
 
@@ -41,6 +41,7 @@
 #include <astra.h>
 #include <core/timer.h>
 #include <luaapi/stream.h>
+#include <mpegts/framer.h>
 #include <mpegts/sync.h>
 
 #include "http.h"
@@ -127,8 +128,8 @@ struct module_data_t
         size_t buf_write;
         size_t buf_fill;
 
+        mpegts_framer_t *framer;
         mpegts_sync_t *sync;
-        asc_timer_t *sync_loop;
         size_t sync_ration_size;
         ssize_t sync_feed;
     } ts;
@@ -274,7 +275,7 @@ static void on_close(void *arg)
     }
 
     ASC_FREE(mod->ts.buf, free);
-    ASC_FREE(mod->ts.sync_loop, asc_timer_destroy);
+    ASC_FREE(mod->ts.framer, mpegts_framer_destroy);
     ASC_FREE(mod->ts.sync, mpegts_sync_destroy);
 
     if(mod->idx_response)
@@ -327,68 +328,101 @@ static void check_is_active(void *arg)
 
 static void on_sync_ready(void *arg);
 
-static void on_ts_read(void *arg)
+static void on_sync_fed(module_data_t *mod, size_t count)
+{
+    if(mod->ts.sync_feed > 0)
+    {
+        mod->ts.sync_feed -= (ssize_t)count;
+        if(mod->ts.sync_feed <= 0)
+        {
+            asc_socket_set_on_read(mod->sock, NULL);
+            mpegts_sync_set_on_ready(mod->ts.sync, on_sync_ready);
+        }
+    }
+}
+
+static void on_ts_batch(void *arg, const uint8_t *ts, size_t count)
 {
     module_data_t *const mod = (module_data_t *)arg;
 
-    ssize_t size = asc_socket_recv(mod->sock
-                                   , &mod->ts.buf[mod->ts.buf_write]
-                                   , mod->ts.buf_size - mod->ts.buf_write);
-    if(size <= 0)
+    if(mod->ts.sync == NULL)
     {
-        on_close(mod);
+        module_stream_send_batch(mod, ts, count);
         return;
     }
 
-    mod->is_active = true;
-    mod->ts.buf_write += size;
-    mod->ts.buf_read = 0;
-
-    while(1)
+    if(!mpegts_sync_push(mod->ts.sync, ts, count))
     {
-        while(mod->ts.buf[mod->ts.buf_read] != 0x47)
-        {
-            ++mod->ts.buf_read;
-            if(mod->ts.buf_read >= mod->ts.buf_write)
-            {
-                mod->ts.buf_write = 0;
-                return;
-            }
-        }
+        asc_log_error(MSG("sync push failed, resetting buffer"));
+        mpegts_sync_reset(mod->ts.sync, SYNC_RESET_ALL);
 
-        const size_t next = mod->ts.buf_read + TS_PACKET_SIZE;
-        if(next > mod->ts.buf_write)
-        {
-            const size_t tail = mod->ts.buf_write - mod->ts.buf_read;
-            if(tail > 0)
-                memmove(mod->ts.buf, &mod->ts.buf[mod->ts.buf_read], tail);
-            mod->ts.buf_write = tail;
-            return;
-        }
+        return;
+    }
 
-        if(mod->ts.sync != NULL)
-        {
-            if (!mpegts_sync_push(mod->ts.sync, &mod->ts.buf[mod->ts.buf_read], 1))
-            {
-                asc_log_error(MSG("sync push failed, resetting buffer"));
-                mpegts_sync_reset(mod->ts.sync, SYNC_RESET_ALL);
+    on_sync_fed(mod, count);
+}
 
-                return;
-            }
+static void on_ts_read(void *arg)
+{
+    module_data_t *const mod = (module_data_t *)arg;
 
-            if (mod->ts.sync_feed > 0 && --mod->ts.sync_feed <= 0)
-            {
-                asc_socket_set_on_read(mod->sock, NULL);
-                mpegts_sync_set_on_ready(mod->ts.sync, on_sync_ready);
-            }
+    uint8_t *buf = mod->ts.buf;
+    size_t space = mod->ts.buf_size;
+    size_t head = 0;
+
+    /* aligned stream, receive straight into the sync buffer */
+    uint8_t *ring = NULL;
+    if(mod->ts.sync != NULL && mpegts_framer_aligned(mod->ts.framer))
+    {
+        size_t count = mod->ts.buf_size / TS_PACKET_SIZE;
+        ring = mpegts_sync_reserve(mod->ts.sync, &count);
+
+        if(ring != NULL && count > 1)
+        {
+            buf = ring;
+            space = count * TS_PACKET_SIZE;
+            head = mpegts_framer_take(mod->ts.framer, buf);
         }
         else
         {
-            module_stream_send(mod, &mod->ts.buf[mod->ts.buf_read]);
+            ring = NULL;
         }
+    }
 
-        mod->ts.buf_read += TS_PACKET_SIZE;
+    const ssize_t size = asc_socket_recv(mod->sock, &buf[head], space - head);
+    if(size <= 0)
+    {
+        on_close(mod);
+        return;
     }
+
+    mod->is_active = true;
+
+    if(ring == NULL)
+    {
+        mpegts_framer_push(mod->ts.framer, buf, size);
+        return;
+    }
+
+    const size_t total = head + size;
+    size_t count = 0;
+    while((count + 1) * TS_PACKET_SIZE <= total
+          && ring[count * TS_PACKET_SIZE] == 0x47)
+    {
+        count++;
+    }
+
+    mpegts_sync_commit(mod->ts.sync, count);
+
+    /* partial packet or lost sync, the framer takes it from here */
+    const size_t used = count * TS_PACKET_SIZE;
+    if(used < total)
+    {
+        memcpy(mod->ts.buf, &ring[used], total - used);
+        mpegts_framer_push(mod->ts.framer, mod->ts.buf, total - used);
+    }
+
+    on_sync_fed(mod, count);
 }
 
 static void on_sync_ready(void *arg)
@@ -612,6 +646,7 @@ static void on_read(void *arg)
             callback(L, mod);
 
             mod->ts.buf = ASC_ALLOC(mod->ts.buf_size, uint8_t);
+            mod->ts.framer = mpegts_framer_init(on_ts_batch, mod);
             mod->timeout = asc_timer_init(mod->timeout_ms, check_is_active, mod);
 
             asc_socket_set_on_read(mod->sock, on_ts_read);
@@ -636,9 +671,7 @@ static void on_read(void *arg)
                 mod->ts.sync_ration_size = HTTP_BUFFER_SIZE / TS_PACKET_SIZE;
                 mod->ts.sync_feed = mod->ts.sync_ration_size;
 
-                mod->ts.sync_loop = asc_timer_init(SYNC_INTERVAL_MSEC
-                                                   , mpegts_sync_loop
-                                                   , mod->ts.sync);
+                mpegts_sync_start(mod->ts.sync);
             }
 
             mod->buffer_skip = 0;
@@ -25,6 +25,7 @@
  *      rate - target bitrate, bits per second
  *      pcr_interval - PCR insertion interval, ms
  *      pcr_delay - delay to apply to PCR value, ms
+ *      loop - worker loop to run on (default: 0, main loop)
  */
 
 #include "remux.h"
@@ -97,16 +98,43 @@ static inline bool can_insert(unsigned *count, unsigned interval)
 /*
  * TS datapath
  */
-void remux_ts_out(void *arg, const uint8_t *ts)
+void remux_flush(module_data_t *mod)
 {
     /*
-     * TS output hook
+     * send pending output
+     */
+    if(mod->out == NULL)
+        return;
+
+    if(mod->out->count > 0)
+        module_stream_send_block(mod, mod->out);
+
+    mpegts_block_release(mod->out);
+    mod->out = NULL;
+}
+
+static uint8_t *out_slot(module_data_t *mod)
+{
+    /*
+     * next free packet in the output block
+     */
+    if(mod->out == NULL)
+        mod->out = mpegts_block_alloc(mod->pool);
+
+    return MPEGTS_BLOCK_TS(mod->out, mod->out->count);
+}
+
+static void out_commit(module_data_t *mod)
+{
+    /*
+     * account for a packet written to out_slot()
      */
-    module_data_t *const mod = (module_data_t *)arg;
 
     /* write early; PCR gets messed up otherwise */
     mod->offset += TS_PACKET_SIZE;
-    module_stream_send(mod, ts);
+
+    if(++mod->out->count == mod->out->size)
+        remux_flush(mod);
 
     /* insert SI */
     if(can_insert(&mod->pat_count, mod->pat_interval))
@@ -137,6 +165,17 @@ void remux_ts_out(void *arg, const uint8_t *ts)
     }
 }
 
+void remux_ts_out(void *arg, const uint8_t *ts)
+{
+    /*
+     * TS output hook
+     */
+    module_data_t *const mod = (module_data_t *)arg;
+
+    memcpy(out_slot(mod), ts, TS_PACKET_SIZE);
+    out_commit(mod);
+}
+
 void remux_pes(void *arg, mpegts_pes_t *pes)
 {
     /*
@@ -188,12 +227,11 @@ void remux_pes(void *arg, mpegts_pes_t *pes)
      */
 }
 
-void remux_ts_in(module_data_t *mod, const uint8_t *orig_ts)
+void remux_ts_in(module_data_t *mod, const uint8_t *ts)
 {
     /*
      * TS input hook
      */
-    const uint8_t *ts = orig_ts;
     const uint16_t pid = TS_GET_PID(ts);
 
     /*
@@ -249,7 +287,7 @@ void remux_ts_in(module_data_t *mod, const uint8_t *orig_ts)
             else if(TS_IS_PCR(ts))
             {
                 /* got PCR in a scrambled packet */
-                uint8_t *const copy = mod->buf;
+                uint8_t *const copy = out_slot(mod);
                 memcpy(copy, ts, TS_PACKET_SIZE);
 
                 /* clear PCR flag and field */
@@ -266,7 +304,8 @@ void remux_ts_in(module_data_t *mod, const uint8_t *orig_ts)
                         memcpy(&copy[6], &ts[12], af_len - 7);
                 }
 
-                ts = copy;
+                out_commit(mod);
+                break;
             }
 
         case MPEGTS_PACKET_CA:
@@ -304,6 +343,20 @@ void remux_ts_in(module_data_t *mod, const uint8_t *orig_ts)
     }
 }
 
+static void on_ts(module_data_t *mod, const uint8_t *ts)
+{
+    remux_ts_in(mod, ts);
+    remux_flush(mod);
+}
+
+static void on_ts_batch(module_data_t *mod, const uint8_t *ts, size_t count)
+{
+    for(size_t i = 0; i < count; i++)
+        remux_ts_in(mod, &ts[i * TS_PACKET_SIZE]);
+
+    remux_flush(mod);
+}
+
 /*
  * module init/deinit
  */
@@ -361,13 +414,19 @@ static void module_init(lua_State *L, module_data_t *mod)
     mod->stream[0x13] = MPEGTS_PACKET_DATA; /* RST */
     mod->stream[0x14] = MPEGTS_PACKET_DATA; /* TDT, TOT */
 
-    module_stream_init(mod, remux_ts_in);
+    mod->pool = mpegts_block_pool_init(MPEGTS_BLOCK_PACKETS, REMUX_POOL_CACHE);
+
+    module_stream_init(mod, on_ts);
+    module_stream_set_batch(mod, on_ts_batch);
 }
 
 static void module_destroy(module_data_t *mod)
 {
     module_stream_destroy(mod);
 
+    ASC_FREE(mod->out, mpegts_block_release);
+    ASC_FREE(mod->pool, mpegts_block_pool_destroy);
+
     /* PSI deinit */
     mpegts_psi_destroy(mod->pat);
     mpegts_psi_destroy(mod->cat);
@@ -411,4 +470,4 @@ MODULE_LUA_METHODS()
 {
     MODULE_STREAM_METHODS_REF(),
 };
-MODULE_LUA_REGISTER(remux)
+MODULE_LUA_REGISTER_LOOP(remux)
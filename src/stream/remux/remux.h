@@ -108,7 +108,10 @@ struct module_data_t
     mpegts_packet_type_t stream[MAX_PID];
     mpegts_pes_t *pes[MAX_PID];
     uint16_t nit_pid;
-    uint8_t buf[TS_PACKET_SIZE];
+
+    /* output is packed into blocks, sent once per input batch */
+    mpegts_block_pool_t *pool;
+    mpegts_block_t *out;
 
     ts_program_t **progs;
     size_t prog_cnt;
@@ -122,7 +125,11 @@ struct module_data_t
 
 void remux_ts_out(void *arg, const uint8_t *ts);
 void remux_pes(void *arg, mpegts_pes_t *pes);
-void remux_ts_in(module_data_t *mod, const uint8_t *orig_ts);
+void remux_ts_in(module_data_t *mod, const uint8_t *ts);
+void remux_flush(module_data_t *mod);
+
+/* spare output blocks */
+#define REMUX_POOL_CACHE 8
 
 /* default PCR insertion interval, ms */
 #define PCR_INTERVAL 20
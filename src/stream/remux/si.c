@@ -61,13 +61,6 @@ static inline bool list_contains_item(const void *list
     return false;
 }
 
-static inline void copy_psi(mpegts_psi_t *dst
-                            , const mpegts_psi_t *src)
-{
-    dst->buffer_size = src->buffer_size;
-    memcpy(dst->buffer, src->buffer, PSI_MAX_SIZE);
-}
-
 static void stream_reload(module_data_t *mod)
 {
     /* garbage collection */
@@ -251,7 +244,7 @@ void remux_pat(void *arg, mpegts_psi_t *psi)
     stream_reload(mod);
 
     /* copy data to output PAT */
-    copy_psi(mod->custom_pat, psi);
+    mpegts_psi_copy(mod->custom_pat, psi);
 }
 
 void remux_cat(void *arg, mpegts_psi_t *psi)
@@ -303,7 +296,7 @@ void remux_cat(void *arg, mpegts_psi_t *psi)
     stream_reload(mod);
 
     /* copy data to output CAT */
-    copy_psi(mod->custom_cat, psi);
+    mpegts_psi_copy(mod->custom_cat, psi);
 }
 
 void remux_sdt(void *arg, mpegts_psi_t *psi)
@@ -318,7 +311,7 @@ void remux_sdt(void *arg, mpegts_psi_t *psi)
     mod->sdt->crc32 = crc32;
 
     /* copy data to output SDT */
-    copy_psi(mod->custom_sdt, psi);
+    mpegts_psi_copy(mod->custom_sdt, psi);
 }
 
 void remux_pmt(void *arg, mpegts_psi_t *psi)
@@ -467,5 +460,5 @@ void remux_pmt(void *arg, mpegts_psi_t *psi)
     stream_reload(mod);
 
     /* copy data to output PMT */
-    copy_psi(prog->custom_pmt, psi);
+    mpegts_psi_copy(prog->custom_pmt, psi);
 }
@@ -29,11 +29,22 @@
  *      cam         - object, cam instance returned by cam_module_instance:cam()
  *      cas_data    - string, additional paramters for CAS
  *      cas_pnr     - number, original PNR
+ *      threads     - number, descramble in a pool of worker threads
+ *                    (default: 0, descramble on the main thread)
  */
 
 #include "module_cam.h"
+#include <core/mainloop.h>
+#include <core/mutex.h>
+#include <core/thread.h>
+#include <mpegts/pidmap.h>
 #include <dvbcsa/dvbcsa.h>
 
+#define MAX_THREADS 32
+
+/* storage is a ring of pool blocks this many bytes long */
+#define STORAGE_BLOCK_SIZE (MPEGTS_BLOCK_PACKETS * TS_PACKET_SIZE)
+
 typedef struct
 {
     uint8_t ecm_type;
@@ -50,10 +61,44 @@ typedef struct
 
     int new_key_id;  // 0 - not, 1 - first key, 2 - second key, 3 - both keys
     uint8_t new_key[16];
+    uint8_t key[16]; // current keys, even and odd
 
     uint64_t sendtime;
 } ca_stream_t;
 
+/* single batch for a worker thread, see decrypt() */
+typedef struct
+{
+    struct dvbcsa_bs_key_s *key;
+    struct dvbcsa_bs_batch_s *batch;
+
+    uint8_t cw[8];
+    uint8_t key_cw[8];
+    bool is_key_set;
+} dsc_task_t;
+
+enum
+{
+    DSC_JOB_QUEUED = 0,
+    DSC_JOB_BUSY,
+    DSC_JOB_DONE,
+};
+
+typedef struct dsc_job_t dsc_job_t;
+
+struct dsc_job_t
+{
+    dsc_job_t *next;
+    int state;
+
+    /* storage bytes released when this job is done */
+    size_t size;
+
+    dsc_task_t *tasks;
+    size_t task_count;
+    size_t task_size;
+};
+
 typedef struct
 {
     uint16_t es_pid;
@@ -80,25 +125,41 @@ struct module_data_t
 
     struct
     {
-        uint8_t *buffer;
+        mpegts_block_pool_t *pool;
+        mpegts_block_t **blocks;
         size_t size;
         size_t count;
         size_t dsc_count;
+        size_t pending;
         size_t read;
         size_t write;
     } storage;
 
     struct
     {
-        uint8_t *buffer;
+        asc_thread_t *thread[MAX_THREADS];
+        unsigned int count;
+        bool is_running;
+        bool is_notified;
+
+        asc_mutex_t mutex;
+        asc_cond_t cond;
+
+        dsc_job_t *head;
+        dsc_job_t *tail;
+        dsc_job_t *unused;
+    } workers;
+
+    /* packets at the end of storage not yet queued for descrambling */
+    struct
+    {
         size_t size;
         size_t count;
         size_t read;
-        size_t write;
     } shift;
 
     /* Base */
-    mpegts_psi_t *stream[MAX_PID];
+    mpegts_pidmap_t stream;
     mpegts_psi_t *pmt;
 };
 
@@ -145,9 +206,320 @@ static void ca_stream_destroy(ca_stream_t *ca_stream)
 static void ca_stream_set_keys(ca_stream_t *ca_stream, const uint8_t *even, const uint8_t *odd)
 {
     if(even)
+    {
         dvbcsa_bs_key_set(even, ca_stream->even_key);
+        memcpy(&ca_stream->key[0], even, 8);
+    }
     if(odd)
+    {
         dvbcsa_bs_key_set(odd, ca_stream->odd_key);
+        memcpy(&ca_stream->key[8], odd, 8);
+    }
+}
+
+/*
+ * oooo     oooo  ooooooo  oooooooooo  oooo   oooo ooooooooooo oooooooooo
+ *  88   88  88 o888   888o 888    888  888  o88    888    88   888    888
+ *   88 888 88  888     888 888oooo88   888888      888ooo8     888oooo88
+ *    888 888   888o   o888 888  88o    888  88o    888    oo   888  88o
+ *     8   8      88ooo88  o888o  88o8 o888o o888o o888ooo8888 o888o  88o8
+ *
+ */
+
+static void workers_flush(module_data_t *mod, bool is_drop);
+
+static void dsc_job_destroy(dsc_job_t *job)
+{
+    for(size_t i = 0; i < job->task_size; ++i)
+    {
+        dvbcsa_bs_key_free(job->tasks[i].key);
+        free(job->tasks[i].batch);
+    }
+
+    free(job->tasks);
+    free(job);
+}
+
+static dsc_job_t *dsc_job_get(module_data_t *mod)
+{
+    asc_mutex_lock(&mod->workers.mutex);
+    dsc_job_t *job = mod->workers.unused;
+    if(job)
+        mod->workers.unused = job->next;
+    asc_mutex_unlock(&mod->workers.mutex);
+
+    if(!job)
+        job = ASC_ALLOC(1, dsc_job_t);
+
+    job->next = NULL;
+    job->state = DSC_JOB_QUEUED;
+    job->size = 0;
+    job->task_count = 0;
+
+    return job;
+}
+
+static void dsc_job_add_task(module_data_t *mod, dsc_job_t *job
+                             , const ca_stream_t *ca_stream, const uint8_t *cw)
+{
+    if(job->task_count >= job->task_size)
+    {
+        const size_t task_size = job->task_size + 1;
+        dsc_task_t *const tasks =
+            (dsc_task_t *)realloc(job->tasks, task_size * sizeof(*tasks));
+        asc_assert(tasks != NULL, MSG("realloc() failed"));
+
+        dsc_task_t *const task = &tasks[job->task_size];
+        memset(task, 0, sizeof(*task));
+        task->key = dvbcsa_bs_key_alloc();
+        task->batch = ASC_ALLOC(mod->batch_size + 1, struct dvbcsa_bs_batch_s);
+
+        job->tasks = tasks;
+        job->task_size = task_size;
+    }
+
+    dsc_task_t *const task = &job->tasks[job->task_count++];
+    memcpy(task->batch, ca_stream->batch
+           , (ca_stream->batch_skip + 1) * sizeof(*task->batch));
+    memcpy(task->cw, cw, sizeof(task->cw));
+}
+
+static void dsc_job_submit(module_data_t *mod, dsc_job_t *job)
+{
+    asc_mutex_lock(&mod->workers.mutex);
+    if(mod->workers.tail)
+        mod->workers.tail->next = job;
+    else
+        mod->workers.head = job;
+    mod->workers.tail = job;
+
+    asc_cond_broadcast(&mod->workers.cond);
+    asc_mutex_unlock(&mod->workers.mutex);
+}
+
+static void on_workers_done(void *arg)
+{
+    module_data_t *const mod = (module_data_t *)arg;
+
+    asc_mutex_lock(&mod->workers.mutex);
+    mod->workers.is_notified = false;
+    asc_mutex_unlock(&mod->workers.mutex);
+
+    workers_flush(mod, false);
+}
+
+static void worker_loop(void *arg)
+{
+    module_data_t *const mod = (module_data_t *)arg;
+
+    asc_mutex_lock(&mod->workers.mutex);
+    while(mod->workers.is_running)
+    {
+        dsc_job_t *job = mod->workers.head;
+        while(job && job->state != DSC_JOB_QUEUED)
+            job = job->next;
+
+        if(!job)
+        {
+            asc_cond_wait(&mod->workers.cond, &mod->workers.mutex);
+            continue;
+        }
+
+        job->state = DSC_JOB_BUSY;
+        asc_mutex_unlock(&mod->workers.mutex);
+
+        for(size_t i = 0; i < job->task_count; ++i)
+        {
+            dsc_task_t *const task = &job->tasks[i];
+
+            if(!task->is_key_set || memcmp(task->key_cw, task->cw, 8) != 0)
+            {
+                dvbcsa_bs_key_set(task->cw, task->key);
+                memcpy(task->key_cw, task->cw, 8);
+                task->is_key_set = true;
+            }
+
+            dvbcsa_bs_decrypt(task->key, task->batch, TS_BODY_SIZE);
+        }
+
+        asc_mutex_lock(&mod->workers.mutex);
+        job->state = DSC_JOB_DONE;
+        asc_cond_broadcast(&mod->workers.cond);
+
+        /* wake up main thread unless it's already been notified */
+        if(job == mod->workers.head && !mod->workers.is_notified)
+        {
+            mod->workers.is_notified = true;
+            asc_job_queue(mod, on_workers_done, mod);
+            asc_wake();
+        }
+    }
+    asc_mutex_unlock(&mod->workers.mutex);
+}
+
+static void workers_stop(void *arg)
+{
+    module_data_t *const mod = (module_data_t *)arg;
+
+    if(mod->workers.count == 0)
+        return;
+
+    asc_mutex_lock(&mod->workers.mutex);
+    mod->workers.is_running = false;
+    asc_cond_broadcast(&mod->workers.cond);
+    asc_mutex_unlock(&mod->workers.mutex);
+
+    for(unsigned int i = 0; i < mod->workers.count; ++i)
+        ASC_FREE(mod->workers.thread[i], asc_thread_join);
+
+    mod->workers.count = 0;
+    asc_job_prune(mod);
+    asc_wake_close();
+
+    while(mod->workers.head)
+    {
+        dsc_job_t *const job = mod->workers.head;
+        mod->workers.head = job->next;
+        dsc_job_destroy(job);
+    }
+    mod->workers.tail = NULL;
+
+    while(mod->workers.unused)
+    {
+        dsc_job_t *const job = mod->workers.unused;
+        mod->workers.unused = job->next;
+        dsc_job_destroy(job);
+    }
+
+    asc_cond_destroy(&mod->workers.cond);
+    asc_mutex_destroy(&mod->workers.mutex);
+}
+
+static void workers_start(module_data_t *mod, unsigned int count)
+{
+    asc_mutex_init(&mod->workers.mutex);
+    asc_cond_init(&mod->workers.cond);
+    asc_wake_open();
+
+    mod->workers.is_running = true;
+    mod->workers.count = count;
+
+    for(unsigned int i = 0; i < count; ++i)
+    {
+        mod->workers.thread[i] = asc_thread_init();
+        asc_thread_start(mod->workers.thread[i], mod, worker_loop, workers_stop);
+    }
+}
+
+static inline uint8_t *storage_ts(module_data_t *mod, size_t pos)
+{
+    mpegts_block_t *const block = mod->storage.blocks[pos / STORAGE_BLOCK_SIZE];
+    return &block->data[pos % STORAGE_BLOCK_SIZE];
+}
+
+/*
+ * copy packet to the end of storage. packets are descrambled in place
+ * there; a block is never written again once it's full, so children
+ * are free to keep it.
+ */
+static void storage_write(module_data_t *mod, const uint8_t *ts)
+{
+    mpegts_block_t **const slot =
+        &mod->storage.blocks[mod->storage.write / STORAGE_BLOCK_SIZE];
+
+    if(mod->storage.write % STORAGE_BLOCK_SIZE == 0)
+    {
+        ASC_FREE(*slot, mpegts_block_release);
+        *slot = mpegts_block_alloc(mod->storage.pool);
+    }
+
+    mpegts_block_append(*slot, ts, 1);
+
+    mod->storage.write += TS_PACKET_SIZE;
+    if(mod->storage.write == mod->storage.size)
+        mod->storage.write = 0;
+    mod->storage.count += TS_PACKET_SIZE;
+}
+
+/*
+ * send out descrambled packets. whole blocks are passed on by
+ * reference, partial ones as a batch.
+ */
+static void storage_send(module_data_t *mod)
+{
+    while(mod->storage.dsc_count > 0)
+    {
+        const size_t offset = mod->storage.read % STORAGE_BLOCK_SIZE;
+        mpegts_block_t *const block =
+            mod->storage.blocks[mod->storage.read / STORAGE_BLOCK_SIZE];
+
+        size_t chunk = STORAGE_BLOCK_SIZE - offset;
+        if(chunk > mod->storage.dsc_count)
+            chunk = mod->storage.dsc_count;
+
+        mod->storage.read += chunk;
+        if(mod->storage.read == mod->storage.size)
+            mod->storage.read = 0;
+        mod->storage.dsc_count -= chunk;
+        mod->storage.count -= chunk;
+
+        if(chunk == STORAGE_BLOCK_SIZE)
+        {
+            module_stream_send_block(mod, block);
+        }
+        else
+        {
+            module_stream_send_batch(mod, &block->data[offset]
+                                     , chunk / TS_PACKET_SIZE);
+        }
+    }
+}
+
+/*
+ * collect finished jobs in submission order, optionally waiting until
+ * every job is done. is_drop discards their packets instead of sending.
+ */
+static void workers_flush(module_data_t *mod, bool is_drop)
+{
+    asc_mutex_lock(&mod->workers.mutex);
+    while(mod->workers.head)
+    {
+        dsc_job_t *const job = mod->workers.head;
+
+        if(job->state != DSC_JOB_DONE)
+        {
+            if(!is_drop)
+                break;
+
+            asc_cond_wait(&mod->workers.cond, &mod->workers.mutex);
+            continue;
+        }
+
+        mod->workers.head = job->next;
+        if(!mod->workers.head)
+            mod->workers.tail = NULL;
+
+        job->next = mod->workers.unused;
+        mod->workers.unused = job;
+
+        mod->storage.pending -= job->size;
+        mod->storage.dsc_count += job->size;
+    }
+    asc_mutex_unlock(&mod->workers.mutex);
+
+    if(!is_drop)
+        storage_send(mod);
+}
+
+/* block until the oldest job is done */
+static void workers_wait(module_data_t *mod)
+{
+    asc_mutex_lock(&mod->workers.mutex);
+    while(mod->workers.head && mod->workers.head->state != DSC_JOB_DONE)
+        asc_cond_wait(&mod->workers.cond, &mod->workers.mutex);
+    asc_mutex_unlock(&mod->workers.mutex);
+
+    workers_flush(mod, false);
 }
 
 static void module_decrypt_cas_init(module_data_t *mod)
@@ -190,29 +562,42 @@ static void module_decrypt_cas_destroy(module_data_t *mod)
     }
 }
 
-static void stream_reload(module_data_t *mod)
+static inline mpegts_psi_t *get_psi(module_data_t *mod, uint16_t pid)
 {
-    mod->stream[0]->crc32 = 0;
+    return (mpegts_psi_t *)mpegts_pidmap_get(&mod->stream, pid);
+}
 
-    for(int i = 1; i < MAX_PID; ++i)
+static void stream_destroy(module_data_t *mod, uint16_t first)
+{
+    for(int i = first; i < MAX_PID; ++i)
     {
-        if(mod->stream[i])
+        mpegts_psi_t *const psi = get_psi(mod, i);
+        if(psi)
         {
-            mpegts_psi_destroy(mod->stream[i]);
-            mod->stream[i] = NULL;
+            mpegts_psi_destroy(psi);
+            mpegts_pidmap_set(&mod->stream, i, NULL);
         }
     }
+}
+
+static void stream_reload(module_data_t *mod)
+{
+    get_psi(mod, 0)->crc32 = 0;
+    stream_destroy(mod, 1);
 
     module_decrypt_cas_destroy(mod);
 
+    if(mod->workers.count > 0)
+        workers_flush(mod, true);
+
     mod->storage.count = 0;
     mod->storage.dsc_count = 0;
+    mod->storage.pending = 0;
     mod->storage.read = 0;
     mod->storage.write = 0;
 
     mod->shift.count = 0;
     mod->shift.read = 0;
-    mod->shift.write = 0;
 }
 
 /*
@@ -257,7 +642,7 @@ static void on_pat(void *arg, mpegts_psi_t *psi)
             continue; // skip NIT
 
         const uint16_t pid = PAT_ITEM_GET_PID(psi, pointer);
-        if(mod->stream[pid])
+        if(get_psi(mod, pid))
             asc_log_error(MSG("Skip PMT pid:%d"), pid);
         else
         {
@@ -265,7 +650,8 @@ static void on_pat(void *arg, mpegts_psi_t *psi)
             if(mod->__decrypt.cas_pnr == 0)
                 mod->__decrypt.cas_pnr = pnr;
 
-            mod->stream[pid] = mpegts_psi_init(MPEGTS_PACKET_PMT, pid);
+            mpegts_pidmap_set(&mod->stream, pid
+                              , mpegts_psi_init(MPEGTS_PACKET_PMT, pid));
         }
 
         break;
@@ -274,7 +660,8 @@ static void on_pat(void *arg, mpegts_psi_t *psi)
     if(mod->__decrypt.cam && mod->__decrypt.cam->is_ready)
     {
         module_decrypt_cas_init(mod);
-        mod->stream[1] = mpegts_psi_init(MPEGTS_PACKET_CAT, 1);
+        mpegts_pidmap_set(&mod->stream, 1
+                          , mpegts_psi_init(MPEGTS_PACKET_CAT, 1));
     }
 }
 
@@ -295,16 +682,20 @@ static bool __cat_check_desc(module_data_t *mod, const uint8_t *desc)
     if(pid == NULL_TS_PID)
         return false;
 
-    if(mod->stream[pid])
+    mpegts_psi_t *psi = get_psi(mod, pid);
+    if(psi)
     {
-        if(!(mod->stream[pid]->type & MPEGTS_PACKET_CA))
+        if(!(psi->type & MPEGTS_PACKET_CA))
         {
             asc_log_warning(MSG("Skip EMM pid:%d"), pid);
             return false;
         }
     }
     else
-        mod->stream[pid] = mpegts_psi_init(MPEGTS_PACKET_CA, pid);
+    {
+        psi = mpegts_psi_init(MPEGTS_PACKET_CA, pid);
+        mpegts_pidmap_set(&mod->stream, pid, psi);
+    }
 
     if(mod->disable_emm || mod->__decrypt.cam->disable_emm)
         return false;
@@ -313,7 +704,7 @@ static bool __cat_check_desc(module_data_t *mod, const uint8_t *desc)
        && DESC_CA_CAID(desc) == mod->caid
        && module_cas_check_descriptor(mod->__decrypt.cas, desc))
     {
-        mod->stream[pid]->type = MPEGTS_PACKET_EMM;
+        psi->type = MPEGTS_PACKET_EMM;
         asc_log_info(MSG("Select EMM pid:%d"), pid);
         return true;
     }
@@ -382,8 +773,12 @@ static ca_stream_t * __pmt_check_desc(  module_data_t *mod
     if(pid == NULL_TS_PID)
         return NULL;
 
-    if(mod->stream[pid] == NULL)
-        mod->stream[pid] = mpegts_psi_init(MPEGTS_PACKET_CA, pid);
+    mpegts_psi_t *psi = get_psi(mod, pid);
+    if(psi == NULL)
+    {
+        psi = mpegts_psi_init(MPEGTS_PACKET_CA, pid);
+        mpegts_pidmap_set(&mod->stream, pid, psi);
+    }
 
     do
     {
@@ -391,7 +786,7 @@ static ca_stream_t * __pmt_check_desc(  module_data_t *mod
             break;
         if(is_ecm_selected)
             break;
-        if(!(mod->stream[pid]->type & MPEGTS_PACKET_CA))
+        if(!(psi->type & MPEGTS_PACKET_CA))
             break;
 
         if(mod->ecm_pid == 0)
@@ -414,7 +809,7 @@ static ca_stream_t * __pmt_check_desc(  module_data_t *mod
                 return ca_stream;
         }
 
-        mod->stream[pid]->type = MPEGTS_PACKET_ECM;
+        psi->type = MPEGTS_PACKET_ECM;
         asc_log_info(MSG("Select ECM pid:%d"), pid);
         return ca_stream_init(mod, pid);
     } while(0);
@@ -467,6 +862,7 @@ static void on_pmt(void *arg, mpegts_psi_t *psi)
     bool is_ecm_selected;
 
     uint16_t skip = 12;
+    mpegts_psi_reserve(mod->pmt, psi->buffer_size);
     memcpy(mod->pmt->buffer, psi->buffer, 10);
 
     is_ecm_selected = false;
@@ -622,6 +1018,11 @@ static void on_em(void *arg, mpegts_psi_t *psi)
 
 static void decrypt(module_data_t *mod)
 {
+    /* with worker threads, batches are descrambled with a copy of the keys */
+    dsc_job_t *job = NULL;
+    if(mod->workers.count > 0)
+        job = dsc_job_get(mod);
+
     asc_list_for(mod->ca_list)
     {
         ca_stream_t *ca_stream = (ca_stream_t *)asc_list_data(mod->ca_list);
@@ -630,7 +1031,14 @@ static void decrypt(module_data_t *mod)
         {
             ca_stream->batch[ca_stream->batch_skip].data = NULL;
 
-            if(ca_stream->parity == 0x80)
+            if(job)
+            {
+                if(ca_stream->parity == 0x80)
+                    dsc_job_add_task(mod, job, ca_stream, &ca_stream->key[0]);
+                else if(ca_stream->parity == 0xC0)
+                    dsc_job_add_task(mod, job, ca_stream, &ca_stream->key[8]);
+            }
+            else if(ca_stream->parity == 0x80)
                 dvbcsa_bs_decrypt(ca_stream->even_key, ca_stream->batch, TS_BODY_SIZE);
             else if(ca_stream->parity == 0xC0)
                 dvbcsa_bs_decrypt(ca_stream->odd_key, ca_stream->batch, TS_BODY_SIZE);
@@ -660,37 +1068,62 @@ static void decrypt(module_data_t *mod)
         }
     }
 
-    mod->storage.dsc_count = mod->storage.count;
+    if(job)
+    {
+        /* job covers everything queued since the previous call */
+        job->size = mod->storage.count
+                  - mod->shift.count
+                  - mod->storage.dsc_count
+                  - mod->storage.pending;
+        mod->storage.pending += job->size;
+
+        if(job->size > 0 || job->task_count > 0)
+        {
+            dsc_job_submit(mod, job);
+        }
+        else
+        {
+            asc_mutex_lock(&mod->workers.mutex);
+            job->next = mod->workers.unused;
+            mod->workers.unused = job;
+            asc_mutex_unlock(&mod->workers.mutex);
+        }
+        return;
+    }
+
+    mod->storage.dsc_count = mod->storage.count - mod->shift.count;
 }
 
 static void on_ts(module_data_t *mod, const uint8_t *ts)
 {
     const uint16_t pid = TS_GET_PID(ts);
 
+    mpegts_psi_t *const psi = get_psi(mod, pid);
+
     if(pid == 0)
     {
-        mpegts_psi_mux(mod->stream[pid], ts, on_pat, mod);
+        mpegts_psi_mux(psi, ts, on_pat, mod);
     }
     else if(pid == 1)
     {
-        if(mod->stream[pid])
-            mpegts_psi_mux(mod->stream[pid], ts, on_cat, mod);
+        if(psi)
+            mpegts_psi_mux(psi, ts, on_cat, mod);
         return;
     }
     else if(pid == NULL_TS_PID)
     {
         return;
     }
-    else if(mod->stream[pid])
+    else if(psi)
     {
-        switch(mod->stream[pid]->type)
+        switch(psi->type)
         {
             case MPEGTS_PACKET_PMT:
-                mpegts_psi_mux(mod->stream[pid], ts, on_pmt, mod);
+                mpegts_psi_mux(psi, ts, on_pmt, mod);
                 return;
             case MPEGTS_PACKET_ECM:
             case MPEGTS_PACKET_EMM:
-                mpegts_psi_mux(mod->stream[pid], ts, on_em, mod);
+                mpegts_psi_mux(psi, ts, on_em, mod);
             case MPEGTS_PACKET_CA:
                 return;
             default:
@@ -704,32 +1137,18 @@ static void on_ts(module_data_t *mod, const uint8_t *ts)
         return;
     }
 
-    if(mod->shift.buffer)
-    {
-        memcpy(&mod->shift.buffer[mod->shift.write], ts, TS_PACKET_SIZE);
-        mod->shift.write += TS_PACKET_SIZE;
-        if(mod->shift.write == mod->shift.size)
-            mod->shift.write = 0;
-        mod->shift.count += TS_PACKET_SIZE;
+    /* storage is full of packets still being descrambled */
+    if(mod->workers.count > 0 && mod->storage.count >= mod->storage.size)
+        workers_wait(mod);
 
-        if(mod->shift.count < mod->shift.size)
-            return;
+    storage_write(mod, ts);
 
-        ts = &mod->shift.buffer[mod->shift.read];
-        mod->shift.read += TS_PACKET_SIZE;
-        if(mod->shift.read == mod->shift.size)
-            mod->shift.read = 0;
-        mod->shift.count -= TS_PACKET_SIZE;
-    }
-
-    uint8_t *dst = &mod->storage.buffer[mod->storage.write];
-    memcpy(dst, ts, TS_PACKET_SIZE);
-
-    mod->storage.write += TS_PACKET_SIZE;
-    if(mod->storage.write == mod->storage.size)
-        mod->storage.write = 0;
-    mod->storage.count += TS_PACKET_SIZE;
+    /* with shift, packets wait in storage for keys to arrive */
+    mod->shift.count += TS_PACKET_SIZE;
+    if(mod->shift.count < mod->shift.size)
+        return;
 
+    uint8_t *const dst = storage_ts(mod, mod->shift.read);
     const uint8_t sc = TS_IS_SCRAMBLED(dst);
     if(sc)
     {
@@ -737,9 +1156,9 @@ static void on_ts(module_data_t *mod, const uint8_t *ts)
 
         int hdr_size = 0;
 
-        if(TS_IS_PAYLOAD(ts))
+        if(TS_IS_PAYLOAD(dst))
         {
-            if(TS_IS_AF(ts))
+            if(TS_IS_AF(dst))
             {
                 hdr_size = TS_HEADER_SIZE + dst[4] + 1;
 
@@ -752,11 +1171,13 @@ static void on_ts(module_data_t *mod, const uint8_t *ts)
 
         if(hdr_size)
         {
+            const uint16_t es_pid = TS_GET_PID(dst);
+
             ca_stream_t *ca_stream = NULL;
             asc_list_for(mod->el_list)
             {
                 el_stream_t *el_stream = (el_stream_t *)asc_list_data(mod->el_list);
-                if(el_stream->es_pid == pid)
+                if(el_stream->es_pid == es_pid)
                 {
                     ca_stream = el_stream->ca_stream;
                     break;
@@ -784,18 +1205,17 @@ static void on_ts(module_data_t *mod, const uint8_t *ts)
         }
     }
 
+    /* queued only now, decrypt() above must not count it as done */
+    mod->shift.read += TS_PACKET_SIZE;
+    if(mod->shift.read == mod->storage.size)
+        mod->shift.read = 0;
+    mod->shift.count -= TS_PACKET_SIZE;
+
     if(mod->storage.count >= mod->storage.size)
         decrypt(mod);
 
-    if(mod->storage.dsc_count > 0)
-    {
-        module_stream_send(mod, &mod->storage.buffer[mod->storage.read]);
-        mod->storage.read += TS_PACKET_SIZE;
-        if(mod->storage.read == mod->storage.size)
-            mod->storage.read = 0;
-        mod->storage.dsc_count -= TS_PACKET_SIZE;
-        mod->storage.count -= TS_PACKET_SIZE;
-    }
+    if(mod->workers.count == 0)
+        storage_send(mod);
 }
 
 /*
@@ -919,7 +1339,8 @@ static void module_init(lua_State *L, module_data_t *mod)
     module_option_string(L, "name", &mod->name, NULL);
     asc_assert(mod->name != NULL, "[decrypt] option 'name' is required");
 
-    mod->stream[0] = mpegts_psi_init(MPEGTS_PACKET_PAT, 0);
+    mpegts_pidmap_set(&mod->stream, 0
+                      , mpegts_psi_init(MPEGTS_PACKET_PAT, 0));
     mod->pmt = mpegts_psi_init(MPEGTS_PACKET_PMT, MAX_PID);
 
     mod->ca_list = asc_list_init();
@@ -927,8 +1348,13 @@ static void module_init(lua_State *L, module_data_t *mod)
 
     mod->batch_size = dvbcsa_bs_batch_size();
 
-    mod->storage.size = mod->batch_size * 4 * TS_PACKET_SIZE;
-    mod->storage.buffer = ASC_ALLOC(mod->storage.size, uint8_t);
+    int threads = 0;
+    module_option_integer(L, "threads", &threads);
+    if(threads < 0 || threads > MAX_THREADS)
+        luaL_error(L, MSG("option 'threads' must be between 0 and %d"), MAX_THREADS);
+
+    if(threads > 0)
+        workers_start(mod, threads);
 
     const char *biss_key = NULL;
     size_t biss_length = 0;
@@ -981,15 +1407,25 @@ static void module_init(lua_State *L, module_data_t *mod)
     if(shift > 0)
     {
         mod->shift.size = (shift * 1000 * 1000) / (TS_PACKET_SIZE * 8) * (TS_PACKET_SIZE);
-        mod->shift.buffer = ASC_ALLOC(mod->shift.size, uint8_t);
     }
 
+    /* leave room for batches in flight and shifted packets */
+    const size_t storage_size = mod->batch_size * 4 * (threads + 1) * TS_PACKET_SIZE
+                              + mod->shift.size;
+    const size_t block_count =
+        (storage_size + STORAGE_BLOCK_SIZE - 1) / STORAGE_BLOCK_SIZE;
+
+    mod->storage.size = block_count * STORAGE_BLOCK_SIZE;
+    mod->storage.blocks = ASC_ALLOC(block_count, mpegts_block_t *);
+    mod->storage.pool = mpegts_block_pool_init(MPEGTS_BLOCK_PACKETS, block_count);
+
     stream_reload(mod);
 }
 
 static void module_destroy(module_data_t *mod)
 {
     module_stream_destroy(mod);
+    workers_stop(mod);
 
     if(mod->__decrypt.cam)
     {
@@ -1010,17 +1446,13 @@ static void module_destroy(module_data_t *mod)
     asc_list_destroy(mod->ca_list);
     asc_list_destroy(mod->el_list);
 
-    free(mod->storage.buffer);
-    free(mod->shift.buffer);
+    for(size_t i = 0; i < mod->storage.size / STORAGE_BLOCK_SIZE; ++i)
+        ASC_FREE(mod->storage.blocks[i], mpegts_block_release);
 
-    for(int i = 0; i < MAX_PID; ++i)
-    {
-        if(mod->stream[i])
-        {
-            mpegts_psi_destroy(mod->stream[i]);
-            mod->stream[i] = NULL;
-        }
-    }
+    free(mod->storage.blocks);
+    ASC_FREE(mod->storage.pool, mpegts_block_pool_destroy);
+
+    stream_destroy(mod, 0);
     mpegts_psi_destroy(mod->pmt);
 }
 
@@ -27,6 +27,7 @@
  *      pnr         - number, program containing T2-MI payload
  *      pid         - number, force decapsulator to process this pid
  *      plp         - number, PLP ID (defaults to first one available)
+ *      loop        - number, worker loop to run on (default: 0, main loop)
  */
 
 #include <astra.h>
@@ -104,4 +105,4 @@ MODULE_LUA_METHODS()
 {
     MODULE_STREAM_METHODS_REF(),
 };
-MODULE_LUA_REGISTER(t2mi_decap)
+MODULE_LUA_REGISTER_LOOP(t2mi_decap)
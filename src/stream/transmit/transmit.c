@@ -24,6 +24,7 @@
  *
  * Module Options:
  *      upstream    - object, stream instance returned by module_instance:stream()
+ *      loop        - number, worker loop to run on (default: 0, main loop)
  *
  * Module Methods:
  *      set_upstream(object)
@@ -54,11 +55,17 @@ static void on_ts(module_data_t *mod, const uint8_t *ts)
     module_stream_send(mod, ts);
 }
 
+static void on_ts_batch(module_data_t *mod, const uint8_t *ts, size_t count)
+{
+    module_stream_send_batch(mod, ts, count);
+}
+
 static void module_init(lua_State *L, module_data_t *mod)
 {
     __uarg(L);
 
     module_stream_init(mod, on_ts);
+    module_stream_set_batch(mod, on_ts_batch);
 }
 
 static void module_destroy(module_data_t *mod)
@@ -72,4 +79,4 @@ MODULE_LUA_METHODS()
     MODULE_STREAM_METHODS_REF(),
     { "set_upstream", method_set_upstream },
 };
-MODULE_LUA_REGISTER(transmit)
+MODULE_LUA_REGISTER_LOOP(transmit)
@@ -0,0 +1,481 @@
+/*
+ * Astra Module: UDP Capture
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <astra.h>
+#include "capture.h"
+
+#define MSG(_msg) "[udp_capture] " _msg
+
+#if HAVE_DECL_TPACKET_V3
+
+#include <core/event.h>
+
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+/* 16MiB ring */
+#define CAPTURE_BLOCK_SIZE (256 * 1024)
+#define CAPTURE_BLOCK_COUNT 64
+#define CAPTURE_FRAME_SIZE 2048
+
+/* ms before a partly filled block is handed over */
+#define CAPTURE_TIMEOUT 10
+
+/* subscriber hash table size, power of two */
+#define CAPTURE_BUCKETS 256
+
+#define IP_HEADER_SIZE 20
+#define UDP_HEADER_SIZE 8
+
+struct udp_capture_sub_t
+{
+    /* network byte order */
+    uint32_t addr;
+    uint16_t port;
+
+    /* receiving interface, 0 until the first datagram without localaddr */
+    int ifindex;
+
+    capture_callback_t on_data;
+    void *arg;
+
+    udp_capture_sub_t *next;
+};
+
+typedef struct
+{
+    int fd;
+    asc_event_t *event;
+
+    uint8_t *ring;
+    unsigned int block;
+
+    udp_capture_sub_t *buckets[CAPTURE_BUCKETS];
+    unsigned int refcnt;
+
+    /* subscribers removed from a callback are swept up afterwards */
+    bool is_busy;
+    bool is_dirty;
+
+    udp_capture_stat_t stats;
+} udp_capture_t;
+
+/* each event loop thread has its own ring */
+static __thread_local udp_capture_t *capture = NULL;
+
+/*
+ * Incoming IPv4 UDP datagrams that are not fragmented, offsets are
+ * relative to the network header on a SOCK_DGRAM packet socket
+ */
+static struct sock_filter capture_filter[] =
+{
+    /* skb->pkt_type != PACKET_OUTGOING */
+    BPF_STMT(BPF_LD + BPF_W + BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+    BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, PACKET_OUTGOING, 5, 0),
+    /* ip[9] == IPPROTO_UDP */
+    BPF_STMT(BPF_LD + BPF_B + BPF_ABS, 9),
+    BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_UDP, 0, 3),
+    /* no MF flag, zero fragment offset */
+    BPF_STMT(BPF_LD + BPF_H + BPF_ABS, 6),
+    BPF_JUMP(BPF_JMP + BPF_JSET + BPF_K, 0x3fff, 1, 0),
+    BPF_STMT(BPF_RET + BPF_K, 0xffff),
+    BPF_STMT(BPF_RET + BPF_K, 0),
+};
+
+static inline
+unsigned int sub_hash(uint32_t addr, uint16_t port)
+{
+    return (ntohl(addr) * 31 + ntohs(port)) & (CAPTURE_BUCKETS - 1);
+}
+
+static
+void on_datagram(const uint8_t *ip, size_t size, int ifindex)
+{
+    if (size < IP_HEADER_SIZE + UDP_HEADER_SIZE || (ip[0] >> 4) != 4)
+        return;
+
+    const size_t ihl = (ip[0] & 0x0f) * 4;
+    const size_t total = (ip[2] << 8) | ip[3];
+    if (ihl < IP_HEADER_SIZE || total > size || ihl + UDP_HEADER_SIZE > total)
+        return;
+
+    const uint8_t *const udp = &ip[ihl];
+    const size_t len = (udp[4] << 8) | udp[5];
+    if (len < UDP_HEADER_SIZE || ihl + len > total)
+        return;
+
+    uint32_t addr;
+    uint16_t port;
+    memcpy(&addr, &ip[16], sizeof(addr));
+    memcpy(&port, &udp[2], sizeof(port));
+
+    udp_capture_sub_t *sub = capture->buckets[sub_hash(addr, port)];
+    for (; sub != NULL; sub = sub->next)
+    {
+        if (sub->addr != addr || sub->port != port || sub->on_data == NULL)
+            continue;
+
+        /*
+         * The ring sees every interface. Stick to the first one the
+         * stream shows up on, so a group joined on several NICs isn't
+         * passed on twice.
+         */
+        if (sub->ifindex == 0)
+            sub->ifindex = ifindex;
+        else if (sub->ifindex != ifindex)
+            continue;
+
+        capture->stats.datagrams++;
+        sub->on_data(sub->arg, &udp[UDP_HEADER_SIZE], len - UDP_HEADER_SIZE);
+    }
+}
+
+static
+void on_block(const struct tpacket_block_desc *bd)
+{
+    const uint8_t *ptr = (uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt;
+
+    for (uint32_t i = 0; i < bd->hdr.bh1.num_pkts; i++)
+    {
+        const struct tpacket3_hdr *const hdr =
+            (const struct tpacket3_hdr *)ptr;
+        const struct sockaddr_ll *const sll = (const struct sockaddr_ll *)
+            &ptr[TPACKET_ALIGN(sizeof(*hdr))];
+
+        /* outgoing packets are normally rejected by the filter already */
+        if (sll->sll_pkttype != PACKET_OUTGOING)
+        {
+            const size_t head = hdr->tp_net - hdr->tp_mac;
+            if (hdr->tp_snaplen > head)
+            {
+                on_datagram(&ptr[hdr->tp_net], hdr->tp_snaplen - head
+                            , sll->sll_ifindex);
+            }
+        }
+
+        ptr += hdr->tp_next_offset;
+    }
+}
+
+static
+void capture_close(void)
+{
+    asc_event_close(capture->event);
+    munmap(capture->ring, CAPTURE_BLOCK_SIZE * CAPTURE_BLOCK_COUNT);
+    close(capture->fd);
+
+    free(capture);
+    capture = NULL;
+}
+
+static
+void capture_sweep(void)
+{
+    for (size_t i = 0; i < CAPTURE_BUCKETS; i++)
+    {
+        udp_capture_sub_t **prev = &capture->buckets[i];
+        while (*prev != NULL)
+        {
+            udp_capture_sub_t *const sub = *prev;
+            if (sub->on_data == NULL)
+            {
+                *prev = sub->next;
+                free(sub);
+            }
+            else
+            {
+                prev = &sub->next;
+            }
+        }
+    }
+
+    capture->is_dirty = false;
+}
+
+static
+void on_capture_read(void *arg)
+{
+    __uarg(arg);
+
+    capture->is_busy = true;
+
+    for (unsigned int i = 0; i < ASC_EVENT_BUDGET; i++)
+    {
+        struct tpacket_block_desc *const bd = (struct tpacket_block_desc *)
+            &capture->ring[capture->block * CAPTURE_BLOCK_SIZE];
+
+        const uint32_t status = __atomic_load_n(&bd->hdr.bh1.block_status
+                                                , __ATOMIC_ACQUIRE);
+        if (!(status & TP_STATUS_USER))
+            break;
+
+        on_block(bd);
+        capture->stats.blocks++;
+
+        /* hand the block back to the kernel */
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL
+                         , __ATOMIC_RELEASE);
+        capture->block = (capture->block + 1) % CAPTURE_BLOCK_COUNT;
+    }
+
+    capture->is_busy = false;
+
+    if (capture->is_dirty)
+        capture_sweep();
+
+    if (capture->refcnt == 0)
+        capture_close();
+}
+
+static
+bool capture_open(void)
+{
+    const int fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP));
+    if (fd == -1)
+    {
+        asc_log_error(MSG("socket(): %s"), asc_error_msg());
+        return false;
+    }
+
+    const int version = TPACKET_V3;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION
+                   , &version, sizeof(version)) != 0)
+    {
+        asc_log_error(MSG("failed to set TPACKET_V3: %s"), asc_error_msg());
+        close(fd);
+        return false;
+    }
+
+    const struct sock_fprog fprog =
+    {
+        .len = ASC_ARRAY_SIZE(capture_filter),
+        .filter = capture_filter,
+    };
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER
+                   , &fprog, sizeof(fprog)) != 0)
+    {
+        asc_log_error(MSG("failed to attach filter: %s"), asc_error_msg());
+        close(fd);
+        return false;
+    }
+
+#ifdef PACKET_IGNORE_OUTGOING
+    /* Linux 4.20+, skips the filter for outgoing packets altogether */
+    const int ignore = 1;
+    setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &ignore, sizeof(ignore));
+#endif /* PACKET_IGNORE_OUTGOING */
+
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = CAPTURE_BLOCK_SIZE;
+    req.tp_block_nr = CAPTURE_BLOCK_COUNT;
+    req.tp_frame_size = CAPTURE_FRAME_SIZE;
+    req.tp_frame_nr = (CAPTURE_BLOCK_SIZE / CAPTURE_FRAME_SIZE)
+                      * CAPTURE_BLOCK_COUNT;
+    req.tp_retire_blk_tov = CAPTURE_TIMEOUT;
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0)
+    {
+        asc_log_error(MSG("failed to set up ring: %s"), asc_error_msg());
+        close(fd);
+        return false;
+    }
+
+    const size_t ring_size = CAPTURE_BLOCK_SIZE * CAPTURE_BLOCK_COUNT;
+    void *const ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE
+                            , MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED)
+    {
+        asc_log_error(MSG("mmap(): %s"), asc_error_msg());
+        close(fd);
+        return false;
+    }
+
+    /* all interfaces */
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_IP);
+
+    if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) != 0)
+    {
+        asc_log_error(MSG("bind(): %s"), asc_error_msg());
+        munmap(ring, ring_size);
+        close(fd);
+        return false;
+    }
+
+    capture = ASC_ALLOC(1, udp_capture_t);
+    capture->fd = fd;
+    capture->ring = (uint8_t *)ring;
+
+    capture->event = asc_event_init(fd, NULL);
+    asc_event_set_on_read(capture->event, on_capture_read);
+
+    asc_log_debug(MSG("opened %u x %u byte ring")
+                  , CAPTURE_BLOCK_COUNT, CAPTURE_BLOCK_SIZE);
+
+    return true;
+}
+
+/* index of the interface `localaddr' is assigned to, 0 if there's none */
+static
+int local_ifindex(const char *localaddr)
+{
+    struct in_addr in;
+    if (inet_pton(AF_INET, localaddr, &in) != 1)
+        return 0;
+
+    struct ifaddrs *ifaddr;
+    if (getifaddrs(&ifaddr) != 0)
+        return 0;
+
+    int ifindex = 0;
+    for (const struct ifaddrs *i = ifaddr; i != NULL; i = i->ifa_next)
+    {
+        if (i->ifa_addr == NULL || i->ifa_addr->sa_family != AF_INET)
+            continue;
+
+        const struct sockaddr_in *const sin =
+            (const struct sockaddr_in *)i->ifa_addr;
+
+        if (sin->sin_addr.s_addr == in.s_addr)
+        {
+            ifindex = if_nametoindex(i->ifa_name);
+            break;
+        }
+    }
+
+    freeifaddrs(ifaddr);
+
+    return ifindex;
+}
+
+udp_capture_sub_t *udp_capture_attach(const char *addr, int port
+                                      , const char *localaddr
+                                      , capture_callback_t on_data
+                                      , void *arg)
+{
+    struct in_addr in;
+    if (inet_pton(AF_INET, addr, &in) != 1 || port <= 0 || port > 0xffff)
+    {
+        asc_log_error(MSG("%s:%d is not an IPv4 address and port")
+                      , addr, port);
+        return NULL;
+    }
+
+    int ifindex = 0;
+    if (localaddr != NULL)
+    {
+        ifindex = local_ifindex(localaddr);
+        if (ifindex == 0)
+        {
+            asc_log_error(MSG("no interface with address %s"), localaddr);
+            return NULL;
+        }
+    }
+
+    if (capture == NULL && !capture_open())
+        return NULL;
+
+    udp_capture_sub_t *const sub = ASC_ALLOC(1, udp_capture_sub_t);
+    sub->addr = in.s_addr;
+    sub->port = htons(port);
+    sub->ifindex = ifindex;
+    sub->on_data = on_data;
+    sub->arg = arg;
+
+    udp_capture_sub_t **const bucket =
+        &capture->buckets[sub_hash(sub->addr, sub->port)];
+    sub->next = *bucket;
+    *bucket = sub;
+
+    capture->refcnt++;
+
+    return sub;
+}
+
+void udp_capture_detach(udp_capture_sub_t *sub)
+{
+    asc_assert(capture != NULL, MSG("detaching from a closed ring"));
+
+    sub->on_data = NULL;
+    capture->is_dirty = true;
+    capture->refcnt--;
+
+    /* otherwise the read callback finishes the job */
+    if (!capture->is_busy)
+    {
+        capture_sweep();
+        if (capture->refcnt == 0)
+            capture_close();
+    }
+}
+
+void udp_capture_query(udp_capture_stat_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    if (capture == NULL)
+        return;
+
+    /* kernel counters reset on every read */
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+    if (getsockopt(capture->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)
+        capture->stats.drops += st.tp_drops;
+
+    *out = capture->stats;
+}
+
+#else /* HAVE_DECL_TPACKET_V3 */
+
+udp_capture_sub_t *udp_capture_attach(const char *addr, int port
+                                      , const char *localaddr
+                                      , capture_callback_t on_data
+                                      , void *arg)
+{
+    __uarg(addr);
+    __uarg(port);
+    __uarg(localaddr);
+    __uarg(on_data);
+    __uarg(arg);
+
+    asc_log_error(MSG("packet capture is not supported on this system"));
+
+    return NULL;
+}
+
+void udp_capture_detach(udp_capture_sub_t *sub)
+{
+    __uarg(sub);
+}
+
+void udp_capture_query(udp_capture_stat_t *out)
+{
+    memset(out, 0, sizeof(*out));
+}
+
+#endif /* !HAVE_DECL_TPACKET_V3 */
@@ -0,0 +1,64 @@
+/*
+ * Astra Module: UDP Capture
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _UDP_CAPTURE_H_
+#define _UDP_CAPTURE_H_ 1
+
+#ifndef _ASTRA_H_
+#   error "Please include <astra.h> first"
+#endif /* !_ASTRA_H_ */
+
+/*
+ * Receives UDP datagrams for any number of destinations through one
+ * AF_PACKET socket with a TPACKET_V3 ring, shared by everything on
+ * the calling thread's loop. Payloads are passed on straight from the
+ * ring and are only valid for the duration of the callback.
+ *
+ * The capture doesn't join multicast groups; that is still done with
+ * a regular socket, which doesn't have to be read.
+ */
+
+typedef struct udp_capture_sub_t udp_capture_sub_t;
+typedef void (*capture_callback_t)(void *, const uint8_t *, size_t);
+
+typedef struct
+{
+    /* datagrams passed on to subscribers */
+    uint64_t datagrams;
+    /* ring blocks processed */
+    uint64_t blocks;
+    /* packets dropped by the kernel on a full ring */
+    uint64_t drops;
+} udp_capture_stat_t;
+
+/*
+ * Datagrams are taken from the interface `localaddr' belongs to, or
+ * without it, from whichever interface the stream arrives on first.
+ * Returns NULL if capture is not available, e.g. without CAP_NET_RAW.
+ */
+udp_capture_sub_t *udp_capture_attach(const char *addr, int port
+                                      , const char *localaddr
+                                      , capture_callback_t on_data
+                                      , void *arg) __wur;
+void udp_capture_detach(udp_capture_sub_t *sub);
+
+void udp_capture_query(udp_capture_stat_t *out);
+
+#endif /* _UDP_CAPTURE_H_ */
@@ -29,24 +29,102 @@
  *      socket_size - number, socket buffer size
  *      renew       - number, renewing multicast subscription interval in seconds
  *      rtp         - boolean, use RTP instead of RAW UDP
+ *      burst       - number, maximum datagrams to read per system call
+ *                    (default: 32)
+ *      loop        - number, worker loop to run on (default: 0, main loop)
+ *      engine      - string, "socket" (default) or "packet" to receive through
+ *                    an AF_PACKET ring shared by all inputs on the loop
+ *                    (Linux, needs CAP_NET_RAW), or "completion" to queue
+ *                    reads on the io_uring event ring, one datagram each
+ *                    (falls back to "socket" with other event backends)
  *
  * Module Methods:
  *      port()      - return number, random port number
+ *      stats()     - return table, receive counters; inputs with the same
+ *                    addr, port, localaddr, rtp and engine on one loop share
+ *                    a socket and report the same counters
  */
 
 #include <astra.h>
+#include <core/event.h>
 #include <core/socket.h>
 #include <core/timer.h>
 #include <luaapi/stream.h>
 
+#include "capture.h"
+
 #define UDP_BUFFER_SIZE 1460
+#define UDP_DEFAULT_BURST 32
+#define UDP_POOL_CACHE 8
 #define RTP_HEADER_SIZE 12
 
 #define RTP_IS_EXT(_data) ((_data[0] & 0x10))
 #define RTP_EXT_SIZE(_data) \
     (((_data[RTP_HEADER_SIZE + 2] << 8) | _data[RTP_HEADER_SIZE + 3]) * 4 + 4)
 
-#define MSG(_msg) "[udp_input %s:%d] " _msg, mod->config.addr, mod->config.port
+#define MSG(_msg) "[udp_input %s:%d] " _msg, rx->addr, rx->port
+
+/*
+ * Inputs on the same loop with the same address, port, local address,
+ * RTP flag and engine share a receiver: one socket (or capture
+ * subscription) whose packets are fanned out to every member's stream.
+ * Options like burst and socket_size are taken from the first input.
+ */
+typedef enum
+{
+    UDP_ENGINE_SOCKET = 0,
+    UDP_ENGINE_PACKET,
+    UDP_ENGINE_COMPLETION,
+} udp_engine_t;
+
+typedef struct udp_receiver_t udp_receiver_t;
+
+struct udp_receiver_t
+{
+    char *addr;
+    int port;
+    char *localaddr;
+    bool rtp;
+    udp_engine_t engine;
+
+    module_data_t **members;
+    unsigned int count;
+    unsigned int size;
+
+    /* members leaving from a send callback are removed afterwards */
+    bool is_busy;
+    bool is_dirty;
+
+    bool is_error_message;
+
+    asc_socket_t *sock;
+    asc_timer_t *timer_renew;
+
+    /* packet engine, the socket is only used for the group membership */
+    udp_capture_sub_t *capture;
+
+    /* completion engine, `block' is being received into */
+    asc_event_io_t *io;
+    mpegts_block_t *block;
+
+    /*
+     * datagram n is received at data[n * UDP_BUFFER_SIZE] of a pooled
+     * block, so that downstream can keep it without copying
+     */
+    unsigned int burst;
+    mpegts_block_pool_t *pool;
+    size_t lens[ASC_SOCKET_BURST_MAX];
+
+    struct
+    {
+        uint64_t wakeups;
+        uint64_t datagrams;
+        uint64_t full;
+        unsigned int max_burst;
+    } stats;
+
+    udp_receiver_t *next;
+};
 
 struct module_data_t
 {
@@ -60,88 +138,496 @@ struct module_data_t
         bool rtp;
     } config;
 
-    bool is_error_message;
-
-    asc_socket_t *sock;
-    asc_timer_t *timer_renew;
-
-    uint8_t buffer[UDP_BUFFER_SIZE];
+    udp_receiver_t *rx;
 };
 
+/* receivers of the loop running on this thread */
+static __thread_local udp_receiver_t *receiver_list = NULL;
+
 static void on_close(void *arg)
 {
-    module_data_t *const mod = (module_data_t *)arg;
+    udp_receiver_t *const rx = (udp_receiver_t *)arg;
 
-    if(mod->sock)
+    if(rx->capture)
     {
-        asc_socket_multicast_leave(mod->sock);
-        asc_socket_close(mod->sock);
-        mod->sock = NULL;
+        udp_capture_detach(rx->capture);
+        rx->capture = NULL;
     }
 
-    if(mod->timer_renew)
+    /* before the socket, the kernel may still be writing to the block */
+    ASC_FREE(rx->io, asc_event_io_close);
+    ASC_FREE(rx->block, mpegts_block_release);
+
+    if(rx->sock)
     {
-        asc_timer_destroy(mod->timer_renew);
-        mod->timer_renew = NULL;
+        asc_socket_multicast_leave(rx->sock);
+        asc_socket_close(rx->sock);
+        rx->sock = NULL;
+    }
+
+    if(rx->timer_renew)
+    {
+        asc_timer_destroy(rx->timer_renew);
+        rx->timer_renew = NULL;
     }
 }
 
-static void on_read(void *arg)
+static void receiver_free(udp_receiver_t *rx)
 {
-    module_data_t *const mod = (module_data_t *)arg;
+    on_close(rx);
 
-    /* TODO: read until it fails with EAGAIN */
-    const ssize_t ret = asc_socket_recv(mod->sock, mod->buffer, UDP_BUFFER_SIZE);
-    if(ret <= 0)
+    for(udp_receiver_t **prev = &receiver_list; *prev; prev = &(*prev)->next)
     {
-        if(ret == 0 || asc_socket_would_block())
-            return;
+        if(*prev == rx)
+        {
+            *prev = rx->next;
+            break;
+        }
+    }
 
-        asc_log_error(MSG("recv(): %s"), asc_error_msg());
-        on_close(mod);
+    ASC_FREE(rx->pool, mpegts_block_pool_destroy);
+    free(rx->members);
+    free(rx->localaddr);
+    free(rx->addr);
+    free(rx);
+}
+
+/* drop members removed while busy, returns false if `rx' is gone */
+static bool receiver_settle(udp_receiver_t *rx)
+{
+    rx->is_busy = false;
+
+    if(rx->is_dirty)
+    {
+        unsigned int count = 0;
+        for(unsigned int i = 0; i < rx->count; ++i)
+        {
+            if(rx->members[i] != NULL)
+                rx->members[count++] = rx->members[i];
+        }
+
+        rx->count = count;
+        rx->is_dirty = false;
+    }
+
+    if(rx->count == 0)
+    {
+        receiver_free(rx);
+        return false;
+    }
+
+    return true;
+}
+
+static void receiver_join(udp_receiver_t *rx, module_data_t *mod)
+{
+    if(rx->count == rx->size)
+    {
+        rx->size = (rx->size > 0) ? (rx->size * 2) : 4;
+        rx->members = (module_data_t **)realloc(rx->members
+                                                , rx->size * sizeof(*rx->members));
+        asc_assert(rx->members != NULL, MSG("realloc() failed"));
+    }
+
+    rx->members[rx->count++] = mod;
+}
+
+static void receiver_leave(udp_receiver_t *rx, module_data_t *mod)
+{
+    for(unsigned int i = 0; i < rx->count; ++i)
+    {
+        if(rx->members[i] != mod)
+            continue;
+
+        rx->members[i] = NULL;
+        rx->is_dirty = true;
+        break;
+    }
+
+    if(!rx->is_busy)
+        receiver_settle(rx);
+}
+
+static bool str_equal(const char *a, const char *b)
+{
+    if(a == NULL || b == NULL)
+        return (a == b);
+
+    return (strcmp(a, b) == 0);
+}
 
+/* make `rx' available to inputs created later */
+static void receiver_register(udp_receiver_t *rx)
+{
+    if(rx->port == 0)
         return;
+
+    rx->next = receiver_list;
+    receiver_list = rx;
+}
+
+static udp_receiver_t *receiver_find(const module_data_t *mod
+                                     , udp_engine_t engine)
+{
+    /* each input without a port binds a random one of its own */
+    if(mod->config.port == 0)
+        return NULL;
+
+    for(udp_receiver_t *rx = receiver_list; rx != NULL; rx = rx->next)
+    {
+        /* skip receivers whose socket has failed */
+        if(rx->sock == NULL)
+            continue;
+
+        if(rx->port == mod->config.port
+           && rx->rtp == mod->config.rtp
+           && rx->engine == engine
+           && str_equal(rx->addr, mod->config.addr)
+           && str_equal(rx->localaddr, mod->config.localaddr))
+        {
+            return rx;
+        }
     }
 
-    const size_t len = ret;
+    return NULL;
+}
+
+/* offset of TS packets in a datagram, or -1 if there are none */
+static ssize_t payload_offset(udp_receiver_t *rx, const uint8_t *data, size_t len)
+{
     size_t i = 0;
 
-    if(mod->config.rtp)
+    if(rx->rtp)
     {
         i = RTP_HEADER_SIZE;
-        if(RTP_IS_EXT(mod->buffer))
+        if(RTP_IS_EXT(data))
         {
             if(len < RTP_HEADER_SIZE + 4)
-                return;
+                return -1;
+
+            i += RTP_EXT_SIZE(data);
+        }
+    }
+
+    if(i > len)
+        return -1;
+
+    return i;
+}
+
+/* whole packets in `len' bytes of payload */
+static size_t payload_size(udp_receiver_t *rx, size_t len)
+{
+    const size_t size = (len / TS_PACKET_SIZE) * TS_PACKET_SIZE;
+
+    if(size != len && !rx->is_error_message)
+    {
+        asc_log_error(MSG("wrong stream format. drop %zu bytes"), len - size);
+        rx->is_error_message = true;
+    }
+
+    return size;
+}
+
+/* send out `count' datagrams received into `block', see rx->lens */
+static void send_burst(udp_receiver_t *rx, mpegts_block_t *block
+                       , unsigned int count)
+{
+    uint8_t *const buffer = block->data;
+
+    rx->stats.datagrams += count;
+    if(count == rx->burst)
+        ++rx->stats.full;
+    if(count > rx->stats.max_burst)
+        rx->stats.max_burst = count;
+
+    /* pack payloads to the start of the buffer to send them at once */
+    size_t skip = 0;
+
+    for(unsigned int n = 0; n < count; ++n)
+    {
+        uint8_t *const data = &buffer[n * UDP_BUFFER_SIZE];
+        const size_t len = rx->lens[n];
+
+        const ssize_t i = payload_offset(rx, data, len);
+        if(i < 0)
+            continue;
+
+        const size_t size = payload_size(rx, len - i);
+        if(&data[i] != &buffer[skip])
+            memmove(&buffer[skip], &data[i], size);
+        skip += size;
+    }
+
+    /* every member gets a reference to the same block */
+    block->count = skip / TS_PACKET_SIZE;
+    for(unsigned int i = 0; i < rx->count && block->count > 0; ++i)
+    {
+        if(rx->members[i] != NULL)
+            module_stream_send_block(rx->members[i], block);
+    }
+}
+
+/* read one burst, return number of datagrams or -1 if the socket is closed */
+static ssize_t read_burst(udp_receiver_t *rx)
+{
+    mpegts_block_t *const block = mpegts_block_alloc(rx->pool);
+
+    const ssize_t ret = asc_socket_recv_burst(rx->sock, block->data
+                                              , UDP_BUFFER_SIZE, rx->lens
+                                              , rx->burst);
+    if(ret <= 0)
+    {
+        mpegts_block_release(block);
+        if(ret == 0)
+            return 0;
+
+        asc_log_error(MSG("recv(): %s"), asc_error_msg());
+        on_close(rx);
+
+        return -1;
+    }
+
+    send_burst(rx, block, ret);
+    mpegts_block_release(block);
+
+    return ret;
+}
+
+static void on_read(void *arg)
+{
+    udp_receiver_t *const rx = (udp_receiver_t *)arg;
 
-            i += RTP_EXT_SIZE(mod->buffer);
+    ++rx->stats.wakeups;
+    rx->is_busy = true;
+
+    /* edge-triggered: a short burst means the socket queue is empty */
+    bool is_empty = false;
+    for(unsigned int i = 0; i < ASC_EVENT_BUDGET; ++i)
+    {
+        if(read_burst(rx) < (ssize_t)rx->burst)
+        {
+            is_empty = true;
+            break;
         }
     }
 
-    for(; i + TS_PACKET_SIZE <= len; i += TS_PACKET_SIZE)
-        module_stream_send(mod, &mod->buffer[i]);
+    if(!receiver_settle(rx))
+        return;
+
+    if(!is_empty)
+        asc_socket_rearm(rx->sock);
+}
+
+/* completion engine: queue the next read */
+static void recv_queue(udp_receiver_t *rx)
+{
+    rx->block = mpegts_block_alloc(rx->pool);
+    asc_event_io_recv(rx->io, rx->block->data, UDP_BUFFER_SIZE);
+}
+
+static void on_recv(void *arg, ssize_t ret)
+{
+    udp_receiver_t *const rx = (udp_receiver_t *)arg;
+
+    mpegts_block_t *const block = rx->block;
+    rx->block = NULL;
+
+    if(ret < 0)
+    {
+        mpegts_block_release(block);
+
+        asc_log_error(MSG("recv(): %s"), strerror(-ret));
+        on_close(rx);
+
+        return;
+    }
+
+    ++rx->stats.wakeups;
+    rx->is_busy = true;
+
+    rx->lens[0] = ret;
+    send_burst(rx, block, 1);
+    mpegts_block_release(block);
+
+    if(!receiver_settle(rx))
+        return;
+
+    recv_queue(rx);
+}
+
+/* packet engine: payload points into the capture ring */
+static void on_capture(void *arg, const uint8_t *data, size_t len)
+{
+    udp_receiver_t *const rx = (udp_receiver_t *)arg;
+
+    ++rx->stats.datagrams;
+
+    const ssize_t i = payload_offset(rx, data, len);
+    if(i < 0)
+        return;
+
+    const size_t size = payload_size(rx, len - i);
+    if(size == 0)
+        return;
 
-    if(i != len && !mod->is_error_message)
+    rx->is_busy = true;
+    for(unsigned int n = 0; n < rx->count; ++n)
     {
-        asc_log_error(MSG("wrong stream format. drop %zu bytes"), len - i);
-        mod->is_error_message = true;
+        if(rx->members[n] != NULL)
+        {
+            module_stream_send_batch(rx->members[n], &data[i]
+                                     , size / TS_PACKET_SIZE);
+        }
     }
+
+    receiver_settle(rx);
 }
 
 static void timer_renew_callback(void *arg)
 {
-    module_data_t *const mod = (module_data_t *)arg;
-    asc_socket_multicast_renew(mod->sock);
+    udp_receiver_t *const rx = (udp_receiver_t *)arg;
+    asc_socket_multicast_renew(rx->sock);
+}
+
+static udp_receiver_t *receiver_open(lua_State *L, const module_data_t *mod
+                                     , udp_engine_t engine, unsigned int burst)
+{
+    udp_receiver_t *const rx = ASC_ALLOC(1, udp_receiver_t);
+
+    rx->addr = strdup(mod->config.addr);
+    rx->port = mod->config.port;
+    if(mod->config.localaddr != NULL)
+        rx->localaddr = strdup(mod->config.localaddr);
+    rx->rtp = mod->config.rtp;
+    rx->engine = engine;
+
+    int value;
+    if(module_option_integer(L, "renew", &value))
+        rx->timer_renew = asc_timer_init(value * 1000, timer_renew_callback, rx);
+
+    if(engine == UDP_ENGINE_PACKET)
+    {
+        rx->capture = udp_capture_attach(rx->addr, rx->port, rx->localaddr
+                                         , on_capture, rx);
+        if(rx->capture == NULL)
+            asc_log_warning(MSG("packet engine unavailable, using socket"));
+    }
+
+    if(rx->capture != NULL)
+    {
+        /* unbound, datagrams only reach the capture ring */
+        rx->sock = asc_socket_open_udp4(rx);
+        asc_socket_multicast_join(rx->sock, rx->addr, rx->localaddr);
+        receiver_register(rx);
+
+        return rx;
+    }
+
+    rx->sock = asc_socket_open_udp4(rx);
+
+    if(engine == UDP_ENGINE_COMPLETION)
+    {
+        rx->io = asc_event_io_init(asc_socket_fd(rx->sock), rx, on_recv);
+        if(rx->io == NULL)
+            asc_log_warning(MSG("completion engine unavailable, using socket"));
+        else
+            burst = 1; /* a read gets a single datagram */
+    }
+
+    rx->burst = burst;
+    const size_t packets = (rx->burst * UDP_BUFFER_SIZE + TS_PACKET_SIZE - 1)
+                           / TS_PACKET_SIZE;
+    rx->pool = mpegts_block_pool_init(packets, UDP_POOL_CACHE);
+
+    asc_socket_set_reuseaddr(rx->sock, 1);
+#if defined(_WIN32) || defined(__CYGWIN__)
+    if(!asc_socket_bind(rx->sock, NULL, rx->port))
+#else
+    if(!asc_socket_bind(rx->sock, rx->addr, rx->port))
+#endif
+    {
+        /* not shared, the next input gets to try binding again */
+        return rx;
+    }
+
+    if(module_option_integer(L, "socket_size", &value))
+        asc_socket_set_buffer(rx->sock, value, 0);
+
+    if(rx->io != NULL)
+    {
+        recv_queue(rx);
+    }
+    else
+    {
+        asc_socket_set_edge(rx->sock, true);
+        asc_socket_set_on_read(rx->sock, on_read);
+        asc_socket_set_on_close(rx->sock, on_close);
+    }
+
+    asc_socket_multicast_join(rx->sock, rx->addr, rx->localaddr);
+    receiver_register(rx);
+
+    return rx;
 }
 
 static int method_port(lua_State *L, module_data_t *mod)
 {
-    const int port = asc_socket_port(mod->sock);
+    const int port = asc_socket_port(mod->rx->sock);
     lua_pushinteger(L, port);
 
     return 1;
 }
 
+static int method_stats(lua_State *L, module_data_t *mod)
+{
+    const udp_receiver_t *const rx = mod->rx;
+
+    lua_newtable(L);
+
+    const char *engine = "socket";
+    if(rx->capture != NULL)
+        engine = "packet";
+    else if(rx->io != NULL)
+        engine = "completion";
+
+    lua_pushstring(L, engine);
+    lua_setfield(L, -2, "engine");
+
+    /* inputs sharing the receiver, counters below are common to all */
+    lua_pushinteger(L, rx->count);
+    lua_setfield(L, -2, "members");
+
+    if(rx->capture != NULL)
+    {
+        udp_capture_stat_t st;
+        udp_capture_query(&st);
+
+        lua_pushnumber(L, st.blocks);
+        lua_setfield(L, -2, "ring_blocks");
+        lua_pushnumber(L, st.drops);
+        lua_setfield(L, -2, "ring_drops");
+    }
+
+    lua_pushnumber(L, rx->stats.wakeups);
+    lua_setfield(L, -2, "wakeups");
+    lua_pushnumber(L, rx->stats.datagrams);
+    lua_setfield(L, -2, "datagrams");
+    lua_pushnumber(L, rx->stats.full);
+    lua_setfield(L, -2, "full_bursts");
+    lua_pushinteger(L, rx->stats.max_burst);
+    lua_setfield(L, -2, "max_burst");
+
+    /* average datagrams per wakeup */
+    const double avg = (rx->stats.wakeups > 0)
+                     ? ((double)rx->stats.datagrams / rx->stats.wakeups)
+                     : 0.0;
+    lua_pushnumber(L, avg);
+    lua_setfield(L, -2, "burst_avg");
+
+    return 1;
+}
+
 static void module_init(lua_State *L, module_data_t *mod)
 {
     module_stream_init(mod, NULL);
@@ -151,36 +637,50 @@ static void module_init(lua_State *L, module_data_t *mod)
         luaL_error(L, "[udp_input] option 'addr' is required");
 
     module_option_integer(L, "port", &mod->config.port);
+    module_option_boolean(L, "rtp", &mod->config.rtp);
+    module_option_string(L, "localaddr", &mod->config.localaddr, NULL);
 
-    mod->sock = asc_socket_open_udp4(mod);
-    asc_socket_set_reuseaddr(mod->sock, 1);
-#if defined(_WIN32) || defined(__CYGWIN__)
-    if(!asc_socket_bind(mod->sock, NULL, mod->config.port))
-#else
-    if(!asc_socket_bind(mod->sock, mod->config.addr, mod->config.port))
-#endif
-        return;
-
-    int value;
-    if(module_option_integer(L, "socket_size", &value))
-        asc_socket_set_buffer(mod->sock, value, 0);
+    const char *value = "socket";
+    module_option_string(L, "engine", &value, NULL);
 
-    module_option_boolean(L, "rtp", &mod->config.rtp);
+    udp_engine_t engine = UDP_ENGINE_SOCKET;
+    if(!strcmp(value, "packet"))
+        engine = UDP_ENGINE_PACKET;
+    else if(!strcmp(value, "completion"))
+        engine = UDP_ENGINE_COMPLETION;
+    else if(strcmp(value, "socket"))
+    {
+        luaL_error(L, "[udp_input] option 'engine' must be "
+                   "\"socket\", \"packet\" or \"completion\"");
+    }
 
-    asc_socket_set_on_read(mod->sock, on_read);
-    asc_socket_set_on_close(mod->sock, on_close);
+    int burst = UDP_DEFAULT_BURST;
+    module_option_integer(L, "burst", &burst);
+    if(burst < 1 || burst > ASC_SOCKET_BURST_MAX)
+    {
+        luaL_error(L, "[udp_input] option 'burst' must be between 1 and %d"
+                   , ASC_SOCKET_BURST_MAX);
+    }
 
-    module_option_string(L, "localaddr", &mod->config.localaddr, NULL);
-    asc_socket_multicast_join(mod->sock, mod->config.addr, mod->config.localaddr);
+    udp_receiver_t *rx = receiver_find(mod, engine);
+    if(rx != NULL)
+        asc_log_debug(MSG("sharing receiver with %u input(s)"), rx->count);
+    else
+        rx = receiver_open(L, mod, engine, burst);
 
-    if(module_option_integer(L, "renew", &value))
-        mod->timer_renew = asc_timer_init(value * 1000, timer_renew_callback, mod);
+    receiver_join(rx, mod);
+    mod->rx = rx;
 }
 
 static void module_destroy(module_data_t *mod)
 {
     module_stream_destroy(mod);
-    on_close(mod);
+
+    if(mod->rx)
+    {
+        receiver_leave(mod->rx, mod);
+        mod->rx = NULL;
+    }
 }
 
 MODULE_STREAM_METHODS()
@@ -188,5 +688,6 @@ MODULE_LUA_METHODS()
 {
     MODULE_STREAM_METHODS_REF(),
     { "port", method_port },
+    { "stats", method_stats },
 };
-MODULE_LUA_REGISTER(udp_input)
+MODULE_LUA_REGISTER_LOOP(udp_input)
@@ -32,6 +32,17 @@
  *      rtp         - boolean, use RTP instead of RAW UDP
  *      sync        - boolean, use MPEG-TS syncing
  *      sync_opts   - string, sync buffer options
+ *      txtime      - number, with sync: hand datagrams to the kernel this
+ *                    many milliseconds ahead, stamped with SO_TXTIME for
+ *                    pacing by the fq or etf qdisc (default: 0, disabled)
+ *      txtime_clock - string, "monotonic" for fq or "tai" for etf, which
+ *                    drops datagrams stamped with any other clock
+ *                    (default: "monotonic")
+ *      batch       - number, datagrams to collect before sending them with
+ *                    a single system call (default: 1, send immediately)
+ *      batch_time  - number, maximum time in milliseconds to hold
+ *                    collected datagrams (default: 10)
+ *      loop        - number, worker loop to run on (default: 0, main loop)
  */
 
 #include <astra.h>
@@ -43,8 +54,14 @@
 #define MSG(_msg) "[udp_output %s:%d] " _msg, mod->addr, mod->port
 
 #define UDP_BUFFER_SIZE 1460
+#define RTP_HEADER_SIZE 12
 #define RTP_PT_MP2T 33 /* RFC2250 */
 
+/* TS packets per datagram */
+#define UDP_TS_COUNT ((UDP_BUFFER_SIZE - RTP_HEADER_SIZE) / TS_PACKET_SIZE)
+
+#define UDP_DEFAULT_BATCH_TIME 10
+
 struct module_data_t
 {
     MODULE_STREAM_DATA();
@@ -59,14 +76,23 @@ struct module_data_t
     bool can_send;
     size_t dropped;
 
+    uint8_t rtp_header[RTP_HEADER_SIZE];
+
+    /* datagrams are laid out back to back, `size' bytes each */
     struct
     {
-        uint32_t skip;
-        uint8_t buffer[UDP_BUFFER_SIZE];
+        uint8_t *buffer;
+        size_t skip;
+        size_t size;
+        size_t capacity;
     } packet;
 
+    asc_timer_t *batch_timer;
+
     mpegts_sync_t *sync;
-    asc_timer_t *sync_loop;
+
+    /* transmit time per datagram in the buffer, NULL if disabled */
+    uint64_t *txtime;
 };
 
 static void on_ready(void *arg)
@@ -83,9 +109,10 @@ static void on_ready(void *arg)
     asc_socket_set_on_ready(mod->sock, NULL);
 }
 
-static void on_sync_ts(module_data_t *mod, const uint8_t *ts)
+static void on_sync_ts_batch(module_data_t *mod, const uint8_t *ts
+                             , size_t count)
 {
-    const bool ret = mpegts_sync_push(mod->sync, ts, 1);
+    const bool ret = mpegts_sync_push(mod->sync, ts, count);
 
     if (!ret)
     {
@@ -94,55 +121,123 @@ static void on_sync_ts(module_data_t *mod, const uint8_t *ts)
     }
 }
 
+static void on_sync_ts(module_data_t *mod, const uint8_t *ts)
+{
+    on_sync_ts_batch(mod, ts, 1);
+}
+
+/* send complete datagrams, keeping an unfinished one in the buffer */
+static void flush_datagrams(module_data_t *mod)
+{
+    const size_t tail = mod->packet.skip % mod->packet.size;
+    const size_t size = mod->packet.skip - tail;
+
+    if(size == 0)
+        return;
+
+    ssize_t ret;
+    if(mod->txtime != NULL)
+    {
+        ret = asc_socket_sendto_txtime(mod->sock, mod->packet.buffer
+                                       , size, mod->packet.size
+                                       , mod->txtime);
+    }
+    else
+    {
+        ret = asc_socket_sendto_burst(mod->sock, mod->packet.buffer
+                                      , size, mod->packet.size);
+    }
+
+    if(ret == -1)
+    {
+        asc_log_warning(MSG("sendto(): %s"), asc_error_msg());
+        ret = 0;
+    }
+    else if((size_t)ret < size)
+    {
+        /* socket buffer is full, wait for on_ready() */
+        mod->can_send = false;
+        asc_socket_set_on_ready(mod->sock, on_ready);
+    }
+
+    if((size_t)ret < size)
+    {
+        /* unsent datagrams are overwritten below */
+        const size_t lost = ((size - ret) / mod->packet.size) * UDP_TS_COUNT;
+        mod->dropped += lost;
+        module_stream_stat_drop(mod, lost);
+    }
+
+    if(tail > 0)
+    {
+        memmove(mod->packet.buffer, &mod->packet.buffer[size], tail);
+
+        if(mod->txtime != NULL)
+            mod->txtime[0] = mod->txtime[size / mod->packet.size];
+    }
+
+    mod->packet.skip = tail;
+}
+
+static void on_batch_timer(void *arg)
+{
+    module_data_t *const mod = (module_data_t *)arg;
+
+    if(mod->can_send)
+        flush_datagrams(mod);
+}
+
 static void on_output_ts(module_data_t *mod, const uint8_t *ts)
 {
     if(!mod->can_send)
     {
         mod->dropped++;
+        module_stream_stat_drop(mod, 1);
         return;
     }
 
-    if(mod->is_rtp && mod->packet.skip == 0)
+    uint8_t *const dst = &mod->packet.buffer[mod->packet.skip];
+
+    if(mod->txtime != NULL && (mod->packet.skip % mod->packet.size) == 0)
+    {
+        /* datagram leaves with its first packet */
+        const size_t idx = mod->packet.skip / mod->packet.size;
+        mod->txtime[idx] = mpegts_sync_txtime(mod->sync);
+    }
+
+    if(mod->is_rtp && (mod->packet.skip % mod->packet.size) == 0)
     {
         struct timeval tv;
         gettimeofday(&tv, NULL);
         const uint64_t msec = ((tv.tv_sec % 1000000) * 1000) + (tv.tv_usec / 1000);
 
-        mod->packet.buffer[2] = (mod->rtpseq >> 8) & 0xFF;
-        mod->packet.buffer[3] = (mod->rtpseq     ) & 0xFF;
+        memcpy(dst, mod->rtp_header, RTP_HEADER_SIZE);
 
-        mod->packet.buffer[4] = (msec >> 24) & 0xFF;
-        mod->packet.buffer[5] = (msec >> 16) & 0xFF;
-        mod->packet.buffer[6] = (msec >>  8) & 0xFF;
-        mod->packet.buffer[7] = (msec      ) & 0xFF;
+        dst[2] = (mod->rtpseq >> 8) & 0xFF;
+        dst[3] = (mod->rtpseq     ) & 0xFF;
+
+        dst[4] = (msec >> 24) & 0xFF;
+        dst[5] = (msec >> 16) & 0xFF;
+        dst[6] = (msec >>  8) & 0xFF;
+        dst[7] = (msec      ) & 0xFF;
 
         ++mod->rtpseq;
 
-        mod->packet.skip += 12;
+        mod->packet.skip += RTP_HEADER_SIZE;
     }
 
     memcpy(&mod->packet.buffer[mod->packet.skip], ts, TS_PACKET_SIZE);
     mod->packet.skip += TS_PACKET_SIZE;
 
-    if(mod->packet.skip > UDP_BUFFER_SIZE - TS_PACKET_SIZE)
-    {
-        const ssize_t ret = asc_socket_sendto(mod->sock
-                                              , mod->packet.buffer
-                                              , mod->packet.skip);
-
-        if(ret == -1)
-        {
-            if(asc_socket_would_block())
-            {
-                mod->can_send = false;
-                asc_socket_set_on_ready(mod->sock, on_ready);
-            }
-            else
-                asc_log_warning(MSG("sendto(): %s"), asc_error_msg());
-        }
+    if(mod->packet.skip >= mod->packet.capacity)
+        flush_datagrams(mod);
+}
 
-        mod->packet.skip = 0;
-    }
+static void on_output_ts_batch(module_data_t *mod, const uint8_t *ts
+                               , size_t count)
+{
+    for(size_t i = 0; i < count; ++i)
+        on_output_ts(mod, &ts[i * TS_PACKET_SIZE]);
 }
 
 static void module_init(lua_State *L, module_data_t *mod)
@@ -159,12 +254,37 @@ static void module_init(lua_State *L, module_data_t *mod)
     {
         const uint32_t rtpssrc = (uint32_t)rand();
 
-        mod->packet.buffer[0 ] = 0x80; // RTP version
-        mod->packet.buffer[1 ] = RTP_PT_MP2T;
-        mod->packet.buffer[8 ] = (rtpssrc >> 24) & 0xFF;
-        mod->packet.buffer[9 ] = (rtpssrc >> 16) & 0xFF;
-        mod->packet.buffer[10] = (rtpssrc >>  8) & 0xFF;
-        mod->packet.buffer[11] = (rtpssrc      ) & 0xFF;
+        mod->rtp_header[0 ] = 0x80; // RTP version
+        mod->rtp_header[1 ] = RTP_PT_MP2T;
+        mod->rtp_header[8 ] = (rtpssrc >> 24) & 0xFF;
+        mod->rtp_header[9 ] = (rtpssrc >> 16) & 0xFF;
+        mod->rtp_header[10] = (rtpssrc >>  8) & 0xFF;
+        mod->rtp_header[11] = (rtpssrc      ) & 0xFF;
+    }
+
+    mod->packet.size = UDP_TS_COUNT * TS_PACKET_SIZE;
+    if(mod->is_rtp)
+        mod->packet.size += RTP_HEADER_SIZE;
+
+    int batch = 1;
+    module_option_integer(L, "batch", &batch);
+    if(batch < 1 || batch > ASC_SOCKET_BURST_MAX)
+    {
+        luaL_error(L, MSG("option 'batch' must be between 1 and %d")
+                   , ASC_SOCKET_BURST_MAX);
+    }
+
+    mod->packet.capacity = batch * mod->packet.size;
+    mod->packet.buffer = ASC_ALLOC(mod->packet.capacity, uint8_t);
+
+    if(batch > 1)
+    {
+        int batch_time = UDP_DEFAULT_BATCH_TIME;
+        module_option_integer(L, "batch_time", &batch_time);
+        if(batch_time <= 0)
+            luaL_error(L, MSG("option 'batch_time' must be positive"));
+
+        mod->batch_timer = asc_timer_init(batch_time, on_batch_timer, mod);
     }
 
     mod->sock = asc_socket_open_udp4(mod);
@@ -192,6 +312,7 @@ static void module_init(lua_State *L, module_data_t *mod)
     asc_socket_set_on_ready(mod->sock, on_ready);
 
     stream_callback_t on_ts = on_output_ts;
+    stream_batch_callback_t on_ts_batch = on_output_ts_batch;
     bool sync_on = false;
     module_option_boolean(L, "sync", &sync_on);
 
@@ -209,22 +330,56 @@ static void module_init(lua_State *L, module_data_t *mod)
         if (optstr != NULL && !mpegts_sync_parse_opts(mod->sync, optstr))
             luaL_error(L, MSG("invalid value for option 'sync_opts'"));
 
-        mod->sync_loop = asc_timer_init(SYNC_INTERVAL_MSEC, mpegts_sync_loop
-                                        , mod->sync);
+        int txtime = 0;
+        module_option_integer(L, "txtime", &txtime);
+        if(txtime < 0)
+            luaL_error(L, MSG("option 'txtime' can't be negative"));
+
+        const char *clock = "monotonic";
+        module_option_string(L, "txtime_clock", &clock, NULL);
+        const bool is_tai = !strcmp(clock, "tai");
+        if(!is_tai && strcmp(clock, "monotonic"))
+        {
+            luaL_error(L, MSG("option 'txtime_clock' must be "
+                              "\"monotonic\" or \"tai\""));
+        }
+
+        if(txtime > 0)
+        {
+            if(asc_socket_set_txtime(mod->sock, is_tai))
+            {
+                mod->txtime = ASC_ALLOC(batch, uint64_t);
+                mpegts_sync_set_lead(mod->sync, txtime * 1000);
+            }
+            else
+            {
+                asc_log_warning(MSG("falling back to timer-based pacing"));
+            }
+        }
+
+        mpegts_sync_start(mod->sync);
 
         on_ts = on_sync_ts;
+        on_ts_batch = on_sync_ts_batch;
+    }
+    else if(module_option_integer(L, "txtime", &value) && value > 0)
+    {
+        luaL_error(L, MSG("option 'txtime' requires 'sync'"));
     }
 
     module_stream_init(mod, on_ts);
+    module_stream_set_batch(mod, on_ts_batch);
 }
 
 static void module_destroy(module_data_t *mod)
 {
     module_stream_destroy(mod);
 
-    ASC_FREE(mod->sync_loop, asc_timer_destroy);
+    ASC_FREE(mod->batch_timer, asc_timer_destroy);
     ASC_FREE(mod->sync, mpegts_sync_destroy);
     ASC_FREE(mod->sock, asc_socket_close);
+    ASC_FREE(mod->packet.buffer, free);
+    ASC_FREE(mod->txtime, free);
 }
 
 MODULE_STREAM_METHODS()
@@ -232,4 +387,4 @@ MODULE_LUA_METHODS()
 {
     MODULE_STREAM_METHODS_REF(),
 };
-MODULE_LUA_REGISTER(udp_output)
+MODULE_LUA_REGISTER_LOOP(udp_output)
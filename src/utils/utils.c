@@ -30,10 +30,20 @@
  *                  - file/folder information
  *      utils.readdir(path)
  *                  - iterator to scan directory located by path
+ *      utils.psi_memory()
+ *                  - PSI section assemblers: number of objects, buffers,
+ *                    bytes held by buffers and bytes cached for reuse
+ *      utils.stream_stat(enable)
+ *                  - turn per-module packet and CPU time counters on or off
+ *      utils.stream_graph()
+ *                  - list of all stream modules with their counters,
+ *                    ids and parent ids
  */
 
 #include <astra.h>
 #include <luaapi/luaapi.h>
+#include <luaapi/stream.h>
+#include <mpegts/psi.h>
 
 #include <dirent.h>
 
@@ -185,6 +195,48 @@ static int method_stat(lua_State *L)
     return 1;
 }
 
+/* psi_memory */
+
+static int method_psi_memory(lua_State *L)
+{
+    mpegts_psi_stats_t stats;
+    mpegts_psi_stats(&stats);
+
+    lua_newtable(L);
+
+    lua_pushinteger(L, stats.objects);
+    lua_setfield(L, -2, "objects");
+
+    lua_pushinteger(L, stats.buffers);
+    lua_setfield(L, -2, "buffers");
+
+    lua_pushinteger(L, stats.bytes);
+    lua_setfield(L, -2, "bytes");
+
+    lua_pushinteger(L, stats.cached);
+    lua_setfield(L, -2, "cached");
+
+    return 1;
+}
+
+/* stream_stat */
+
+static int method_stream_stat(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TBOOLEAN);
+    module_stream_stat_enable(lua_toboolean(L, 1));
+
+    return 0;
+}
+
+/* stream_graph */
+
+static int method_stream_graph(lua_State *L)
+{
+    module_stream_graph(L);
+    return 1;
+}
+
 /* readdir */
 
 static const char __utils_readdir[] = "__utils_readdir";
@@ -244,6 +296,9 @@ MODULE_LUA_BINDING(utils)
         { "ifaddrs", method_ifaddrs },
 #endif
         { "stat", method_stat },
+        { "psi_memory", method_psi_memory },
+        { "stream_stat", method_stream_stat },
+        { "stream_graph", method_stream_graph },
         { NULL, NULL },
     };
 
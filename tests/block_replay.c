@@ -0,0 +1,249 @@
+/*
+ * TS replay benchmark for cross-loop stream links
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Replays a TS file (or null packets) from the main loop into a chain
+ * of pass-through stages running on a worker loop, once as plain
+ * packet batches and once as pooled blocks, and reports throughput
+ * along with the number of packets memcpy()'d on the way.
+ */
+
+#include <astra.h>
+#include <core/loop.h>
+#include <core/mainloop.h>
+#include <luaapi/stream.h>
+#include <mpegts/block.h>
+
+#define fatal(__fmt, ...) \
+    { \
+        fprintf(stderr, "error: " __fmt "\n", __VA_ARGS__); \
+        exit(1); \
+    }
+
+/* packets per read, same as an udp_input burst of 7-packet datagrams */
+#define REPLAY_CHUNK 224
+
+/* keep this many packets in flight at most */
+#define REPLAY_WINDOW 2048
+
+#define REPLAY_STAGES_MAX 32
+
+struct module_data_t
+{
+    MODULE_STREAM_DATA();
+
+    uint64_t count;
+};
+
+static void on_stage_ts(module_data_t *mod, const uint8_t *ts, size_t count)
+{
+    module_stream_send_batch(mod, ts, count);
+}
+
+static void on_sink_ts(module_data_t *mod, const uint8_t *ts, size_t count)
+{
+    __uarg(ts);
+    __atomic_add_fetch(&mod->count, count, __ATOMIC_RELAXED);
+}
+
+static uint8_t *replay_data;
+static size_t replay_size;
+
+static void load_file(const char *path, size_t packets)
+{
+    if (path == NULL)
+    {
+        replay_size = packets;
+        replay_data = ASC_ALLOC(packets * TS_PACKET_SIZE, uint8_t);
+
+        for (size_t i = 0; i < packets; i++)
+            memcpy(&replay_data[i * TS_PACKET_SIZE], null_ts, TS_PACKET_SIZE);
+
+        return;
+    }
+
+    FILE *const f = fopen(path, "rb");
+    if (f == NULL)
+        fatal("fopen: %s: %s", path, strerror(errno));
+
+    replay_data = ASC_ALLOC(packets * TS_PACKET_SIZE, uint8_t);
+    replay_size = fread(replay_data, TS_PACKET_SIZE, packets, f);
+    fclose(f);
+
+    if (replay_size == 0)
+        fatal("%s: no packets", path);
+}
+
+static double run(bool blocks, unsigned int stages, size_t total
+                  , uint64_t *copied)
+{
+    module_data_t src, chain[REPLAY_STAGES_MAX], sink;
+    memset(&src, 0, sizeof(src));
+    memset(chain, 0, sizeof(chain));
+    memset(&sink, 0, sizeof(sink));
+
+    src.__stream.self = &src;
+    __module_stream_init(&src.__stream);
+
+    /* stages and sink live on loop 1 */
+    asc_loop_t *const worker = asc_loop_get(1);
+    asc_loop_t *const prev = asc_loop_enter(worker);
+
+    module_stream_t *up = &src.__stream;
+    for (unsigned int i = 0; i < stages; i++)
+    {
+        chain[i].__stream.self = &chain[i];
+        chain[i].__stream.on_ts_batch = on_stage_ts;
+        __module_stream_init(&chain[i].__stream);
+        __module_stream_attach(up, &chain[i].__stream);
+
+        up = &chain[i].__stream;
+    }
+
+    sink.__stream.self = &sink;
+    sink.__stream.on_ts_batch = on_sink_ts;
+    __module_stream_init(&sink.__stream);
+    __module_stream_attach(up, &sink.__stream);
+
+    asc_loop_leave(worker, prev);
+
+    mpegts_block_pool_t *const pool =
+        mpegts_block_pool_init(REPLAY_CHUNK, 16);
+
+    mpegts_block_stats_t before;
+    mpegts_block_pool_stats(NULL, &before);
+
+    const uint64_t start = asc_utime();
+    size_t sent = 0, pos = 0;
+
+    while (sent < total)
+    {
+        /* don't overflow the link */
+        while (sent - __atomic_load_n(&sink.count, __ATOMIC_RELAXED)
+               > REPLAY_WINDOW)
+        {
+            asc_usleep(50);
+        }
+
+        size_t count = REPLAY_CHUNK;
+        if (count > replay_size - pos)
+            count = replay_size - pos;
+        if (count > total - sent)
+            count = total - sent;
+
+        const uint8_t *const ts = &replay_data[pos * TS_PACKET_SIZE];
+
+        if (blocks)
+        {
+            /* a reader would fill the block directly, e.g. recvmmsg() */
+            mpegts_block_t *const block = mpegts_block_alloc(pool);
+            block->count = count;
+            memcpy(block->data, ts, count * TS_PACKET_SIZE);
+
+            __module_stream_send_block(&src.__stream, block);
+            mpegts_block_release(block);
+        }
+        else
+        {
+            __module_stream_send_batch(&src.__stream, ts, count);
+        }
+
+        sent += count;
+        pos = (pos + count) % replay_size;
+    }
+
+    while (__atomic_load_n(&sink.count, __ATOMIC_RELAXED) < total)
+        asc_usleep(50);
+
+    const double elapsed = (asc_utime() - start) / 1000000.0;
+
+    mpegts_block_stats_t after;
+    mpegts_block_pool_stats(NULL, &after);
+    *copied = after.copied - before.copied;
+
+    /* tear down */
+    asc_loop_t *const prev2 = asc_loop_enter(worker);
+    __module_stream_destroy(&sink.__stream);
+    for (unsigned int i = stages; i > 0; i--)
+        __module_stream_destroy(&chain[i - 1].__stream);
+    asc_loop_leave(worker, prev2);
+
+    __module_stream_destroy(&src.__stream);
+    mpegts_block_pool_destroy(pool);
+
+    return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *infile = NULL;
+    unsigned int stages = 4;
+    size_t total = 2000000;
+
+    int c;
+    while ((c = getopt(argc, argv, "i:n:s:")) != -1)
+    {
+        switch (c)
+        {
+            case 'i':
+                infile = optarg;
+                break;
+
+            case 'n':
+                total = strtoul(optarg, NULL, 10);
+                break;
+
+            case 's':
+                stages = atoi(optarg);
+                break;
+
+            default:
+                fatal("usage: %s [-i <file.ts>] [-n <packets>] [-s <stages>]"
+                      , argv[0]);
+        }
+    }
+
+    if (stages > REPLAY_STAGES_MAX || total == 0)
+        fatal("stages must be 0..%d, packets above 0", REPLAY_STAGES_MAX);
+
+    asc_lib_init();
+    asc_log_set_stdout(false);
+
+    load_file(infile, (infile != NULL) ? 100000 : REPLAY_CHUNK * 16);
+
+    printf("replaying %zu packets through %u stages on loop 1\n"
+           , total, stages);
+
+    static const char *const names[] = { "batch", "block" };
+    for (unsigned int i = 0; i < 2; i++)
+    {
+        uint64_t copied = 0;
+        const double elapsed = run(i == 1, stages, total, &copied);
+
+        printf("%s: %.3f s, %.0f packets/s, %" PRIu64 " packets copied "
+               "(%.2f per packet)\n"
+               , names[i], elapsed, total / elapsed, copied
+               , (double)copied / total);
+    }
+
+    free(replay_data);
+    asc_lib_destroy();
+
+    return 0;
+}
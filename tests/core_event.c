@@ -0,0 +1,187 @@
+/*
+ * Astra: Unit tests
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unit_tests.h"
+#include <core/event.h>
+
+#define TEST_BUDGET 4
+#define TEST_SIZE 64
+
+typedef struct
+{
+    int fds[2];
+    asc_event_t *event;
+
+    unsigned int total;
+    unsigned int reads;
+} pipe_test_t;
+
+static void pipe_open(pipe_test_t *p)
+{
+    memset(p, 0, sizeof(*p));
+
+    ck_assert(pipe(p->fds) == 0);
+    ck_assert(fcntl(p->fds[0], F_SETFL, O_NONBLOCK) == 0);
+
+    p->event = asc_event_init(p->fds[0], p);
+    asc_event_set_edge(p->event, true);
+}
+
+static void pipe_close(pipe_test_t *p)
+{
+    asc_event_close(p->event);
+    close(p->fds[0]);
+    close(p->fds[1]);
+}
+
+/* one byte per read, give up the loop after TEST_BUDGET reads */
+static void on_pipe_read(void *arg)
+{
+    pipe_test_t *const p = (pipe_test_t *)arg;
+
+    for (unsigned int i = 0; i < TEST_BUDGET; i++)
+    {
+        uint8_t byte;
+        if (read(p->fds[0], &byte, 1) != 1)
+        {
+            ck_assert(errno == EAGAIN);
+            return;
+        }
+
+        p->total++;
+        p->reads++;
+    }
+
+    asc_event_rearm(p->event);
+}
+
+/* budgeted callbacks take turns until both fds are drained */
+START_TEST(edge_budget)
+{
+    pipe_test_t a, b;
+    pipe_open(&a);
+    pipe_open(&b);
+
+    uint8_t data[TEST_SIZE];
+    memset(data, 0, sizeof(data));
+    ck_assert(write(a.fds[1], data, sizeof(data)) == sizeof(data));
+    ck_assert(write(b.fds[1], data, sizeof(data)) == sizeof(data));
+
+    asc_event_set_on_read(a.event, on_pipe_read);
+    asc_event_set_on_read(b.event, on_pipe_read);
+
+    unsigned int rounds = 0;
+    while (a.total < TEST_SIZE || b.total < TEST_SIZE)
+    {
+        ck_assert(++rounds <= TEST_SIZE);
+
+        a.reads = b.reads = 0;
+        asc_event_core_loop(100);
+
+        /* one budget per iteration, no fd starves the other */
+        ck_assert(a.reads <= TEST_BUDGET && b.reads <= TEST_BUDGET);
+    }
+
+    ck_assert(a.total == TEST_SIZE && b.total == TEST_SIZE);
+
+    /* new data wakes the callback up again */
+    ck_assert(write(a.fds[1], data, 1) == 1);
+    for (unsigned int i = 0; i < 10 && a.total == TEST_SIZE; i++)
+        asc_event_core_loop(100);
+
+    ck_assert(a.total == TEST_SIZE + 1);
+
+    pipe_close(&a);
+    pipe_close(&b);
+}
+END_TEST
+
+/* whichever pipe is read first closes another unread one */
+static pipe_test_t close_pipes[3];
+static pipe_test_t *close_victim;
+
+static void on_close_read(void *arg)
+{
+    pipe_test_t *const p = (pipe_test_t *)arg;
+
+    uint8_t buf[TEST_SIZE];
+    while (read(p->fds[0], buf, sizeof(buf)) > 0)
+        p->total += TEST_SIZE;
+
+    if (close_victim != NULL)
+        return;
+
+    for (size_t i = 0; i < ASC_ARRAY_SIZE(close_pipes); i++)
+    {
+        pipe_test_t *const other = &close_pipes[i];
+        if (other != p && other->total == 0)
+        {
+            close_victim = other;
+            pipe_close(other);
+            break;
+        }
+    }
+}
+
+/* closing an event from a callback doesn't skip the rest of the wakeup */
+START_TEST(edge_close)
+{
+    uint8_t data[TEST_SIZE];
+    memset(data, 0, sizeof(data));
+
+    close_victim = NULL;
+    for (size_t i = 0; i < ASC_ARRAY_SIZE(close_pipes); i++)
+    {
+        pipe_test_t *const p = &close_pipes[i];
+        pipe_open(p);
+        ck_assert(write(p->fds[1], data, sizeof(data)) == sizeof(data));
+        asc_event_set_on_read(p->event, on_close_read);
+    }
+
+    /* edge-triggered fds that get skipped are not reported again */
+    asc_event_core_loop(100);
+    ck_assert(close_victim != NULL);
+
+    for (size_t i = 0; i < ASC_ARRAY_SIZE(close_pipes); i++)
+    {
+        pipe_test_t *const p = &close_pipes[i];
+        if (p == close_victim)
+            continue;
+
+        ck_assert(p->total == TEST_SIZE);
+        pipe_close(p);
+    }
+}
+END_TEST
+
+Suite *core_event(void)
+{
+    Suite *const s = suite_create("event");
+
+    TCase *const tc = tcase_create("default");
+    tcase_add_checked_fixture(tc, lib_setup, lib_teardown);
+
+    tcase_add_test(tc, edge_budget);
+    tcase_add_test(tc, edge_close);
+
+    suite_add_tcase(s, tc);
+
+    return s;
+}
@@ -0,0 +1,345 @@
+/*
+ * Astra: Unit tests
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unit_tests.h"
+#include <core/loop.h>
+#include <core/mainloop.h>
+#include <core/timer.h>
+#include <luaapi/stream.h>
+#include <mpegts/block.h>
+
+struct module_data_t
+{
+    MODULE_STREAM_DATA();
+
+    asc_loop_t *main;
+    unsigned int count;
+    unsigned int errors;
+    bool is_done;
+};
+
+static void on_shutdown(void *arg)
+{
+    __uarg(arg);
+    asc_main_loop_shutdown();
+}
+
+/* nested enter and leave */
+START_TEST(enter_leave)
+{
+    asc_loop_t *const main = asc_loop_current();
+    asc_loop_t *const one = asc_loop_get(1);
+    asc_loop_t *const two = asc_loop_get(2);
+
+    ck_assert(main == asc_loop_get(0));
+    ck_assert(asc_loop_id(main) == 0);
+    ck_assert(asc_loop_id(two) == 2);
+    ck_assert(asc_loop_get(ASC_LOOP_MAX + 1) == NULL);
+
+    asc_loop_t *const p1 = asc_loop_enter(one);
+    ck_assert(p1 == main && asc_loop_current() == one);
+
+    asc_loop_t *const p2 = asc_loop_enter(two);
+    ck_assert(p2 == one && asc_loop_current() == two);
+
+    asc_loop_t *const p3 = asc_loop_enter(one);
+    ck_assert(p3 == two && asc_loop_current() == one);
+
+    asc_loop_leave(one, p3);
+    ck_assert(asc_loop_current() == two);
+    asc_loop_leave(two, p2);
+    ck_assert(asc_loop_current() == one);
+    asc_loop_leave(one, p1);
+    ck_assert(asc_loop_current() == main);
+}
+END_TEST
+
+/* timer running on a worker loop */
+#define TICK_COUNT 100
+
+static void on_tick(void *arg)
+{
+    module_data_t *const mod = (module_data_t *)arg;
+
+    if (asc_loop_current() != mod->__loop)
+        mod->errors++;
+
+    if (++mod->count == TICK_COUNT)
+        asc_loop_job_queue(mod->main, NULL, on_shutdown, NULL);
+}
+
+START_TEST(worker_timer)
+{
+    module_data_t mod;
+    memset(&mod, 0, sizeof(mod));
+
+    mod.main = asc_loop_current();
+    mod.__loop = asc_loop_get(1);
+    ck_assert(mod.__loop != NULL && mod.__loop != mod.main);
+
+    asc_loop_t *prev = asc_loop_enter(mod.__loop);
+    asc_timer_t *const timer = asc_timer_init(1, on_tick, &mod);
+    asc_loop_leave(mod.__loop, prev);
+
+    ck_assert(asc_main_loop_run() == false);
+
+    prev = asc_loop_enter(mod.__loop);
+    asc_timer_destroy(timer);
+    asc_loop_leave(mod.__loop, prev);
+
+    ck_assert(mod.count >= TICK_COUNT);
+    ck_assert(mod.errors == 0);
+}
+END_TEST
+
+/* stream link between main loop and a worker */
+#define LINK_PACKETS 2000
+#define LINK_BATCH 10
+
+static void link_packet(uint8_t *ts, uint16_t pid, uint32_t seq)
+{
+    memset(ts, 0xff, TS_PACKET_SIZE);
+    ts[0] = 0x47;
+    ts[1] = pid >> 8;
+    ts[2] = pid & 0xff;
+    ts[3] = 0x10;
+    memcpy(&ts[4], &seq, sizeof(seq));
+}
+
+static void on_link_ts(module_data_t *mod, const uint8_t *ts)
+{
+    uint32_t seq;
+    memcpy(&seq, &ts[4], sizeof(seq));
+
+    if (asc_loop_current() != mod->__loop)
+        mod->errors++;
+
+    if (TS_GET_PID(ts) != 100 || seq != mod->count)
+        mod->errors++;
+
+    if (++mod->count == LINK_PACKETS && !mod->is_done)
+    {
+        mod->is_done = true;
+        asc_loop_job_queue(mod->main, NULL, on_shutdown, NULL);
+    }
+}
+
+static unsigned int link_joins;
+
+static void on_link_join(void *arg, uint16_t pid)
+{
+    __uarg(arg);
+
+    if (pid == 100)
+        link_joins++;
+}
+
+static void link_run(bool demux, bool blocks)
+{
+    module_data_t up, down;
+    memset(&up, 0, sizeof(up));
+    memset(&down, 0, sizeof(down));
+
+    link_joins = 0;
+
+    /* upstream on main loop */
+    up.__loop = asc_loop_current();
+    up.__stream.self = &up;
+    __module_stream_init(&up.__stream);
+    if (demux)
+    {
+        __module_stream_demux_init(&up.__stream);
+        up.__stream.join_pid = on_link_join;
+    }
+
+    /* downstream on a worker */
+    down.main = up.__loop;
+    down.__loop = asc_loop_get(1);
+
+    asc_loop_t *prev = asc_loop_enter(down.__loop);
+    down.__stream.self = &down;
+    down.__stream.on_ts = on_link_ts;
+    __module_stream_init(&down.__stream);
+    __module_stream_attach(&up.__stream, &down.__stream);
+    if (demux)
+    {
+        module_stream_demux_set((&down), NULL, NULL);
+        module_stream_demux_join_pid((&down), 100);
+    }
+    asc_loop_leave(down.__loop, prev);
+
+    ck_assert(down.__stream.parent != &up.__stream);
+    ck_assert(down.__stream.link != NULL);
+
+    /* wait for the join to reach upstream */
+    if (demux)
+    {
+        for (unsigned int i = 0; i < 100 && link_joins == 0; i++)
+        {
+            asc_usleep(1000);
+            asc_job_run();
+        }
+
+        ck_assert(link_joins == 1);
+    }
+
+    mpegts_block_pool_t *const pool = mpegts_block_pool_init(LINK_BATCH, 4);
+    uint8_t ts[LINK_BATCH * 2][TS_PACKET_SIZE];
+    uint32_t seq = 0;
+
+    while (seq < LINK_PACKETS)
+    {
+        if (blocks)
+        {
+            mpegts_block_t *const block = mpegts_block_alloc(pool);
+            for (unsigned int i = 0; i < LINK_BATCH; i++)
+                link_packet(MPEGTS_BLOCK_TS(block, i), 100, seq++);
+
+            block->count = LINK_BATCH;
+            __module_stream_send_block(&up.__stream, block);
+            mpegts_block_release(block);
+
+            continue;
+        }
+
+        for (unsigned int i = 0; i < LINK_BATCH; i++)
+        {
+            /* foreign PID in between; filtered out in demux mode */
+            link_packet(ts[i * 2], 100, seq++);
+            link_packet(ts[i * 2 + 1], 200, 0);
+        }
+
+        if (demux)
+        {
+            __module_stream_send_batch(&up.__stream, ts[0], LINK_BATCH * 2);
+        }
+        else
+        {
+            for (unsigned int i = 0; i < LINK_BATCH; i++)
+                __module_stream_send(&up.__stream, ts[i * 2]);
+        }
+    }
+
+    ck_assert(asc_main_loop_run() == false);
+
+    prev = asc_loop_enter(down.__loop);
+    if (demux)
+        module_stream_destroy((&down));
+    else
+        __module_stream_destroy(&down.__stream);
+    asc_loop_leave(down.__loop, prev);
+
+    ck_assert(asc_list_size(up.__stream.children) == 0);
+    __module_stream_destroy(&up.__stream);
+    ASC_FREE(up.__stream.pid_list, free);
+
+    /* link must have dropped all its references */
+    mpegts_block_stats_t stats;
+    mpegts_block_pool_stats(pool, &stats);
+    ck_assert(stats.used == 0);
+    ck_assert(stats.copied == 0);
+    mpegts_block_pool_destroy(pool);
+
+    ck_assert(down.count == LINK_PACKETS);
+    ck_assert(down.errors == 0);
+}
+
+START_TEST(stream_link)
+{
+    link_run(false, false);
+}
+END_TEST
+
+START_TEST(stream_link_demux)
+{
+    link_run(true, false);
+}
+END_TEST
+
+START_TEST(stream_link_block)
+{
+    link_run(false, true);
+}
+END_TEST
+
+/* block references and copy-on-write */
+START_TEST(block_refs)
+{
+    mpegts_block_pool_t *const pool = mpegts_block_pool_init(4, 1);
+    uint8_t ts[6][TS_PACKET_SIZE];
+
+    for (unsigned int i = 0; i < 6; i++)
+        link_packet(ts[i], 100, i);
+
+    mpegts_block_t *block = mpegts_block_alloc(pool);
+    ck_assert(block->size == 4 && block->count == 0);
+    ck_assert(mpegts_block_append(block, ts[0], 6) == 4);
+    ck_assert(MPEGTS_BLOCK_SPACE(block) == 0);
+    ck_assert(!memcmp(MPEGTS_BLOCK_TS(block, 3), ts[3], TS_PACKET_SIZE));
+
+    /* sole owner writes in place */
+    mpegts_block_t *const orig = block;
+    block = mpegts_block_writable(block, pool);
+    ck_assert(block == orig);
+
+    /* shared block gets copied */
+    mpegts_block_retain(block);
+    mpegts_block_t *const copy = mpegts_block_writable(block, pool);
+    ck_assert(copy != block && copy->count == 4);
+    ck_assert(!memcmp(copy->data, block->data, 4 * TS_PACKET_SIZE));
+
+    mpegts_block_stats_t stats;
+    mpegts_block_pool_stats(pool, &stats);
+    ck_assert(stats.used == 2 && stats.allocs == 2 && stats.copied == 8);
+
+    /* one spare is cached and handed out again */
+    mpegts_block_release(copy);
+    mpegts_block_t *const again = mpegts_block_alloc(pool);
+    ck_assert(again == copy && again->count == 0);
+    mpegts_block_release(again);
+
+    /* pool outlives its destroy call while blocks are referenced */
+    mpegts_block_pool_destroy(pool);
+    ck_assert(block->count == 4);
+    mpegts_block_release(block);
+}
+END_TEST
+
+Suite *core_loop(void)
+{
+    Suite *const s = suite_create("loop");
+
+    TCase *const tc = tcase_create("default");
+    tcase_add_checked_fixture(tc, lib_setup, lib_teardown);
+
+    if (can_fork != CK_NOFORK)
+        tcase_set_timeout(tc, 5);
+
+    tcase_add_test(tc, enter_leave);
+    tcase_add_test(tc, worker_timer);
+    tcase_add_test(tc, stream_link);
+    tcase_add_test(tc, stream_link_demux);
+    tcase_add_test(tc, stream_link_block);
+    tcase_add_test(tc, block_refs);
+
+    suite_add_tcase(s, tc);
+
+    return s;
+}
@@ -20,6 +20,7 @@
 
 #include "unit_tests.h"
 #include <core/mainloop.h>
+#include <core/thread.h>
 #include <core/timer.h>
 
 /* basic shutdown and reload commands */
@@ -223,6 +224,91 @@ START_TEST(callback_cancel)
 }
 END_TEST
 
+/* queue grows past its soft limit without dropping jobs */
+#define FLOOD_COUNT 1000
+
+static void on_flood(void *arg)
+{
+    unsigned int *const cnt = (unsigned *)arg;
+
+    if (++(*cnt) == FLOOD_COUNT)
+        asc_main_loop_shutdown();
+}
+
+START_TEST(callback_flood)
+{
+    unsigned int cnt = 0;
+
+    for (size_t i = 0; i < FLOOD_COUNT; i++)
+        asc_job_queue(NULL, on_flood, &cnt);
+
+    asc_job_stats_t stats;
+    asc_job_stats(&stats);
+    ck_assert(stats.depth == FLOOD_COUNT);
+    ck_assert(stats.peak == FLOOD_COUNT);
+    ck_assert(stats.overflow == FLOOD_COUNT - 256);
+
+    const bool again = asc_main_loop_run();
+    ck_assert(again == false);
+    ck_assert(cnt == FLOOD_COUNT);
+
+    asc_job_stats(&stats);
+    ck_assert(stats.depth == 0);
+}
+END_TEST
+
+/* several threads queueing jobs at once */
+#define MPSC_THREADS 4
+#define MPSC_JOBS 10000
+
+static unsigned int mpsc_done;
+
+static void on_mpsc_job(void *arg)
+{
+    unsigned int *const cnt = (unsigned *)arg;
+
+    (*cnt)++;
+    if (++mpsc_done == MPSC_THREADS * MPSC_JOBS)
+        asc_main_loop_shutdown();
+}
+
+static void mpsc_proc(void *arg)
+{
+    for (size_t i = 0; i < MPSC_JOBS; i++)
+    {
+        asc_job_queue(NULL, on_mpsc_job, arg);
+
+        if (i % 100 == 0)
+            asc_wake();
+    }
+
+    asc_wake();
+}
+
+START_TEST(callback_threads)
+{
+    unsigned int counts[MPSC_THREADS] = { 0 };
+
+    mpsc_done = 0;
+    asc_wake_open();
+
+    for (size_t i = 0; i < MPSC_THREADS; i++)
+    {
+        asc_thread_t *const thr = asc_thread_init();
+        asc_thread_start(thr, &counts[i], mpsc_proc, NULL);
+    }
+
+    const bool again = asc_main_loop_run();
+    ck_assert(again == false);
+
+    /* threads are joined by their exit jobs or at library cleanup */
+    for (size_t i = 0; i < MPSC_THREADS; i++)
+        ck_assert(counts[i] == MPSC_JOBS);
+
+    asc_wake_close();
+}
+END_TEST
+
 Suite *core_mainloop(void)
 {
     Suite *const s = suite_create("mainloop");
@@ -238,6 +324,8 @@ Suite *core_mainloop(void)
     tcase_add_test(tc, callback_simple);
     tcase_add_test(tc, callback_prune);
     tcase_add_test(tc, callback_cancel);
+    tcase_add_test(tc, callback_flood);
+    tcase_add_test(tc, callback_threads);
 
     if (can_fork != CK_NOFORK)
     {
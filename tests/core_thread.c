@@ -144,6 +144,127 @@ START_TEST(producers)
 }
 END_TEST
 
+/* ring buffer wrap-around and overflow */
+START_TEST(buffer_wrap)
+{
+    asc_thread_buffer_t *const buf = asc_thread_buffer_init(1000);
+    ck_assert(buf != NULL);
+
+    /* size is rounded up to 1024 */
+    uint8_t data[1024];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = i & 0xff;
+
+    ck_assert(asc_thread_buffer_write(buf, data, 1024) == 1024);
+    ck_assert(asc_thread_buffer_write(buf, data, 1) == -1);
+    ck_assert(asc_thread_buffer_reserve(buf, 1) == NULL);
+    asc_thread_buffer_flush(buf);
+
+    uint8_t out[1024];
+    ck_assert(asc_thread_buffer_read(buf, out, sizeof(out)) == 0);
+
+    /* odd-sized chunks crossing the end of the ring */
+    unsigned int wr = 0, rd = 0;
+    for (size_t i = 0; i < 500; i++)
+    {
+        const size_t size = 1 + (i * 37) % 300;
+
+        uint8_t *const ptr = (uint8_t *)asc_thread_buffer_reserve(buf, size);
+        ck_assert(ptr != NULL);
+
+        for (size_t j = 0; j < size; j++)
+            ptr[j] = wr++ & 0xff;
+
+        asc_thread_buffer_commit(buf, size);
+
+        const ssize_t ret = asc_thread_buffer_read(buf, out, size);
+        ck_assert(ret == (ssize_t)size);
+
+        for (size_t j = 0; j < size; j++)
+            ck_assert(out[j] == (rd++ & 0xff));
+    }
+
+    asc_thread_buffer_destroy(buf);
+}
+END_TEST
+
+/* one producer thread, main thread consuming */
+#define SPSC_ITEMS (256 * 1024)
+
+static void spsc_proc(void *arg)
+{
+    asc_thread_buffer_t *const buf = (asc_thread_buffer_t *)arg;
+
+    uint32_t seq = 0;
+    while (seq < SPSC_ITEMS)
+    {
+        /* alternate between copying and writing in place */
+        const size_t count = 1 + seq % 7;
+        uint32_t data[8];
+
+        if (seq & 1)
+        {
+            uint32_t *const ptr = (uint32_t *)asc_thread_buffer_reserve(buf
+                                                    , count * sizeof(*ptr));
+            if (ptr == NULL)
+            {
+                asc_usleep(100);
+                continue;
+            }
+
+            for (size_t i = 0; i < count; i++)
+                ptr[i] = seq + i;
+
+            asc_thread_buffer_commit(buf, count * sizeof(*ptr));
+        }
+        else
+        {
+            for (size_t i = 0; i < count; i++)
+                data[i] = seq + i;
+
+            if (asc_thread_buffer_write(buf, data, count * sizeof(*data)) < 0)
+            {
+                asc_usleep(100);
+                continue;
+            }
+        }
+
+        seq += count;
+    }
+}
+
+START_TEST(buffer_spsc)
+{
+    asc_thread_buffer_t *const buf = asc_thread_buffer_init(4096);
+    asc_thread_t *const thr = asc_thread_init();
+
+    asc_thread_start(thr, buf, spsc_proc, NULL);
+
+    uint32_t expect = 0;
+    while (true)
+    {
+        uint32_t data[64];
+        const ssize_t ret = asc_thread_buffer_read(buf, data, sizeof(data));
+        ck_assert(ret >= 0 && ret % sizeof(*data) == 0);
+
+        for (size_t i = 0; i < ret / sizeof(*data); i++)
+            ck_assert(data[i] == expect++);
+
+        if (ret == 0)
+        {
+            if (expect >= SPSC_ITEMS)
+                break;
+
+            asc_usleep(100);
+        }
+    }
+
+    asc_thread_join(thr);
+    ck_assert(asc_thread_buffer_read(buf, &expect, sizeof(expect)) == 0);
+    asc_thread_buffer_destroy(buf);
+}
+END_TEST
+
 /* thread that never gets started */
 START_TEST(no_start)
 {
@@ -189,10 +310,6 @@ static void wake_up_proc(void *arg)
 {
     __uarg(arg);
 
-    /*
-     * TODO: add APIs for conditional variables, simulate data exchange
-     *       between main and auxiliary threads.
-     */
     asc_usleep(50 * 1000); /* 50ms */
 
     wake_time = asc_utime();
@@ -297,6 +414,62 @@ START_TEST(timedlock)
 }
 END_TEST
 
+/* condition variable ping-pong */
+#define CV_ROUNDS 1000
+
+static asc_mutex_t cv_mutex;
+static asc_cond_t cv_cond;
+static unsigned int cv_value;
+
+static void cond_proc(void *arg)
+{
+    __uarg(arg);
+
+    asc_mutex_lock(&cv_mutex);
+    while (true)
+    {
+        /* wait for an even number from main thread */
+        while (cv_value % 2)
+            asc_cond_wait(&cv_cond, &cv_mutex);
+
+        if (cv_value >= CV_ROUNDS * 2)
+            break;
+
+        cv_value++;
+        asc_cond_broadcast(&cv_cond);
+    }
+    asc_mutex_unlock(&cv_mutex);
+}
+
+START_TEST(cond_var)
+{
+    asc_mutex_init(&cv_mutex);
+    asc_cond_init(&cv_cond);
+    cv_value = 0;
+
+    asc_thread_t *const thr = asc_thread_init();
+    asc_thread_start(thr, NULL, cond_proc, NULL);
+
+    asc_mutex_lock(&cv_mutex);
+    while (cv_value < CV_ROUNDS * 2)
+    {
+        /* wait for an odd number from aux thread */
+        while (!(cv_value % 2))
+            asc_cond_wait(&cv_cond, &cv_mutex);
+
+        cv_value++;
+        asc_cond_signal(&cv_cond);
+    }
+    asc_mutex_unlock(&cv_mutex);
+
+    asc_thread_join(thr);
+    ck_assert(cv_value == CV_ROUNDS * 2);
+
+    asc_cond_destroy(&cv_cond);
+    asc_mutex_destroy(&cv_mutex);
+}
+END_TEST
+
 Suite *core_thread(void)
 {
     Suite *const s = suite_create("thread");
@@ -309,6 +482,9 @@ Suite *core_thread(void)
     tcase_add_test(tc, no_start);
     tcase_add_test(tc, wake_up);
     tcase_add_test(tc, timedlock);
+    tcase_add_test(tc, cond_var);
+    tcase_add_test(tc, buffer_wrap);
+    tcase_add_test(tc, buffer_spsc);
 
     if (can_fork != CK_NOFORK)
     {
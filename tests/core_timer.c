@@ -205,6 +205,61 @@ START_TEST(blocked_thread)
 }
 END_TEST
 
+/* lots of one shot timers, some of them cancelled */
+#define MANY_COUNT 100000
+#define MANY_SPREAD 200 /* ms */
+
+/*
+ * average for an insert or a removal, far above what a heap needs even
+ * on a slow or instrumented build, but well below a linear search
+ */
+#define MANY_OP_LIMIT 10 /* us */
+
+static size_t many_next;
+
+static void on_many_timer(void *arg)
+{
+    const size_t idx = (uintptr_t)arg;
+
+    /* timers are created in deadline order, so must fire in that order */
+    ck_assert_msg(idx >= many_next, "timer %zu fired after %zu"
+                  , idx, many_next);
+    ck_assert_msg(idx % 3 != 1, "cancelled timer %zu fired", idx);
+
+    many_next = idx + 1;
+}
+
+START_TEST(many_timers)
+{
+    asc_timer_t **const list = ASC_ALLOC(MANY_COUNT, asc_timer_t *);
+    many_next = 0;
+
+    const uint64_t start = asc_utime();
+    for (size_t i = 0; i < MANY_COUNT; i++)
+    {
+        const unsigned ms = (i * MANY_SPREAD) / MANY_COUNT;
+        list[i] = asc_timer_one_shot(ms, on_many_timer, (void *)(uintptr_t)i);
+    }
+
+    for (size_t i = 1; i < MANY_COUNT; i += 3)
+        asc_timer_destroy(list[i]);
+
+    const size_t ops = MANY_COUNT + (MANY_COUNT / 3);
+    const uint64_t bench = asc_utime() - start;
+    ck_assert_msg(bench < ops * MANY_OP_LIMIT
+                  , "%zu timer operations took %" PRIu64 "us", ops, bench);
+
+    /* stopper is armed after setup, past every deadline however slow it was */
+    run_loop(MANY_SPREAD + 100);
+
+    /* last timer is not cancelled */
+    ck_assert((MANY_COUNT - 1) % 3 != 1);
+    ck_assert(many_next == MANY_COUNT);
+
+    free(list);
+}
+END_TEST
+
 Suite *core_timer(void)
 {
     Suite *const s = suite_create("timer");
@@ -221,6 +276,7 @@ Suite *core_timer(void)
     tcase_add_test(tc, single_one_shot);
     tcase_add_test(tc, cancel_one_shot);
     tcase_add_test(tc, blocked_thread);
+    tcase_add_test(tc, many_timers);
 
     suite_add_tcase(s, tc);
 
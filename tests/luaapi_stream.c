@@ -0,0 +1,541 @@
+/*
+ * Astra: Unit tests
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unit_tests.h"
+#include <luaapi/state.h>
+#include <luaapi/stream.h>
+#include <mpegts/psi.h>
+
+struct module_data_t
+{
+    MODULE_STREAM_DATA();
+
+    unsigned int sections;
+    uint32_t crc32;
+    bool leave;
+
+    unsigned int joins;
+    unsigned int leaves;
+
+    unsigned int blocks;
+
+    /* joins or leaves `toggle' on seeing `trigger' */
+    uint16_t trigger;
+    uint16_t toggle;
+    bool toggle_join;
+
+    uint16_t seen[8];
+    unsigned int seen_count;
+};
+
+static void on_join(void *arg, uint16_t pid)
+{
+    module_data_t *const mod = (module_data_t *)arg;
+
+    if (pid == 0)
+        mod->joins++;
+}
+
+static void on_leave(void *arg, uint16_t pid)
+{
+    module_data_t *const mod = (module_data_t *)arg;
+
+    if (pid == 0)
+        mod->leaves++;
+}
+
+static void on_pat(module_data_t *mod, const mpegts_psi_t *psi)
+{
+    ck_assert(psi->pid == 0 && psi->buffer[0] == 0x00);
+
+    mod->sections++;
+    mod->crc32 = psi->crc32;
+
+    if (mod->leave)
+        module_stream_psi_leave(mod, 0);
+}
+
+static void stream_setup(module_data_t *mod, module_stream_t *up)
+{
+    memset(mod, 0, sizeof(*mod));
+
+    mod->__stream.self = mod;
+    __module_stream_init(&mod->__stream);
+    module_stream_demux_set(mod, NULL, NULL);
+
+    if (up != NULL)
+        __module_stream_attach(up, &mod->__stream);
+}
+
+static mpegts_psi_t *make_pat(void)
+{
+    mpegts_psi_t *const psi = mpegts_psi_init(MPEGTS_PACKET_PAT, 0);
+
+    mpegts_psi_reserve(psi, 8 + 100 * 4 + CRC32_SIZE);
+    PAT_INIT(psi, 1, 0);
+    for (unsigned int i = 1; i <= 100; i++)
+        PAT_ITEMS_APPEND(psi, i, 0x100 + i);
+
+    PSI_SET_CRC32(psi);
+
+    return psi;
+}
+
+static void send_pat(module_data_t *up, mpegts_psi_t *psi)
+{
+    mpegts_psi_demux(psi, __module_stream_send, &up->__stream);
+}
+
+/* one assembler serves every child */
+START_TEST(psi_shared)
+{
+    module_data_t up, a, b;
+
+    stream_setup(&up, NULL);
+    up.__stream.join_pid = on_join;
+    up.__stream.leave_pid = on_leave;
+
+    stream_setup(&a, &up.__stream);
+    stream_setup(&b, &up.__stream);
+
+    module_stream_psi_join((&a), 0, on_pat);
+    module_stream_psi_join((&b), 0, on_pat);
+    module_stream_psi_join((&b), 0, on_pat);
+    ck_assert(up.joins == 1);
+
+    mpegts_psi_t *const psi = make_pat();
+    for (unsigned int i = 0; i < 3; i++)
+        send_pat(&up, psi);
+
+    ck_assert(a.sections == 3 && b.sections == 3);
+    ck_assert(a.crc32 == PSI_GET_CRC32(psi) && b.crc32 == a.crc32);
+
+    /* broken section is dropped before reaching children */
+    psi->buffer[10] ^= 0xff;
+    send_pat(&up, psi);
+    ck_assert(a.sections == 3 && b.sections == 3);
+
+    /* new version */
+    psi->buffer[10] ^= 0xff;
+    PAT_SET_VERSION(psi, 1);
+    PSI_SET_CRC32(psi);
+    send_pat(&up, psi);
+    ck_assert(a.sections == 4 && a.crc32 == PSI_GET_CRC32(psi));
+
+    module_stream_psi_leave((&a), 0);
+    send_pat(&up, psi);
+    ck_assert(a.sections == 4 && b.sections == 5);
+    ck_assert(up.leaves == 0);
+
+    module_stream_psi_leave((&b), 0);
+    ck_assert(up.leaves == 1);
+
+    send_pat(&up, psi);
+    ck_assert(b.sections == 5);
+
+    module_stream_destroy((&a));
+    module_stream_destroy((&b));
+    module_stream_destroy((&up));
+    mpegts_psi_destroy(psi);
+}
+END_TEST
+
+/* leaving from inside the callback, including the last subscriber */
+START_TEST(psi_leave_callback)
+{
+    module_data_t up, a, b;
+
+    stream_setup(&up, NULL);
+    up.__stream.leave_pid = on_leave;
+
+    stream_setup(&a, &up.__stream);
+    stream_setup(&b, &up.__stream);
+
+    module_stream_psi_join((&a), 0, on_pat);
+    module_stream_psi_join((&b), 0, on_pat);
+
+    a.leave = true;
+    mpegts_psi_t *const psi = make_pat();
+    send_pat(&up, psi);
+    send_pat(&up, psi);
+    ck_assert(a.sections == 1 && b.sections == 2);
+
+    b.leave = true;
+    send_pat(&up, psi);
+    send_pat(&up, psi);
+    ck_assert(b.sections == 3 && up.leaves == 1);
+
+    /* assembler comes back on demand */
+    b.leave = false;
+    module_stream_psi_join((&b), 0, on_pat);
+    send_pat(&up, psi);
+    ck_assert(b.sections == 4);
+
+    module_stream_destroy((&a));
+    module_stream_destroy((&b));
+    module_stream_destroy((&up));
+    mpegts_psi_destroy(psi);
+}
+END_TEST
+
+/* subscriptions follow the child across attach and upstream removal */
+START_TEST(psi_reattach)
+{
+    module_data_t one, two, child;
+
+    stream_setup(&one, NULL);
+    stream_setup(&two, NULL);
+    one.__stream.join_pid = two.__stream.join_pid = on_join;
+    one.__stream.leave_pid = two.__stream.leave_pid = on_leave;
+
+    /* join before having an upstream */
+    stream_setup(&child, NULL);
+    module_stream_psi_join((&child), 0, on_pat);
+
+    __module_stream_attach(&one.__stream, &child.__stream);
+    ck_assert(one.joins == 1);
+
+    mpegts_psi_t *const psi = make_pat();
+    send_pat(&one, psi);
+    ck_assert(child.sections == 1);
+
+    __module_stream_attach(&two.__stream, &child.__stream);
+    ck_assert(one.leaves == 1 && two.joins == 1);
+
+    send_pat(&one, psi);
+    send_pat(&two, psi);
+    ck_assert(child.sections == 2);
+
+    /* upstream goes away first */
+    module_stream_destroy((&two));
+    ck_assert(child.__stream.parent == NULL);
+
+    __module_stream_attach(&one.__stream, &child.__stream);
+    ck_assert(one.joins == 2);
+
+    send_pat(&one, psi);
+    ck_assert(child.sections == 3);
+
+    module_stream_destroy((&child));
+    ck_assert(one.leaves == 2);
+
+    module_stream_destroy((&one));
+    mpegts_psi_destroy(psi);
+}
+END_TEST
+
+/* raw subscribers also see sections with a bad CRC */
+START_TEST(psi_raw)
+{
+    module_data_t up, a, raw;
+
+    stream_setup(&up, NULL);
+    stream_setup(&a, &up.__stream);
+    stream_setup(&raw, &up.__stream);
+
+    module_stream_psi_join((&a), 0, on_pat);
+    module_stream_psi_join_raw((&raw), 0, on_pat);
+
+    mpegts_psi_t *const psi = make_pat();
+    send_pat(&up, psi);
+    ck_assert(a.sections == 1 && raw.sections == 1);
+    ck_assert(raw.crc32 == PSI_GET_CRC32(psi));
+
+    psi->buffer[10] ^= 0xff;
+    send_pat(&up, psi);
+    ck_assert(a.sections == 1 && raw.sections == 2);
+    ck_assert(raw.crc32 != PSI_GET_CRC32(psi));
+    ck_assert(raw.crc32 == PSI_CALC_CRC32(psi));
+
+    /* joining again switches the subscription back to checked */
+    module_stream_psi_join((&raw), 0, on_pat);
+    send_pat(&up, psi);
+    ck_assert(raw.sections == 2);
+
+    module_stream_destroy((&a));
+    module_stream_destroy((&raw));
+    module_stream_destroy((&up));
+    mpegts_psi_destroy(psi);
+}
+END_TEST
+
+static void on_batch(module_data_t *mod, const uint8_t *ts, size_t count)
+{
+    __uarg(ts);
+    mod->sections += count;
+}
+
+static void on_block(module_data_t *mod, mpegts_block_t *block)
+{
+    mod->blocks++;
+    mod->sections += block->count;
+}
+
+/* demuxed children get the block itself if they want all of it */
+START_TEST(block_demux)
+{
+    module_data_t up, whole, part;
+
+    stream_setup(&up, NULL);
+    stream_setup(&whole, &up.__stream);
+    stream_setup(&part, &up.__stream);
+
+    whole.__stream.on_ts_batch = part.__stream.on_ts_batch = on_batch;
+    whole.__stream.on_ts_block = part.__stream.on_ts_block = on_block;
+
+    module_stream_demux_join_pid((&whole), 0x100);
+    module_stream_demux_join_pid((&whole), 0x200);
+    module_stream_demux_join_pid((&part), 0x100);
+
+    mpegts_block_pool_t *const pool = mpegts_block_pool_init(16, 1);
+    mpegts_block_t *const block = mpegts_block_alloc(pool);
+    for (unsigned int i = 0; i < 10; i++)
+    {
+        uint8_t pkt[TS_PACKET_SIZE];
+
+        memcpy(pkt, null_ts, TS_PACKET_SIZE);
+        TS_SET_PID(pkt, (i % 2) ? 0x100 : 0x200);
+        ck_assert(mpegts_block_append(block, pkt, 1) == 1);
+    }
+
+    __module_stream_send_block(&up.__stream, block);
+    ck_assert(whole.blocks == 1 && whole.sections == 10);
+    ck_assert(part.blocks == 0 && part.sections == 5);
+
+    mpegts_block_release(block);
+    mpegts_block_pool_destroy(pool);
+
+    module_stream_destroy((&whole));
+    module_stream_destroy((&part));
+    module_stream_destroy((&up));
+}
+END_TEST
+
+static void on_toggle_batch(module_data_t *mod, const uint8_t *ts
+                            , size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint8_t *const pkt = &ts[i * TS_PACKET_SIZE];
+        const uint16_t pid = TS_GET_PID(pkt);
+
+        ck_assert(mod->seen_count < ASC_ARRAY_SIZE(mod->seen));
+        mod->seen[mod->seen_count++] = pid;
+
+        if (pid != mod->trigger)
+            continue;
+
+        if (mod->toggle_join)
+            module_stream_demux_join_pid(mod, mod->toggle);
+        else
+            module_stream_demux_leave_pid(mod, mod->toggle);
+    }
+}
+
+static void send_pids(module_data_t *up, const uint16_t *pids, size_t count)
+{
+    uint8_t buf[8 * TS_PACKET_SIZE];
+    ck_assert(count <= 8);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint8_t *const pkt = &buf[i * TS_PACKET_SIZE];
+
+        memcpy(pkt, null_ts, TS_PACKET_SIZE);
+        TS_SET_PID(pkt, pids[i]);
+    }
+
+    __module_stream_send_batch(&up->__stream, buf, count);
+}
+
+/* subscriptions changed while handling a batch apply to the rest of it */
+START_TEST(demux_change)
+{
+    module_data_t up, a, b;
+
+    stream_setup(&up, NULL);
+    stream_setup(&a, &up.__stream);
+    stream_setup(&b, &up.__stream);
+
+    a.__stream.on_ts_batch = b.__stream.on_ts_batch = on_toggle_batch;
+
+    /* `a' joins 0x20 on 0x10 and gets the 0x20 packets after it */
+    a.trigger = 0x10;
+    a.toggle = 0x20;
+    a.toggle_join = true;
+    module_stream_demux_join_pid((&a), 0x10);
+    module_stream_demux_join_pid((&b), 0x20);
+    module_stream_demux_join_pid((&b), 0x30);
+
+    static const uint16_t join[] = { 0x20, 0x10, 0x30, 0x20, 0x20 };
+    send_pids(&up, join, ASC_ARRAY_SIZE(join));
+
+    ck_assert(a.seen_count == 3);
+    ck_assert(a.seen[0] == 0x10 && a.seen[1] == 0x20 && a.seen[2] == 0x20);
+    ck_assert(b.seen_count == 4);
+    ck_assert(b.seen[0] == 0x20 && b.seen[1] == 0x30 && b.seen[3] == 0x20);
+
+    /* `a' leaves 0x20 on 0x10 and gets nothing on it afterwards */
+    a.toggle_join = false;
+    a.seen_count = b.seen_count = 0;
+
+    static const uint16_t leave[] = { 0x20, 0x10, 0x30, 0x20, 0x10 };
+    send_pids(&up, leave, ASC_ARRAY_SIZE(leave));
+
+    ck_assert(a.seen_count == 3);
+    ck_assert(a.seen[0] == 0x20 && a.seen[1] == 0x10 && a.seen[2] == 0x10);
+    ck_assert(b.seen_count == 3);
+
+    /* empty PID sets are freed */
+    ck_assert(mpegts_pidmap_get(up.__stream.pids, 0x20) != NULL);
+    module_stream_demux_leave_pid((&b), 0x20);
+    ck_assert(mpegts_pidmap_get(up.__stream.pids, 0x20) == NULL);
+
+    module_stream_destroy((&a));
+    module_stream_destroy((&b));
+    module_stream_destroy((&up));
+}
+END_TEST
+
+static uint64_t graph_field(int idx, const char *name)
+{
+    lua_getfield(lua, idx, name);
+    const uint64_t value = lua_tonumber(lua, -1);
+    lua_pop(lua, 1);
+
+    return value;
+}
+
+/* counters and the stream list */
+START_TEST(stat_graph)
+{
+    module_data_t up, all, demux;
+
+    stream_setup(&up, NULL);
+    stream_setup(&demux, &up.__stream);
+
+    /* gets every packet */
+    memset(&all, 0, sizeof(all));
+    all.__stream.self = &all;
+    all.__stream.on_ts_batch = on_batch;
+    __module_stream_init(&all.__stream);
+    __module_stream_attach(&up.__stream, &all.__stream);
+
+    demux.__stream.on_ts_batch = on_batch;
+    module_stream_demux_join_pid((&demux), 0x100);
+
+    uint8_t ts[10 * TS_PACKET_SIZE];
+    for (unsigned int i = 0; i < 10; i++)
+    {
+        uint8_t *const pkt = &ts[i * TS_PACKET_SIZE];
+
+        memcpy(pkt, null_ts, TS_PACKET_SIZE);
+        TS_SET_PID(pkt, (i % 2) ? 0x100 : 0x200);
+    }
+
+    /* off by default */
+    __module_stream_send_batch(&up.__stream, ts, 10);
+    ck_assert(all.sections == 10 && demux.sections == 5);
+    ck_assert(up.__stream.stat.packets_out == 0);
+
+    module_stream_stat_enable(true);
+    for (unsigned int i = 0; i < 200; i++)
+        __module_stream_send_batch(&up.__stream, ts, 10);
+    __module_stream_send(&up.__stream, ts);
+    module_stream_stat_enable(false);
+
+    ck_assert(up.__stream.stat.packets_out == 2001);
+    ck_assert(all.__stream.stat.packets_in == 2001);
+    ck_assert(all.__stream.stat.calls == 201);
+    ck_assert(demux.__stream.stat.packets_in == 1000);
+    ck_assert(all.__stream.stat.cpu_ns > 0);
+
+    snprintf(demux.__stream.name, sizeof(demux.__stream.name), "demux");
+
+    module_stream_graph(lua);
+    ck_assert(lua_istable(lua, -1));
+
+    /* find our streams, the list holds every stream in the process */
+    unsigned int found = 0;
+    lua_foreach(lua, -2)
+    {
+        const unsigned int id = graph_field(-1, "id");
+
+        if (id == up.__stream.id)
+        {
+            ck_assert(graph_field(-1, "parent") == 0);
+            ck_assert(graph_field(-1, "bytes_out") == 2001 * TS_PACKET_SIZE);
+            found++;
+        }
+        else if (id == demux.__stream.id)
+        {
+            ck_assert(graph_field(-1, "parent") == up.__stream.id);
+            ck_assert(graph_field(-1, "packets_in") == 1000);
+
+            lua_getfield(lua, -1, "name");
+            ck_assert(strcmp(lua_tostring(lua, -1), "demux") == 0);
+            lua_pop(lua, 1);
+
+            lua_getfield(lua, -1, "type");
+            ck_assert(strcmp(lua_tostring(lua, -1), "stream") == 0);
+            lua_pop(lua, 1);
+
+            found++;
+        }
+    }
+    lua_pop(lua, 1);
+    ck_assert(found == 2);
+
+    module_stream_destroy((&demux));
+    module_stream_destroy((&all));
+
+    /* destroyed streams leave the list */
+    module_stream_graph(lua);
+    ck_assert(luaL_len(lua, -1) >= 1);
+    lua_foreach(lua, -2)
+    {
+        const unsigned int id = graph_field(-1, "id");
+        ck_assert(id != demux.__stream.id && id != all.__stream.id);
+    }
+    lua_pop(lua, 1);
+
+    module_stream_destroy((&up));
+}
+END_TEST
+
+Suite *luaapi_stream(void)
+{
+    Suite *const s = suite_create("stream");
+
+    TCase *const tc = tcase_create("default");
+    tcase_add_checked_fixture(tc, lib_setup, lib_teardown);
+
+    tcase_add_test(tc, psi_shared);
+    tcase_add_test(tc, psi_leave_callback);
+    tcase_add_test(tc, psi_reattach);
+    tcase_add_test(tc, psi_raw);
+    tcase_add_test(tc, block_demux);
+    tcase_add_test(tc, demux_change);
+    tcase_add_test(tc, stat_graph);
+
+    suite_add_tcase(s, tc);
+
+    return s;
+}
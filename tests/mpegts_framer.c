@@ -0,0 +1,249 @@
+/*
+ * Astra: Unit tests
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unit_tests.h"
+#include <mpegts/framer.h>
+#include <utils/crc8.h>
+
+#define TEST_PACKETS 500
+#define TEST_PID 0x100
+
+static unsigned int rcvd;
+static unsigned int calls;
+static unsigned int cc_in;
+
+static void on_ts(void *arg, const uint8_t *ts, size_t count)
+{
+    __uarg(arg);
+
+    calls++;
+    for (size_t i = 0; i < count; i++)
+    {
+        ck_assert(TS_IS_SYNC(ts));
+        ck_assert(TS_GET_PID(ts) == TEST_PID);
+
+        cc_in = (cc_in + 1) & 0xf;
+        ck_assert(TS_GET_CC(ts) == cc_in);
+
+        const uint8_t c8 = au_crc8(&ts[5], TS_BODY_SIZE - 1);
+        ck_assert(c8 == ts[4]);
+
+        rcvd++;
+        ts += TS_PACKET_SIZE;
+    }
+}
+
+/* TS_PACKET_SIZE bytes of TS at `offset' in each `psize'-byte slot */
+static uint8_t *make_stream(size_t psize, size_t offset, size_t *size)
+{
+    *size = TEST_PACKETS * psize;
+    uint8_t *const buf = ASC_ALLOC(*size, uint8_t);
+
+    for (size_t i = 0; i < TEST_PACKETS; i++)
+    {
+        uint8_t *const slot = &buf[i * psize];
+        for (size_t j = 0; j < psize; j++)
+        {
+            do {
+                slot[j] = rand();
+            } while (slot[j] == 0x47);
+        }
+
+        uint8_t *const ts = &slot[offset];
+        ts[0] = 0x47;
+        ts[1] = ts[2] = ts[3] = 0;
+        TS_SET_PID(ts, TEST_PID);
+        TS_SET_CC(ts, i & 0xf);
+        ts[4] = au_crc8(&ts[5], TS_BODY_SIZE - 1);
+    }
+
+    return buf;
+}
+
+static void test_setup(void)
+{
+    rcvd = calls = 0;
+    cc_in = 15;
+}
+
+/* 188, RS and M2TS packets, pushed in random pieces */
+START_TEST(packet_sizes)
+{
+    static const size_t sizes[][2] =
+    {
+        { TS_PACKET_SIZE, 0 },
+        { RS_PACKET_SIZE, 0 },
+        { M2TS_PACKET_SIZE, 4 },
+    };
+
+    for (size_t i = 0; i < ASC_ARRAY_SIZE(sizes); i++)
+    {
+        size_t size;
+        uint8_t *const buf = make_stream(sizes[i][0], sizes[i][1], &size);
+
+        test_setup();
+        mpegts_framer_t *const fr = mpegts_framer_init(on_ts, NULL);
+
+        size_t pos = 0;
+        while (pos < size)
+        {
+            size_t len = 1 + (rand() % 4096);
+            if (len > size - pos)
+                len = size - pos;
+
+            mpegts_framer_push(fr, &buf[pos], len);
+            pos += len;
+        }
+
+        mpegts_framer_stat_t st;
+        mpegts_framer_query(fr, &st);
+        ck_assert(st.packet_size == sizes[i][0]);
+        ck_assert(st.resyncs == 0);
+
+        /* the last packet of an M2TS stream waits for the next header */
+        ck_assert(rcvd >= TEST_PACKETS - 1 && st.packets == rcvd);
+
+        mpegts_framer_destroy(fr);
+        free(buf);
+    }
+}
+END_TEST
+
+/* runs of packets come through in few callbacks */
+START_TEST(batching)
+{
+    size_t size;
+    uint8_t *const buf = make_stream(TS_PACKET_SIZE, 0, &size);
+
+    test_setup();
+    mpegts_framer_t *const fr = mpegts_framer_init(on_ts, NULL);
+
+    /* first packet is cut off */
+    cc_in = 0;
+    mpegts_framer_push(fr, &buf[1], size - 1);
+    ck_assert(rcvd == TEST_PACKETS - 1 && calls == 1);
+
+    mpegts_framer_stat_t st;
+    mpegts_framer_query(fr, &st);
+    ck_assert(st.dropped == TS_PACKET_SIZE - 1);
+
+    /* reset drops the lock */
+    mpegts_framer_reset(fr);
+    mpegts_framer_query(fr, &st);
+    ck_assert(st.packet_size == 0);
+
+    mpegts_framer_destroy(fr);
+    free(buf);
+}
+END_TEST
+
+/* garbage between packets, no packet is lost */
+START_TEST(resync)
+{
+    size_t size;
+    uint8_t *const buf = make_stream(TS_PACKET_SIZE, 0, &size);
+
+    test_setup();
+    mpegts_framer_t *const fr = mpegts_framer_init(on_ts, NULL);
+
+    size_t pos = 0;
+    while (pos < size)
+    {
+        uint8_t trash[64];
+        const size_t tlen = 1 + (rand() % sizeof(trash));
+        for (size_t i = 0; i < tlen; i++)
+        {
+            do {
+                trash[i] = rand();
+            } while (trash[i] == 0x47);
+        }
+
+        mpegts_framer_push(fr, trash, tlen);
+
+        /* short runs included */
+        size_t len = (1 + (rand() % 10)) * TS_PACKET_SIZE;
+        if (len > size - pos)
+            len = size - pos;
+
+        mpegts_framer_push(fr, &buf[pos], len);
+        pos += len;
+    }
+
+    ck_assert(rcvd == TEST_PACKETS);
+
+    mpegts_framer_stat_t st;
+    mpegts_framer_query(fr, &st);
+    ck_assert(st.resyncs > 0 && st.dropped > 0);
+
+    mpegts_framer_destroy(fr);
+    free(buf);
+}
+END_TEST
+
+/* vector and scalar parts of the scanner agree */
+START_TEST(scan)
+{
+    uint8_t buf[2048];
+
+    for (size_t i = 0; i < 1000; i++)
+    {
+        memset(buf, 0, sizeof(buf));
+
+        const size_t stride = 188 + (rand() % 17);
+        const size_t count = 1 + (rand() % 4);
+        const size_t at = rand() % (sizeof(buf) - (count - 1) * stride);
+
+        /* decoys, one sync byte short */
+        for (size_t j = 0; j + 1 < count && j * stride < at; j++)
+            buf[j * stride] = 0x47;
+
+        for (size_t j = 0; j < count; j++)
+            buf[at + j * stride] = 0x47;
+
+        const size_t ret = mpegts_framer_scan(buf, sizeof(buf)
+                                              , stride, count);
+        ck_assert(ret <= at);
+
+        for (size_t j = 0; j < count; j++)
+            ck_assert(buf[ret + j * stride] == 0x47);
+    }
+
+    memset(buf, 0, sizeof(buf));
+    ck_assert(mpegts_framer_scan(buf, sizeof(buf), 188, 4) == sizeof(buf));
+    ck_assert(mpegts_framer_scan(buf, 100, 188, 4) == 100);
+}
+END_TEST
+
+Suite *mpegts_framer(void)
+{
+    Suite *const s = suite_create("mpegts_framer");
+
+    TCase *const tc = tcase_create("default");
+    tcase_add_checked_fixture(tc, lib_setup, lib_teardown);
+
+    tcase_add_test(tc, packet_sizes);
+    tcase_add_test(tc, batching);
+    tcase_add_test(tc, resync);
+    tcase_add_test(tc, scan);
+
+    suite_add_tcase(s, tc);
+
+    return s;
+}
@@ -0,0 +1,185 @@
+/*
+ * Astra: Unit tests
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unit_tests.h"
+#include <mpegts/pidmap.h>
+#include <mpegts/psi.h>
+
+static unsigned int sections;
+static uint32_t last_crc;
+
+static void on_section(void *arg, mpegts_psi_t *psi)
+{
+    __uarg(arg);
+
+    ck_assert(PSI_CALC_CRC32(psi) == PSI_GET_CRC32(psi));
+    last_crc = PSI_GET_CRC32(psi);
+    sections++;
+}
+
+static void on_ts(void *arg, const uint8_t *ts)
+{
+    mpegts_psi_mux((mpegts_psi_t *)arg, ts, on_section, NULL);
+}
+
+static mpegts_psi_t *make_pat(unsigned int items)
+{
+    mpegts_psi_t *const psi = mpegts_psi_init(MPEGTS_PACKET_PAT, 0);
+
+    mpegts_psi_reserve(psi, 8 + items * 4 + CRC32_SIZE);
+    PAT_INIT(psi, 1, 0);
+    for (unsigned int i = 1; i <= items; i++)
+        PAT_ITEMS_APPEND(psi, i, 0x100 + i);
+
+    PSI_SET_CRC32(psi);
+
+    return psi;
+}
+
+/* buffers are allocated on first section and grow with it */
+START_TEST(lazy_buffer)
+{
+    mpegts_psi_stats_t before, st;
+    mpegts_psi_stats(&before);
+
+    mpegts_psi_t *const rx = mpegts_psi_init(MPEGTS_PACKET_PAT, 0);
+    ck_assert(rx->buffer == NULL && rx->buffer_alloc == 0);
+
+    mpegts_psi_stats(&st);
+    ck_assert(st.objects == before.objects + 1);
+    ck_assert(st.buffers == before.buffers);
+
+    /* nothing to send yet */
+    mpegts_psi_demux(rx, on_ts, NULL);
+
+    sections = 0;
+    mpegts_psi_t *small = make_pat(2);
+    ck_assert(small->buffer_alloc == 256);
+    mpegts_psi_demux(small, on_ts, rx);
+    ck_assert(sections == 1 && last_crc == PSI_GET_CRC32(small));
+    ck_assert(rx->buffer_alloc == 256);
+
+    /* multi-packet section moves to a larger class */
+    mpegts_psi_t *large = make_pat(200);
+    ck_assert(large->buffer_alloc == 1024);
+    mpegts_psi_demux(large, on_ts, rx);
+    ck_assert(sections == 2 && last_crc == PSI_GET_CRC32(large));
+    ck_assert(rx->buffer_alloc == 1024);
+
+    /* largest class fits a maximum size section */
+    mpegts_psi_reserve(rx, PSI_MAX_SIZE);
+    ck_assert(rx->buffer_alloc > PSI_MAX_SIZE);
+
+    mpegts_psi_stats(&st);
+    ck_assert(st.buffers == before.buffers + 3);
+    ck_assert(st.bytes == before.bytes + 256 + 1024 + rx->buffer_alloc);
+
+    mpegts_psi_destroy(small);
+    mpegts_psi_destroy(large);
+    mpegts_psi_destroy(rx);
+
+    mpegts_psi_stats(&st);
+    ck_assert(st.objects == before.objects);
+    ck_assert(st.buffers == before.buffers);
+    ck_assert(st.bytes == before.bytes);
+    ck_assert(st.cached > before.cached);
+}
+END_TEST
+
+/* copy brings its own buffer and survives the source */
+START_TEST(copy)
+{
+    mpegts_psi_t *const src = make_pat(50);
+    mpegts_psi_t *const dst = mpegts_psi_init(MPEGTS_PACKET_PAT, 0);
+    src->crc32 = PSI_GET_CRC32(src);
+
+    mpegts_psi_copy(dst, src);
+    ck_assert(dst->buffer != src->buffer);
+    ck_assert(dst->buffer_size == src->buffer_size);
+    ck_assert(dst->crc32 == src->crc32);
+    ck_assert(!memcmp(dst->buffer, src->buffer, src->buffer_size));
+
+    mpegts_psi_destroy(src);
+
+    sections = 0;
+    mpegts_psi_t *const rx = mpegts_psi_init(MPEGTS_PACKET_PAT, 0);
+    mpegts_psi_demux(dst, on_ts, rx);
+    ck_assert(sections == 1 && last_crc == dst->crc32);
+
+    mpegts_psi_destroy(rx);
+    mpegts_psi_destroy(dst);
+}
+END_TEST
+
+/* pages come and go with their entries */
+START_TEST(pidmap)
+{
+    mpegts_pidmap_t map;
+    memset(&map, 0, sizeof(map));
+
+    int a, b, c;
+    ck_assert(mpegts_pidmap_get(&map, 0) == NULL);
+    ck_assert(mpegts_pidmap_get(&map, NULL_TS_PID) == NULL);
+
+    mpegts_pidmap_set(&map, 0, &a);
+    mpegts_pidmap_set(&map, 1, &b);
+    mpegts_pidmap_set(&map, NULL_TS_PID, &c);
+    ck_assert(mpegts_pidmap_get(&map, 0) == &a);
+    ck_assert(mpegts_pidmap_get(&map, 1) == &b);
+    ck_assert(mpegts_pidmap_get(&map, 2) == NULL);
+    ck_assert(mpegts_pidmap_get(&map, NULL_TS_PID) == &c);
+    ck_assert(mpegts_pidmap_get(&map, 0x1000) == NULL);
+
+    /* overwrite doesn't change page usage */
+    mpegts_pidmap_set(&map, 1, &a);
+    ck_assert(map.used[0] == 2);
+
+    mpegts_pidmap_set(&map, 0, NULL);
+    mpegts_pidmap_set(&map, 1, NULL);
+    mpegts_pidmap_set(&map, 1, NULL);
+    ck_assert(map.page[0] == NULL && map.used[0] == 0);
+    ck_assert(mpegts_pidmap_get(&map, 1) == NULL);
+
+    /* clearing an absent entry allocates nothing */
+    mpegts_pidmap_set(&map, 0x200, NULL);
+    ck_assert(map.page[0x200 / MPEGTS_PIDMAP_PAGE] == NULL);
+
+    mpegts_pidmap_clear(&map);
+    ck_assert(mpegts_pidmap_get(&map, NULL_TS_PID) == NULL);
+    for (unsigned int i = 0; i < MPEGTS_PIDMAP_PAGES; i++)
+        ck_assert(map.page[i] == NULL && map.used[i] == 0);
+}
+END_TEST
+
+Suite *mpegts_psi(void)
+{
+    Suite *const s = suite_create("mpegts_psi");
+
+    TCase *const tc = tcase_create("default");
+    tcase_add_checked_fixture(tc, lib_setup, lib_teardown);
+
+    tcase_add_test(tc, lazy_buffer);
+    tcase_add_test(tc, copy);
+    tcase_add_test(tc, pidmap);
+
+    suite_add_tcase(s, tc);
+
+    return s;
+}
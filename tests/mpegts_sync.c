@@ -0,0 +1,355 @@
+/*
+ * Astra: Unit tests
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unit_tests.h"
+#include <core/mainloop.h>
+#include <core/timer.h>
+#include <mpegts/pcr.h>
+#include <mpegts/sync.h>
+
+/* 10ms between PCR packets */
+#define BLOCK_PCR (PCR_TIME_BASE / 100)
+
+typedef struct
+{
+    mpegts_sync_t *sx;
+
+    unsigned int packets;
+    unsigned int blocks;
+
+    unsigned int written;
+
+    /* destroy another buffer after this many packets */
+    unsigned int destroy_after;
+    mpegts_sync_t **victim;
+
+    /* transmit times seen in on_write */
+    uint64_t txtime;
+    uint64_t max_ahead;
+    bool txtime_back;
+
+    /* continuity counters, out of order output */
+    unsigned int cc_out;
+    unsigned int cc_in;
+    bool cc_error;
+} sync_test_t;
+
+static void on_write(void *arg, const uint8_t *ts)
+{
+    sync_test_t *const test = (sync_test_t *)arg;
+
+    ck_assert(TS_IS_SYNC(ts));
+    test->written++;
+
+    if (TS_GET_PID(ts) == 0x100)
+    {
+        if (test->cc_in != 0 && TS_GET_CC(ts) != ((test->cc_in + 1) & 0xf))
+            test->cc_error = true;
+
+        test->cc_in = TS_GET_CC(ts) | 0x10;
+    }
+
+    const uint64_t txtime = mpegts_sync_txtime(test->sx);
+    const uint64_t now = asc_utime();
+
+    if (txtime < test->txtime)
+        test->txtime_back = true;
+
+    if (txtime > now && txtime - now > test->max_ahead)
+        test->max_ahead = txtime - now;
+
+    test->txtime = txtime;
+
+    if (test->written == test->destroy_after && test->victim != NULL)
+        ASC_FREE(*test->victim, mpegts_sync_destroy);
+}
+
+/* feed a block of packets with PCR in the first one */
+static void on_ready(void *arg)
+{
+    sync_test_t *const test = (sync_test_t *)arg;
+    uint8_t buf[64 * TS_PACKET_SIZE];
+
+    for (unsigned int i = 0; i < test->packets; i++)
+        memcpy(&buf[i * TS_PACKET_SIZE], null_ts, TS_PACKET_SIZE);
+
+    buf[1] = 0x01;
+    buf[2] = 0x00;
+    buf[3] = 0x20;
+    buf[4] = 183;
+    buf[5] = 0x10;
+    TS_SET_PCR(buf, test->blocks * BLOCK_PCR);
+
+    ck_assert(mpegts_sync_push(test->sx, buf, test->packets));
+    test->blocks++;
+}
+
+/* same, written in place; a second PCR pid in the middle of each block */
+static void on_ready_reserve(void *arg)
+{
+    sync_test_t *const test = (sync_test_t *)arg;
+
+    for (unsigned int i = 0; i < test->packets;)
+    {
+        size_t count = test->packets - i;
+        uint8_t *const buf = mpegts_sync_reserve(test->sx, &count);
+        ck_assert(buf != NULL && count > 0);
+
+        for (size_t j = 0; j < count; j++, i++)
+        {
+            uint8_t *const ts = &buf[j * TS_PACKET_SIZE];
+            memcpy(ts, null_ts, TS_PACKET_SIZE);
+
+            if (i == 0 || i == test->packets / 2)
+            {
+                ts[1] = (i == 0) ? 0x01 : 0x02;
+                ts[2] = 0x00;
+                ts[3] = 0x30;
+                ts[4] = 7;
+                ts[5] = 0x10;
+                TS_SET_PCR(ts, test->blocks * BLOCK_PCR + i);
+            }
+            else
+            {
+                ts[1] = 0x01;
+                ts[2] = 0x00;
+                ts[3] = 0x10;
+            }
+
+            if (TS_GET_PID(ts) == 0x100)
+            {
+                TS_SET_CC(ts, test->cc_out);
+                test->cc_out = (test->cc_out + 1) & 0xf;
+            }
+        }
+
+        mpegts_sync_commit(test->sx, count);
+    }
+
+    test->blocks++;
+}
+
+static void on_stop(void *arg)
+{
+    __uarg(arg);
+    asc_main_loop_shutdown();
+}
+
+static void run_loop(unsigned int ms)
+{
+    asc_timer_t *const timer = asc_timer_one_shot(ms, on_stop, NULL);
+    ck_assert(timer != NULL);
+    ck_assert(asc_main_loop_run() == false);
+}
+
+static void sync_setup(sync_test_t *test, unsigned int packets)
+{
+    test->sx = mpegts_sync_init();
+    test->packets = packets;
+
+    mpegts_sync_set_on_write(test->sx, on_write);
+    mpegts_sync_set_on_ready(test->sx, on_ready);
+    mpegts_sync_set_arg(test->sx, test);
+
+    mpegts_sync_start(test->sx);
+}
+
+/* one pacer drives buffers of different bitrates */
+START_TEST(shared_pacer)
+{
+    sync_test_t slow, fast, gone;
+    memset(&slow, 0, sizeof(slow));
+    memset(&fast, 0, sizeof(fast));
+    memset(&gone, 0, sizeof(gone));
+
+    sync_setup(&slow, 10);
+    sync_setup(&fast, 30);
+
+    /* this one is removed from the pacer mid-run */
+    sync_setup(&gone, 20);
+    slow.destroy_after = 50;
+    slow.victim = &gone.sx;
+
+    run_loop(700);
+
+    /* 1000 and 3000 packets per second after 200ms of buffering */
+    ck_assert_msg(slow.written > 300 && slow.written < 700
+                  , "slow: %u packets", slow.written);
+    ck_assert_msg(fast.written > 900 && fast.written < 2100
+                  , "fast: %u packets", fast.written);
+
+    const double ratio = (double)fast.written / slow.written;
+    ck_assert_msg(ratio > 2.5 && ratio < 3.5, "ratio: %.2f", ratio);
+
+    ck_assert(gone.sx == NULL && gone.written > 0);
+
+    mpegts_sync_stat_t st;
+    mpegts_sync_query(fast.sx, &st);
+    ck_assert(st.bitrate > 0);
+    ck_assert(st.jitter_max >= st.jitter_avg);
+
+    mpegts_sync_destroy(slow.sx);
+
+    /* remaining buffer keeps going */
+    const unsigned int before = fast.written;
+    run_loop(100);
+    ck_assert(fast.written > before);
+
+    mpegts_sync_destroy(fast.sx);
+
+    /* pacer is gone along with its last buffer */
+    run_loop(10);
+}
+END_TEST
+
+/* buffer destroys itself from on_write */
+START_TEST(destroy_self)
+{
+    sync_test_t self, other;
+    memset(&self, 0, sizeof(self));
+    memset(&other, 0, sizeof(other));
+
+    sync_setup(&self, 20);
+    sync_setup(&other, 20);
+    self.destroy_after = 50;
+    self.victim = &self.sx;
+
+    run_loop(500);
+
+    ck_assert(self.sx == NULL && self.written == 50);
+    ck_assert(other.written > 50);
+
+    /* pacer still works for the other one */
+    const unsigned int before = other.written;
+    run_loop(100);
+    ck_assert(other.written > before);
+
+    mpegts_sync_destroy(other.sx);
+    run_loop(10);
+}
+END_TEST
+
+/* packets are written early, stamped with when they're due */
+START_TEST(txtime_lead)
+{
+    sync_test_t plain, lead;
+    memset(&plain, 0, sizeof(plain));
+    memset(&lead, 0, sizeof(lead));
+
+    sync_setup(&plain, 20);
+    sync_setup(&lead, 20);
+    mpegts_sync_set_lead(lead.sx, 50000);
+
+    run_loop(500);
+
+    ck_assert(!plain.txtime_back && !lead.txtime_back);
+    ck_assert_msg(plain.max_ahead < 5000
+                  , "plain: %" PRIu64 " usecs ahead", plain.max_ahead);
+    ck_assert_msg(lead.max_ahead > 25000 && lead.max_ahead <= 55000
+                  , "lead: %" PRIu64 " usecs ahead", lead.max_ahead);
+
+    /* 50ms at 2000 packets per second */
+    const int extra = (int)lead.written - (int)plain.written;
+    ck_assert_msg(extra > 50 && extra < 150, "extra: %d packets", extra);
+
+    mpegts_sync_destroy(plain.sx);
+    mpegts_sync_destroy(lead.sx);
+}
+END_TEST
+
+/* in-place writes keep the pace and the order of packets */
+START_TEST(reserve_commit)
+{
+    sync_test_t test;
+    memset(&test, 0, sizeof(test));
+
+    sync_setup(&test, 25);
+    mpegts_sync_set_on_ready(test.sx, on_ready_reserve);
+
+    run_loop(600);
+
+    /* 2500 packets per second after 200ms of buffering */
+    ck_assert_msg(test.written > 700 && test.written < 1500
+                  , "written: %u packets", test.written);
+    ck_assert(!test.cc_error);
+
+    mpegts_sync_stat_t st;
+    mpegts_sync_query(test.sx, &st);
+    ck_assert(st.bitrate > 0 && st.num_blocks > 0);
+
+    mpegts_sync_destroy(test.sx);
+}
+END_TEST
+
+/* a burst grows the ring while it's wrapped around */
+START_TEST(resize_in_place)
+{
+    sync_test_t test;
+    memset(&test, 0, sizeof(test));
+
+    sync_setup(&test, 50);
+    mpegts_sync_set_on_ready(test.sx, on_ready_reserve);
+
+    run_loop(400);
+
+    mpegts_sync_stat_t st;
+    mpegts_sync_query(test.sx, &st);
+    const size_t size = st.size;
+    ck_assert(test.written > 0 && st.grows == 0);
+
+    for (unsigned int i = 0; i < 40; i++)
+        on_ready_reserve(&test);
+
+    mpegts_sync_query(test.sx, &st);
+    ck_assert(st.size > size && st.grows > 0);
+#ifndef _WIN32
+    /* only the wrapped part of the ring gets moved */
+    ck_assert_msg(st.moved < st.filled / 2, "moved: %" PRIu64, st.moved);
+#endif /* !_WIN32 */
+
+    const unsigned int before = test.written;
+    run_loop(200);
+    ck_assert(test.written > before && !test.cc_error);
+
+    mpegts_sync_reset(test.sx, SYNC_RESET_ALL);
+    mpegts_sync_query(test.sx, &st);
+    ck_assert(st.size == size && st.shrinks > 0);
+
+    mpegts_sync_destroy(test.sx);
+}
+END_TEST
+
+Suite *mpegts_sync(void)
+{
+    Suite *const s = suite_create("mpegts_sync");
+
+    TCase *const tc = tcase_create("default");
+    tcase_add_checked_fixture(tc, lib_setup, lib_teardown);
+
+    tcase_add_test(tc, shared_pacer);
+    tcase_add_test(tc, destroy_self);
+    tcase_add_test(tc, txtime_lead);
+    tcase_add_test(tc, reserve_commit);
+    tcase_add_test(tc, resize_in_place);
+
+    suite_add_tcase(s, tc);
+
+    return s;
+}
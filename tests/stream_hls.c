@@ -0,0 +1,312 @@
+/*
+ * Astra: Unit tests
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unit_tests.h"
+#include <core/event.h>
+#include <luaapi/state.h>
+#include <luaapi/stream.h>
+#include <mpegts/pes.h>
+#include <mpegts/psi.h>
+
+#include <arpa/inet.h>
+
+#define TEST_ADDR "127.0.0.1"
+
+#define PMT_PID 0x100
+#define VIDEO_PID 0x101
+
+/* 0.5s between key frames, segments are cut every 1s */
+#define FRAME_PTS 45000
+
+struct module_data_t
+{
+    MODULE_STREAM_DATA();
+};
+
+static module_data_t up;
+static unsigned int port;
+static unsigned int frames;
+static uint8_t cc;
+
+static char reply[64 * 1024];
+static size_t reply_size;
+
+static void run_lua(const char *code)
+{
+    const int ret = luaL_dostring(lua, code);
+    ck_assert_msg(ret == 0, "%s", lua_tostring(lua, -1));
+}
+
+/* feed the segmenter from a stream of our own */
+static void hls_setup(void)
+{
+    char code[512];
+
+    port = 20000 + (rand() % 20000);
+    snprintf(code, sizeof(code)
+             , "hls = hls_output({ name = 'hls', duration = 1, window = 2 })\n"
+               "server = http_server({ addr = '%s', port = %u\n"
+               "                     , route = { { '/ch/*', hls } } })"
+             , TEST_ADDR, port);
+    run_lua(code);
+
+    memset(&up, 0, sizeof(up));
+    up.__stream.self = &up;
+    __module_stream_init(&up.__stream);
+
+    lua_getglobal(lua, "hls");
+    lua_getfield(lua, -1, "stream");
+    lua_pushvalue(lua, -2);
+    ck_assert(lua_pcall(lua, 1, 1, 0) == 0);
+
+    module_stream_t *const child = (module_stream_t *)lua_touserdata(lua, -1);
+    ck_assert(child != NULL);
+    __module_stream_attach(&up.__stream, child);
+    lua_pop(lua, 2);
+
+    mpegts_psi_t *const pat = mpegts_psi_init(MPEGTS_PACKET_PAT, 0);
+    mpegts_psi_reserve(pat, 8 + 4 + CRC32_SIZE);
+    PAT_INIT(pat, 1, 0);
+    PAT_ITEMS_APPEND(pat, 1, PMT_PID);
+    PSI_SET_CRC32(pat);
+
+    mpegts_psi_t *const pmt = mpegts_psi_init(MPEGTS_PACKET_PMT, PMT_PID);
+    mpegts_psi_reserve(pmt, 12 + 5 + CRC32_SIZE);
+    PMT_INIT(pmt, 1, 0, VIDEO_PID, NULL, 0);
+    PMT_ITEMS_APPEND(pmt, 0x1b, VIDEO_PID, NULL, 0);
+    PSI_SET_CRC32(pmt);
+
+    mpegts_psi_demux(pat, __module_stream_send, &up.__stream);
+    mpegts_psi_demux(pmt, __module_stream_send, &up.__stream);
+
+    mpegts_psi_destroy(pat);
+    mpegts_psi_destroy(pmt);
+
+    frames = 0;
+    cc = 0;
+}
+
+static void hls_teardown(void)
+{
+    run_lua("server = nil; hls = nil; collectgarbage()");
+    __module_stream_destroy(&up.__stream);
+}
+
+/* key frame with a PTS followed by `extra' payload packets */
+static void send_frame(unsigned int extra)
+{
+    uint8_t ts[TS_PACKET_SIZE];
+
+    memset(ts, 0xff, sizeof(ts));
+    ts[0] = 0x47;
+    ts[1] = 0x40;
+    ts[2] = 0;
+    ts[3] = 0x30;
+    TS_SET_PID(ts, VIDEO_PID);
+    TS_SET_CC(ts, cc++);
+
+    /* adaptation field with random access indicator */
+    ts[4] = 1;
+    ts[5] = 0x40;
+
+    uint8_t *const pes = &ts[6];
+    pes[0] = pes[1] = 0x00;
+    pes[2] = 0x01;
+    pes[3] = 0xe0;
+    pes[4] = pes[5] = 0x00;
+    pes[6] = 0x80;
+    pes[7] = 0x80;
+    pes[8] = 5;
+
+    const uint64_t pts = (uint64_t)frames++ * FRAME_PTS;
+    PES_SET_PTS(pes, pts);
+
+    __module_stream_send(&up.__stream, ts);
+
+    memset(ts, 0xff, sizeof(ts));
+    ts[0] = 0x47;
+    ts[1] = 0;
+    ts[2] = 0;
+    ts[3] = 0x10;
+    TS_SET_PID(ts, VIDEO_PID);
+
+    for (unsigned int i = 0; i < extra; i++)
+    {
+        TS_SET_CC(ts, cc++);
+        __module_stream_send(&up.__stream, ts);
+    }
+}
+
+/* returns HTTP status, body is in `reply' */
+static int http_get(const char *path)
+{
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    ck_assert(fd != -1);
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = inet_addr(TEST_ADDR);
+    ck_assert(connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+
+    char req[256];
+    const int len = snprintf(req, sizeof(req)
+                             , "GET %s HTTP/1.1\r\nHost: test\r\n\r\n"
+                             , path);
+    ck_assert(send(fd, req, len, 0) == len);
+
+    char buf[sizeof(reply)];
+    size_t size = 0;
+    for (unsigned int i = 0; i < 200; i++)
+    {
+        asc_event_core_loop(10);
+
+        const ssize_t ret = recv(fd, &buf[size], sizeof(buf) - size - 1
+                                 , MSG_DONTWAIT);
+        if (ret == 0)
+            break;
+        else if (ret > 0)
+            size += ret;
+    }
+    close(fd);
+
+    buf[size] = '\0';
+
+    int code = 0;
+    ck_assert(sscanf(buf, "HTTP/1.%*d %d", &code) == 1);
+
+    const char *const body = strstr(buf, "\r\n\r\n");
+    ck_assert(body != NULL);
+
+    reply_size = size - (body + 4 - buf);
+    memcpy(reply, body + 4, reply_size);
+    reply[reply_size] = '\0';
+
+    return code;
+}
+
+/* segments start on a key frame once `duration' has passed */
+START_TEST(segment_cut)
+{
+    hls_setup();
+
+    /* no playlist before the first segment */
+    ck_assert(http_get("/ch/index.m3u8") == 404);
+
+    send_frame(10);
+    send_frame(10);
+    ck_assert(http_get("/ch/0.ts") == 404);
+
+    /* 1s after the first frame */
+    send_frame(10);
+    ck_assert(http_get("/ch/0.ts") == 200);
+
+    /* PAT, PMT, then two frames */
+    ck_assert(reply_size == (2 + 2 * 11) * TS_PACKET_SIZE);
+    ck_assert(TS_GET_PID(((uint8_t *)&reply[0])) == 0);
+    ck_assert(TS_GET_PID(((uint8_t *)&reply[TS_PACKET_SIZE])) == PMT_PID);
+    ck_assert(TS_GET_PID(((uint8_t *)&reply[2 * TS_PACKET_SIZE])) == VIDEO_PID);
+
+    ck_assert(http_get("/ch/1.ts") == 404);
+
+    hls_teardown();
+}
+END_TEST
+
+/* playlist lists the last `window' segments */
+START_TEST(playlist_window)
+{
+    hls_setup();
+
+    for (unsigned int i = 0; i < 5; i++)
+        send_frame(1);
+
+    ck_assert(http_get("/ch/live.m3u8") == 200);
+    ck_assert_msg(strcmp(reply, "#EXTM3U\n"
+                                "#EXT-X-VERSION:3\n"
+                                "#EXT-X-TARGETDURATION:1\n"
+                                "#EXT-X-MEDIA-SEQUENCE:0\n"
+                                "#EXTINF:1.000,\n0.ts\n"
+                                "#EXTINF:1.000,\n1.ts\n") == 0
+                  , "%s", reply);
+
+    /* window slides on */
+    for (unsigned int i = 0; i < 4; i++)
+        send_frame(1);
+
+    ck_assert(http_get("/ch/live.m3u8") == 200);
+    ck_assert_msg(strstr(reply, "#EXT-X-MEDIA-SEQUENCE:2\n") != NULL
+                  , "%s", reply);
+    ck_assert(strstr(reply, "\n1.ts\n") == NULL);
+    ck_assert(strstr(reply, "\n2.ts\n") != NULL);
+    ck_assert(strstr(reply, "\n3.ts\n") != NULL);
+
+    hls_teardown();
+}
+END_TEST
+
+/* segment names are checked against the store */
+START_TEST(route_lookup)
+{
+    hls_setup();
+
+    /* segments 0 to 3 */
+    for (unsigned int i = 0; i < 9; i++)
+        send_frame(1);
+
+    /* left out of the playlist, still kept for slow clients */
+    ck_assert(http_get("/ch/0.ts") == 200);
+    ck_assert(http_get("/ch/3.ts") == 200);
+
+    ck_assert(http_get("/ch/4.ts") == 404);
+    ck_assert(http_get("/ch/x3.ts") == 404);
+    ck_assert(http_get("/ch/3x.ts") == 404);
+    ck_assert(http_get("/ch/.ts") == 404);
+    ck_assert(http_get("/ch/3.mp4") == 404);
+    ck_assert(http_get("/ch/playlist") == 404);
+    ck_assert(http_get("/ch/a/b.m3u8") == 200);
+
+    /* segment 4 pushes segment 0 out of the store */
+    send_frame(1);
+    send_frame(1);
+    ck_assert(http_get("/ch/0.ts") == 404);
+    ck_assert(http_get("/ch/1.ts") == 200);
+    ck_assert(http_get("/ch/4.ts") == 200);
+
+    hls_teardown();
+}
+END_TEST
+
+Suite *stream_hls(void)
+{
+    Suite *const s = suite_create("stream_hls");
+
+    TCase *const tc = tcase_create("default");
+    tcase_add_checked_fixture(tc, lib_setup, lib_teardown);
+
+    tcase_add_test(tc, segment_cut);
+    tcase_add_test(tc, playlist_window);
+    tcase_add_test(tc, route_lookup);
+
+    suite_add_tcase(s, tc);
+
+    return s;
+}
@@ -0,0 +1,313 @@
+/*
+ * Astra: Unit tests
+ * http://cesbo.com/astra
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unit_tests.h"
+#include <core/event.h>
+#include <luaapi/state.h>
+#include <luaapi/stream.h>
+#include <stream/udp/capture.h>
+
+#include <arpa/inet.h>
+
+#define TEST_ADDR "127.0.0.1"
+#define TEST_PACKETS 7
+#define TEST_SIZE (TEST_PACKETS * TS_PACKET_SIZE)
+
+typedef struct
+{
+    udp_capture_sub_t *sub;
+    unsigned int port;
+
+    unsigned int rcvd;
+    unsigned int limit;
+} capture_test_t;
+
+static void on_data(void *arg, const uint8_t *data, size_t size)
+{
+    capture_test_t *const t = (capture_test_t *)arg;
+
+    ck_assert(size == TEST_SIZE);
+    for (size_t i = 0; i < TEST_PACKETS; i++)
+    {
+        const uint8_t *const ts = &data[i * TS_PACKET_SIZE];
+        ck_assert(TS_IS_SYNC(ts) && TS_GET_PID(ts) == t->port % 0x1fff);
+    }
+
+    t->rcvd++;
+
+    /* subscriber goes away from inside the callback */
+    if (t->rcvd == t->limit)
+    {
+        udp_capture_detach(t->sub);
+        t->sub = NULL;
+    }
+}
+
+static void send_to(int fd, unsigned int port, unsigned int count)
+{
+    uint8_t buf[TEST_SIZE];
+    memset(buf, 0xff, sizeof(buf));
+    for (size_t i = 0; i < TEST_PACKETS; i++)
+    {
+        uint8_t *const ts = &buf[i * TS_PACKET_SIZE];
+        ts[0] = 0x47;
+        ts[1] = ts[2] = ts[3] = 0;
+        TS_SET_PID(ts, port % 0x1fff);
+    }
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = inet_addr(TEST_ADDR);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        ck_assert(sendto(fd, buf, sizeof(buf), 0, (struct sockaddr *)&sin
+                         , sizeof(sin)) == sizeof(buf));
+    }
+}
+
+/* datagrams are sorted out by destination port */
+START_TEST(capture_loopback)
+{
+    capture_test_t a, b;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+
+    a.port = 20000 + (rand() % 20000);
+    b.port = a.port + 1;
+    a.limit = 10;
+
+    a.sub = udp_capture_attach(TEST_ADDR, a.port, NULL, on_data, &a);
+    if (a.sub == NULL)
+    {
+        /* needs CAP_NET_RAW */
+        return;
+    }
+
+    /* no interface has this address */
+    ck_assert(udp_capture_attach(TEST_ADDR, b.port, "192.0.2.1"
+                                 , on_data, &b) == NULL);
+
+    b.sub = udp_capture_attach(TEST_ADDR, b.port, TEST_ADDR, on_data, &b);
+    ck_assert(b.sub != NULL);
+
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    ck_assert(fd != -1);
+
+    /* `a' detaches after `limit' datagrams and misses the rest */
+    send_to(fd, a.port, a.limit + 5);
+    send_to(fd, b.port, 5);
+
+    for (unsigned int i = 0; i < 100 && (a.rcvd < a.limit || b.rcvd < 5); i++)
+        asc_event_core_loop(10);
+
+    ck_assert(a.rcvd == a.limit && a.sub == NULL);
+    ck_assert(b.rcvd == 5);
+
+    udp_capture_stat_t st;
+    udp_capture_query(&st);
+    ck_assert(st.datagrams >= a.limit + 5 && st.blocks > 0);
+
+    udp_capture_detach(b.sub);
+    close(fd);
+
+    /* ring is closed along with the last subscriber */
+    udp_capture_query(&st);
+    ck_assert(st.datagrams == 0);
+}
+END_TEST
+
+/*
+ * udp_input receivers
+ */
+
+struct module_data_t
+{
+    MODULE_STREAM_DATA();
+
+    unsigned int packets;
+    mpegts_block_t *block;
+
+    /* Lua code run on the first block */
+    const char *on_first;
+};
+
+static void run_lua(const char *code)
+{
+    const int ret = luaL_dostring(lua, code);
+    ck_assert_msg(ret == 0, "%s", lua_tostring(lua, -1));
+}
+
+static int lua_int(const char *code)
+{
+    run_lua(code);
+    const int value = lua_tointeger(lua, -1);
+    lua_pop(lua, 1);
+
+    return value;
+}
+
+static void on_block(module_data_t *mod, mpegts_block_t *block)
+{
+    mod->packets += block->count;
+    mod->block = block;
+
+    if (mod->on_first != NULL)
+    {
+        const char *const code = mod->on_first;
+        mod->on_first = NULL;
+        run_lua(code);
+    }
+}
+
+/* attach a test stream to the stream of Lua global `name' */
+static void attach_to(module_data_t *mod, const char *name)
+{
+    memset(mod, 0, sizeof(*mod));
+    mod->__stream.self = mod;
+    mod->__stream.on_ts_block = on_block;
+    __module_stream_init(&mod->__stream);
+
+    lua_getglobal(lua, name);
+    lua_getfield(lua, -1, "stream");
+    lua_pushvalue(lua, -2);
+    ck_assert(lua_pcall(lua, 1, 1, 0) == 0);
+
+    module_stream_t *const up = (module_stream_t *)lua_touserdata(lua, -1);
+    ck_assert(up != NULL);
+    __module_stream_attach(up, &mod->__stream);
+
+    lua_pop(lua, 2);
+}
+
+static void wait_packets(const module_data_t *mod, unsigned int packets)
+{
+    for (unsigned int i = 0; i < 100 && mod->packets < packets; i++)
+        asc_event_core_loop(10);
+
+    ck_assert_msg(mod->packets == packets, "%u packets", mod->packets);
+}
+
+/* identical inputs share a socket and get the same blocks */
+START_TEST(receiver_shared)
+{
+    const unsigned int port = 20000 + (rand() % 20000);
+    char code[256];
+
+    snprintf(code, sizeof(code)
+             , "opts = { addr = '%s', port = %u }\n"
+               "in_a = udp_input(opts)\n"
+               "in_b = udp_input(opts)\n"
+               "in_c = udp_input(opts)\n"
+               "in_rtp = udp_input({ addr = '%s', port = %u, rtp = true })"
+             , TEST_ADDR, port, TEST_ADDR, port);
+    run_lua(code);
+
+    ck_assert(lua_int("return in_a:stats().members") == 3);
+    ck_assert(lua_int("return in_rtp:stats().members") == 1);
+    ck_assert(lua_int("return in_a:port()") == lua_int("return in_c:port()"));
+
+    /* unicast datagrams only reach one of the sockets bound to a port */
+    run_lua("in_rtp = nil; collectgarbage()");
+
+    module_data_t a, b, c;
+    attach_to(&a, "in_a");
+    attach_to(&b, "in_b");
+    attach_to(&c, "in_c");
+
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    ck_assert(fd != -1);
+
+    /* one block, referenced by every member */
+    send_to(fd, port, 1);
+    wait_packets(&c, TEST_PACKETS);
+    ck_assert(a.packets == TEST_PACKETS && b.packets == TEST_PACKETS);
+    ck_assert(a.block == b.block && b.block == c.block);
+
+    /* `a' destroys `b' while the block is being fanned out */
+    a.on_first = "in_b = nil; collectgarbage()";
+    send_to(fd, port, 1);
+    wait_packets(&c, TEST_PACKETS * 2);
+    ck_assert(a.packets == TEST_PACKETS * 2);
+    ck_assert(b.packets == TEST_PACKETS && b.__stream.parent == NULL);
+    ck_assert(lua_int("return in_a:stats().members") == 2);
+
+    /* last member closes the socket, a new input binds it again */
+    run_lua("in_a = nil; in_c = nil; collectgarbage()");
+    ck_assert(a.__stream.parent == NULL && c.__stream.parent == NULL);
+
+    run_lua("in_a = udp_input(opts)");
+    ck_assert(lua_int("return in_a:stats().members") == 1);
+    ck_assert(lua_int("return in_a:port()") == (int)port);
+
+    attach_to(&a, "in_a");
+    send_to(fd, port, 1);
+    wait_packets(&a, TEST_PACKETS);
+
+    run_lua("in_a = nil; collectgarbage()");
+
+    __module_stream_destroy(&a.__stream);
+    __module_stream_destroy(&b.__stream);
+    __module_stream_destroy(&c.__stream);
+    close(fd);
+}
+END_TEST
+
+/* inputs that can't share a socket get their own */
+START_TEST(receiver_private)
+{
+    /* random ports */
+    run_lua("in_a = udp_input({ addr = '" TEST_ADDR "' })\n"
+            "in_b = udp_input({ addr = '" TEST_ADDR "' })");
+
+    ck_assert(lua_int("return in_a:stats().members") == 1);
+    ck_assert(lua_int("return in_b:stats().members") == 1);
+    ck_assert(lua_int("return in_a:port()") != lua_int("return in_b:port()"));
+
+    /* failed bind isn't shared with later inputs */
+    run_lua("opts = { addr = '192.0.2.1', port = 1234 }\n"
+            "in_c = udp_input(opts)\n"
+            "in_d = udp_input(opts)");
+
+    ck_assert(lua_int("return in_c:stats().members") == 1);
+    ck_assert(lua_int("return in_d:stats().members") == 1);
+
+    run_lua("in_a = nil; in_b = nil; in_c = nil; in_d = nil\n"
+            "collectgarbage()");
+}
+END_TEST
+
+Suite *stream_udp(void)
+{
+    Suite *const s = suite_create("stream_udp");
+
+    TCase *const tc = tcase_create("default");
+    tcase_add_checked_fixture(tc, lib_setup, lib_teardown);
+
+    tcase_add_test(tc, capture_loopback);
+    tcase_add_test(tc, receiver_shared);
+    tcase_add_test(tc, receiver_private);
+
+    suite_add_tcase(s, tc);
+
+    return s;
+}
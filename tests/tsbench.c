@@ -0,0 +1,748 @@
+/*
+ * TS pipeline benchmark
+ *
+ * Copyright (C) 2016, Artem Kharitonov <artem@3phase.pw>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Loads a TS file into memory and replays it as fast as possible
+ * through a module chain built by a Lua script. The script gets a
+ * global `input' to use as the first upstream, for example:
+ *
+ *     ch = channel({ upstream = input:stream(), name = "ch", pnr = 1 })
+ *     dec = decrypt({ upstream = ch:stream(), name = "dec"
+ *                   , biss = "1122330044556600" })
+ *     mux = remux({ upstream = dec:stream(), name = "mux" })
+ *     an = analyze({ upstream = mux:stream(), name = "an"
+ *                  , callback = function(data) end })
+ *     out = udp_output({ upstream = mux:stream()
+ *                      , addr = "127.0.0.1", port = 9 })
+ *
+ * The file is replayed twice on the main loop. The first pass runs
+ * the chain as is and gives packet rate, CPU time, heap allocations
+ * and RSS. The second one wraps every module's stream callbacks to
+ * measure time spent in each of them, not counting its children.
+ * Modules are labelled with the names of globals holding them;
+ * section callbacks are counted against the upstream module. Modules
+ * on worker loops and work done by helper threads aren't profiled.
+ */
+
+#include <astra.h>
+#include <core/mainloop.h>
+#include <core/timer.h>
+#include <luaapi/state.h>
+#include <luaapi/stream.h>
+
+#ifndef _WIN32
+#   include <sys/resource.h>
+#endif
+
+#if defined(HAVE_DLFCN_H) && defined(__linux__)
+#   include <dlfcn.h>
+#   define BENCH_MALLOC 1
+#endif
+
+#define MSG(_msg) "[tsbench] " _msg
+
+#define fatal(__fmt, ...) \
+    { \
+        fprintf(stderr, "error: " __fmt "\n", __VA_ARGS__); \
+        exit(1); \
+    }
+
+/* chunks to send per main loop iteration */
+#define BENCH_SLICE 256
+
+/* let outputs become writable before starting */
+#define BENCH_WARMUP 200
+
+#define BENCH_NODES_MAX 256
+
+/*
+ * heap allocation counter
+ */
+
+#ifdef BENCH_MALLOC
+static uint64_t alloc_count = 0;
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+
+/* dlsym() may need memory before the real allocator is found */
+static uint8_t boot_heap[4096] __attribute__((aligned(16)));
+static size_t boot_used = 0;
+
+static void *boot_alloc(size_t size)
+{
+    size = (size + 15) & ~((size_t)15);
+    if (boot_used + size > sizeof(boot_heap))
+        return NULL;
+
+    void *const p = &boot_heap[boot_used];
+    boot_used += size;
+
+    return p;
+}
+
+/* ISO C has no conversion from void * to a function pointer */
+#define alloc_sym(_fn, _name) \
+    do { \
+        union { void *sym; __typeof__(_fn) fn; } __u; \
+        __u.sym = dlsym(RTLD_NEXT, _name); \
+        _fn = __u.fn; \
+    } while (0)
+
+static bool is_boot(const void *p)
+{
+    return ((const uint8_t *)p >= boot_heap
+            && (const uint8_t *)p < &boot_heap[sizeof(boot_heap)]);
+}
+
+static void alloc_init(void)
+{
+    static bool busy = false;
+    if (busy)
+        return;
+
+    busy = true;
+    alloc_sym(real_calloc, "calloc");
+    alloc_sym(real_malloc, "malloc");
+    alloc_sym(real_realloc, "realloc");
+    alloc_sym(real_free, "free");
+    busy = false;
+}
+
+void *malloc(size_t size)
+{
+    if (real_malloc == NULL)
+    {
+        alloc_init();
+        if (real_malloc == NULL)
+            return boot_alloc(size);
+    }
+
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return real_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if (real_calloc == NULL)
+    {
+        alloc_init();
+        if (real_calloc == NULL)
+            return boot_alloc(nmemb * size); /* already zeroed */
+    }
+
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return real_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (real_realloc == NULL)
+        alloc_init();
+
+    if (is_boot(ptr))
+    {
+        const size_t avail = &boot_heap[sizeof(boot_heap)] - (uint8_t *)ptr;
+
+        void *const p = malloc(size);
+        if (p != NULL)
+            memcpy(p, ptr, (size < avail) ? size : avail);
+
+        return p;
+    }
+
+    if (ptr == NULL || size > 0)
+        __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+
+    return real_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL || is_boot(ptr))
+        return;
+
+    if (real_free == NULL)
+        alloc_init();
+
+    real_free(ptr);
+}
+#endif /* BENCH_MALLOC */
+
+static uint64_t alloc_total(void)
+{
+#ifdef BENCH_MALLOC
+    return __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * CPU time and memory
+ */
+
+/* user and system time of the whole process, usecs */
+static uint64_t cpu_time(void)
+{
+#ifndef _WIN32
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL
+           + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#else
+    return 0;
+#endif
+}
+
+/* current and peak resident set size, KiB */
+static void rss_query(unsigned long *cur, unsigned long *peak)
+{
+    *cur = *peak = 0;
+
+#ifdef __linux__
+    FILE *const f = fopen("/proc/self/statm", "r");
+    if (f != NULL)
+    {
+        unsigned long size, resident;
+        if (fscanf(f, "%lu %lu", &size, &resident) == 2)
+            *cur = resident * (sysconf(_SC_PAGESIZE) / 1024);
+
+        fclose(f);
+    }
+#endif
+
+#ifndef _WIN32
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        *peak = ru.ru_maxrss;
+#endif
+
+    /* maxrss lags behind */
+    if (*peak < *cur)
+        *peak = *cur;
+}
+
+/*
+ * per-module profiling
+ */
+
+typedef struct
+{
+    module_stream_t *stream;
+    unsigned int depth;
+    bool is_remote;
+    char name[64];
+
+    stream_callback_t on_ts;
+    stream_batch_callback_t on_ts_batch;
+    stream_block_callback_t on_ts_block;
+
+    uint64_t calls;
+    uint64_t packets;
+    uint64_t ns;
+} bench_node_t;
+
+/* first node is the input itself */
+static bench_node_t nodes[BENCH_NODES_MAX];
+static unsigned int node_count = 0;
+static bench_node_t *node_last = NULL;
+
+/* time spent in callees of the current callback */
+static uint64_t frame_ns = 0;
+
+static bench_node_t *node_find(const module_data_t *self)
+{
+    if (node_last != NULL && node_last->stream->self == self)
+        return node_last;
+
+    for (unsigned int i = 0; i < node_count; i++)
+    {
+        if (nodes[i].stream->self == self)
+        {
+            node_last = &nodes[i];
+            return node_last;
+        }
+    }
+
+    asc_assert(false, MSG("callback for an unknown module"));
+    return NULL;
+}
+
+static inline
+uint64_t profile_enter(uint64_t *saved)
+{
+    *saved = frame_ns;
+    frame_ns = 0;
+
+    return asc_ntime();
+}
+
+static inline
+void profile_leave(bench_node_t *node, uint64_t start, uint64_t saved
+                   , size_t packets)
+{
+    const uint64_t elapsed = asc_ntime() - start;
+
+    node->ns += elapsed - frame_ns;
+    node->calls++;
+    node->packets += packets;
+
+    frame_ns = saved + elapsed;
+}
+
+static void on_profile_ts(module_data_t *self, const uint8_t *ts)
+{
+    bench_node_t *const node = node_find(self);
+
+    uint64_t saved;
+    const uint64_t start = profile_enter(&saved);
+    node->on_ts(self, ts);
+    profile_leave(node, start, saved, 1);
+}
+
+static void on_profile_batch(module_data_t *self, const uint8_t *ts
+                             , size_t count)
+{
+    bench_node_t *const node = node_find(self);
+
+    uint64_t saved;
+    const uint64_t start = profile_enter(&saved);
+    node->on_ts_batch(self, ts, count);
+    profile_leave(node, start, saved, count);
+}
+
+static void on_profile_block(module_data_t *self, mpegts_block_t *block)
+{
+    bench_node_t *const node = node_find(self);
+
+    uint64_t saved;
+    const uint64_t start = profile_enter(&saved);
+    node->on_ts_block(self, block);
+    profile_leave(node, start, saved, block->count);
+}
+
+/* label streams with names of the globals holding their modules */
+static void node_label(bench_node_t *node)
+{
+    lua_State *const L = lua;
+
+    snprintf(node->name, sizeof(node->name), "%p", (void *)node->stream);
+
+    lua_pushglobaltable(L);
+    lua_foreach(L, -2)
+    {
+        if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TTABLE)
+            continue;
+
+        lua_getfield(L, -1, "stream");
+        if (!lua_isfunction(L, -1))
+        {
+            lua_pop(L, 1);
+            continue;
+        }
+
+        lua_pushvalue(L, -2);
+        if (lua_pcall(L, 1, 1, 0) != 0)
+        {
+            lua_pop(L, 1);
+            continue;
+        }
+
+        const bool found = (lua_touserdata(L, -1) == node->stream);
+        lua_pop(L, 1);
+
+        if (found)
+        {
+            const char *const type = luaL_tolstring(L, -1, NULL);
+            snprintf(node->name, sizeof(node->name), "%s (%s)"
+                     , lua_tostring(L, -3), type);
+
+            lua_pop(L, 3);
+            break;
+        }
+    }
+    lua_pop(L, 1);
+}
+
+static void node_walk(module_stream_t *stream, unsigned int depth)
+{
+    if (node_count >= BENCH_NODES_MAX)
+        fatal("more than %d modules", BENCH_NODES_MAX);
+
+    bench_node_t *const node = &nodes[node_count++];
+    node->stream = stream;
+    node->depth = depth;
+    node->is_remote = (stream->loop != asc_loop_current());
+    node_label(node);
+
+    if (node->is_remote)
+        return;
+
+    asc_list_for(stream->children)
+    {
+        module_stream_t *const child =
+            (module_stream_t *)asc_list_data(stream->children);
+
+        node_walk(child, depth + 1);
+    }
+}
+
+static void profile_start(void)
+{
+    /* input is timed by the replay loop itself */
+    for (unsigned int i = 1; i < node_count; i++)
+    {
+        bench_node_t *const node = &nodes[i];
+        module_stream_t *const stream = node->stream;
+
+        if (node->is_remote)
+            continue;
+
+        /* keep NULL callbacks NULL, dispatch depends on them */
+        node->on_ts = stream->on_ts;
+        node->on_ts_batch = stream->on_ts_batch;
+        node->on_ts_block = stream->on_ts_block;
+
+        if (stream->on_ts != NULL)
+            stream->on_ts = on_profile_ts;
+        if (stream->on_ts_batch != NULL)
+            stream->on_ts_batch = on_profile_batch;
+        if (stream->on_ts_block != NULL)
+            stream->on_ts_block = on_profile_block;
+    }
+}
+
+static void profile_stop(void)
+{
+    for (unsigned int i = 1; i < node_count; i++)
+    {
+        bench_node_t *const node = &nodes[i];
+        if (node->is_remote)
+            continue;
+
+        node->stream->on_ts = node->on_ts;
+        node->stream->on_ts_batch = node->on_ts_batch;
+        node->stream->on_ts_block = node->on_ts_block;
+    }
+}
+
+/*
+ * replay source
+ */
+
+struct module_data_t
+{
+    MODULE_STREAM_DATA();
+};
+
+static module_data_t *bench_input = NULL;
+
+static void module_init(lua_State *L, module_data_t *mod)
+{
+    if (bench_input != NULL)
+        luaL_error(L, MSG("only one input is supported"));
+
+    module_stream_init(mod, NULL);
+    bench_input = mod;
+}
+
+static void module_destroy(module_data_t *mod)
+{
+    module_stream_destroy(mod);
+
+    if (bench_input == mod)
+        bench_input = NULL;
+}
+
+MODULE_STREAM_METHODS()
+MODULE_LUA_METHODS()
+{
+    MODULE_STREAM_METHODS_REF(),
+};
+/* not in the generated list of bindings */
+MODULE_LUA_BINDING(tsbench_input);
+MODULE_LUA_REGISTER(tsbench_input)
+
+static uint8_t *replay_data;
+static size_t replay_size;
+
+static struct
+{
+    size_t chunk;
+    size_t total;
+    size_t sent;
+    size_t pos;
+    bool profile;
+
+    uint64_t start;
+    uint64_t cpu;
+    uint64_t allocs;
+    uint64_t jobs;
+} replay;
+
+static void load_file(const char *path)
+{
+    FILE *const f = fopen(path, "rb");
+    if (f == NULL)
+        fatal("fopen: %s: %s", path, strerror(errno));
+
+    if (fseek(f, 0, SEEK_END) != 0)
+        fatal("fseek: %s: %s", path, strerror(errno));
+
+    const long size = ftell(f);
+    rewind(f);
+
+    const size_t packets = (size > 0) ? size / TS_PACKET_SIZE : 0;
+    if (packets == 0)
+        fatal("%s: no packets", path);
+
+    replay_data = ASC_ALLOC(packets * TS_PACKET_SIZE, uint8_t);
+    replay_size = fread(replay_data, TS_PACKET_SIZE, packets, f);
+    fclose(f);
+
+    for (size_t i = 0; i < replay_size; i++)
+    {
+        const uint8_t *const ts = &replay_data[i * TS_PACKET_SIZE];
+        if (!TS_IS_SYNC(ts))
+            fatal("%s: lost sync at packet %zu", path, i);
+    }
+}
+
+static void pass_begin(bool profile)
+{
+    replay.profile = profile;
+    replay.sent = replay.pos = 0;
+    replay.jobs = 0;
+
+    if (profile)
+    {
+        for (unsigned int i = 0; i < node_count; i++)
+        {
+            nodes[i].calls = nodes[i].packets = nodes[i].ns = 0;
+        }
+
+        profile_start();
+    }
+
+    replay.allocs = alloc_total();
+    replay.cpu = cpu_time();
+    replay.start = asc_ntime();
+}
+
+static void report_plain(void)
+{
+    const uint64_t elapsed = asc_ntime() - replay.start;
+    const uint64_t cpu = cpu_time() - replay.cpu;
+    /* don't count the replay's own jobs */
+    const uint64_t allocs = alloc_total() - replay.allocs - replay.jobs;
+    const double secs = elapsed / 1000000000.0;
+
+    unsigned long rss, rss_peak;
+    rss_query(&rss, &rss_peak);
+
+    printf("packets:      %zu in %.3f s\n", replay.total, secs);
+    printf("rate:         %.0f packets/s, %.1f Mbit/s\n"
+           , replay.total / secs
+           , replay.total * TS_PACKET_SIZE * 8 / secs / 1000000.0);
+    printf("time:         %.1f ns/packet wall, %.1f ns/packet cpu\n"
+           , (double)elapsed / replay.total
+           , cpu * 1000.0 / replay.total);
+#ifdef BENCH_MALLOC
+    printf("allocations:  %" PRIu64 " (%.3f per 1000 packets)\n"
+           , allocs, allocs * 1000.0 / replay.total);
+#else
+    __uarg(allocs);
+    printf("allocations:  not counted on this platform\n");
+#endif
+    printf("rss:          %lu KiB, peak %lu KiB\n", rss, rss_peak);
+}
+
+static void report_profile(void)
+{
+    const uint64_t elapsed = asc_ntime() - replay.start;
+
+    printf("\n%-40s %12s %10s %7s\n", "module", "packets", "ns/packet"
+           , "share");
+
+    for (unsigned int i = 0; i < node_count; i++)
+    {
+        const bench_node_t *const node = &nodes[i];
+
+        char label[128];
+        snprintf(label, sizeof(label), "%*s%s", node->depth * 2, ""
+                 , node->name);
+
+        if (node->is_remote)
+        {
+            printf("%-40s %12s\n", label, "(other loop)");
+            continue;
+        }
+
+        /* normalized to input packets so the column adds up */
+        printf("%-40s %12" PRIu64 " %10.1f %6.1f%%\n", label, node->packets
+               , (double)node->ns / replay.total
+               , node->ns * 100.0 / elapsed);
+    }
+
+    printf("%-40s %12s %10.1f\n", "total (with profiling overhead)", ""
+           , (double)elapsed / replay.total);
+}
+
+static void on_replay(void *arg)
+{
+    __uarg(arg);
+
+    bench_node_t *const input = &nodes[0];
+    module_stream_t *const stream = &bench_input->__stream;
+
+    for (unsigned int i = 0; i < BENCH_SLICE && replay.sent < replay.total; i++)
+    {
+        size_t count = replay.chunk;
+        if (count > replay_size - replay.pos)
+            count = replay_size - replay.pos;
+        if (count > replay.total - replay.sent)
+            count = replay.total - replay.sent;
+
+        const uint8_t *const ts = &replay_data[replay.pos * TS_PACKET_SIZE];
+
+        if (replay.profile)
+        {
+            uint64_t saved;
+            const uint64_t start = profile_enter(&saved);
+            __module_stream_send_batch(stream, ts, count);
+            profile_leave(input, start, saved, count);
+        }
+        else
+        {
+            __module_stream_send_batch(stream, ts, count);
+        }
+
+        replay.sent += count;
+        replay.pos = (replay.pos + count) % replay_size;
+    }
+
+    if (replay.sent < replay.total)
+    {
+        /* let the loop run timers and socket events in between */
+        asc_job_queue(NULL, on_replay, NULL);
+        replay.jobs++;
+        return;
+    }
+
+    if (!replay.profile)
+    {
+        report_plain();
+
+        pass_begin(true);
+        asc_job_queue(NULL, on_replay, NULL);
+    }
+    else
+    {
+        profile_stop();
+        report_profile();
+
+        asc_main_loop_shutdown();
+    }
+}
+
+static void on_start(void *arg)
+{
+    __uarg(arg);
+
+    if (bench_input == NULL)
+        fatal("%s", "input was destroyed by the script");
+
+    node_walk(&bench_input->__stream, 0);
+    if (node_count < 2)
+        fatal("%s", "nothing is attached to the input");
+
+    printf("replaying %zu packets through %u modules, %zu per send\n\n"
+           , replay.total, node_count - 1, replay.chunk);
+
+    pass_begin(false);
+    on_replay(NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *infile = NULL;
+    replay.chunk = 7;
+
+    int c;
+    while ((c = getopt(argc, argv, "i:n:c:")) != -1)
+    {
+        switch (c)
+        {
+            case 'i':
+                infile = optarg;
+                break;
+
+            case 'n':
+                replay.total = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'c':
+                replay.chunk = strtoul(optarg, NULL, 10);
+                break;
+
+            default:
+                infile = NULL;
+                optind = argc;
+                break;
+        }
+    }
+
+    if (infile == NULL || optind != argc - 1 || replay.chunk == 0)
+    {
+        fatal("usage: %s -i <file.ts> [-n <packets>] [-c <chunk>] "
+              "<chain.lua>", argv[0]);
+    }
+
+    load_file(infile);
+    if (replay.total == 0)
+        replay.total = replay_size;
+
+    asc_lib_init();
+    asc_wake_open();
+
+    luaopen_tsbench_input(lua);
+    if (luaL_dostring(lua, "input = tsbench_input({})") != 0
+        || luaL_dofile(lua, argv[optind]) != 0)
+    {
+        fatal("%s", lua_tostring(lua, -1));
+    }
+
+    asc_timer_t *const timer =
+        asc_timer_one_shot(BENCH_WARMUP, on_start, NULL);
+    asc_assert(timer != NULL, MSG("couldn't start timer"));
+
+    if (asc_main_loop_run())
+        asc_log_error(MSG("unexpected reload request"));
+
+    asc_wake_close();
+    asc_lib_destroy();
+    free(replay_data);
+
+    return 0;
+}
@@ -33,13 +33,27 @@ void lib_teardown(void);
 /* core */
 Suite *core_alloc(void);
 Suite *core_clock(void);
+Suite *core_event(void);
 Suite *core_list(void);
+Suite *core_loop(void);
 Suite *core_mainloop(void);
 Suite *core_spawn(void);
 Suite *core_child(void);
 Suite *core_thread(void);
 Suite *core_timer(void);
 
+/* luaapi */
+Suite *luaapi_stream(void);
+
+/* mpegts */
+Suite *mpegts_framer(void);
+Suite *mpegts_psi(void);
+Suite *mpegts_sync(void);
+
+/* stream */
+Suite *stream_hls(void);
+Suite *stream_udp(void);
+
 /* unit test list */
 typedef Suite (*(*const suite_func_t)(void));
 
@@ -47,13 +61,27 @@ static suite_func_t suite_list[] = {
     /* core */
     core_alloc,
     core_clock,
+    core_event,
     core_list,
+    core_loop,
     core_mainloop,
     core_spawn,
     core_child,
     core_thread,
     core_timer,
 
+    /* luaapi */
+    luaapi_stream,
+
+    /* mpegts */
+    mpegts_framer,
+    mpegts_psi,
+    mpegts_sync,
+
+    /* stream */
+    stream_hls,
+    stream_udp,
+
     NULL,
 };
 